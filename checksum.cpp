@@ -0,0 +1,32 @@
+// checksum.cpp
+
+// Headers
+#include <vector>
+#include "checksum.h"
+
+// CRC-32 (the zlib polynomial) of some bytes
+// Parameters:
+//   data - bytes to checksum
+//   crc - checksum of the bytes before data (0 for none)
+// Returns:
+//   uint32_t - checksum
+uint32_t crc32( std::string_view data, uint32_t crc )
+{
+  static const std::vector<uint32_t> table = []() {
+    std::vector<uint32_t> t( 256 );
+    for ( uint32_t i = 0; i < 256; i++ ) {
+      uint32_t c = i;
+      for ( int k = 0; k < 8; k++ ) {
+        c = ( c & 1 ) ? 0xEDB88320u ^ ( c >> 1 ) : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+
+  crc ^= 0xFFFFFFFFu;
+  for ( unsigned char c : data ) {
+    crc = table[( crc ^ c ) & 0xFF] ^ ( crc >> 8 );
+  }
+  return crc ^ 0xFFFFFFFFu;
+}
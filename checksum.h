@@ -0,0 +1,21 @@
+// checksum.h
+
+// Guards
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+// Headers
+#include <cstdint>
+#include <string_view>
+
+// CRC-32 (the zlib polynomial) of some bytes.  Checksums of consecutive
+// pieces can be chained: crc32( b, crc32( a ) ) == crc32( a + b ).
+// Parameters:
+//   data - bytes to checksum
+//   crc - checksum of the bytes before data (0 for none)
+// Returns:
+//   uint32_t - checksum
+uint32_t crc32( std::string_view data, uint32_t crc = 0 );
+
+// End of guards
+#endif // CHECKSUM_H
@@ -1,318 +1,791 @@
 // Headers
 #include <iostream>
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <sys/uio.h>
 #include "csapp.h"
 #include "message.h"
 #include "message_serialization.h"
 #include "server.h"
 #include "exceptions.h"
 #include "client_connection.h"
-#include <regex>
+#include "identifier.h"
+#include "timer_wheel.h"
+
+// Find the smallest string greater than every string starting with a
+// prefix
+// Parameters:
+//   prefix - the prefix
+// Returns:
+//   std::string - the string, or "" if there is none
+static std::string prefix_end(std::string_view prefix) {
+    std::string end(prefix);
+    while (!end.empty() && static_cast<unsigned char>(end.back()) == 0xFF) {
+        end.pop_back();
+    }
+    if (!end.empty()) {
+        end.back()++;
+    }
+    return end;
+}
 
 // Constructor
 ClientConnection::ClientConnection(Server *server, int client_fd)
     // Initialize member variables
-    : m_server(server), m_client_fd(client_fd) {
-    rio_readinitb(&m_fdbuf, m_client_fd);
+    : m_server(server), m_client_fd(client_fd), m_out_offset(0), m_eof(false), m_closing(false), m_protocol(Protocol::UNKNOWN), m_logged_in(false), inTransaction(false), m_txn(0),
+      m_snapshot(server->get_snapshots().acquire_slot()), m_in_snapshot(false), m_snapshot_ts(0),
+      m_table_cache_len(0), m_table_cache_epoch(0), m_wait_lsn(0) {
 }
 
 // Destructor
 ClientConnection::~ClientConnection() {
+    // Release any tables still locked by an unfinished transaction
+    roll_back_all();
+
+    // Let another connection reuse the snapshot slot
+    m_server->get_snapshots().release_slot(m_snapshot);
+
     // Close the client file descriptor
     Close(m_client_fd); 
 }
 
-// This method initializes the client connection that allows the client to chat with the server
+// This method services the client: it finishes sending earlier replies,
+// reads whatever input is available and handles every complete request
+// in it, then sends all of the resulting replies at once.  It never waits
+// for the socket, so it is called again each time the socket is ready.
 // Parameters:
 //   none
 // Returns:
-//   void
-void ClientConnection::chat_with_client() {
-    // Initialize buffer
-    char buf[MAXLINE]; 
-    // Initialize first message flag
-    bool firstmsg = true;
+//   ChatStatus - what the server should do with the connection next
+ClientConnection::ChatStatus ClientConnection::chat_with_client() {
+    // Replies to changes that aren't durable yet are held back
+    if (!is_durable()) {
+        return ChatStatus::WAIT_DURABLE;
+    }
+
+    // Don't accept more requests until earlier replies have been sent
+    if (!flush_output()) {
+        return ChatStatus::CLOSE;
+    }
+    if (!m_outbuf.empty()) {
+        return ChatStatus::KEEP;
+    }
+    if (m_closing) {
+        return ChatStatus::CLOSE;
+    }
+
+    // Read whatever the client has sent
+    if (!m_eof && !read_available()) {
+        return ChatStatus::CLOSE;
+    }
+
+    // Offset of the first byte not yet handled
+    size_t start = 0;
+    ChatStatus status = ChatStatus::KEEP;
+
+    try {
+        // Handle each complete (possibly pipelined) request in the input
+        // buffer
+        while (start < m_inbuf.size()) {
+            size_t len = next_request_len(start);
+            if (len == 0) {
+                // Wait for the rest of the request
+                break;
+            }
+
+            if (!handle_request(std::string_view(m_inbuf).substr(start, len))) {
+                m_closing = true;
+                break;
+            }
+            start += len;
+        }
+    } catch (const LockQueued&) {
+        // Keep the request until its transaction is woken
+        status = ChatStatus::WAIT_LOCK;
+    } catch (const RequestBlocked&) {
+        // Keep the blocked request so it is handled again on retry
+        status = ChatStatus::BLOCKED;
+    }
+
+    // Discard the handled requests
+    m_inbuf.erase(0, start);
+
+    if (m_eof) {
+        m_closing = true;
+    }
+
+    // Send the replies to the whole batch once its changes are durable
+    // (the log's writer flushes many connections' changes at once)
+    if (!is_durable()) {
+        return ChatStatus::WAIT_DURABLE;
+    }
+    if (!flush_output()) {
+        return ChatStatus::CLOSE;
+    }
+
+    // A closing connection lingers until its last replies are sent
+    if (m_closing) {
+        return m_outbuf.empty() ? ChatStatus::CLOSE : ChatStatus::KEEP;
+    }
+
+    return status;
+}
+
+// This method checks whether the connection's last logged change is
+// durable, so replies acknowledging it may be sent
+// Parameters:
+//   none
+// Returns:
+//   bool - true if there is nothing to wait for
+bool ClientConnection::is_durable() const {
+    WriteAheadLog *log = m_server->get_log();
+    return !log || log->is_durable(m_wait_lsn);
+}
+
+// This method reads everything the socket currently has available
+// into the input buffer (the socket is edge-triggered, so it must be
+// drained until it would block)
+// Parameters:
+//   none
+// Returns:
+//   false if the connection failed, true otherwise
+bool ClientConnection::read_available() {
+    char buf[MAXLINE];
 
-    // Loop to read messages from client
     while (true) {
-        
-        // Read client's message
-        if (rio_readlineb(&m_fdbuf, buf, MAXLINE) <= 0) {
-            // Client closed connection or error occurred
-            break; 
+        ssize_t n = read(m_client_fd, buf, sizeof(buf));
+
+        if (n > 0) {
+            m_inbuf.append(buf, n);
+        } else if (n == 0) {
+            // Client closed connection
+            m_eof = true;
+            return true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // Nothing more to read for now
+            return true;
+        } else {
+            // Error occurred
+            return false;
+        }
+    }
+}
+
+// This method finds the length of the next request in the input
+// buffer, choosing the connection's protocol first if necessary
+// Parameters:
+//   start - offset of the request in the input buffer
+// Returns:
+//   size_t - length of the request, or 0 if the rest of it hasn't
+//   been received yet
+size_t ClientConnection::next_request_len(size_t start) {
+    size_t available = m_inbuf.size() - start;
+
+    // A binary client announces itself with a byte no request line
+    // starts with
+    if (m_protocol == Protocol::UNKNOWN) {
+        if (static_cast<unsigned char>(m_inbuf[start]) == MessageSerialization::BINARY_MAGIC) {
+            m_protocol = Protocol::BINARY;
+            m_inbuf.erase(start, 1);
+            if (--available == 0) {
+                return 0;
+            }
+        } else {
+            m_protocol = Protocol::TEXT;
         }
+    }
+
+    if (m_protocol == Protocol::BINARY) {
+        size_t len = MessageSerialization::binary_frame_len(std::string_view(m_inbuf).substr(start));
+        if (len != 0 && len <= available) {
+            return len;
+        }
+        if (m_eof || len > MessageSerialization::MAX_FRAME_LEN) {
+            // Truncated or oversized frame: let the decoder reject it
+            return available;
+        }
+        return 0;
+    }
+
+    size_t newline = m_inbuf.find('\n', start);
+    if (newline != std::string::npos) {
+        return newline + 1 - start;
+    }
+    if (m_eof || available > Message::MAX_ENCODED_LEN) {
+        // Unterminated or overlong request: let the decoder reject it
+        return available;
+    }
+    return 0;
+}
+
+// This method handles a single request
+// Parameters:
+//   request - request line, including the terminating newline, or
+//             binary frame
+// Returns:
+//   false if the connection should be closed, true otherwise
+bool ClientConnection::handle_request(std::string_view request) {
+    // The request is decoded into a reused view of the input buffer
+    MessageView &msg = m_request;
 
+    try {
         // Decode the message
-        std::string request(buf);
+        if (m_protocol == Protocol::BINARY) {
+            MessageSerialization::decode_binary(request, msg);
+        } else {
+            MessageSerialization::decode(request, msg);
+        }
+        
+        // Check if the first message is LOGIN
+        if (!m_logged_in && msg.get_message_type() != MessageType::LOGIN) {
+            send_response(Message(MessageType::ERROR, {"First message must be LOGIN"}));
+
+            // Close connection if protocol is violated
+            return false; 
+        }
+        
+        // Set first message flag to false
+        m_logged_in = true;
 
         // Check if the message is valid
-        Message msg;
+        if (!msg.is_valid()) {
+            send_response(Message(MessageType::ERROR, {"Invalid message format"}));
+            // Continue to next message
+            return true;
+        }
 
-        try {
-            // Decode the message
-            MessageSerialization::decode(request, msg);
-            
-            // Check if the first message is LOGIN
-            if (firstmsg && msg.get_message_type() != MessageType::LOGIN) {
-                send_response("ERROR First message must be LOGIN\n");
+        switch (msg.get_message_type()) {
+            // SET
+            case MessageType::SET: {
+                // Get table, key, and value from the message
+                std::string_view table = msg.get_table();
+                std::string_view key = msg.get_key();
+                const std::string &value = top_value(); 
 
-                // Close connection if protocol is violated
-                break; 
-            }
-            
-            // Set first message flag to false
-            firstmsg = false;
+                if (!Identifier::is_identifier(key)) {
+                    send_response(Message(MessageType::ERROR, {"Invalid key"}));
+                    return true;
+                }
+                
+                // Set the value in the table
+                set_value(table, key, value);
 
-            // Check if the message is valid
-            if (!msg.is_valid()) {
-                send_response("ERROR Invalid message format\n");
-                // Continue to next message
-                continue;
+                // Send response to client
+                send_response(Message(MessageType::OK));
+                break;
+            } 
+            // SETEX
+            case MessageType::SETEX: {
+                // Like SET, but the value expires after the given time
+                std::string_view key = msg.get_key();
+                if (!Identifier::is_identifier(key)) {
+                    send_response(Message(MessageType::ERROR, {"Invalid key"}));
+                    return true;
+                }
+                set_value(msg.get_table(), key, top_value(), ttl_deadline(msg.get_arg(2)));
+                send_response(Message(MessageType::OK));
+                break;
+            }
+            // EXPIRE
+            case MessageType::EXPIRE: {
+                // Reply 1 if the key exists (and now expires after the
+                // given time), 0 if it doesn't
+                bool found = expire_value(msg.get_table(), msg.get_key(), ttl_deadline(msg.get_arg(2)));
+                send_response(Message(MessageType::DATA, {found ? "1" : "0"}));
+                break;
             }
+            case MessageType::POP: {
+                // Pop the value from the stack
+                pop_value();
 
-            switch (msg.get_message_type()) {
-                // SET
-                case MessageType::SET: {
-                    // Get table, key, and value from the message
-                    std::string table = msg.get_table();
-                    std::string key = msg.get_key();
-                    std::string value = top_value(); 
+                // Send response to client
+                send_response(Message(MessageType::OK));
 
-                    if (!is_valid_key(key)) {
-                        send_response(Message(MessageType::ERROR, {"Invalid key"}));
-                        continue;
-                    }
-                    
-                    // Set the value in the table
-                    set_value(table, key, value);
+                break;
+            }
+            // CREATE
+            case MessageType::CREATE: {
+                // Get table from the message
+                std::string table(msg.get_table());
 
-                    // Send response to client
-                    send_response(Message(MessageType::OK));
-                    break;
-                } 
-                case MessageType::POP: {
-                    // Pop the value from the stack
-                    pop_value();
+                // duplicates?
+                if (find_table(table) != nullptr) {
+                    // table has been named already, cannot be duplicated
+                    send_response(Message(MessageType::ERROR, {"Table created"}));
+                    return true;
+                }
 
-                    // Send response to client
-                    send_response(Message(MessageType::OK));
+                // Handle invalid table name
+                if (!Identifier::is_identifier(table)) {
+                    send_response(Message(MessageType::ERROR, {"Invalid table name"}));
+                    return true;
+                }
 
-                    break;
+                // Optional storage engine (defaults to the hash index)
+                StorageEngineKind engine = StorageEngineKind::HASH;
+                if (msg.get_num_args() > 1 && !StorageEngine::parse_kind(msg.get_arg(1), engine)) {
+                    send_response(Message(MessageType::ERROR, {"Unknown storage engine"}));
+                    return true;
                 }
-                // CREATE
-                case MessageType::CREATE: {
-                    // Get table from the message
-                    std::string table = msg.get_table();
-
-                    // duplicates?
-                    if (m_server->find_table(table) != nullptr) {
-                        // table has been named already, cannot be duplicated
-                        send_response(Message(MessageType::ERROR, {"Table created"}));
-                        continue;
-                    }
 
-                    // Handle invalid table name
-                    if (!is_valid_table_name(table)) {
-                        send_response(Message(MessageType::ERROR, {"Invalid table name"}));
-                        continue;
+                // Optional memory budget (most bytes, then the eviction
+                // policy; no limit by default)
+                MemoryBudget budget;
+                if (msg.get_num_args() > 3) {
+                    int64_t max_bytes;
+                    if (!Table::parse_integer(msg.get_arg(2), max_bytes) || max_bytes < 1) {
+                        send_response(Message(MessageType::ERROR, {"Invalid memory budget"}));
+                        return true;
                     }
-
-                    try {
-                        m_server->create_table(table);
-                        send_response(Message(MessageType::OK));
-                    } catch (const InvalidMessage& ex) {
-                        send_response(Message(MessageType::ERROR, {ex.what()}));
-                        continue;
+                    budget.max_bytes = max_bytes;
+                    if (!MemoryBudget::parse_policy(msg.get_arg(3), budget.policy)) {
+                        send_response(Message(MessageType::ERROR, {"Unknown eviction policy"}));
+                        return true;
                     }
+                }
 
-                    break;
+                try {
+                    m_wait_lsn = std::max(m_wait_lsn, m_server->create_table(table, engine, budget));
+                    send_response(Message(MessageType::OK));
+                } catch (const InvalidMessage& ex) {
+                    send_response(Message(MessageType::ERROR, {ex.what()}));
+                    return true;
                 }
-                // ADD, SUB, MUL, DIV
-                case MessageType::ADD:
-                case MessageType::SUB:
-                case MessageType::MUL:
-                case MessageType::DIV: {
-                    // Check if there are at least two values in the stack
-                    try {
-                        // Get the right and left operands
-                        int right = std::stoi(pop_value());
-                        int left = std::stoi(pop_value());
-
-                        // Perform the operation
-                        int result = 0;
-
-                        // Perform the operation based on the message type
-                        // ADD
-                        if (msg.get_message_type() == MessageType::ADD) {
-                            result = left + right;
-                        } 
-                        // MUL
-                        else if (msg.get_message_type() == MessageType::MUL) {
-                            result = left * right;
-                        } 
-                        // SUB
-                        else if (msg.get_message_type() == MessageType::SUB) {
-                            result = left - right;
-                        } 
-                        // DIV
-                        else if (msg.get_message_type() == MessageType::DIV) {
-                            if (right == 0) throw std::runtime_error("Division by zero");
-                            result = left / right;
-                        }
-                        // Push the result to the stack
-                        push_value(std::to_string(result));
-                        // Send response to client
-                        send_response(Message(MessageType::OK));
-                        break;
-                    } catch (std::invalid_argument& iae) {
-                        throw OperationException("top two values are not integers");
+
+                break;
+            }
+            // ADD, SUB, MUL, DIV
+            case MessageType::ADD:
+            case MessageType::SUB:
+            case MessageType::MUL:
+            case MessageType::DIV: {
+                // Check if there are at least two values in the stack
+                try {
+                    // Get the right and left operands
+                    int right = std::stoi(pop_value());
+                    int left = std::stoi(pop_value());
+
+                    // Perform the operation
+                    int result = 0;
+
+                    // Perform the operation based on the message type
+                    // ADD
+                    if (msg.get_message_type() == MessageType::ADD) {
+                        result = left + right;
+                    } 
+                    // MUL
+                    else if (msg.get_message_type() == MessageType::MUL) {
+                        result = left * right;
+                    } 
+                    // SUB
+                    else if (msg.get_message_type() == MessageType::SUB) {
+                        result = left - right;
+                    } 
+                    // DIV
+                    else if (msg.get_message_type() == MessageType::DIV) {
+                        if (right == 0) throw std::runtime_error("Division by zero");
+                        result = left / right;
                     }
-                }
-                // PUSH
-                case MessageType::PUSH: {
-                    // Get the value from the message
-                    std::string value = msg.get_value();
-                    // Push the value to the stack
-                    push_value(value);
+                    // Push the result to the stack
+                    push_value(std::to_string(result));
                     // Send response to client
                     send_response(Message(MessageType::OK));
                     break;
+                } catch (std::invalid_argument& iae) {
+                    throw OperationException("top two values are not integers");
                 }
-                // BYE
-                case MessageType::BYE: {
-                    // Send response to client
-                    send_response(Message(MessageType::OK));
-                    // Exit the function to end this client connection
-                    return; 
+            }
+            // PUSH
+            case MessageType::PUSH: {
+                // Get the value from the message
+                std::string_view value = msg.get_value();
+                // Push the value to the stack
+                push_value(value);
+                // Send response to client
+                send_response(Message(MessageType::OK));
+                break;
+            }
+            // BYE
+            case MessageType::BYE: {
+                // Send response to client
+                send_response(Message(MessageType::OK));
+                // End this client connection
+                return false; 
+            }
+            // TOP
+            case MessageType::TOP: {
+                // Get the top value from the stack
+                const std::string &top_val = top_value();
+                // Values set over the binary protocol may not fit in a
+                // text reply
+                if (m_protocol != Protocol::BINARY && !Message::is_text_value(top_val)) {
+                    throw OperationException("value can't be sent as text");
                 }
-                // TOP
-                case MessageType::TOP: {
-                    // Get the top value from the stack
-                    std::string top_val = top_value();
-                    // Send response to client
-                    send_response(Message(MessageType::DATA, {top_val}));
-                    // Continue to next message
-                    break;
+                // Send response to client
+                send_response(Message(MessageType::DATA, {top_val}));
+                // Continue to next message
+                break;
+            }
+            // COMMIT
+            case MessageType::COMMIT: {
+                // Commit the transaction
+                commit_transaction();   
+                // Transaction is complete
+                inTransaction = false;
+                // Send response to client
+                send_response(Message(MessageType::OK));
+                break;
+            }
+            // INCRBY, INCR, DECR
+            case MessageType::INCRBY:
+            case MessageType::INCR:
+            case MessageType::DECR: {
+                int64_t delta = msg.get_message_type() == MessageType::DECR ? -1 : 1;
+                if (msg.get_message_type() == MessageType::INCRBY && !Table::parse_integer(msg.get_arg(2), delta)) {
+                    throw OperationException("amount is not an integer");
                 }
-                // COMMIT
-                case MessageType::COMMIT: {
-                    // Commit the transaction
-                    commit_transaction();   
-                    // Transaction is complete
-                    inTransaction = false;
-                    // Send response to client
-                    send_response(Message(MessageType::OK));
-                    break;
+
+                // The new value is returned without touching the stack
+                int64_t result = increment_value(msg.get_table(), msg.get_key(), delta);
+                send_response(Message(MessageType::DATA, {std::to_string(result)}));
+                break;
+            }
+            // SCAN, KEYS
+            case MessageType::SCAN:
+            case MessageType::KEYS: {
+                bool keys_only = msg.get_message_type() == MessageType::KEYS;
+                int64_t limit;
+                if (!Table::parse_integer(msg.get_arg(keys_only ? 2 : 3), limit) || limit < 1 || limit > int64_t(MAX_SCAN_LIMIT)) {
+                    throw OperationException("limit must be from 1 to " + std::to_string(MAX_SCAN_LIMIT));
                 }
-                // LOGIN
-                case MessageType::LOGIN: {
-                    std::string username = msg.get_username();
-                    if (!is_valid_username(username)) {
-                        send_response(Message(MessageType::ERROR, {"Invalid username"}));
-                        close(m_client_fd);
-                        return;
+
+                // KEYS scans the range of keys starting with the prefix,
+                // from the cursor if one is given
+                std::string_view start = msg.get_arg(1);
+                std::string end;
+                if (keys_only) {
+                    end = prefix_end(start);
+                    if (msg.get_num_args() > 3 && msg.get_arg(3) > start) {
+                        start = msg.get_arg(3);
                     }
-                    
-                    // Send response to client
-                    send_response(Message(MessageType::OK));
-                    break;
+                } else {
+                    end = msg.get_arg(2);
                 }
-                // BEGIN
-                case MessageType::BEGIN: {
-                    // Begin a transaction
-                    begin_transaction();
-                    // Send response to client
-                    inTransaction = true;
-                    // Send response to client
-                    send_response(Message(MessageType::OK));
-                    break;
+
+                // One more key than the limit tells where to continue
+                std::vector<std::pair<std::string, std::string>> entries;
+                scan_table(msg.get_table(), start, end, limit + 1, entries);
+                send_scan_reply(entries, limit, keys_only);
+                break;
+            }
+            // CAS
+            case MessageType::CAS: {
+                // Pop the new value (on top) and the expected value
+                if (value_stack.size() < 2) {
+                    throw OperationException("Not enough values on the stack");
                 }
-                // GET
-                case MessageType::GET: {
-                    // Get table from the message
-                    std::string table = msg.get_table();
+                std::string value = pop_value();
+                std::string expected = pop_value();
 
-                    // Get the value from the table
-                    std::string key = msg.get_key();
+                bool swapped;
+                try {
+                    swapped = compare_and_set(msg.get_table(), msg.get_key(), expected, value);
+                } catch (...) {
+                    // Put the values back, so a retried or failed request
+                    // leaves the stack as it was
+                    value_stack.push(std::move(expected));
+                    value_stack.push(std::move(value));
+                    throw;
+                }
 
-                    if (!is_valid_key(key)) {
-                        send_response(Message(MessageType::ERROR, {"Invalid key"}));
-                        continue;
-                    }
+                // Reply 1 if the key was set, 0 if its value differed
+                send_response(Message(MessageType::DATA, {swapped ? "1" : "0"}));
+                break;
+            }
+            // MSET
+            case MessageType::MSET: {
+                // Pop a value per key: the last key's value is on top
+                unsigned n = msg.get_num_args() - 1;
+                if (value_stack.size() < n) {
+                    throw OperationException("Not enough values on the stack");
+                }
+                std::vector<std::string_view> keys;
+                std::vector<std::string> values(n);
+                for (unsigned i = 0; i < n; i++) {
+                    keys.push_back(msg.get_arg(i + 1));
+                    values[n - 1 - i] = pop_value();
+                }
 
-                    // Get the value from the table
-                    std::string value = get_value(table, key);
+                try {
+                    set_values(msg.get_table(), keys, values);
+                } catch (...) {
+                    // Put the values back, so a retried or failed request
+                    // leaves the stack as it was
+                    for (std::string& value : values) {
+                        value_stack.push(std::move(value));
+                    }
+                    throw;
+                }
 
-                    
+                // Send response to client
+                send_response(Message(MessageType::OK));
+                break;
+            }
+            // DEL
+            case MessageType::DEL: {
+                std::vector<std::string_view> keys;
+                for (unsigned i = 1; i < msg.get_num_args(); i++) {
+                    keys.push_back(msg.get_arg(i));
+                }
 
-                    // Push the value to the stack
-                    push_value(value); 
+                // The number of keys erased is returned without touching
+                // the stack
+                size_t erased = erase_values(msg.get_table(), keys);
+                send_response(Message(MessageType::DATA, {std::to_string(erased)}));
+                break;
+            }
+            // MGET
+            case MessageType::MGET: {
+                std::vector<std::string_view> keys;
+                for (unsigned i = 1; i < msg.get_num_args(); i++) {
+                    keys.push_back(msg.get_arg(i));
+                }
+                std::vector<std::string> values;
+                get_values(msg.get_table(), keys, values);
 
-                    // Send response to client
-                    send_response(Message(MessageType::OK));
-                    break;
+                // The values are returned in one reply, without touching
+                // the stack
+                Message reply(MessageType::DATA);
+                size_t text_len = 5;
+                for (const std::string& value : values) {
+                    text_len += value.length() + 1;
+                    if (m_protocol != Protocol::BINARY && (!Message::is_text_value(value) || text_len > Message::MAX_ENCODED_LEN)) {
+                        throw OperationException("values can't be sent as text");
+                    }
+                    reply.push_arg(value);
                 }
-                // Default case
-                default: {
-                    throw InvalidMessage("Bad message");
-                    break;
+                send_response(reply);
+                break;
+            }
+            // LOGIN
+            case MessageType::LOGIN: {
+                std::string_view username = msg.get_username();
+                if (!Identifier::is_identifier(username)) {
+                    send_response(Message(MessageType::ERROR, {"Invalid username"}));
+                    return false;
                 }
+                
+                // Send response to client
+                send_response(Message(MessageType::OK));
+                break;
             }
-        } 
-        // Catch OperationException
-        catch (const OperationException& oe) {
-            if (inTransaction) {
-                throw FailedTransaction("invalid operation");
-            } else {
-                send_response(Message(MessageType::FAILED, {oe.what()}));
+            // BEGIN
+            case MessageType::BEGIN: {
+                // Begin a transaction
+                begin_transaction();
+                // Send response to client
+                inTransaction = true;
+                // Send response to client
+                send_response(Message(MessageType::OK));
+                break;
+            }
+            // SNAPSHOT
+            case MessageType::SNAPSHOT: {
+                // The snapshot is written in the background
+                if (!m_server->request_snapshot()) {
+                    send_response(Message(MessageType::ERROR, {"Snapshots are not enabled"}));
+                    return true;
+                }
+
+                // Send response to client
+                send_response(Message(MessageType::OK));
+                break;
+            }
+            // GET
+            case MessageType::GET: {
+                // Get table from the message
+                std::string_view table = msg.get_table();
+
+                // Get the value from the table
+                std::string_view key = msg.get_key();
+
+                if (!Identifier::is_identifier(key)) {
+                    send_response(Message(MessageType::ERROR, {"Invalid key"}));
+                    return true;
+                }
+
+                // Get the value from the table
+                std::string value = get_value(table, key);
+
+                
+
+                // Push the value to the stack
+                push_value(value); 
+
+                // Send response to client
+                send_response(Message(MessageType::OK));
+                break;
+            }
+            // Default case
+            default: {
+                throw InvalidMessage("Bad message");
+                break;
             }
         }
-        // Catch FailedTransaction
-        catch (const FailedTransaction& fte) {
+    } 
+    // Catch OperationException
+    catch (const OperationException& oe) {
+        // A failed operation aborts the current transaction (if any)
+        if (inTransaction) {
             roll_back_all();
             inTransaction = false;
-            send_response(Message(MessageType::FAILED, {fte.what()}));
-            
+            send_response(Message(MessageType::FAILED, {"invalid operation"}));
+        } else {
+            send_response(Message(MessageType::FAILED, {oe.what()}));
         }
-        // Catch InvalidMessage
-        catch (const InvalidMessage& ime) {
-            send_response(Message(MessageType::ERROR, {ime.what()}));
+    }
+    // Catch FailedTransaction
+    catch (const FailedTransaction& fte) {
+        roll_back_all();
+        inTransaction = false;
+        send_response(Message(MessageType::FAILED, {fte.what()}));
+        
+    }
+    // Catch InvalidMessage
+    catch (const InvalidMessage& ime) {
+        send_response(Message(MessageType::ERROR, {ime.what()}));
+        return false;
+    }
+    // Retry blocked requests later
+    catch (const RequestBlocked&) {
+        throw;
+    }
+    // Catch std::exception
+    catch (const std::exception& e) {
+        send_response(Message(MessageType::ERROR, {e.what()}));
+    }
+
+    return true;
+}
+
+// This method replies to a SCAN or KEYS request with the first of the
+// keys found, as many as fit in one reply: the key to continue from
+// (or "." if there are no more), then each key (and its value)
+// Parameters:
+//   entries - keys found and their values, in key order (the last
+//             one only tells where to continue if the limit is hit)
+//   limit - most keys the reply may hold
+//   keys_only - true to leave out the values
+// Returns:
+//   void
+void ClientConnection::send_scan_reply(const std::vector<std::pair<std::string, std::string>>& entries, size_t limit, bool keys_only) {
+    // Bytes of the reply so far, and the most it may have
+    bool binary = m_protocol == Protocol::BINARY;
+    size_t per_arg = binary ? 4 : 1;
+    size_t used = binary ? MessageSerialization::FRAME_HEADER_LEN : 5;
+    size_t budget = binary ? MessageSerialization::MAX_FRAME_LEN : Message::MAX_ENCODED_LEN;
+
+    // Take keys until the limit is hit or the next key (and the cursor
+    // after it) wouldn't fit
+    size_t n = 0;
+    while (n < entries.size() && n < limit) {
+        const std::string& key = entries[n].first;
+        const std::string& value = entries[n].second;
+        size_t size = per_arg + key.size() + (keys_only ? 0 : per_arg + value.size());
+        size_t cursor_size = n + 1 < entries.size() ? entries[n + 1].first.size() : 1;
+        if (used + size + per_arg + cursor_size > budget) {
             break;
         }
-        // Catch std::exception
-        catch (const std::exception& e) {
-            send_response(Message(MessageType::ERROR, {e.what()}));
+        if (!binary && !keys_only && !Message::is_text_value(value)) {
+            throw OperationException("values can't be sent as text");
+        }
+        used += size;
+        n++;
+    }
+    if (n == 0 && !entries.empty()) {
+        throw OperationException("key and value don't fit in a reply");
+    }
+
+    Message reply(MessageType::DATA, {n < entries.size() ? entries[n].first : "."});
+    for (size_t i = 0; i < n; i++) {
+        reply.push_arg(entries[i].first);
+        if (!keys_only) {
+            reply.push_arg(entries[i].second);
         }
     }
+    send_response(reply);
 }
 
-// This method sends a response to the client
+// This method queues a response to the client; queued responses are
+// sent together by flush_output()
 // Parameters:
 //   message - message to send
 // Returns:
 //   void
 void ClientConnection::send_response(const Message& msg) {
-    // Encode the message
+    // Encode the message in the client's protocol
     std::string response;
-    MessageSerialization::encode(msg, response);
+    if (m_protocol == Protocol::BINARY) {
+        MessageSerialization::encode_binary(msg, response);
+    } else {
+        MessageSerialization::encode(msg, response);
+    }
 
-    // Response length
-    size_t result = rio_writen(m_client_fd, response.c_str(), response.length());
+    // Queue the encoded message
+    m_outbuf.push_back(std::move(response));
+}
 
-    // Check if all bytes were written
-    if (result != response.length()) {
-        // Print error message
-        std::cerr << "Failed to write all bytes to socket. Expected " << response.length() << ", but wrote " << result << std::endl;
-        
-        // Close the connection and clean up resources
-        Close(m_client_fd); 
+// This method sends as many queued responses as the socket will take,
+// using a single writev call per batch of up to IOV_MAX responses
+// Parameters:
+//   none
+// Returns:
+//   false if the connection failed, true otherwise
+bool ClientConnection::flush_output() {
+    struct iovec iov[IOV_MAX];
 
-        // Set the client file descriptor to -1
-        m_client_fd = -1;
-        
-        // Throw an exception
-        throw std::runtime_error("Socket write failure, connection closed.");
+    while (!m_outbuf.empty()) {
+        // Gather the queued responses (skipping any part already sent)
+        int iovcnt = 0;
+        for (size_t i = 0; i < m_outbuf.size() && iovcnt < IOV_MAX; i++, iovcnt++) {
+            size_t skip = (i == 0) ? m_out_offset : 0;
+            iov[iovcnt].iov_base = const_cast<char*>(m_outbuf[i].data()) + skip;
+            iov[iovcnt].iov_len = m_outbuf[i].size() - skip;
+        }
+
+        ssize_t n = writev(m_client_fd, iov, iovcnt);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Socket buffer is full; the rest is sent once it's writable
+                return true;
+            }
+            // Print error message
+            std::cerr << "Failed to write responses to socket" << std::endl;
+            return false;
+        }
+
+        // Drop the responses that were sent completely
+        size_t sent = n + m_out_offset;
+        size_t done = 0;
+        while (done < m_outbuf.size() && sent >= m_outbuf[done].size()) {
+            sent -= m_outbuf[done].size();
+            done++;
+        }
+        m_outbuf.erase(m_outbuf.begin(), m_outbuf.begin() + done);
+        m_out_offset = sent;
     }
+
+    return true;
 }
 
 // This function pushes a value to the stack
@@ -320,9 +793,9 @@ void ClientConnection::send_response(const Message& msg) {
 //  table - pointer to the table
 // Returns:
 //  void
-void ClientConnection::push_value(const std::string& value) {
+void ClientConnection::push_value(std::string_view value) {
     // Push the value to the stack
-    value_stack.push(value);
+    value_stack.emplace(value);
 }
 
 // This function pops a value from the stack
@@ -337,7 +810,7 @@ std::string ClientConnection::pop_value() {
     }
 
     // Pop the value from the stack
-    std::string value = value_stack.top();
+    std::string value = std::move(value_stack.top());
 
     // Remove the value from the stack
     value_stack.pop();
@@ -350,18 +823,15 @@ std::string ClientConnection::pop_value() {
 // Parameters:
 //  none
 // Returns:
-//  std::string - value
-std::string ClientConnection::top_value() {
+//  const std::string& - value
+const std::string& ClientConnection::top_value() {
     // Check if the stack is empty
     if (value_stack.empty()) {
         throw OperationException("Stack is empty");
     }
 
     // Return the top value from the stack
-    std::string value = value_stack.top();
-
-    // Return the value
-    return value;
+    return value_stack.top();
 }
 
 // This function begins a transaction
@@ -377,6 +847,7 @@ void ClientConnection::begin_transaction() {
 
     // Set the transaction flag to true
     inTransaction = true;
+    m_txn = m_server->get_lock_manager().begin();
 }
 
 // This function commits a transaction
@@ -390,37 +861,367 @@ void ClientConnection::commit_transaction() {
         throw std::runtime_error("No transaction in progress");
     }
 
-    // Commit the transaction
-    for (auto& pair : lockedTables) {
-        // Commit the changes
-        pair.first->commit_changes();
-        // Unlock the table
-        pair.first->unlock(); 
+    // Optimistic transactions hold no locks until they are validated
+    if (m_server->get_concurrency_mode() == ConcurrencyMode::OPTIMISTIC) {
+        commit_optimistic();
+        inTransaction = false;
+        return;
+    }
+
+    // Retry later if an engine written to is behind: checked before
+    // the commit starts, as nothing may wait once it has
+    std::vector<std::pair<Table*, unsigned>> written;
+    m_write_set.collect_shards(written);
+    for (auto& shard : written) {
+        check_room(shard.first, shard.second);
     }
 
-    // Clear the locked tables
-    lockedTables.clear();
+    // Releases the locks
+    LockManager& locks = m_server->get_lock_manager();
+    auto release = [&]() {
+        for (auto& shard : lockedShards) {
+            locks.release(m_txn, shard.first, shard.second);
+        }
+        lockedShards.clear();
+    };
+
+    if (m_write_set.empty()) {
+        release();
+    } else {
+        // Apply the transaction's writes (every written shard is
+        // locked); the guard then releases the locks and lets new
+        // snapshots see the writes.  Erased keys are looked up first,
+        // so nothing is written if that fails.
+        m_write_set.prepare();
+        CommitGuard commit(m_server->get_commit_clock(), release);
+        log_writes();
+        m_write_set.apply(commit.get_ts());
+    }
 
     // Transaction is complete
     inTransaction = false;
 }
 
+// This method validates and installs an optimistic transaction
+// Parameters:
+//   none
+// Returns:
+//   void (throws FailedTransaction if validation fails)
+void ClientConnection::commit_optimistic() {
+    // Everything a read-only transaction read came from one snapshot,
+    // so it is consistent without any validation
+    if (m_write_set.empty()) {
+        end_snapshot();
+        m_read_set.clear();
+        return;
+    }
+
+    // Shards that were written are locked exclusively, shards that
+    // were only read are locked shared
+    std::vector<std::pair<Table*, unsigned>> written, read;
+    m_write_set.collect_shards(written);
+    m_read_set.collect_shards(read);
+    std::sort(written.begin(), written.end());
+    written.erase(std::unique(written.begin(), written.end()), written.end());
+    std::sort(read.begin(), read.end());
+    read.erase(std::unique(read.begin(), read.end()), read.end());
+
+    // Retry later if an engine written to is behind
+    for (auto& shard : written) {
+        check_room(shard.first, shard.second);
+    }
+
+    // Merge both lists in (table, shard) order; every committer locks in
+    // this order, and each lock is only held for the validation below,
+    // so waiting for a lock here can't deadlock
+    std::vector<std::pair<std::pair<Table*, unsigned>, bool>> shards;
+    auto w = written.begin();
+    for (auto& r : read) {
+        for (; w != written.end() && *w < r; ++w) {
+            shards.push_back({*w, true});
+        }
+        if (w != written.end() && *w == r) {
+            continue;
+        }
+        shards.push_back({r, false});
+    }
+    for (; w != written.end(); ++w) {
+        shards.push_back({*w, true});
+    }
+
+    for (auto& shard : shards) {
+        if (shard.second) {
+            shard.first.first->lock(shard.first.second);
+        } else {
+            shard.first.first->lock_shared(shard.first.second);
+        }
+    }
+
+    auto unlock = [&]() {
+        for (auto& shard : shards) {
+            if (shard.second) {
+                shard.first.first->unlock(shard.first.second);
+            } else {
+                shard.first.first->unlock_shared(shard.first.second);
+            }
+        }
+    };
+
+    // Install the writes only if nothing read has changed since (erased
+    // keys are looked up first, so nothing is written if that fails);
+    // the guard then unlocks the shards and lets new snapshots see the
+    // writes
+    bool valid;
+    try {
+        valid = m_read_set.validate();
+        if (valid) {
+            m_write_set.prepare();
+        }
+    } catch (...) {
+        unlock();
+        throw;
+    }
+    if (valid) {
+        CommitGuard commit(m_server->get_commit_clock(), unlock);
+        log_writes();
+        m_write_set.apply(commit.get_ts());
+    } else {
+        unlock();
+    }
+
+    end_snapshot();
+    m_write_set.clear();
+    m_read_set.clear();
+
+    if (!valid) {
+        throw FailedTransaction("transaction conflict");
+    }
+}
+
+// This method logs the current transaction's writes, if logging is
+// enabled (called while every written shard is locked)
+// Parameters:
+//   none
+// Returns:
+//   void
+void ClientConnection::log_writes() {
+    WriteAheadLog *log = m_server->get_log();
+    if (log) {
+        WriteAheadLog::Record record(WriteAheadLog::Record::COMMIT);
+        m_write_set.log(record);
+        m_wait_lsn = log->append(record);
+    }
+}
+
+// This method locks a table shard for the current two-phase locking
+// transaction, unless it already holds it
+// Parameters:
+//   table - table to lock
+//   shard - shard index
+// Returns:
+//   void (throws RequestBlocked if the transaction must wait for the
+//   lock, FailedTransaction if it must abort instead)
+void ClientConnection::lock_shard(Table *table, unsigned shard) {
+    if (lockedShards.count({table, shard}) != 0) {
+        return;
+    }
+
+    switch (m_server->get_lock_manager().acquire(m_txn, table, shard)) {
+        case LockManager::Result::GRANTED:
+            lockedShards.insert({table, shard});
+            return;
+        case LockManager::Result::WAIT:
+            // Queued for the lock: the request is retried once the
+            // transaction ahead lets go
+            throw LockQueued("table is locked");
+        case LockManager::Result::BUSY:
+            // Next in line for the lock: the request is retried shortly
+            throw RequestBlocked("table is locked");
+        case LockManager::Result::DEADLOCK:
+            throw FailedTransaction("deadlock detected");
+        case LockManager::Result::TIMEOUT:
+            throw FailedTransaction("timed out waiting for a lock");
+    }
+}
+
+// This method locks a table shard for an autocommit write, unless a
+// two-phase locking transaction is queued for it
+// Parameters:
+//   table - table to lock
+//   shard - shard index
+// Returns:
+//   bool - true if the shard was locked
+bool ClientConnection::trylock_shard(Table *table, unsigned shard) {
+    // Taking a shard that transactions queue for would let a steady
+    // stream of autocommit writes starve them
+    return !m_server->get_lock_manager().is_queued(table, shard) && table->trylock(shard);
+}
+
+// This method turns a write away while a table shard's engine is
+// behind (see StorageEngine::has_room()); called before any lock is
+// taken or commit started, so nothing waits while holding them
+// Parameters:
+//   table - table about to be written
+//   shard - shard index
+// Returns:
+//   void (throws RequestBlocked if the write must be retried later)
+void ClientConnection::check_room(Table *table, unsigned shard) {
+    if (!table->has_room(shard)) {
+        throw RequestBlocked("table is busy");
+    }
+}
+
+// This method finds a table by name, checking the connection's
+// table cache before the server's table directory
+// Parameters:
+//   name - table name
+// Returns:
+//   Table* - the table, or nullptr if there is no such table
+Table* ClientConnection::find_table(std::string_view name) {
+    // Drop the cache if the set of tables changed since it was filled
+    uint64_t epoch = m_server->get_table_epoch();
+    if (epoch != m_table_cache_epoch) {
+        m_table_cache_len = 0;
+        m_table_cache_epoch = epoch;
+    }
+
+    // Most connections use one or two tables, so a hit is usually the
+    // first name compared
+    for (unsigned i = 0; i < m_table_cache_len; i++) {
+        Table* table = m_table_cache[i];
+        if (table->get_name() == name) {
+            std::copy_backward(m_table_cache, m_table_cache + i, m_table_cache + i + 1);
+            m_table_cache[0] = table;
+            return table;
+        }
+    }
+
+    // The table directory may only be read under a snapshot (any
+    // snapshot the transaction already holds will do)
+    Table* table;
+    if (m_in_snapshot) {
+        table = m_server->find_table(name);
+    } else {
+        SnapshotRegistry& snapshots = m_server->get_snapshots();
+        snapshots.begin(m_snapshot, m_server->get_commit_clock());
+        table = m_server->find_table(name);
+        snapshots.end(m_snapshot);
+    }
+
+    // Tables are never deleted, so the pointer stays valid; misses
+    // aren't cached, since the table may be created later
+    if (table != nullptr) {
+        if (m_table_cache_len < TABLE_CACHE_SIZE) {
+            m_table_cache_len++;
+        }
+        std::copy_backward(m_table_cache, m_table_cache + m_table_cache_len - 1, m_table_cache + m_table_cache_len);
+        m_table_cache[0] = table;
+    }
+    return table;
+}
+
+// This method reads a key the current transaction is about to write:
+// its own write if it made one, else the committed value (locking the
+// shard, or reading the snapshot of an optimistic transaction)
+// Parameters:
+//   table - table to read
+//   key - key to read
+//   value - set to the key's value
+//   deadline - set to the value's deadline (0 if none)
+// Returns:
+//   bool - true if the key exists
+bool ClientConnection::read_for_update(Table *table, std::string_view key, std::string &value, uint64_t &deadline) {
+    // The transaction's own writes (and erases) take precedence
+    if (const std::optional<std::string> *written = m_write_set.find(table, key, deadline)) {
+        if (!*written) {
+            return false;
+        }
+        value = **written;
+        return true;
+    }
+
+    if (m_server->get_concurrency_mode() == ConcurrencyMode::OPTIMISTIC) {
+        // Read from the transaction's snapshot, remembering the version
+        // for validation
+        if (!m_in_snapshot) {
+            m_snapshot_ts = m_server->get_snapshots().begin(m_snapshot, m_server->get_commit_clock());
+            m_in_snapshot = true;
+        }
+        uint64_t version;
+        bool found = table->get_snapshot(key, m_snapshot_ts, value, version, deadline);
+        m_read_set.record(table, key, version);
+        return found;
+    }
+
+    // Lock the shard (waiting for it if necessary)
+    lock_shard(table, Table::shard_of(key));
+    uint64_t version;
+    bool found = table->get(key, value, version);
+    deadline = found ? table->get_deadline(key) : 0;
+    return found;
+}
+
+// This method turns a time to live sent by the client into a deadline
+// Parameters:
+//   seconds - number of seconds
+// Returns:
+//   uint64_t - the deadline
+uint64_t ClientConnection::ttl_deadline(std::string_view seconds) {
+    int64_t n;
+    if (!Table::parse_integer(seconds, n) || n < 1 || n > MAX_TTL_SECONDS) {
+        throw OperationException("time to live must be from 1 to " + std::to_string(MAX_TTL_SECONDS) + " seconds");
+    }
+    return TimerWheel::now_ms() + uint64_t(n) * 1000;
+}
+
+// This method checks a table's memory budget before a write that may
+// grow the table
+// Parameters:
+//   table - table about to be written
+// Returns:
+//   void
+void ClientConnection::check_memory(Table *table) {
+    if (!table->is_full()) {
+        return;
+    }
+    if (table->get_budget().policy == EvictionPolicy::NOEVICTION) {
+        throw OperationException("table is out of memory");
+    }
+    m_server->request_eviction();
+}
+
+// This method ends the current transaction's snapshot, if it has one
+// Parameters:
+//   none
+// Returns:
+//   void
+void ClientConnection::end_snapshot() {
+    if (m_in_snapshot) {
+        m_server->get_snapshots().end(m_snapshot);
+        m_in_snapshot = false;
+    }
+}
+
 // This method rolls back all the changes made during a transaction
 // Parameters:
 //   none
 // Returns:
 //   void
 void ClientConnection::roll_back_all() {
-    // Roll back all the changes made during a transaction
-    for (auto& pair : lockedTables) {
-        // Roll back the changes
-        pair.first->rollback_changes();
-        // Unlock the table
-        pair.first->unlock();
+    // Drop the changes made during a transaction
+    m_write_set.clear();
+    m_read_set.clear();
+    end_snapshot();
+
+    // Release the locks, and stop waiting for one
+    LockManager& locks = m_server->get_lock_manager();
+    locks.cancel(m_txn);
+    for (auto& shard : lockedShards) {
+        locks.release(m_txn, shard.first, shard.second);
     }
 
-    // Clear the locked tables
-    lockedTables.clear();
+    // Clear the locked shards
+    lockedShards.clear();
 }
 
 // This function sets a value in the table
@@ -428,36 +1229,48 @@ void ClientConnection::roll_back_all() {
 //  table - table name
 //  key - key
 //  value - value
+//  deadline - when the value expires (0 for never)
 // Returns:
 //  void
-void ClientConnection::set_value(const std::string& table, const std::string& key, const std::string& value) {
+void ClientConnection::set_value(std::string_view table, std::string_view key, const std::string& value, uint64_t deadline) {
     // Find the table
-    Table* t = m_server->find_table(table);
+    Table* t = find_table(table);
     
     // Check if the table exists
     if (t) {
-        // Set the value in the table
-        if (inTransaction) {
-            // Check if the table is already locked
-            if (lockedTables.count(t) == 0 && !t->trylock()) {
-            // Error if the table is already locked
-                throw FailedTransaction("attempted to acquire a lock already in use");
-            }
+        check_memory(t);
+
+        // Only the shard holding the key is locked
+        unsigned shard = Table::shard_of(key);
 
-            // Lock the table
-            lockedTables[t] = true;
+        // Set the value in the table
+        if (inTransaction && m_server->get_concurrency_mode() == ConcurrencyMode::OPTIMISTIC) {
+            // Buffer the write until COMMIT (no lock needed)
+            m_write_set.put(t, key, value, deadline);
+        } else if (inTransaction) {
+            // Lock the shard (waiting for it if necessary)
+            lock_shard(t, shard);
 
-            // Set the value in the table
-            t->set(key, value);
+            // Buffer the write until COMMIT
+            m_write_set.put(t, key, value, deadline);
         } else {
-            // Lock the table
-            t->lock();
-            // Set the value in the table
-            t->set(key, value);
-            // Commit the changes
-            t->commit_changes();
-            // Unlock the table
-            t->unlock();
+            // Lock the shard (retry later if a transaction holds it,
+            // or its engine is behind)
+            check_room(t, shard);
+            if (!trylock_shard(t, shard)) {
+                throw RequestBlocked("table is locked");
+            }
+            // Set the value in the table; the guard unlocks the shard
+            // and lets new snapshots see the write
+            CommitGuard commit(m_server->get_commit_clock(), [t, shard]() { t->unlock(shard); });
+            t->set(key, value, commit.get_ts(), deadline);
+            // Log the write while the shard is still locked, so writes
+            // to a key are logged in commit order
+            if (WriteAheadLog *log = m_server->get_log()) {
+                WriteAheadLog::Record record(WriteAheadLog::Record::COMMIT);
+                record.add_write(t->get_name(), key, value, deadline);
+                m_wait_lsn = log->append(record);
+            }
         }
     } else {
         // Error if the table is not found
@@ -465,15 +1278,68 @@ void ClientConnection::set_value(const std::string& table, const std::string& ke
     }
 }
 
+// This function gives a key's value a new deadline (by writing it
+// again)
+// Parameters:
+//  table - table name
+//  key - key
+//  deadline - when the value expires
+// Returns:
+//  bool - true if the key exists
+bool ClientConnection::expire_value(std::string_view table, std::string_view key, uint64_t deadline) {
+    // Find the table
+    Table* t = find_table(table);
+    if (!t) {
+        throw std::runtime_error("Table not found");
+    }
+    unsigned shard = Table::shard_of(key);
+
+    std::string value;
+    if (inTransaction) {
+        // The value is written again with its new deadline, buffered
+        // like any other write
+        uint64_t old_deadline;
+        if (!read_for_update(t, key, value, old_deadline)) {
+            return false;
+        }
+        m_write_set.put(t, key, value, deadline);
+        return true;
+    }
+
+    // Lock the shard (retry later if a transaction holds it, or its
+    // engine is behind)
+    check_room(t, shard);
+    if (!trylock_shard(t, shard)) {
+        throw RequestBlocked("table is locked");
+    }
+
+    // Read and write under the one lock
+    uint64_t version;
+    if (!t->get(key, value, version)) {
+        t->unlock(shard);
+        return false;
+    }
+    CommitGuard commit(m_server->get_commit_clock(), [t, shard]() { t->unlock(shard); });
+    t->set(key, value, commit.get_ts(), deadline);
+
+    // Log the write while the shard is still locked
+    if (WriteAheadLog *log = m_server->get_log()) {
+        WriteAheadLog::Record record(WriteAheadLog::Record::COMMIT);
+        record.add_write(t->get_name(), key, value, deadline);
+        m_wait_lsn = log->append(record);
+    }
+    return true;
+}
+
 // This function gets a value from the table
 // Parameters:
 //  table - table name
 //  key - key
 // Returns:
 //  std::string - value
-std::string ClientConnection::get_value(const std::string& table, const std::string& key) {
+std::string ClientConnection::get_value(std::string_view table, std::string_view key) {
     // Find the table
-    Table* t = m_server->find_table(table);
+    Table* t = find_table(table);
     
     // Check if the table exists
     std::string value;
@@ -483,50 +1349,471 @@ std::string ClientConnection::get_value(const std::string& table, const std::str
         throw std::runtime_error("Table not found");
     }
 
-    // If in transaction
-    if (inTransaction) {
-        // Check if the table is already locked
-        if (lockedTables.count(t) == 0 && !t->trylock()) {
-            throw FailedTransaction("attempted to acquire a lock already in use");
+    // If in an optimistic transaction
+    if (inTransaction && m_server->get_concurrency_mode() == ConcurrencyMode::OPTIMISTIC) {
+        // The transaction's own writes (and erases) take precedence
+        if (const std::optional<std::string> *written = m_write_set.find(t, key)) {
+            if (!*written) {
+                throw std::invalid_argument("key not in table");
+            }
+            return **written;
         }
 
-        // Lock the table
-        lockedTables[t] = true;
-
-        // Get the value from the table
-        value = t->get(key);
-    } else {
-        // Lock the table
-        t->lock();
+        // Every read of the transaction comes from the snapshot taken
+        // by its first read, without locking the shard
+        if (!m_in_snapshot) {
+            m_snapshot_ts = m_server->get_snapshots().begin(m_snapshot, m_server->get_commit_clock());
+            m_in_snapshot = true;
+        }
 
-        // Get the value from the table
-        value = t->get(key);
+        // Remember the version read, for validation if the transaction
+        // turns out to write anything
+        uint64_t version;
+        bool found = t->get_snapshot(key, m_snapshot_ts, value, version);
+        m_read_set.record(t, key, version);
+        if (!found) {
+            throw std::invalid_argument("key not in table");
+        }
+    } else if (inTransaction) {
+        // Only the shard holding the key is locked (waiting for it if
+        // necessary)
+        lock_shard(t, Table::shard_of(key));
 
-        // Unlock the table
-        t->commit_changes();
+        // The transaction's own writes (and erases) take precedence
+        if (const std::optional<std::string> *written = m_write_set.find(t, key)) {
+            if (!*written) {
+                throw std::invalid_argument("key not in table");
+            }
+            value = **written;
+        } else {
+            value = t->get(key);
+        }
+    } else {
+        // Read the latest committed value from a snapshot, without
+        // locking the shard (so writers and transactions never block it)
+        SnapshotRegistry& snapshots = m_server->get_snapshots();
+        uint64_t version;
+        bool found = t->get_snapshot(key, snapshots.begin(m_snapshot, m_server->get_commit_clock()), value, version);
+        snapshots.end(m_snapshot);
 
-        // Unlock the table
-        t->unlock();
+        if (!found) {
+            throw std::invalid_argument("key not in table");
+        }
     }
 
     // Return the value
     return value;
 }
 
-bool is_valid_username(const std::string& username) {
-    // Check if username follows the identifier rules
-    std::regex pattern("^[a-zA-Z][a-zA-Z0-9_]*$");
-    return std::regex_match(username, pattern);
+// This function adds to the integer value of a key in one step
+// (a key that doesn't exist counts as 0)
+// Parameters:
+//  table - table name
+//  key - key
+//  delta - amount to add
+// Returns:
+//  int64_t - the key's new value
+int64_t ClientConnection::increment_value(std::string_view table, std::string_view key, int64_t delta) {
+    // Find the table
+    Table* t = find_table(table);
+    if (!t) {
+        throw std::runtime_error("Table not found");
+    }
+    check_memory(t);
+    unsigned shard = Table::shard_of(key);
+
+    if (!inTransaction) {
+        // Lock the shard (retry later if a transaction holds it, or
+        // its engine is behind)
+        check_room(t, shard);
+        if (!trylock_shard(t, shard)) {
+            throw RequestBlocked("table is locked");
+        }
+
+        // Read, add and write under the one lock (the guard unlocks the
+        // shard and publishes the timestamp even if nothing is written)
+        CommitGuard commit(m_server->get_commit_clock(), [t, shard]() { t->unlock(shard); });
+        int64_t result = t->increment(key, delta, commit.get_ts());
+
+        // Log the new value while the shard is still locked
+        if (WriteAheadLog *log = m_server->get_log()) {
+            WriteAheadLog::Record record(WriteAheadLog::Record::COMMIT);
+            record.add_write(t->get_name(), key, std::to_string(result), t->get_deadline(key));
+            m_wait_lsn = log->append(record);
+        }
+        return result;
+    }
+
+    // In a transaction, the sum is buffered like any other write
+    std::string value;
+    uint64_t deadline;
+    int64_t result = read_for_update(t, key, value, deadline) ? Table::add_integer(value, delta) : delta;
+    m_write_set.put(t, key, std::to_string(result), deadline);
+    return result;
 }
 
-bool is_valid_table_name(const std::string& name) {
-    // Check if table name follows the identifier rules
-    std::regex pattern("^[a-zA-Z][a-zA-Z0-9_]*$");
-    return std::regex_match(name, pattern);
+// This function sets a key only if its value is the expected one, in
+// one step
+// Parameters:
+//  table - table name
+//  key - key
+//  expected - value the key must have
+//  value - new value
+// Returns:
+//  bool - true if the key was set
+bool ClientConnection::compare_and_set(std::string_view table, std::string_view key, const std::string& expected, const std::string& value) {
+    // Find the table
+    Table* t = find_table(table);
+    if (!t) {
+        throw std::runtime_error("Table not found");
+    }
+    check_memory(t);
+    unsigned shard = Table::shard_of(key);
+
+    if (inTransaction) {
+        // The new value is buffered like any other write
+        std::string current;
+        uint64_t deadline;
+        if (!read_for_update(t, key, current, deadline) || current != expected) {
+            return false;
+        }
+        m_write_set.put(t, key, value, deadline);
+        return true;
+    }
+
+    // Lock the shard (retry later if a transaction holds it, or its
+    // engine is behind)
+    check_room(t, shard);
+    if (!trylock_shard(t, shard)) {
+        throw RequestBlocked("table is locked");
+    }
+
+    // Compare and write under the one lock; the compare reads the base
+    // layer, which may fail, so it comes before the commit starts.  The
+    // key keeps its deadline.
+    std::string current;
+    uint64_t version, deadline;
+    try {
+        if (!t->get(key, current, version) || current != expected) {
+            t->unlock(shard);
+            return false;
+        }
+        deadline = t->get_deadline(key);
+    } catch (...) {
+        t->unlock(shard);
+        throw;
+    }
+    CommitGuard commit(m_server->get_commit_clock(), [t, shard]() { t->unlock(shard); });
+    t->set(key, value, commit.get_ts(), deadline);
+
+    // Log the new value while the shard is still locked
+    if (WriteAheadLog *log = m_server->get_log()) {
+        WriteAheadLog::Record record(WriteAheadLog::Record::COMMIT);
+        record.add_write(t->get_name(), key, value, deadline);
+        m_wait_lsn = log->append(record);
+    }
+    return true;
 }
 
-bool is_valid_key(const std::string& key) {
-    // Check if key follows the identifier rules
-    std::regex pattern("^[a-zA-Z][a-zA-Z0-9_]*$");
-    return std::regex_match(key, pattern);
-}
\ No newline at end of file
+// This function gets the first keys of a range of a table, in key
+// order, from a snapshot (without locking anything, and outside any
+// transaction)
+// Parameters:
+//  table - table name
+//  start - smallest key of the range
+//  end - key just past the range (empty for no upper bound)
+//  limit - most keys to get
+//  entries - set to the keys and their values
+// Returns:
+//  void
+void ClientConnection::scan_table(std::string_view table, std::string_view start, std::string_view end, size_t limit, std::vector<std::pair<std::string, std::string>>& entries) {
+    // Find the table
+    Table* t = find_table(table);
+    if (!t) {
+        throw std::runtime_error("Table not found");
+    }
+
+    // Each chunk of a scan reads its own snapshot of the latest
+    // committed data, so writers are never blocked by a scan
+    SnapshotRegistry& snapshots = m_server->get_snapshots();
+    uint64_t ts = snapshots.begin(m_snapshot, m_server->get_commit_clock());
+    try {
+        t->scan_range(ts, start, end, limit, entries);
+    } catch (...) {
+        snapshots.end(m_snapshot);
+        throw;
+    }
+    snapshots.end(m_snapshot);
+}
+
+// This function sets several keys of a table at once, locking each
+// shard written only once (the keys are written atomically outside
+// a transaction)
+// Parameters:
+//  table - table name
+//  keys - keys (if a key is repeated, its last value is written)
+//  values - values, in the same order as the keys
+// Returns:
+//  void
+void ClientConnection::set_values(std::string_view table, const std::vector<std::string_view>& keys, const std::vector<std::string>& values) {
+    // Find the table
+    Table* t = find_table(table);
+    if (!t) {
+        throw std::runtime_error("Table not found");
+    }
+    check_memory(t);
+
+    // The last value of each key, and the shards written (in index
+    // order, so shards are always locked in the same order)
+    std::map<std::string_view, const std::string*> writes;
+    std::vector<unsigned> shards;
+    for (size_t i = 0; i < keys.size(); i++) {
+        writes[keys[i]] = &values[i];
+        shards.push_back(Table::shard_of(keys[i]));
+    }
+    std::sort(shards.begin(), shards.end());
+    shards.erase(std::unique(shards.begin(), shards.end()), shards.end());
+
+    if (inTransaction) {
+        // Lock the shards (waiting for them if necessary), unless the
+        // transaction is optimistic
+        if (m_server->get_concurrency_mode() != ConcurrencyMode::OPTIMISTIC) {
+            for (unsigned shard : shards) {
+                lock_shard(t, shard);
+            }
+        }
+
+        // Buffer the writes until COMMIT
+        for (auto& write : writes) {
+            m_write_set.put(t, write.first, *write.second);
+        }
+        return;
+    }
+
+    // Lock the shards (retry later if a transaction holds one, or an
+    // engine is behind)
+    for (unsigned shard : shards) {
+        check_room(t, shard);
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (!trylock_shard(t, shards[i])) {
+            while (i-- > 0) {
+                t->unlock(shards[i]);
+            }
+            throw RequestBlocked("table is locked");
+        }
+    }
+
+    // Every write gets the same commit timestamp, so snapshots see all
+    // of them or none; the guard unlocks the shards and publishes it
+    CommitGuard commit(m_server->get_commit_clock(), [t, &shards]() {
+        for (unsigned shard : shards) {
+            t->unlock(shard);
+        }
+    });
+    for (auto& write : writes) {
+        t->set(write.first, *write.second, commit.get_ts());
+    }
+
+    // Log the writes as one record while the shards are still locked
+    if (WriteAheadLog *log = m_server->get_log()) {
+        WriteAheadLog::Record record(WriteAheadLog::Record::COMMIT);
+        for (auto& write : writes) {
+            record.add_write(t->get_name(), write.first, *write.second);
+        }
+        m_wait_lsn = log->append(record);
+    }
+}
+
+// This function gets the values of several keys of a table at once,
+// from a single snapshot (or locking each shard read only once in a
+// two-phase locking transaction)
+// Parameters:
+//  table - table name
+//  keys - keys
+//  values - set to the keys' values, in the same order
+// Returns:
+//  void
+void ClientConnection::get_values(std::string_view table, const std::vector<std::string_view>& keys, std::vector<std::string>& values) {
+    // Find the table
+    Table* t = find_table(table);
+    if (!t) {
+        throw std::runtime_error("Table not found");
+    }
+
+    values.resize(keys.size());
+
+    if (inTransaction && m_server->get_concurrency_mode() != ConcurrencyMode::OPTIMISTIC) {
+        // Lock every shard read before reading any key (waiting for
+        // them if necessary)
+        std::vector<unsigned> shards;
+        for (std::string_view key : keys) {
+            shards.push_back(Table::shard_of(key));
+        }
+        std::sort(shards.begin(), shards.end());
+        shards.erase(std::unique(shards.begin(), shards.end()), shards.end());
+        for (unsigned shard : shards) {
+            lock_shard(t, shard);
+        }
+
+        // The transaction's own writes (and erases) take precedence
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (const std::optional<std::string> *written = m_write_set.find(t, keys[i])) {
+                if (!*written) {
+                    throw std::invalid_argument("key not in table");
+                }
+                values[i] = **written;
+            } else {
+                values[i] = t->get(keys[i]);
+            }
+        }
+        return;
+    }
+
+    if (inTransaction) {
+        // An optimistic transaction reads everything from the snapshot
+        // taken by its first read
+        if (!m_in_snapshot) {
+            m_snapshot_ts = m_server->get_snapshots().begin(m_snapshot, m_server->get_commit_clock());
+            m_in_snapshot = true;
+        }
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            // The transaction's own writes (and erases) take precedence
+            if (const std::optional<std::string> *written = m_write_set.find(t, keys[i])) {
+                if (!*written) {
+                    throw std::invalid_argument("key not in table");
+                }
+                values[i] = **written;
+                continue;
+            }
+
+            uint64_t version;
+            bool found = t->get_snapshot(keys[i], m_snapshot_ts, values[i], version);
+            m_read_set.record(t, keys[i], version);
+            if (!found) {
+                throw std::invalid_argument("key not in table");
+            }
+        }
+        return;
+    }
+
+    // Read every key from one snapshot, without locking any shard
+    SnapshotRegistry& snapshots = m_server->get_snapshots();
+    uint64_t ts = snapshots.begin(m_snapshot, m_server->get_commit_clock());
+    bool found = true;
+    for (size_t i = 0; i < keys.size() && found; i++) {
+        uint64_t version;
+        found = t->get_snapshot(keys[i], ts, values[i], version);
+    }
+    snapshots.end(m_snapshot);
+
+    if (!found) {
+        throw std::invalid_argument("key not in table");
+    }
+}
+
+// This function erases several keys of a table at once, locking each
+// shard written only once (the keys are erased atomically outside a
+// transaction)
+// Parameters:
+//  table - table name
+//  keys - keys (a repeated key is only erased once)
+// Returns:
+//  size_t - number of keys that existed
+size_t ClientConnection::erase_values(std::string_view table, const std::vector<std::string_view>& keys) {
+    // Find the table
+    Table* t = find_table(table);
+    if (!t) {
+        throw std::runtime_error("Table not found");
+    }
+
+    // Each key once, and the shards written (in index order, so shards
+    // are always locked in the same order)
+    std::vector<std::string_view> unique_keys(keys);
+    std::sort(unique_keys.begin(), unique_keys.end());
+    unique_keys.erase(std::unique(unique_keys.begin(), unique_keys.end()), unique_keys.end());
+    std::vector<unsigned> shards;
+    for (std::string_view key : unique_keys) {
+        shards.push_back(Table::shard_of(key));
+    }
+    std::sort(shards.begin(), shards.end());
+    shards.erase(std::unique(shards.begin(), shards.end()), shards.end());
+
+    if (inTransaction) {
+        // Lock every shard before buffering any erase (waiting for them
+        // if necessary), unless the transaction is optimistic, so a
+        // retried request finds nothing buffered yet
+        if (m_server->get_concurrency_mode() != ConcurrencyMode::OPTIMISTIC) {
+            for (unsigned shard : shards) {
+                lock_shard(t, shard);
+            }
+        }
+
+        // Buffer a tombstone for each key that exists until COMMIT
+        size_t erased = 0;
+        for (std::string_view key : unique_keys) {
+            std::string value;
+            uint64_t deadline;
+            if (read_for_update(t, key, value, deadline)) {
+                m_write_set.erase(t, key);
+                erased++;
+            }
+        }
+        return erased;
+    }
+
+    // Lock the shards (retry later if a transaction holds one, or an
+    // engine is behind)
+    for (unsigned shard : shards) {
+        check_room(t, shard);
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (!trylock_shard(t, shards[i])) {
+            while (i-- > 0) {
+                t->unlock(shards[i]);
+            }
+            throw RequestBlocked("table is locked");
+        }
+    }
+
+    auto unlock = [t, &shards]() {
+        for (unsigned shard : shards) {
+            t->unlock(shard);
+        }
+    };
+
+    // Find the keys that exist before the commit starts, as looking
+    // them up may fail
+    std::vector<std::pair<std::string_view, bool>> found;
+    try {
+        for (std::string_view key : unique_keys) {
+            bool in_base;
+            if (t->check_erase(key, in_base)) {
+                found.emplace_back(key, in_base);
+            }
+        }
+    } catch (...) {
+        unlock();
+        throw;
+    }
+    if (found.empty()) {
+        unlock();
+        return 0;
+    }
+
+    // Every erase gets the same commit timestamp, so snapshots see all
+    // of them or none; the guard unlocks the shards and publishes it
+    CommitGuard commit(m_server->get_commit_clock(), unlock);
+    WriteAheadLog::Record record(WriteAheadLog::Record::COMMIT);
+    for (auto& key : found) {
+        t->erase_checked(key.first, commit.get_ts(), key.second);
+        record.add_erase(t->get_name(), key.first);
+    }
+
+    // Log the erases as one record while the shards are still locked
+    if (WriteAheadLog *log = m_server->get_log()) {
+        m_wait_lsn = log->append(record);
+    }
+    return found.size();
+}
@@ -4,7 +4,16 @@
 
 // Headers
 #include <set>
+#include <stack>
+#include <string>
+#include <string_view>
+#include <vector>
 #include "message.h"
+#include "write_set.h"
+#include "read_set.h"
+#include "mvcc.h"
+#include "lock_manager.h"
+#include "write_ahead_log.h"
 #include "csapp.h"
 
 // Forward declarations
@@ -16,16 +25,65 @@ private:
   // Member variables
   // Server object
   Server *m_server;
-  // Client file descriptor
+  // Client file descriptor (non-blocking)
   int m_client_fd;
-  // Buffer for reading from the client
-  rio_t m_fdbuf;
+  // Bytes received from the client that haven't been handled yet
+  std::string m_inbuf;
+  // Encoded responses not yet written to the client
+  std::vector<std::string> m_outbuf;
+  // Bytes of the first queued response that were already written
+  size_t m_out_offset;
+  // Set once the client has closed its end of the connection
+  bool m_eof;
+  // Set once the connection should close (after its replies are sent)
+  bool m_closing;
+  // The request currently being handled (a view into m_inbuf)
+  MessageView m_request;
+  // Protocol the client speaks, chosen by the first byte it sends
+  enum class Protocol {
+    // Nothing received yet
+    UNKNOWN,
+    // Newline-terminated text lines (see MessageSerialization::decode)
+    TEXT,
+    // Length-prefixed binary frames (see MessageSerialization::BINARY_MAGIC)
+    BINARY,
+  };
+  Protocol m_protocol;
+  // Set once the first message (which must be LOGIN) has been handled
+  bool m_logged_in;
   // Variable to keep track of the transaction status
   bool inTransaction;
+  // Id of the current transaction in the server's lock manager
+  LockManager::TxnId m_txn;
   // Stack to manage values
   std::stack<std::string> value_stack;  
-  // To keep track of locked tables during a transaction
-  std::unordered_map<Table*, bool> lockedTables;   
+  // To keep track of locked table shards during a transaction
+  std::set<std::pair<Table*, unsigned>> lockedShards;
+  // Writes made during the current transaction (applied at COMMIT)
+  WriteSet m_write_set;
+  // Versions read during the current optimistic transaction
+  // (validated at COMMIT)
+  ReadSet m_read_set;
+  // This connection's slot in the server's snapshot registry
+  SnapshotRegistry::Slot *m_snapshot;
+  // Set while an optimistic transaction holds a snapshot
+  bool m_in_snapshot;
+  // Timestamp of the optimistic transaction's snapshot
+  uint64_t m_snapshot_ts;
+  // Most keys a SCAN or KEYS reply may hold
+  static const size_t MAX_SCAN_LIMIT = 10000;
+  // Longest time to live a key may be given (seconds)
+  static const int64_t MAX_TTL_SECONDS = 10 * 365 * 24 * 3600;
+  // Tables this connection used recently, most recent first (looked
+  // up by comparing names, so a hit hashes nothing)
+  static const unsigned TABLE_CACHE_SIZE = 4;
+  Table *m_table_cache[TABLE_CACHE_SIZE];
+  unsigned m_table_cache_len;
+  // Table directory epoch the cache is valid for
+  uint64_t m_table_cache_epoch;
+  // Log record of this connection's last change: replies are held
+  // back until it is durable
+  WriteAheadLog::Lsn m_wait_lsn;
 
   // copy constructor and assignment operator are prohibited
 
@@ -34,12 +92,196 @@ private:
   // assignment operator
   ClientConnection &operator=( const ClientConnection & );
 
+  // This method reads everything the socket currently has available
+  // into the input buffer (the socket is edge-triggered, so it must be
+  // drained until it would block)
+  // Parameters:
+  //   none
+  // Returns:
+  //   false if the connection failed, true otherwise
+  bool read_available();
+
+  // This method checks whether the connection's last logged change is
+  // durable, so replies acknowledging it may be sent
+  // Parameters:
+  //   none
+  // Returns:
+  //   bool - true if there is nothing to wait for
+  bool is_durable() const;
+
+  // This method validates and installs an optimistic transaction: it
+  // locks every shard the transaction touched (in a global order),
+  // checks that nothing it read has changed, and applies its writes
+  // Parameters:
+  //   none
+  // Returns:
+  //   void (throws FailedTransaction if validation fails)
+  void commit_optimistic();
+
+  // This method logs the current transaction's writes, if logging is
+  // enabled (called while every written shard is locked)
+  // Parameters:
+  //   none
+  // Returns:
+  //   void
+  void log_writes();
+
+  // This method locks a table shard for the current two-phase locking
+  // transaction, unless it already holds it
+  // Parameters:
+  //   table - table to lock
+  //   shard - shard index
+  // Returns:
+  //   void (throws RequestBlocked if the transaction must wait for the
+  //   lock, FailedTransaction if it must abort instead)
+  void lock_shard(Table *table, unsigned shard);
+
+  // This method locks a table shard for an autocommit write, unless a
+  // two-phase locking transaction is queued for it (which goes first)
+  // Parameters:
+  //   table - table to lock
+  //   shard - shard index
+  // Returns:
+  //   bool - true if the shard was locked
+  bool trylock_shard(Table *table, unsigned shard);
+
+  // This method turns a write away while a table shard's engine is
+  // behind, before any lock is taken or commit started
+  // Parameters:
+  //   table - table about to be written
+  //   shard - shard index
+  // Returns:
+  //   void (throws RequestBlocked if the write must be retried later,
+  //   StorageException if the engine has failed)
+  void check_room(Table *table, unsigned shard);
+
+  // This method finds a table by name, checking the connection's
+  // table cache before the server's table directory
+  // Parameters:
+  //   name - table name
+  // Returns:
+  //   Table* - the table, or nullptr if there is no such table
+  Table* find_table(std::string_view name);
+
+  // This method reads a key the current transaction is about to write:
+  // its own write if it made one, else the committed value (locking the
+  // shard, or reading the snapshot of an optimistic transaction)
+  // Parameters:
+  //   table - table to read
+  //   key - key to read
+  //   value - set to the key's value
+  //   deadline - set to the value's deadline (0 if none)
+  // Returns:
+  //   bool - true if the key exists
+  bool read_for_update(Table *table, std::string_view key, std::string &value, uint64_t &deadline);
+
+  // This method turns a time to live sent by the client into a deadline
+  // Parameters:
+  //   seconds - number of seconds
+  // Returns:
+  //   uint64_t - the deadline (see TimerWheel::now_ms()); throws
+  //   OperationException unless seconds is from 1 to MAX_TTL_SECONDS
+  static uint64_t ttl_deadline(std::string_view seconds);
+
+  // This method checks a table's memory budget before a write that may
+  // grow the table: a table whose policy is NOEVICTION takes no such
+  // writes once the budget is used up, and any other has the server
+  // evict keys
+  // Parameters:
+  //   table - table about to be written
+  // Returns:
+  //   void (throws OperationException if the write must fail)
+  void check_memory(Table *table);
+
+  // This method ends the current transaction's snapshot, if it has one
+  // Parameters:
+  //   none
+  // Returns:
+  //   void
+  void end_snapshot();
+
+  // This method finds the length of the next request in the input
+  // buffer, choosing the connection's protocol first if necessary
+  // Parameters:
+  //   start - offset of the request in the input buffer
+  // Returns:
+  //   size_t - length of the request, or 0 if the rest of it hasn't
+  //   been received yet
+  size_t next_request_len(size_t start);
+
+  // This method handles a single request
+  // Parameters:
+  //   request - request line, including the terminating newline, or
+  //             binary frame
+  // Returns:
+  //   false if the connection should be closed, true otherwise
+  bool handle_request(std::string_view request);
+
+  // This method replies to a SCAN or KEYS request with the first of the
+  // keys found, as many as fit in one reply: the key to continue from
+  // (or "." if there are no more), then each key (and its value)
+  // Parameters:
+  //   entries - keys found and their values, in key order (the last
+  //             one only tells where to continue if the limit is hit)
+  //   limit - most keys the reply may hold
+  //   keys_only - true to leave out the values
+  // Returns:
+  //   void
+  void send_scan_reply(const std::vector<std::pair<std::string, std::string>>& entries, size_t limit, bool keys_only);
+
 public:
+  // Outcome of servicing a connection
+  enum class ChatStatus {
+    // Waiting for more input from the client (or for the socket to
+    // accept queued output)
+    KEEP,
+    // A request couldn't make progress yet and must be retried later
+    BLOCKED,
+    // A request waits for a lock its transaction is queued for, and
+    // must be retried once the lock manager wakes the transaction (see
+    // get_txn())
+    WAIT_LOCK,
+    // Replies wait for the connection's last change to be durable, and
+    // must be sent once the log has flushed it (see get_wait_lsn())
+    WAIT_DURABLE,
+    // The connection is finished and should be destroyed
+    CLOSE,
+  };
+
   // Constructor
   ClientConnection( Server *server, int client_fd );
   // Destructor
   ~ClientConnection();
 
+  // Get the client file descriptor
+  // Parameters:
+  //   none
+  // Returns:
+  //   int - client file descriptor
+  int get_fd() const { return m_client_fd; }
+
+  // Get the id of the current two-phase locking transaction
+  // Parameters:
+  //   none
+  // Returns:
+  //   LockManager::TxnId - transaction id (0 if none was begun)
+  LockManager::TxnId get_txn() const { return m_txn; }
+
+  // Get the log record of the connection's last change, which replies
+  // are held back for
+  // Parameters:
+  //   none
+  // Returns:
+  //   WriteAheadLog::Lsn - the record's sequence number (0 if none)
+  WriteAheadLog::Lsn get_wait_lsn() const { return m_wait_lsn; }
+
+  // Check whether queued responses are waiting for the socket to drain
+  // Parameters:
+  //   none
+  // Returns:
+  //   bool - true if there is unsent output
+  bool has_pending_output() const { return !m_outbuf.empty(); }
+
   // The method checks if the operands are valid
   // Parameters:
   //   left - left operand
@@ -48,20 +290,32 @@ public:
   //   true if both operands are valid, false otherwise
   bool check_operands(std::string left, std::string right);
 
-  // This method initializes the client connection that allows the client to chat with the server
+  // This method services the client: it finishes sending earlier replies,
+  // reads whatever input is available and handles every complete request
+  // in it, then sends all of the resulting replies at once.  It never waits
+  // for the socket, so it is called again each time the socket is ready.
   // Parameters:
   //   none
   // Returns:
-  //   void
-  void chat_with_client();
+  //   ChatStatus - what the server should do with the connection next
+  ChatStatus chat_with_client();
 
-  // This method sends a response to the client
+  // This method queues a response to the client; queued responses are
+  // sent together by flush_output()
   // Parameters:
   //   message - message to send
   // Returns:
   //   void
   void send_response(const Message& msg);
 
+  // This method sends as many queued responses as the socket will take,
+  // using a single writev call per batch of up to IOV_MAX responses
+  // Parameters:
+  //   none
+  // Returns:
+  //   false if the connection failed, true otherwise
+  bool flush_output();
+
   // This method rolls back all the changes made during a transaction
   // Parameters:
   //   none
@@ -74,7 +328,7 @@ public:
   //  table - pointer to the table
   // Returns:
   //  void
-  void push_value(const std::string& value);
+  void push_value(std::string_view value);
 
   // This function pops a value from the stack
   // Parameters:
@@ -87,8 +341,8 @@ public:
   // Parameters:
   //  none
   // Returns:
-  //  std::string - value
-  std::string top_value();
+  //  const std::string& - value
+  const std::string& top_value();
 
   // This function begins a transaction
   // Parameters:
@@ -109,9 +363,20 @@ public:
   //  table - table name
   //  key - key
   //  value - value
+  //  deadline - when the value expires (0 for never)
   // Returns:
   //  void
-  void set_value(const std::string& table, const std::string& key, const std::string& value);
+  void set_value(std::string_view table, std::string_view key, const std::string& value, uint64_t deadline = 0);
+
+  // This function gives a key's value a new deadline (by writing it
+  // again)
+  // Parameters:
+  //  table - table name
+  //  key - key
+  //  deadline - when the value expires
+  // Returns:
+  //  bool - true if the key exists
+  bool expire_value(std::string_view table, std::string_view key, uint64_t deadline);
 
   // This function gets a value from the table
   // Parameters:
@@ -119,7 +384,74 @@ public:
   //  key - key
   // Returns:
   //  std::string - value
-  std::string get_value(const std::string& table, const std::string& key);
+  std::string get_value(std::string_view table, std::string_view key);
+
+  // This function adds to the integer value of a key in one step
+  // (a key that doesn't exist counts as 0; one that exists keeps its
+  // deadline)
+  // Parameters:
+  //  table - table name
+  //  key - key
+  //  delta - amount to add
+  // Returns:
+  //  int64_t - the key's new value
+  int64_t increment_value(std::string_view table, std::string_view key, int64_t delta);
+
+  // This function sets a key only if its value is the expected one, in
+  // one step (the key keeps its deadline)
+  // Parameters:
+  //  table - table name
+  //  key - key
+  //  expected - value the key must have
+  //  value - new value
+  // Returns:
+  //  bool - true if the key was set
+  bool compare_and_set(std::string_view table, std::string_view key, const std::string& expected, const std::string& value);
+
+  // This function gets the first keys of a range of a table, in key
+  // order, from a snapshot (without locking anything, and outside any
+  // transaction)
+  // Parameters:
+  //  table - table name
+  //  start - smallest key of the range
+  //  end - key just past the range (empty for no upper bound)
+  //  limit - most keys to get
+  //  entries - set to the keys and their values
+  // Returns:
+  //  void
+  void scan_table(std::string_view table, std::string_view start, std::string_view end, size_t limit, std::vector<std::pair<std::string, std::string>>& entries);
+
+  // This function sets several keys of a table at once, locking each
+  // shard written only once (the keys are written atomically outside
+  // a transaction)
+  // Parameters:
+  //  table - table name
+  //  keys - keys (if a key is repeated, its last value is written)
+  //  values - values, in the same order as the keys
+  // Returns:
+  //  void
+  void set_values(std::string_view table, const std::vector<std::string_view>& keys, const std::vector<std::string>& values);
+
+  // This function gets the values of several keys of a table at once,
+  // from a single snapshot (or locking each shard read only once in a
+  // two-phase locking transaction)
+  // Parameters:
+  //  table - table name
+  //  keys - keys
+  //  values - set to the keys' values, in the same order
+  // Returns:
+  //  void
+  void get_values(std::string_view table, const std::vector<std::string_view>& keys, std::vector<std::string>& values);
+
+  // This function erases several keys of a table at once, locking each
+  // shard written only once (the keys are erased atomically outside a
+  // transaction; in one, the erases are buffered until COMMIT)
+  // Parameters:
+  //  table - table name
+  //  keys - keys (a repeated key is only erased once)
+  // Returns:
+  //  size_t - number of keys that existed
+  size_t erase_values(std::string_view table, const std::vector<std::string_view>& keys);
 };
 
 #endif // CLIENT_CONNECTION_H
\ No newline at end of file
@@ -385,3 +385,40 @@ bool add(int fd) {
     // Check for errors
     return !check_error(buf, fd); 
 }
+
+// Increments the integer value of a key in a table with a single INCR request.
+// Parameters:
+//   table - name of table
+//   key - key whose value is to be incremented
+//   fd - file descriptor of the server connection
+// Returns:
+//   true if the increment was successful, else false
+bool incr(string table, string key, int fd) {
+    // Initialize struct for reading from the server
+    rio_t rio;
+
+    // Create the INCR request
+    string request = "INCR " + table + " " + key + "\n";
+
+    // Send the INCR command
+    rio_writen(fd, request.c_str(), request.size());
+
+    // Initialize the rio struct for reading from the server
+    rio_readinitb(&rio, fd);
+
+    // Buffer to store the response
+    char buf[1024];
+
+    // Read the response
+    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
+        cerr << "Error: no response from server" << endl;
+        close(fd);
+        return false;
+    }
+
+    // The reply is the new value
+    if (string(buf).substr(0, 5) == "DATA ") {
+        return true;
+    }
+    return !check_error(buf, fd);
+}
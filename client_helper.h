@@ -66,6 +66,15 @@ bool commit(int fd);
 //   true if the add operation was successful, else false
 bool add(int fd);
 
+// Increments the integer value of a key in a table with a single INCR request.
+// Parameters:
+//   table - name of table
+//   key - key whose value is to be incremented
+//   fd - file descriptor of the server connection
+// Returns:
+//   true if the increment was successful, else false
+bool incr(std::string table, std::string key, int fd);
+
 // Prints the retrieved value to the console.
 // Parameters:
 //   response - server response containing the value
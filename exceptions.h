@@ -43,7 +43,9 @@ public:
 };
 
 // Exception indicating that a transaction has failed because
-// a lock that is needed can't be immediately acquired.
+// a lock that is needed can't be acquired (waiting for it would
+// deadlock or has timed out) or, for optimistic transactions, because
+// it conflicted with another transaction.
 // This kind of exception is recoverable, but requires special
 // handling.
 class FailedTransaction : public std::runtime_error {
@@ -56,4 +58,56 @@ public:
   { }
 };
 
+// Exception indicating that a request can't make progress right now
+// (e.g., an autocommit operation needs a table that another client's
+// transaction has locked).  The request is left unconsumed and retried
+// later, so that a worker thread never sleeps waiting on a client.
+class RequestBlocked : public std::runtime_error {
+public:
+  RequestBlocked( const std::string &msg )
+    : std::runtime_error( msg )
+  { }
+
+  ~RequestBlocked()
+  { }
+};
+
+// Exception indicating that a request must wait for a lock its
+// transaction is queued for (see LockManager).  The request is left
+// unconsumed like any blocked request, but is only retried once the
+// lock manager wakes the transaction.
+class LockQueued : public RequestBlocked {
+public:
+  LockQueued( const std::string &msg )
+    : RequestBlocked( msg )
+  { }
+
+  ~LockQueued()
+  { }
+};
+
+// Exception indicating that the write-ahead log couldn't be read,
+// opened or written.
+class LogException : public std::runtime_error {
+public:
+  LogException( const std::string &msg )
+    : std::runtime_error( msg )
+  { }
+
+  ~LogException()
+  { }
+};
+
+// Exception indicating that a storage engine's files on disk couldn't
+// be read or written.
+class StorageException : public std::runtime_error {
+public:
+  StorageException( const std::string &msg )
+    : std::runtime_error( msg )
+  { }
+
+  ~StorageException()
+  { }
+};
+
 #endif // EXCEPTIONS_H
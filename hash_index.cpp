@@ -0,0 +1,204 @@
+// hash_index.cpp
+
+// Headers
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include "hash_index.h"
+
+// Constructor
+HashIndex::HashIndex()
+  : m_meta( MIN_CAPACITY, Meta{ 0, 0 } )
+  , m_entries( MIN_CAPACITY )
+  , m_size( 0 )
+{
+}
+
+// Destructor
+HashIndex::~HashIndex()
+{
+}
+
+// Hash a key
+// Parameters:
+//   key - key to hash
+// Returns:
+//   uint32_t - hash of the key
+uint32_t HashIndex::hash_key( std::string_view key )
+{
+  return static_cast<uint32_t>( std::hash<std::string_view>()( key ) );
+}
+
+// Find the slot holding a key
+// Parameters:
+//   key - key to find
+//   hash - hash of the key
+// Returns:
+//   size_t - slot index, or SIZE_MAX if the key is not present
+size_t HashIndex::find_slot( std::string_view key, uint32_t hash ) const
+{
+  size_t mask = m_meta.size() - 1;
+  size_t i = hash & mask;
+
+  // Robin Hood invariant: once we reach a slot whose occupant is closer
+  // to its home than we are to ours (or an empty slot), the key is absent
+  for ( uint32_t dist = 1; ; dist++, i = ( i + 1 ) & mask ) {
+    const Meta &m = m_meta[i];
+    if ( m.dist < dist ) {
+      return SIZE_MAX;
+    }
+    if ( m.hash == hash && m_entries[i].key == key ) {
+      return i;
+    }
+  }
+}
+
+// Place an entry known not to be present, displacing richer entries
+// Parameters:
+//   meta - probe metadata for the entry (dist is reset to 1)
+//   entry - key, value and version to place
+// Returns:
+//   void
+void HashIndex::insert_new( Meta meta, Entry &&entry )
+{
+  size_t mask = m_meta.size() - 1;
+  size_t i = meta.hash & mask;
+  meta.dist = 1;
+
+  for ( ; ; meta.dist++, i = ( i + 1 ) & mask ) {
+    if ( m_meta[i].dist == 0 ) {
+      m_meta[i] = meta;
+      m_entries[i] = std::move( entry );
+      m_size++;
+      return;
+    }
+
+    // take the slot from an occupant that is closer to its home,
+    // and carry on placing the displaced occupant instead
+    if ( m_meta[i].dist < meta.dist ) {
+      std::swap( m_meta[i], meta );
+      std::swap( m_entries[i], entry );
+    }
+  }
+}
+
+// Reallocate the table and reinsert every entry
+// Parameters:
+//   capacity - new capacity (a power of two)
+// Returns:
+//   void
+void HashIndex::rehash( size_t capacity )
+{
+  std::vector<Meta> old_meta( capacity, Meta{ 0, 0 } );
+  std::vector<Entry> old_entries( capacity );
+  old_meta.swap( m_meta );
+  old_entries.swap( m_entries );
+  m_size = 0;
+
+  for ( size_t i = 0; i < old_meta.size(); i++ ) {
+    if ( old_meta[i].dist != 0 ) {
+      insert_new( old_meta[i], std::move( old_entries[i] ) );
+    }
+  }
+}
+
+// Look up the value of a key
+// Parameters:
+//   key - key to look up
+//   value - set to the key's value if it is present
+//   version - set to the version the key was last written with
+// Returns:
+//   bool - true if the key is present, false otherwise
+bool HashIndex::get( std::string_view key, std::string &value, uint64_t &version ) const
+{
+  size_t i = find_slot( key, hash_key( key ) );
+  if ( i == SIZE_MAX ) {
+    return false;
+  }
+  value = m_entries[i].value;
+  version = m_entries[i].version;
+  return true;
+}
+
+// Look up the version a key was last written with
+// Parameters:
+//   key - key to look up
+//   version - set to the key's version if it is present
+// Returns:
+//   bool - true if the key is present, false otherwise
+bool HashIndex::get_version( std::string_view key, uint64_t &version ) const
+{
+  size_t i = find_slot( key, hash_key( key ) );
+  if ( i == SIZE_MAX ) {
+    return false;
+  }
+  version = m_entries[i].version;
+  return true;
+}
+
+// Check whether a key is present
+// Parameters:
+//   key - key to check
+// Returns:
+//   bool - true if the key is present, false otherwise
+bool HashIndex::contains( std::string_view key ) const
+{
+  return find_slot( key, hash_key( key ) ) != SIZE_MAX;
+}
+
+// Insert a key or overwrite its value
+// Parameters:
+//   key - key to set
+//   value - new value (moved into the table)
+//   version - version to record for the key
+// Returns:
+//   void
+void HashIndex::put( std::string_view key, std::string value, uint64_t version )
+{
+  uint32_t hash = hash_key( key );
+  size_t i = find_slot( key, hash );
+  if ( i != SIZE_MAX ) {
+    m_entries[i].value = std::move( value );
+    m_entries[i].version = version;
+    return;
+  }
+
+  // keep the load factor at or below 7/8
+  if ( ( m_size + 1 ) * 8 > m_meta.size() * 7 ) {
+    rehash( m_meta.size() * 2 );
+  }
+  insert_new( Meta{ hash, 1 }, Entry{ std::string( key ), std::move( value ), version } );
+}
+
+// Remove a key
+// Parameters:
+//   key - key to remove
+// Returns:
+//   bool - true if the key was present, false otherwise
+bool HashIndex::erase( std::string_view key )
+{
+  size_t i = find_slot( key, hash_key( key ) );
+  if ( i == SIZE_MAX ) {
+    return false;
+  }
+
+  // shift the following entries of the probe run back by one slot
+  size_t mask = m_meta.size() - 1;
+  for ( size_t next = ( i + 1 ) & mask; m_meta[next].dist > 1; i = next, next = ( next + 1 ) & mask ) {
+    m_meta[i] = m_meta[next];
+    m_meta[i].dist--;
+    m_entries[i] = std::move( m_entries[next] );
+  }
+
+  m_meta[i] = Meta{ 0, 0 };
+  m_entries[i] = Entry();
+  m_size--;
+
+  // keep the load factor at or above 1/4, so a table that emptied out
+  // gives its memory back (halved, it is under half full, well short
+  // of growing again)
+  if ( m_meta.size() > MIN_CAPACITY && m_size * 4 < m_meta.size() ) {
+    rehash( m_meta.size() / 2 );
+  }
+  return true;
+}
@@ -0,0 +1,112 @@
+// hash_index.h
+
+// Guards
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+// Headers
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "storage_engine.h"
+
+// Storage engine using an open-addressing hash table with Robin Hood
+// linear probing.  Probe metadata (hash and distance from the home
+// slot) is kept in its own array so a lookup scans a few contiguous
+// 8-byte entries and only touches a key when the full hash matches.
+// Erase uses backward-shift deletion, so there are no tombstones.  The
+// table doubles when it is more than 7/8 full, and halves when it is
+// less than 1/4 full.
+class HashIndex : public StorageEngine {
+private:
+  // Probe metadata for one slot
+  struct Meta {
+    // Low 32 bits of the key's hash
+    uint32_t hash;
+    // 1 + distance from the key's home slot, or 0 if the slot is empty
+    uint32_t dist;
+  };
+
+  // Key, value and version stored in one slot
+  struct Entry {
+    std::string key;
+    std::string value;
+    uint64_t version;
+  };
+
+  // Smallest table allocated
+  static const size_t MIN_CAPACITY = 16;
+
+  // Probe metadata (capacity is always a power of two)
+  std::vector<Meta> m_meta;
+
+  // Keys and values, parallel to m_meta
+  std::vector<Entry> m_entries;
+
+  // Number of occupied slots
+  size_t m_size;
+
+  // Copy constructor
+  HashIndex( const HashIndex & );
+
+  // Assignment operator
+  HashIndex &operator=( const HashIndex & );
+
+  // Hash a key
+  // Parameters:
+  //   key - key to hash
+  // Returns:
+  //   uint32_t - hash of the key
+  static uint32_t hash_key( std::string_view key );
+
+  // Find the slot holding a key
+  // Parameters:
+  //   key - key to find
+  //   hash - hash of the key
+  // Returns:
+  //   size_t - slot index, or SIZE_MAX if the key is not present
+  size_t find_slot( std::string_view key, uint32_t hash ) const;
+
+  // Place an entry known not to be present, displacing richer entries
+  // Parameters:
+  //   meta - probe metadata for the entry (dist is reset to 1)
+  //   entry - key, value and version to place
+  // Returns:
+  //   void
+  void insert_new( Meta meta, Entry &&entry );
+
+  // Reallocate the table and reinsert every entry
+  // Parameters:
+  //   capacity - new capacity (a power of two)
+  // Returns:
+  //   void
+  void rehash( size_t capacity );
+
+public:
+  // Constructor
+  HashIndex();
+
+  // Destructor
+  ~HashIndex() override;
+
+  using StorageEngine::get;
+  using StorageEngine::put;
+
+  bool get( std::string_view key, std::string &value, uint64_t &version ) const override;
+  bool get_version( std::string_view key, uint64_t &version ) const override;
+  bool contains( std::string_view key ) const override;
+  void put( std::string_view key, std::string value, uint64_t version ) override;
+  bool erase( std::string_view key ) override;
+  size_t size() const override { return m_size; }
+
+  // Number of slots currently allocated
+  // Parameters:
+  //   void
+  // Returns:
+  //   size_t - capacity of the table
+  size_t capacity() const { return m_meta.size(); }
+};
+
+// End of guards
+#endif // HASH_INDEX_H
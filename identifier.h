@@ -0,0 +1,144 @@
+// identifier.h
+
+// Guards
+#ifndef IDENTIFIER_H
+#define IDENTIFIER_H
+
+// Headers
+#include <cstddef>
+#include <string_view>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Validation of protocol identifiers (usernames, table names and keys):
+// a letter followed by any number of letters, digits and underscores.
+// Characters are classified with a lookup table built at compile time,
+// so checking an identifier is one table load per character.
+namespace Identifier {
+
+  // Character class bits
+  enum : unsigned char {
+    // May start an identifier
+    START = 1,
+    // May appear after the first character
+    BODY = 2,
+  };
+
+  // Table mapping each byte value to its character class bits
+  struct CharClassTable {
+    unsigned char cls[256];
+
+    constexpr CharClassTable()
+      : cls()
+    {
+      for ( int c = 'a'; c <= 'z'; c++ ) {
+        cls[c] = START | BODY;
+      }
+      for ( int c = 'A'; c <= 'Z'; c++ ) {
+        cls[c] = START | BODY;
+      }
+      for ( int c = '0'; c <= '9'; c++ ) {
+        cls[c] = BODY;
+      }
+      cls[static_cast<unsigned char>( '_' )] = BODY;
+    }
+  };
+
+  inline constexpr CharClassTable CHAR_CLASSES{};
+
+  // Identifiers at least this long have their body checked 16 bytes at a time
+  inline constexpr size_t SIMD_MIN_LEN = 32;
+
+  // Check whether a character may start an identifier
+  // Parameters:
+  //   c - character to check
+  // Returns:
+  //   bool - true if c is a letter
+  constexpr bool is_start( char c )
+  {
+    return CHAR_CLASSES.cls[static_cast<unsigned char>( c )] & START;
+  }
+
+  // Check whether a character may appear after the first character of an identifier
+  // Parameters:
+  //   c - character to check
+  // Returns:
+  //   bool - true if c is a letter, digit or underscore
+  constexpr bool is_body( char c )
+  {
+    return CHAR_CLASSES.cls[static_cast<unsigned char>( c )] & BODY;
+  }
+
+  // Check whether every character of a string may appear in an identifier body
+  // Parameters:
+  //   s - string to check
+  // Returns:
+  //   bool - true if every character is a letter, digit or underscore
+  constexpr bool is_body( std::string_view s )
+  {
+    for ( char c : s ) {
+      if ( !is_body( c ) ) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+#ifdef __SSE2__
+  // Check 16 characters of an identifier body at once
+  // Parameters:
+  //   p - pointer to 16 characters
+  // Returns:
+  //   bool - true if all 16 are letters, digits or underscores
+  inline bool is_body16( const char *p )
+  {
+    __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) );
+
+    // Bytes >= 0x80 compare as negative, so they fall outside every range
+    auto in_range = [v]( char lo, char hi ) {
+      return _mm_and_si128( _mm_cmpgt_epi8( v, _mm_set1_epi8( lo - 1 ) ),
+                            _mm_cmplt_epi8( v, _mm_set1_epi8( hi + 1 ) ) );
+    };
+
+    __m128i ok = _mm_or_si128( _mm_or_si128( in_range( 'a', 'z' ), in_range( 'A', 'Z' ) ),
+                               _mm_or_si128( in_range( '0', '9' ),
+                                             _mm_cmpeq_epi8( v, _mm_set1_epi8( '_' ) ) ) );
+    return _mm_movemask_epi8( ok ) == 0xFFFF;
+  }
+#endif
+
+  // Check whether a string is an identifier
+  // Parameters:
+  //   s - string to check
+  // Returns:
+  //   bool - true if s is a letter followed by letters, digits and underscores
+  inline bool is_identifier( std::string_view s )
+  {
+    if ( s.empty() || !is_start( s[0] ) ) {
+      return false;
+    }
+
+#ifdef __SSE2__
+    if ( s.size() >= SIMD_MIN_LEN ) {
+      size_t i = 1;
+      for ( ; i + 16 <= s.size(); i += 16 ) {
+        if ( !is_body16( s.data() + i ) ) {
+          return false;
+        }
+      }
+      return is_body( s.substr( i ) );
+    }
+#endif
+
+    return is_body( s.substr( 1 ) );
+  }
+
+  static_assert( is_start( 'q' ) && is_start( 'Q' ) && !is_start( '7' ) && !is_start( '_' ),
+                 "identifier start characters" );
+  static_assert( is_body( '7' ) && is_body( '_' ) && !is_body( '-' ) && !is_body( '\xe9' ),
+                 "identifier body characters" );
+}
+
+// End Guards
+#endif // IDENTIFIER_H
@@ -8,24 +8,33 @@
 
 // Main function
 int main(int argc, char **argv) {
-  // Check for correct number of arguments
-  if ( argc != 6 && (argc != 7 || std::string(argv[1]) != "-t") ) {
-    std::cerr << "Usage: ./incr_value [-t] <hostname> <port> <username> <table> <key>\n";
-    std::cerr << "Options:\n";
-    std::cerr << "  -t      execute the increment as a transaction\n";
-    return 1;
-  }
-
   // Count for transaction
   int count = 1;
 
   // Check if transaction is used
   bool use_transaction = false;
 
-  // Check if transaction is used
-  if ( argc == 7 ) {
-    use_transaction = true;
-    count = 2;
+  // Check if the server's INCR command is used
+  bool use_incr = false;
+
+  // Parse the options
+  for ( ; count < argc && argv[count][0] == '-'; count++ ) {
+    if ( std::string(argv[count]) == "-t" ) {
+      use_transaction = true;
+    } else if ( std::string(argv[count]) == "-i" ) {
+      use_incr = true;
+    } else {
+      break;
+    }
+  }
+
+  // Check for correct number of arguments
+  if ( argc - count != 5 ) {
+    std::cerr << "Usage: ./incr_value [-t] [-i] <hostname> <port> <username> <table> <key>\n";
+    std::cerr << "Options:\n";
+    std::cerr << "  -t      execute the increment as a transaction\n";
+    std::cerr << "  -i      increment with the server's INCR command (one request)\n";
+    return 1;
   }
 
   // Extract arguments
@@ -54,24 +63,31 @@ int main(int argc, char **argv) {
     }
   }
   
-  // Retrieve value from table with key
-  if (!get(table, key, fd)) {
-    exit(1);
-  }
+  if (use_incr) {
+    // Read, add and write the value in one request
+    if (!incr(table, key, fd)) {
+      exit(1);
+    }
+  } else {
+    // Retrieve value from table with key
+    if (!get(table, key, fd)) {
+      exit(1);
+    }
 
-  // Push the integer 1 to the stack
-  if (!push("1", fd)) {
-    exit(1);
-  }
+    // Push the integer 1 to the stack
+    if (!push("1", fd)) {
+      exit(1);
+    }
 
-  // Add the top two elements of the stack
-  if (!add(fd)) {
-    exit(1);
-  }
+    // Add the top two elements of the stack
+    if (!add(fd)) {
+      exit(1);
+    }
 
-  // Set the value of the key in the table
-  if (!set(table, key, fd)) {
-    exit(1);
+    // Set the value of the key in the table
+    if (!set(table, key, fd)) {
+      exit(1);
+    }
   }
 
   // If transaction is used, commit the transaction
@@ -0,0 +1,252 @@
+// lock_manager.cpp
+
+// Headers
+#include <cassert>
+#include <vector>
+#include "lock_manager.h"
+#include "table.h"
+#include "guard.h"
+
+// Constructor
+// Parameters:
+//   timeout_ms - how long a transaction may wait for a lock
+LockManager::LockManager( unsigned timeout_ms )
+  : m_num_waiting( 0 )
+  , m_last_txn( 0 )
+  , m_timeout( timeout_ms )
+{
+  pthread_mutex_init( &m_mutex, nullptr );
+}
+
+// Destructor
+LockManager::~LockManager()
+{
+  pthread_mutex_destroy( &m_mutex );
+}
+
+// Get an id for a new transaction
+// Parameters:
+//   void
+// Returns:
+//   TxnId - id not used by any other transaction (never 0)
+LockManager::TxnId LockManager::begin()
+{
+  Guard g( m_mutex );
+  return ++m_last_txn;
+}
+
+// Request the exclusive lock of a table shard
+// Parameters:
+//   txn - requesting transaction
+//   table - table to lock
+//   shard - shard index
+// Returns:
+//   Result - whether the lock was granted
+LockManager::Result LockManager::acquire( TxnId txn, Table *table, unsigned shard )
+{
+  Guard g( m_mutex );
+  LockState &state = m_locks[Resource( table, shard )];
+
+  if ( state.owner == txn ) {
+    return Result::GRANTED;
+  }
+
+  // Only the transaction at the head of the queue may take the shard
+  // (the shard latch may also be held briefly by an autocommit write)
+  bool first = state.queue.empty() || state.queue.front().txn == txn;
+  if ( state.owner == 0 && first && table->trylock( shard ) ) {
+    if ( !state.queue.empty() ) {
+      state.queue.pop_front();
+      m_waiting.erase( txn );
+      m_num_waiting--;
+    }
+    state.owner = txn;
+    return Result::GRANTED;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  auto waiting = m_waiting.find( txn );
+  if ( waiting == m_waiting.end() ) {
+    // start waiting at the back of the queue
+    state.queue.push_back( { txn, now } );
+    m_waiting.emplace( txn, Resource( table, shard ) );
+    m_num_waiting++;
+  } else {
+    // still waiting: give up if it has been too long
+    assert( waiting->second == Resource( table, shard ) );
+    for ( const Waiter &w : state.queue ) {
+      if ( w.txn == txn && now - w.since > m_timeout ) {
+        dequeue( txn );
+        return Result::TIMEOUT;
+      }
+    }
+  }
+
+  // The graph may have gained a cycle since the last retry, so it is
+  // checked every time; whichever waiter on the cycle checks first aborts
+  std::unordered_set<TxnId> visited;
+  if ( waits_for( txn, txn, visited ) ) {
+    dequeue( txn );
+    return Result::DEADLOCK;
+  }
+
+  // Nobody to be woken by: the shard is only held for the length of
+  // one autocommit write (or a maintenance pass)
+  if ( state.owner == 0 && state.queue.front().txn == txn ) {
+    return Result::BUSY;
+  }
+  return Result::WAIT;
+}
+
+// Release a lock granted by acquire()
+// Parameters:
+//   txn - transaction holding the lock
+//   table - locked table
+//   shard - shard index
+// Returns:
+//   void
+void LockManager::release( TxnId txn, Table *table, unsigned shard )
+{
+  Guard g( m_mutex );
+  auto it = m_locks.find( Resource( table, shard ) );
+  assert( it != m_locks.end() && it->second.owner == txn );
+  (void) txn;
+
+  table->unlock( shard );
+
+  // the head of the queue takes the shard when it next retries
+  it->second.owner = 0;
+  if ( it->second.queue.empty() ) {
+    m_locks.erase( it );
+  } else {
+    wake_next( it->second );
+  }
+}
+
+// Check whether a transaction waiting for a lock would be granted it if
+// it retried now
+// Parameters:
+//   txn - transaction
+// Returns:
+//   bool - true unless the transaction waits behind another one
+bool LockManager::is_next( TxnId txn )
+{
+  Guard g( m_mutex );
+  auto waiting = m_waiting.find( txn );
+  if ( waiting == m_waiting.end() ) {
+    return true;
+  }
+  const LockState &state = m_locks.find( waiting->second )->second;
+  return state.owner == 0 && state.queue.front().txn == txn;
+}
+
+// Check whether any transaction is queued for a table shard
+// Parameters:
+//   table - table
+//   shard - shard index
+// Returns:
+//   bool - true if a transaction waits for the shard
+bool LockManager::is_queued( Table *table, unsigned shard )
+{
+  // autocommit writes ask before every write, so the common case of
+  // nobody waiting anywhere takes no mutex
+  if ( m_num_waiting.load() == 0 ) {
+    return false;
+  }
+  Guard g( m_mutex );
+  auto it = m_locks.find( Resource( table, shard ) );
+  return it != m_locks.end() && !it->second.queue.empty();
+}
+
+// Stop waiting for a lock
+// Parameters:
+//   txn - transaction
+// Returns:
+//   void
+void LockManager::cancel( TxnId txn )
+{
+  Guard g( m_mutex );
+  dequeue( txn );
+}
+
+// Remove a transaction from the queue it waits in
+// Parameters:
+//   txn - waiting transaction
+// Returns:
+//   void
+void LockManager::dequeue( TxnId txn )
+{
+  auto waiting = m_waiting.find( txn );
+  if ( waiting == m_waiting.end() ) {
+    return;
+  }
+
+  auto it = m_locks.find( waiting->second );
+  std::deque<Waiter> &queue = it->second.queue;
+  bool was_first = queue.front().txn == txn;
+  for ( auto w = queue.begin(); w != queue.end(); ++w ) {
+    if ( w->txn == txn ) {
+      queue.erase( w );
+      break;
+    }
+  }
+  m_waiting.erase( waiting );
+  m_num_waiting--;
+  if ( it->second.owner == 0 && queue.empty() ) {
+    m_locks.erase( it );
+  } else if ( was_first ) {
+    // the next waiter may be able to take the shard now
+    wake_next( it->second );
+  }
+}
+
+// Wake the transaction at the head of a resource's queue if nobody
+// holds the resource
+// Parameters:
+//   state - the resource's state
+// Returns:
+//   void
+void LockManager::wake_next( const LockState &state )
+{
+  if ( state.owner == 0 && !state.queue.empty() && m_wakeup ) {
+    m_wakeup( state.queue.front().txn );
+  }
+}
+
+// Check whether a transaction waits, directly or transitively, for another
+// Parameters:
+//   from - transaction to start from
+//   target - transaction to look for
+//   visited - transactions already explored
+// Returns:
+//   bool - true if from waits for target
+bool LockManager::waits_for( TxnId from, TxnId target, std::unordered_set<TxnId> &visited ) const
+{
+  auto waiting = m_waiting.find( from );
+  if ( waiting == m_waiting.end() ) {
+    return false;
+  }
+  const LockState &state = m_locks.find( waiting->second )->second;
+
+  // A waiter waits for the holder and for everyone ahead of it
+  std::vector<TxnId> blockers;
+  if ( state.owner != 0 ) {
+    blockers.push_back( state.owner );
+  }
+  for ( const Waiter &w : state.queue ) {
+    if ( w.txn == from ) {
+      break;
+    }
+    blockers.push_back( w.txn );
+  }
+
+  for ( TxnId blocker : blockers ) {
+    if ( blocker == target ) {
+      return true;
+    }
+    if ( visited.insert( blocker ).second && waits_for( blocker, target, visited ) ) {
+      return true;
+    }
+  }
+  return false;
+}
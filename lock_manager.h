@@ -0,0 +1,210 @@
+// lock_manager.h
+
+// Guards
+#ifndef LOCK_MANAGER_H
+#define LOCK_MANAGER_H
+
+// Headers
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <pthread.h>
+
+// Forward declarations
+class Table;
+
+// Grants the table shard locks of two-phase locking transactions.
+//
+// A transaction that finds a shard locked joins a FIFO queue for it
+// instead of failing.  Worker threads never sleep on a lock: the
+// caller is told to WAIT, and retries the same request once the
+// wakeup function says it may be granted (see set_wakeup()).  While a
+// transaction waits, nobody queued behind it can take the shard, and
+// autocommit writes stay off a shard anyone is queued for (see
+// is_queued()), so waiters are served in arrival order.
+//
+// Each request checks the waits-for graph (a waiter waits for the
+// shard's holder and for everyone queued ahead of it).  A requester
+// that closes a cycle is the deadlock victim, and a waiter that has
+// waited longer than the timeout gives up when it next retries.
+class LockManager {
+public:
+  // Identifies a transaction
+  typedef uint64_t TxnId;
+
+  // Outcome of a lock request
+  enum class Result {
+    // The transaction holds the lock
+    GRANTED,
+    // Another transaction holds or is queued for the lock; retry the
+    // request when woken
+    WAIT,
+    // The lock is next in line for the transaction, but the shard is
+    // briefly held by someone outside the lock manager (an autocommit
+    // write, say); retry the request soon
+    BUSY,
+    // Waiting would deadlock; the transaction must abort
+    DEADLOCK,
+    // The transaction waited too long; it must abort
+    TIMEOUT,
+  };
+
+  // Default bound on how long a transaction waits for a lock
+  static const unsigned DEFAULT_TIMEOUT_MS = 1000;
+
+private:
+  // A lockable resource: one shard of a table
+  typedef std::pair<Table*, unsigned> Resource;
+
+  // A transaction waiting for a resource
+  struct Waiter {
+    TxnId txn;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  // Holder and queue of one resource
+  struct LockState {
+    // Transaction holding the resource (0 if none)
+    TxnId owner = 0;
+    // Transactions waiting for it, in arrival order
+    std::deque<Waiter> queue;
+  };
+
+  // Protects everything below
+  pthread_mutex_t m_mutex;
+
+  // State of every resource that is held or waited for
+  std::map<Resource, LockState> m_locks;
+
+  // Resource each waiting transaction is queued on
+  std::unordered_map<TxnId, Resource> m_waiting;
+
+  // Number of waiting transactions (read without the mutex)
+  std::atomic<size_t> m_num_waiting;
+
+  // Called with a waiting transaction that may now be granted its lock
+  std::function<void( TxnId )> m_wakeup;
+
+  // Last transaction id handed out
+  TxnId m_last_txn;
+
+  // How long a transaction may wait for a lock
+  std::chrono::milliseconds m_timeout;
+
+  // Copy constructor
+  LockManager( const LockManager & );
+
+  // Assignment operator
+  LockManager &operator=( const LockManager & );
+
+  // Remove a transaction from the queue it waits in (mutex must be held)
+  // Parameters:
+  //   txn - waiting transaction
+  // Returns:
+  //   void
+  void dequeue( TxnId txn );
+
+  // Wake the transaction at the head of a resource's queue if nobody
+  // holds the resource (mutex must be held)
+  // Parameters:
+  //   state - the resource's state
+  // Returns:
+  //   void
+  void wake_next( const LockState &state );
+
+  // Check whether a transaction waits, directly or transitively, for
+  // another (mutex must be held)
+  // Parameters:
+  //   from - transaction to start from
+  //   target - transaction to look for
+  //   visited - transactions already explored
+  // Returns:
+  //   bool - true if from waits for target
+  bool waits_for( TxnId from, TxnId target, std::unordered_set<TxnId> &visited ) const;
+
+public:
+  // Constructor
+  // Parameters:
+  //   timeout_ms - how long a transaction may wait for a lock
+  LockManager( unsigned timeout_ms = DEFAULT_TIMEOUT_MS );
+
+  // Destructor
+  ~LockManager();
+
+  // Set the function told when a waiting transaction may be granted its
+  // lock, so it can retry (call before any transaction waits).  It is
+  // called with the lock manager's mutex held, so it must not call
+  // back into the lock manager.
+  // Parameters:
+  //   wakeup - called with the transaction to wake
+  // Returns:
+  //   void
+  void set_wakeup( const std::function<void( TxnId )> &wakeup ) { m_wakeup = wakeup; }
+
+  // Get how long a transaction may wait for a lock
+  // Parameters:
+  //   void
+  // Returns:
+  //   std::chrono::milliseconds - the timeout
+  std::chrono::milliseconds get_timeout() const { return m_timeout; }
+
+  // Get an id for a new transaction
+  // Parameters:
+  //   void
+  // Returns:
+  //   TxnId - id not used by any other transaction (never 0)
+  TxnId begin();
+
+  // Request the exclusive lock of a table shard.  A transaction told to
+  // WAIT (or BUSY) stays queued until it retries and is granted the
+  // lock, gives up (DEADLOCK or TIMEOUT), or calls cancel().
+  // Parameters:
+  //   txn - requesting transaction
+  //   table - table to lock
+  //   shard - shard index
+  // Returns:
+  //   Result - whether the lock was granted
+  Result acquire( TxnId txn, Table *table, unsigned shard );
+
+  // Release a lock granted by acquire()
+  // Parameters:
+  //   txn - transaction holding the lock
+  //   table - locked table
+  //   shard - shard index
+  // Returns:
+  //   void
+  void release( TxnId txn, Table *table, unsigned shard );
+
+  // Check whether a transaction waiting for a lock would be granted it
+  // if it retried now (as far as the lock manager knows)
+  // Parameters:
+  //   txn - transaction
+  // Returns:
+  //   bool - true unless the transaction waits behind another one
+  bool is_next( TxnId txn );
+
+  // Check whether any transaction is queued for a table shard (an
+  // autocommit write must not take a shard ahead of such a transaction)
+  // Parameters:
+  //   table - table
+  //   shard - shard index
+  // Returns:
+  //   bool - true if a transaction waits for the shard
+  bool is_queued( Table *table, unsigned shard );
+
+  // Stop waiting for a lock (e.g., because the transaction aborted)
+  // Parameters:
+  //   txn - transaction
+  // Returns:
+  //   void
+  void cancel( TxnId txn );
+};
+
+// End of guards
+#endif // LOCK_MANAGER_H
@@ -0,0 +1,855 @@
+// lsm_engine.cpp
+
+// Headers
+#include <algorithm>
+#include <cassert>
+#include <deque>
+#include <iostream>
+#include "lsm_engine.h"
+#include "exceptions.h"
+#include "guard.h"
+
+namespace {
+
+// Directory new engines keep their runs under
+std::string run_directory = "/tmp";
+
+// The thread flushing and compacting every LsmEngine, and the queue of
+// engines with work for it
+class Compactor {
+private:
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_cond;
+  std::deque<LsmEngine*> m_queue;
+  // Engine whose work is being done (null if none)
+  LsmEngine *m_busy;
+  bool m_started;
+
+  bool queued( LsmEngine *engine ) const
+  {
+    return std::find( m_queue.begin(), m_queue.end(), engine ) != m_queue.end();
+  }
+
+  static void *compactor_main( void *arg )
+  {
+    Compactor *compactor = static_cast<Compactor*>( arg );
+    while ( true ) {
+      LsmEngine *engine;
+      {
+        Guard g( compactor->m_mutex );
+        while ( compactor->m_queue.empty() ) {
+          pthread_cond_wait( &compactor->m_cond, &compactor->m_mutex );
+        }
+        engine = compactor->m_queue.front();
+        compactor->m_queue.pop_front();
+        compactor->m_busy = engine;
+      }
+
+      // One step at a time, so no engine holds up the others' flushes
+      bool more = engine->do_background_work();
+
+      Guard g( compactor->m_mutex );
+      compactor->m_busy = nullptr;
+      if ( more && !compactor->queued( engine ) ) {
+        compactor->m_queue.push_back( engine );
+      }
+      pthread_cond_broadcast( &compactor->m_cond );
+    }
+    return nullptr;
+  }
+
+public:
+  Compactor()
+    : m_busy( nullptr )
+    , m_started( false )
+  {
+    pthread_mutex_init( &m_mutex, nullptr );
+    pthread_cond_init( &m_cond, nullptr );
+  }
+
+  // Queue an engine's work (the thread starts with the first)
+  void schedule( LsmEngine *engine )
+  {
+    Guard g( m_mutex );
+    if ( !m_started ) {
+      pthread_t thread;
+      if ( pthread_create( &thread, nullptr, compactor_main, this ) != 0 ) {
+        throw StorageException( "Could not create compaction thread" );
+      }
+      pthread_detach( thread );
+      m_started = true;
+    }
+    if ( !queued( engine ) ) {
+      m_queue.push_back( engine );
+      pthread_cond_broadcast( &m_cond );
+    }
+  }
+
+  // Forget an engine, waiting for its work in progress to finish
+  void cancel( LsmEngine *engine )
+  {
+    // work that finishes with more to do queues the engine again, so it
+    // is taken out of the queue once nothing is in progress
+    Guard g( m_mutex );
+    while ( true ) {
+      m_queue.erase( std::remove( m_queue.begin(), m_queue.end(), engine ), m_queue.end() );
+      if ( m_busy != engine ) {
+        break;
+      }
+      pthread_cond_wait( &m_cond, &m_mutex );
+    }
+  }
+
+  // Wait until an engine has no work queued or in progress
+  void wait_idle( LsmEngine *engine )
+  {
+    Guard g( m_mutex );
+    while ( m_busy == engine || queued( engine ) ) {
+      pthread_cond_wait( &m_cond, &m_mutex );
+    }
+  }
+};
+
+// The compactor (never destroyed: its thread runs until the process exits)
+Compactor &compactor()
+{
+  static Compactor *compactor = new Compactor;
+  return *compactor;
+}
+
+// A stream of entries in key order, one of the inputs of a merge
+class Source {
+public:
+  virtual ~Source() { }
+  virtual bool valid() const = 0;
+  virtual const SortedRun::Entry &entry() const = 0;
+  virtual void next() = 0;
+};
+
+// The entries of a memtable
+template<typename Memtable>
+class MemtableSource : public Source {
+private:
+  std::shared_ptr<const Memtable> m_mem;
+  typename Memtable::const_iterator m_it;
+  SortedRun::Entry m_entry;
+
+  void load()
+  {
+    if ( m_it != m_mem->end() ) {
+      m_entry = SortedRun::Entry{ m_it->first, m_it->second.value, m_it->second.version, m_it->second.deleted };
+    }
+  }
+
+public:
+  MemtableSource( std::shared_ptr<const Memtable> mem )
+    : m_mem( std::move( mem ) )
+    , m_it( m_mem->begin() )
+  {
+    load();
+  }
+
+  // (starting from the first key not less than start)
+  MemtableSource( std::shared_ptr<const Memtable> mem, std::string_view start )
+    : m_mem( std::move( mem ) )
+    , m_it( m_mem->lower_bound( start ) )
+  {
+    load();
+  }
+
+  bool valid() const override { return m_it != m_mem->end(); }
+  const SortedRun::Entry &entry() const override { return m_entry; }
+  void next() override { ++m_it; load(); }
+};
+
+// The entries of runs that don't overlap, read one run after another
+class RunsSource : public Source {
+private:
+  std::vector<std::shared_ptr<SortedRun>> m_runs;
+  size_t m_next;
+  std::unique_ptr<SortedRun::Iterator> m_it;
+
+  void open_next()
+  {
+    m_it.reset();
+    if ( m_next < m_runs.size() ) {
+      m_it.reset( new SortedRun::Iterator( *m_runs[m_next++] ) );
+    }
+  }
+
+public:
+  RunsSource( std::vector<std::shared_ptr<SortedRun>> runs )
+    : m_runs( std::move( runs ) )
+    , m_next( 0 )
+  {
+    open_next();
+  }
+
+  // (starting from the first key not less than start: runs before it
+  // aren't read at all)
+  RunsSource( std::vector<std::shared_ptr<SortedRun>> runs, std::string_view start )
+    : m_runs( std::move( runs ) )
+    , m_next( 0 )
+  {
+    while ( m_next < m_runs.size() && std::string_view( m_runs[m_next]->largest() ) < start ) {
+      m_next++;
+    }
+    if ( m_next < m_runs.size() ) {
+      m_it.reset( new SortedRun::Iterator( *m_runs[m_next++], start ) );
+    }
+  }
+
+  bool valid() const override { return m_it != nullptr; }
+  const SortedRun::Entry &entry() const override { return m_it->entry(); }
+  void next() override
+  {
+    m_it->next();
+    if ( !m_it->valid() ) {
+      open_next();
+    }
+  }
+};
+
+// Merge streams of entries, visiting only the newest entry of each key
+// Parameters:
+//   sources - streams to merge, newest first
+//   visit - called with each key's newest entry, in key order, until
+//           it returns false
+// Returns:
+//   void
+void merge_sources( std::vector<std::unique_ptr<Source>> &sources, const std::function<bool( const SortedRun::Entry& )> &visit )
+{
+  while ( true ) {
+    // the smallest key; of equal keys, the one in the newest source
+    Source *best = nullptr;
+    for ( auto &source : sources ) {
+      if ( source->valid() && ( best == nullptr || source->entry().key < best->entry().key ) ) {
+        best = source.get();
+      }
+    }
+    if ( best == nullptr ) {
+      return;
+    }
+
+    if ( !visit( best->entry() ) ) {
+      return;
+    }
+
+    // older entries of the key are shadowed
+    for ( auto &source : sources ) {
+      while ( source.get() != best && source->valid() && source->entry().key == best->entry().key ) {
+        source->next();
+      }
+    }
+    best->next();
+  }
+}
+
+// Add a source for each run of level 0 and one for each deeper level,
+// newest first
+// Parameters:
+//   tree - runs to read
+//   start - smallest key to read
+//   sources - the sources are appended
+// Returns:
+//   void
+template<typename Tree>
+void add_run_sources( const Tree &tree, std::string_view start, std::vector<std::unique_ptr<Source>> &sources )
+{
+  for ( size_t level = 0; level < tree.levels.size(); level++ ) {
+    if ( level == 0 ) {
+      for ( const auto &run : tree.levels[0] ) {
+        sources.emplace_back( new RunsSource( { run }, start ) );
+      }
+    } else {
+      sources.emplace_back( new RunsSource( tree.levels[level], start ) );
+    }
+  }
+}
+
+// Total size of some runs
+// Parameters:
+//   runs - runs to measure
+// Returns:
+//   uint64_t - bytes
+uint64_t total_bytes( const std::vector<std::shared_ptr<SortedRun>> &runs )
+{
+  uint64_t bytes = 0;
+  for ( const auto &run : runs ) {
+    bytes += run->file_size();
+  }
+  return bytes;
+}
+
+}
+
+// Constructor
+LsmEngine::LsmEngine()
+  : m_dir( run_directory )
+  , m_mem_bytes( 0 )
+  , m_tree( new Tree )
+{
+  pthread_mutex_init( &m_mutex, nullptr );
+  pthread_cond_init( &m_flushed, nullptr );
+}
+
+// Destructor (deletes the engine's files)
+LsmEngine::~LsmEngine()
+{
+  compactor().cancel( this );
+
+  // the last references to the runs, so their files are deleted
+  m_frozen.reset();
+  m_tree.reset();
+
+  pthread_cond_destroy( &m_flushed );
+  pthread_mutex_destroy( &m_mutex );
+}
+
+// Set the directory new engines keep their runs under
+// Parameters:
+//   dir - an existing directory
+// Returns:
+//   void
+void LsmEngine::set_directory( const std::string &dir )
+{
+  run_directory = dir;
+}
+
+// Look up a key's newest entry, tombstones included
+// Parameters:
+//   key - key to look up
+//   value - set to the key's value if it has an entry
+//   version - set to the entry's version
+//   deleted - set if the entry is a tombstone
+// Returns:
+//   bool - true if the key has an entry
+bool LsmEngine::find( std::string_view key, std::string &value, uint64_t &version, bool &deleted ) const
+{
+  std::shared_ptr<const Memtable> frozen;
+  std::shared_ptr<const Tree> tree;
+  {
+    Guard g( m_mutex );
+    auto it = m_mem.find( key );
+    if ( it != m_mem.end() ) {
+      value = it->second.value;
+      version = it->second.version;
+      deleted = it->second.deleted;
+      return true;
+    }
+    frozen = m_frozen;
+    tree = m_tree;
+  }
+
+  // The frozen memtable and the runs never change, so they are read
+  // without the lock, newest first
+  if ( frozen != nullptr ) {
+    auto it = frozen->find( key );
+    if ( it != frozen->end() ) {
+      value = it->second.value;
+      version = it->second.version;
+      deleted = it->second.deleted;
+      return true;
+    }
+  }
+
+  uint64_t hash = SortedRun::hash_key( key );
+  for ( size_t level = 0; level < tree->levels.size(); level++ ) {
+    const auto &runs = tree->levels[level];
+    if ( level == 0 ) {
+      for ( const auto &run : runs ) {
+        if ( run->find( key, hash, value, version, deleted ) ) {
+          return true;
+        }
+      }
+      continue;
+    }
+
+    // the only run of a deeper level whose range can hold the key
+    auto it = std::lower_bound( runs.begin(), runs.end(), key,
+                                []( const std::shared_ptr<SortedRun> &run, std::string_view k ) {
+                                  return std::string_view( run->largest() ) < k;
+                                } );
+    if ( it != runs.end() && ( *it )->find( key, hash, value, version, deleted ) ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Look up the value of a key
+// Parameters:
+//   key - key to look up
+//   value - set to the key's value if it is present
+//   version - set to the version the key was last written with
+// Returns:
+//   bool - true if the key is present, false otherwise
+bool LsmEngine::get( std::string_view key, std::string &value, uint64_t &version ) const
+{
+  bool deleted;
+  return find( key, value, version, deleted ) && !deleted;
+}
+
+// Look up the version a key was last written with
+// Parameters:
+//   key - key to look up
+//   version - set to the key's version if it is present
+// Returns:
+//   bool - true if the key is present, false otherwise
+bool LsmEngine::get_version( std::string_view key, uint64_t &version ) const
+{
+  std::string value;
+  return get( key, value, version );
+}
+
+// Check whether a key is present
+// Parameters:
+//   key - key to check
+// Returns:
+//   bool - true if the key is present, false otherwise
+bool LsmEngine::contains( std::string_view key ) const
+{
+  std::string value;
+  uint64_t version;
+  return get( key, value, version );
+}
+
+// Add an entry to the memtable, freezing it if it is full and nothing
+// else waits to be flushed
+// Parameters:
+//   key - key written
+//   value - value written (moved into the memtable)
+//   version - version of the write
+//   deleted - true for a tombstone
+// Returns:
+//   void
+void LsmEngine::write( std::string_view key, std::string value, uint64_t version, bool deleted )
+{
+  {
+    Guard g( m_mutex );
+    auto it = m_mem.lower_bound( key );
+    if ( it != m_mem.end() && it->first == key ) {
+      m_mem_bytes += value.size() - it->second.value.size();
+      // swapped rather than move-assigned: a short new value (such as a
+      // tombstone's) would be copied into the old buffer, keeping it,
+      // while this way the old buffer is freed along with value
+      it->second.value.swap( value );
+      it->second.version = version;
+      it->second.deleted = deleted;
+    } else {
+      m_mem_bytes += ENTRY_OVERHEAD + key.size() + value.size();
+      m_mem.emplace_hint( it, key, MemEntry{ std::move( value ), version, deleted } );
+    }
+
+    // Only one memtable waits to be flushed: until it is, this one
+    // keeps growing (the caller may hold a shard latch and a commit
+    // timestamp, so it can't wait here; writers wait in wait_for_room()
+    // or check has_room() before they commit).  A failed engine flushes
+    // nothing more.
+    if ( m_mem_bytes < MEMTABLE_BYTES || m_frozen != nullptr || !m_error.empty() ) {
+      return;
+    }
+    m_frozen = std::make_shared<const Memtable>( std::move( m_mem ) );
+    m_mem.clear();
+    m_mem_bytes = 0;
+  }
+
+  compactor().schedule( this );
+}
+
+// Insert a key or overwrite its value
+// Parameters:
+//   key - key to set
+//   value - new value (moved into the engine)
+//   version - version to record for the key
+// Returns:
+//   void
+void LsmEngine::put( std::string_view key, std::string value, uint64_t version )
+{
+  write( key, std::move( value ), version, false );
+}
+
+// Remove a key
+// Parameters:
+//   key - key to remove
+// Returns:
+//   bool - true if the key was present, false otherwise
+bool LsmEngine::erase( std::string_view key )
+{
+  // older entries in the runs are shadowed by a tombstone
+  if ( !contains( key ) ) {
+    return false;
+  }
+  write( key, std::string(), 0, true );
+  return true;
+}
+
+// Visit every entry of the engine, newest entry of each key only
+// Parameters:
+//   visit - called with each entry
+// Returns:
+//   void
+void LsmEngine::merge_all( const std::function<void( const SortedRun::Entry& )> &visit ) const
+{
+  std::vector<std::unique_ptr<Source>> sources;
+  std::shared_ptr<const Tree> tree;
+  {
+    // the memtable is copied, so writers aren't held up by the scan
+    Guard g( m_mutex );
+    sources.emplace_back( new MemtableSource<Memtable>( std::make_shared<const Memtable>( m_mem ) ) );
+    if ( m_frozen != nullptr ) {
+      sources.emplace_back( new MemtableSource<Memtable>( m_frozen ) );
+    }
+    tree = m_tree;
+  }
+
+  add_run_sources( *tree, std::string_view(), sources );
+
+  merge_sources( sources, [&]( const SortedRun::Entry &entry ) {
+    visit( entry );
+    return true;
+  } );
+}
+
+// Count the keys
+// Parameters:
+//   void
+// Returns:
+//   size_t - number of keys
+size_t LsmEngine::size() const
+{
+  size_t count = 0;
+  merge_all( [&]( const SortedRun::Entry &entry ) {
+    if ( !entry.deleted ) {
+      count++;
+    }
+  } );
+  return count;
+}
+
+// Visit every key in key order, with its value and version
+// Parameters:
+//   visit - called with each key, its value and its version
+// Returns:
+//   void
+void LsmEngine::scan( const std::function<void( std::string_view, std::string_view, uint64_t )> &visit ) const
+{
+  merge_all( [&]( const SortedRun::Entry &entry ) {
+    if ( !entry.deleted ) {
+      visit( entry.key, entry.value, entry.version );
+    }
+  } );
+}
+
+// Visit keys in key order from a given key on, with their values and
+// versions, until the visitor says stop
+// Parameters:
+//   start - smallest key to visit
+//   visit - called with each key, its value and its version, until it
+//           returns false
+// Returns:
+//   void
+void LsmEngine::scan_from( std::string_view start, const std::function<bool( std::string_view, std::string_view, uint64_t )> &visit ) const
+{
+  // Rather than copy the whole memtable, each round copies the next
+  // SCAN_BATCH of its entries and merges them with the runs up to the
+  // last key copied; the next round starts just past it.  A key
+  // written meanwhile may be seen as of either round.
+  std::string from( start );
+  while ( true ) {
+    std::vector<std::unique_ptr<Source>> sources;
+    std::shared_ptr<const Tree> tree;
+    std::string bound;
+    bool bounded;
+    {
+      Guard g( m_mutex );
+      std::shared_ptr<Memtable> batch = std::make_shared<Memtable>();
+      auto it = m_mem.lower_bound( from );
+      for ( size_t n = 0; n < SCAN_BATCH && it != m_mem.end(); n++, ++it ) {
+        batch->emplace_hint( batch->end(), *it );
+      }
+      bounded = it != m_mem.end();
+      if ( bounded ) {
+        bound = batch->rbegin()->first;
+      }
+      sources.emplace_back( new MemtableSource<Memtable>( batch ) );
+      if ( m_frozen != nullptr ) {
+        sources.emplace_back( new MemtableSource<Memtable>( m_frozen, from ) );
+      }
+      tree = m_tree;
+    }
+    add_run_sources( *tree, from, sources );
+
+    bool stopped = false;
+    merge_sources( sources, [&]( const SortedRun::Entry &entry ) {
+      if ( bounded && entry.key > std::string_view( bound ) ) {
+        return false;
+      }
+      if ( !entry.deleted && !visit( entry.key, entry.value, entry.version ) ) {
+        stopped = true;
+      }
+      return !stopped;
+    } );
+    if ( stopped || !bounded ) {
+      return;
+    }
+
+    // the smallest key greater than the bound
+    from = bound;
+    from.push_back( '\0' );
+  }
+}
+
+// Flush the frozen memtable into a new level 0 run
+// Parameters:
+//   void
+// Returns:
+//   void
+void LsmEngine::flush()
+{
+  std::shared_ptr<const Memtable> frozen;
+  {
+    Guard g( m_mutex );
+    frozen = m_frozen;
+  }
+
+  SortedRun::Writer writer( m_dir );
+  for ( const auto &e : *frozen ) {
+    writer.add( SortedRun::Entry{ e.first, e.second.value, e.second.version, e.second.deleted } );
+  }
+  std::shared_ptr<SortedRun> run = writer.finish();
+
+  // Readers see the memtable or the run, never neither
+  Guard g( m_mutex );
+  std::shared_ptr<Tree> tree = std::make_shared<Tree>( *m_tree );
+  if ( tree->levels.empty() ) {
+    tree->levels.resize( 1 );
+  }
+  tree->levels[0].insert( tree->levels[0].begin(), run );
+  m_tree = tree;
+  m_frozen.reset();
+
+  // the memtable may have filled up while this one was flushed
+  if ( m_mem_bytes >= MEMTABLE_BYTES ) {
+    m_frozen = std::make_shared<const Memtable>( std::move( m_mem ) );
+    m_mem.clear();
+    m_mem_bytes = 0;
+  }
+  pthread_cond_broadcast( &m_flushed );
+}
+
+// Find a level that needs compacting
+// Parameters:
+//   tree - current runs
+//   level - set to the level to compact
+// Returns:
+//   bool - false if no level needs compacting
+bool LsmEngine::pick_level( const Tree &tree, size_t &level )
+{
+  if ( !tree.levels.empty() && tree.levels[0].size() >= L0_RUNS ) {
+    level = 0;
+    return true;
+  }
+
+  uint64_t target = LEVEL1_BYTES;
+  for ( size_t n = 1; n < tree.levels.size(); n++, target *= LEVEL_RATIO ) {
+    if ( total_bytes( tree.levels[n] ) > target ) {
+      level = n;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Merge runs of one level into the next
+// Parameters:
+//   tree - current runs
+//   level - level to compact
+// Returns:
+//   void
+void LsmEngine::compact( const std::shared_ptr<const Tree> &tree, size_t level )
+{
+  // All of level 0 (its runs overlap), or the next run of a deeper level
+  const auto &upper = tree->levels[level];
+  std::vector<std::shared_ptr<SortedRun>> inputs;
+  if ( m_compact_cursor.size() <= level ) {
+    m_compact_cursor.resize( level + 1 );
+  }
+  if ( level == 0 ) {
+    inputs = upper;
+  } else {
+    auto it = std::find_if( upper.begin(), upper.end(), [&]( const std::shared_ptr<SortedRun> &run ) {
+      return run->smallest() > m_compact_cursor[level];
+    } );
+    inputs.push_back( it != upper.end() ? *it : upper.front() );
+  }
+
+  std::string lo = inputs.front()->smallest(), hi = inputs.front()->largest();
+  for ( const auto &run : inputs ) {
+    lo = std::min( lo, run->smallest() );
+    hi = std::max( hi, run->largest() );
+  }
+  m_compact_cursor[level] = hi;
+
+  // The runs of the next level that overlap the inputs are rewritten
+  size_t out = level + 1;
+  std::vector<std::shared_ptr<SortedRun>> overlapping, kept;
+  if ( out < tree->levels.size() ) {
+    for ( const auto &run : tree->levels[out] ) {
+      if ( run->largest() < lo || run->smallest() > hi ) {
+        kept.push_back( run );
+      } else {
+        overlapping.push_back( run );
+      }
+    }
+  }
+
+  // Tombstones are only needed while an older entry could be under them
+  bool bottom = true;
+  for ( size_t n = out + 1; n < tree->levels.size(); n++ ) {
+    bottom = bottom && tree->levels[n].empty();
+  }
+
+  std::vector<std::unique_ptr<Source>> sources;
+  for ( const auto &run : inputs ) {
+    sources.emplace_back( new RunsSource( { run } ) );
+  }
+  sources.emplace_back( new RunsSource( overlapping ) );
+
+  std::vector<std::shared_ptr<SortedRun>> outputs;
+  std::unique_ptr<SortedRun::Writer> writer;
+  merge_sources( sources, [&]( const SortedRun::Entry &entry ) {
+    if ( bottom && entry.deleted ) {
+      return true;
+    }
+    if ( writer == nullptr ) {
+      writer.reset( new SortedRun::Writer( m_dir ) );
+    }
+    writer->add( entry );
+    if ( writer->bytes() >= RUN_BYTES ) {
+      outputs.push_back( writer->finish() );
+      writer.reset();
+    }
+    return true;
+  } );
+  if ( writer != nullptr ) {
+    outputs.push_back( writer->finish() );
+  }
+
+  // Publish the new runs; the inputs' files go once no reader has them
+  std::shared_ptr<Tree> next = std::make_shared<Tree>( *tree );
+  if ( next->levels.size() <= out ) {
+    next->levels.resize( out + 1 );
+  }
+  auto &from = next->levels[level];
+  for ( const auto &run : inputs ) {
+    from.erase( std::find( from.begin(), from.end(), run ) );
+  }
+  kept.insert( kept.end(), outputs.begin(), outputs.end() );
+  std::sort( kept.begin(), kept.end(), []( const std::shared_ptr<SortedRun> &a, const std::shared_ptr<SortedRun> &b ) {
+    return a->smallest() < b->smallest();
+  } );
+  next->levels[out] = kept;
+
+  Guard g( m_mutex );
+  // only this thread changes the runs
+  assert( m_tree == tree );
+  m_tree = next;
+}
+
+// Flush or compact, if needed
+// Parameters:
+//   void
+// Returns:
+//   bool - true if there is more to do
+bool LsmEngine::do_background_work()
+{
+  size_t level;
+  try {
+    bool frozen;
+    {
+      Guard g( m_mutex );
+      frozen = m_frozen != nullptr;
+    }
+    if ( frozen ) {
+      flush();
+    }
+
+    std::shared_ptr<const Tree> tree;
+    {
+      Guard g( m_mutex );
+      tree = m_tree;
+    }
+    if ( pick_level( *tree, level ) ) {
+      compact( tree, level );
+    }
+  } catch ( const StorageException &ex ) {
+    // The memtable can't be moved to disk: it is kept, so reads still
+    // find everything, but writers are turned away from now on
+    std::cerr << "LSM compaction failed: " << ex.what() << std::endl;
+    Guard g( m_mutex );
+    m_error = ex.what();
+    pthread_cond_broadcast( &m_flushed );
+    return false;
+  }
+
+  Guard g( m_mutex );
+  return m_frozen != nullptr || pick_level( *m_tree, level );
+}
+
+// Check whether the engine can take writes now
+// Parameters:
+//   void
+// Returns:
+//   bool - false while the memtable is full and another waits to be
+//   flushed (throws StorageException if the engine has failed)
+bool LsmEngine::has_room() const
+{
+  Guard g( m_mutex );
+  if ( !m_error.empty() ) {
+    throw StorageException( m_error );
+  }
+  return !is_stalled();
+}
+
+// Wait until the engine can take writes
+// Parameters:
+//   void
+// Returns:
+//   void (throws StorageException if the engine has failed)
+void LsmEngine::wait_for_room() const
+{
+  Guard g( m_mutex );
+  while ( m_error.empty() && is_stalled() ) {
+    pthread_cond_wait( &m_flushed, &m_mutex );
+  }
+  if ( !m_error.empty() ) {
+    throw StorageException( m_error );
+  }
+}
+
+// Wait until every frozen memtable is flushed and no level needs
+// compacting
+// Parameters:
+//   void
+// Returns:
+//   void
+void LsmEngine::wait_for_background_work()
+{
+  compactor().wait_idle( this );
+}
+
+// Get the number of runs in each level
+// Parameters:
+//   void
+// Returns:
+//   std::vector<size_t> - runs per level, level 0 first
+std::vector<size_t> LsmEngine::run_counts() const
+{
+  Guard g( m_mutex );
+  std::vector<size_t> counts;
+  for ( const auto &runs : m_tree->levels ) {
+    counts.push_back( runs.size() );
+  }
+  return counts;
+}
@@ -0,0 +1,236 @@
+// lsm_engine.h
+
+// Guards
+#ifndef LSM_ENGINE_H
+#define LSM_ENGINE_H
+
+// Headers
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <pthread.h>
+#include "storage_engine.h"
+#include "sorted_run.h"
+
+// Storage engine using a log-structured merge tree, for tables larger
+// than memory.
+//
+// Writes go to an in-memory memtable.  A full memtable is frozen and
+// flushed to a new SortedRun in level 0 by a background thread, which
+// also compacts the runs: once level 0 has L0_RUNS runs they are merged
+// into level 1, and once level n (n >= 1) holds more than its target
+// size one of its runs is merged into level n + 1.  Runs in level 0 may
+// overlap; runs in deeper levels don't, so a lookup reads at most one
+// run per deeper level, and Bloom filters skip most runs that don't
+// have the key.  Erased keys leave tombstones, which are dropped when
+// they are merged into the deepest level.
+//
+// Only one memtable waits to be flushed at a time: while it does, the
+// next one may grow past MEMTABLE_BYTES, and has_room() says no once
+// it has, so writers back off (before they commit) rather than run
+// ahead of the disk.  If a flush or compaction fails, the engine stops
+// taking writes: has_room() throws the error, while reads still find
+// everything written, in memory.
+//
+// One compaction thread serves every LsmEngine in the process.  Run
+// files are scratch files (see SortedRun) in the directory given to
+// set_directory() when the engine was created.
+//
+// Unlike the other engines, LsmEngine may be read by any number of
+// threads while it is written (see is_concurrent()).
+class LsmEngine : public StorageEngine {
+public:
+  // Bytes of keys and values a memtable is frozen at (each entry also
+  // counts ENTRY_OVERHEAD bytes, so a memtable of tombstones and other
+  // short entries doesn't grow far beyond it)
+  static const size_t MEMTABLE_BYTES = 1 << 20;
+  static const size_t ENTRY_OVERHEAD = 128;
+
+  // Memtable entries a scan copies at a time (see scan_from())
+  static const size_t SCAN_BATCH = 128;
+
+  // Size a compaction's output runs are cut at
+  static const uint64_t RUN_BYTES = 2 << 20;
+
+  // Number of level 0 runs that triggers a compaction into level 1
+  static const size_t L0_RUNS = 4;
+
+  // Target size of level 1; each deeper level's is LEVEL_RATIO times
+  // the one above
+  static const uint64_t LEVEL1_BYTES = 8 << 20;
+  static const unsigned LEVEL_RATIO = 10;
+
+private:
+  // A memtable entry
+  struct MemEntry {
+    std::string value;
+    uint64_t version;
+    // Set for a tombstone: the key was erased
+    bool deleted;
+  };
+
+  typedef std::map<std::string, MemEntry, std::less<>> Memtable;
+
+  // The runs on disk: level 0 newest first, deeper levels in key order.
+  // Never changed once published; compactions publish a new Tree.
+  struct Tree {
+    std::vector<std::vector<std::shared_ptr<SortedRun>>> levels;
+  };
+
+  // Directory the run files are created in
+  std::string m_dir;
+
+  // Protects everything below
+  mutable pthread_mutex_t m_mutex;
+
+  // Signalled when a frozen memtable has been flushed, or the engine
+  // has failed
+  mutable pthread_cond_t m_flushed;
+
+  // Why a flush or compaction failed (empty unless the engine failed)
+  std::string m_error;
+
+  // Memtable receiving writes, and the bytes of entries in it
+  Memtable m_mem;
+  size_t m_mem_bytes;
+
+  // Frozen memtable waiting to be flushed (null if none)
+  std::shared_ptr<const Memtable> m_frozen;
+
+  // Current runs
+  std::shared_ptr<const Tree> m_tree;
+
+  // Only used by the compaction thread: the largest key of the run
+  // last compacted out of each level, so every run gets its turn
+  std::vector<std::string> m_compact_cursor;
+
+  // Copy constructor
+  LsmEngine( const LsmEngine & );
+
+  // Assignment operator
+  LsmEngine &operator=( const LsmEngine & );
+
+  // Look up a key's newest entry, tombstones included
+  // Parameters:
+  //   key - key to look up
+  //   value - set to the key's value if it has an entry
+  //   version - set to the entry's version
+  //   deleted - set if the entry is a tombstone
+  // Returns:
+  //   bool - true if the key has an entry
+  bool find( std::string_view key, std::string &value, uint64_t &version, bool &deleted ) const;
+
+  // Add an entry to the memtable, freezing it if it is full (unless
+  // the last frozen memtable hasn't been flushed yet: it is frozen once
+  // that one is; never waits)
+  // Parameters:
+  //   key - key written
+  //   value - value written (moved into the memtable)
+  //   version - version of the write
+  //   deleted - true for a tombstone
+  // Returns:
+  //   void
+  void write( std::string_view key, std::string value, uint64_t version, bool deleted );
+
+  // Visit every entry of the engine, newest entry of each key only, in
+  // key order
+  // Parameters:
+  //   visit - called with each entry
+  // Returns:
+  //   void
+  void merge_all( const std::function<void( const SortedRun::Entry& )> &visit ) const;
+
+  // Check whether writes must wait for a flush (called with m_mutex
+  // held)
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if the memtable is full and another waits to be
+  //   flushed
+  bool is_stalled() const { return m_mem_bytes >= MEMTABLE_BYTES && m_frozen != nullptr; }
+
+  // Flush the frozen memtable into a new level 0 run, then freeze the
+  // memtable if it filled up in the meantime
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void flush();
+
+  // Merge runs of one level into the next
+  // Parameters:
+  //   tree - current runs
+  //   level - level to compact
+  // Returns:
+  //   void
+  void compact( const std::shared_ptr<const Tree> &tree, size_t level );
+
+  // Find a level that needs compacting
+  // Parameters:
+  //   tree - current runs
+  //   level - set to the level to compact
+  // Returns:
+  //   bool - false if no level needs compacting
+  static bool pick_level( const Tree &tree, size_t &level );
+
+public:
+  // Constructor
+  LsmEngine();
+
+  // Destructor (deletes the engine's files)
+  ~LsmEngine() override;
+
+  // Set the directory new engines keep their runs under
+  // Parameters:
+  //   dir - an existing directory (default: /tmp)
+  // Returns:
+  //   void
+  static void set_directory( const std::string &dir );
+
+  using StorageEngine::get;
+  using StorageEngine::put;
+
+  bool get( std::string_view key, std::string &value, uint64_t &version ) const override;
+  bool get_version( std::string_view key, uint64_t &version ) const override;
+  bool contains( std::string_view key ) const override;
+  void put( std::string_view key, std::string value, uint64_t version ) override;
+  bool erase( std::string_view key ) override;
+  // (counts the keys by reading every run, so it is slow)
+  size_t size() const override;
+  bool is_concurrent() const override { return true; }
+  bool has_room() const override;
+  void wait_for_room() const override;
+  void scan( const std::function<void( std::string_view, std::string_view, uint64_t )> &visit ) const override;
+  bool is_ordered() const override { return true; }
+  void scan_from( std::string_view start, const std::function<bool( std::string_view, std::string_view, uint64_t )> &visit ) const override;
+
+  // Flush or compact, if needed (called on the compaction thread); on
+  // failure the engine is marked failed, and has nothing more to do
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if there is more to do
+  bool do_background_work();
+
+  // Wait until every frozen memtable is flushed and no level needs
+  // compacting (for tests)
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void wait_for_background_work();
+
+  // Get the number of runs in each level (for tests and statistics)
+  // Parameters:
+  //   void
+  // Returns:
+  //   std::vector<size_t> - runs per level, level 0 first
+  std::vector<size_t> run_counts() const;
+};
+
+// End of guards
+#endif // LSM_ENGINE_H
@@ -0,0 +1,69 @@
+// memory_budget.h
+
+// Guards
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+// Headers
+#include <cstdint>
+#include <string_view>
+
+// What a table does once its memory budget is used up
+enum class EvictionPolicy {
+  // Writes that could grow the table fail (default)
+  NOEVICTION,
+  // The least recently used of a few sampled keys is evicted
+  LRU,
+  // The least frequently used of a few sampled keys is evicted
+  LFU,
+};
+
+// How many bytes a table's keys and values may take, and what happens
+// when they take more (see Table::get_memory())
+struct MemoryBudget {
+  // Most bytes (0 for no limit)
+  uint64_t max_bytes;
+
+  // Policy once max_bytes is reached
+  EvictionPolicy policy;
+
+  // Constructor
+  // Parameters:
+  //   max_bytes - most bytes (0 for no limit)
+  //   policy - policy once max_bytes is reached
+  MemoryBudget( uint64_t max_bytes = 0, EvictionPolicy policy = EvictionPolicy::NOEVICTION )
+    : max_bytes( max_bytes )
+    , policy( policy )
+  {
+  }
+
+  // Check whether there is a limit
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if max_bytes is set
+  bool is_limited() const { return max_bytes != 0; }
+
+  // Look up an eviction policy by name
+  // Parameters:
+  //   name - "noeviction", "lru" or "lfu"
+  //   policy - set to the policy named
+  // Returns:
+  //   bool - false if name isn't a policy
+  static bool parse_policy( std::string_view name, EvictionPolicy &policy )
+  {
+    if ( name == "noeviction" ) {
+      policy = EvictionPolicy::NOEVICTION;
+    } else if ( name == "lru" ) {
+      policy = EvictionPolicy::LRU;
+    } else if ( name == "lfu" ) {
+      policy = EvictionPolicy::LFU;
+    } else {
+      return false;
+    }
+    return true;
+  }
+};
+
+// End of guards
+#endif // MEMORY_BUDGET_H
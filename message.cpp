@@ -3,10 +3,11 @@
 // Headers
 #include <set>
 #include <map>
-#include <regex>
+#include <algorithm>
 #include <cassert>
 #include <string>
 #include "message.h"
+#include "identifier.h"
 #include <iostream>
 
 // Constructor
@@ -134,42 +135,124 @@ void Message::push_arg( const std::string &arg )
   m_args.push_back( arg );
 }
 
-// is_valid: Checks if the current message is properly formed according to its type and argument requirements.
+// id_check: Checks that an argument is a well-formed identifier argument.
 // Parameters:
-//   None
+//   arg - The argument to check
 // Returns:
-//   bool - True if the message is valid, false otherwise
-bool Message::is_valid() const
-{
-  // Message type
-  int m_type = static_cast<int> (m_message_type);
-
-  // 1 identifier argument
-  if ((m_type == 1 || m_type == 2)  &&  m_args.size() == 1 && single_id_check()) {
-    return true;
-  }
+//   bool - True if the argument is valid, false otherwise
+static bool id_check(std::string_view arg) {
+  return Identifier::is_identifier(arg);
+}
 
-  // No arguments
-  if ((m_type == 4 || m_type == 5 || (m_type >= 8 && m_type <= 15))  && m_args.size() == 0){
-    return true;
+// value_check: Checks that an argument is a well-formed value argument.
+// Parameters:
+//   arg - The argument to check
+// Returns:
+//   bool - True if the argument is valid, false otherwise
+static bool value_check(std::string_view arg) {
+  // Check if the value is empty
+  if (arg.length() == 0) {
+    return false;
   }
 
-  // value arguments
-  if ((m_type == 3 || m_type == 18) && m_args.size() == 1 && val_check()) {
-    return true;
-  }
+  // Values may not contain spaces (other than a leading one)
+  return arg.find(' ', 1) == std::string_view::npos;
+}
 
-  // quoted text arguments
-  if ((m_type == 16 || m_type == 17) && m_args.size()) {
-    return true;
-  }
-  
-  // 2 identifier arguments
-  if ((m_type == 6 || m_type == 7) && m_args.size() == 2 && double_id_check()) {
-    return true;
+// args_check: Checks the arguments of a message against the protocol
+// requirements for its type.  Shared by Message and MessageView.
+// Parameters:
+//   type - The message type
+//   args - The message arguments
+//   binary - True if the arguments came from a binary frame (whose
+//            values may hold any bytes, spaces included)
+// Returns:
+//   bool - True if the message is valid, false otherwise
+template<typename Args>
+static bool args_check(MessageType type, const Args &args, bool binary = false) {
+  switch (type) {
+    // 1 identifier argument
+    case MessageType::LOGIN:
+      return args.size() == 1 && id_check(args[0]);
+
+    // table name, optional storage engine name, and an optional memory
+    // budget (most bytes and eviction policy name) after the engine
+    case MessageType::CREATE:
+      return (args.size() == 1 || args.size() == 2 || args.size() == 4) && id_check(args[0])
+        && (args.size() < 2 || id_check(args[1]))
+        && (args.size() < 4 || (value_check(args[2]) && id_check(args[3])));
+
+    // No arguments
+    case MessageType::POP:
+    case MessageType::TOP:
+    case MessageType::ADD:
+    case MessageType::SUB:
+    case MessageType::MUL:
+    case MessageType::DIV:
+    case MessageType::BEGIN:
+    case MessageType::COMMIT:
+    case MessageType::SNAPSHOT:
+    case MessageType::BYE:
+    case MessageType::OK:
+      return args.size() == 0;
+
+    // value arguments
+    case MessageType::PUSH:
+      return args.size() == 1 && (binary ? !args[0].empty() : value_check(args[0]));
+
+    // one or more value arguments
+    case MessageType::DATA:
+      return args.size() != 0 && std::all_of(args.begin(), args.end(), [binary](std::string_view arg) {
+        return binary ? !arg.empty() : value_check(arg);
+      });
+
+    // quoted text arguments
+    case MessageType::FAILED:
+    case MessageType::ERROR:
+      return args.size() != 0;
+
+    // 2 identifier arguments
+    case MessageType::SET:
+    case MessageType::GET:
+    case MessageType::INCR:
+    case MessageType::DECR:
+    case MessageType::CAS:
+      return args.size() == 2 && id_check(args[0]) && id_check(args[1]);
+
+    // 2 identifier arguments and an amount (or a number of seconds)
+    case MessageType::INCRBY:
+    case MessageType::SETEX:
+    case MessageType::EXPIRE:
+      return args.size() == 3 && id_check(args[0]) && id_check(args[1]) && value_check(args[2]);
+
+    // table name, start and end of the range, and a limit
+    case MessageType::SCAN:
+      return args.size() == 4 && id_check(args[0]) && value_check(args[1]) && value_check(args[2]) && value_check(args[3]);
+
+    // table name, prefix, limit and an optional cursor
+    case MessageType::KEYS:
+      return (args.size() == 3 || args.size() == 4) && id_check(args[0])
+        && std::all_of(args.begin() + 1, args.end(), [](std::string_view arg) { return value_check(arg); });
+
+    // table name and one or more keys
+    case MessageType::MGET:
+    case MessageType::MSET:
+    case MessageType::DEL:
+      return args.size() >= 2 && std::all_of(args.begin(), args.end(), id_check);
+
+    default:
+      return false;
   }
+}
 
-  return false;
+// is_valid: Checks if the current message is properly formed according to its type and argument requirements.
+// Parameters:
+//   None
+// Returns:
+//   bool - True if the message is valid, false otherwise
+bool Message::is_valid() const
+{
+  return args_check(m_message_type, m_args);
 }
 
 // val_check: Validates the value in the message to ensure it meets specific formatting or content criteria.
@@ -178,20 +261,7 @@ bool Message::is_valid() const
 // Returns:
 //   bool - True if the value is valid, false otherwise
 bool Message::val_check() const {
-  // Check if the value is empty
-  string value = m_args[0];
-  if (value.length() == 0) {
-    return false;
-  }
-
-  // Iterate through the value
-  for (int i = 0; i < value.length(); ++i) {
-    // Check if the value is a number
-    if (i > 0 && value[i] == ' ') {
-      return false;
-    }
-  }
-  return true;
+  return value_check(m_args[0]);
 }
 
 // single_id_check: Validates if a single identifier in the message is correctly formatted.
@@ -200,17 +270,7 @@ bool Message::val_check() const {
 // Returns:
 //   bool - True if the identifier is valid, false otherwise
 bool Message::single_id_check() const {
-  // Check if the identifier is empty
-  if (m_args[0].length() == 0) {
-    return false;
-  }
-
-  // Check if the identifier is valid
-  if (!is_alpha(m_args[0][0]) || !is_valid_body(m_args[0])) {
-    return false;
-  }
-
-  return true;
+  return id_check(m_args[0]);
 }
 
 // double_id_check: Validates if two identifiers in the message are correctly formatted.
@@ -219,16 +279,7 @@ bool Message::single_id_check() const {
 // Returns:
 //   bool - True if both identifiers are valid, false otherwise
 bool Message::double_id_check() const {
-  // Check if the identifiers are empty
-  if (m_args[0].length() == 0 || m_args[1].length() == 0) {
-    return false;
-  }
-
-  // Check if the identifiers are valid
-  if (!is_alpha(m_args[0][0]) || !is_valid_body(m_args[0]) || !isalpha(m_args[1][0]) || !is_valid_body(m_args[1])) {
-    return false;
-  }
-  return true;
+  return id_check(m_args[0]) && id_check(m_args[1]);
 }
 
 // is_alpha: Checks if the given character is an alphabetic letter.
@@ -236,13 +287,8 @@ bool Message::double_id_check() const {
 //   word - The character to check
 // Returns:
 //   bool - True if the character is alphabetic, false otherwise
-bool Message::is_alpha(char c) const {
-  // Check if the character is alphabetic
-  if ((c >= 'a' && c <= 'z') || ( c >= 'A' && c <= 'Z')) {
-    return true;
-  }
-
-  return false;
+bool Message::is_alpha(char c) {
+  return Identifier::is_start(c);
 }
 
 // is_valid_body: Validates the body of a string to ensure it contains only valid identifier characters.
@@ -250,24 +296,60 @@ bool Message::is_alpha(char c) const {
 //   word - The string to validate
 // Returns:
 //   bool - True if the string body is valid, false otherwise
-bool Message::is_valid_body(string word) const {
-  // Iterate through the string
-  for (const char &c : word) {
-    // Check if the character is valid
-    if (!is_alpha(c) && c != '_' && (c < '0' && c > '9')) {
-      return false;
-    }
-  }
-  return true;
+bool Message::is_valid_body(std::string_view word) {
+  return Identifier::is_body(word);
 }
 
-bool Message::is_identifier(const string &arg) const {
-  if (arg.empty() || !isalpha(arg[0])) return false;
+// is_identifier: Checks if a string is an identifier (a letter followed by letters, digits and underscores).
+// Parameters:
+//   arg - The string to check
+// Returns:
+//   bool - True if the string is an identifier, false otherwise
+bool Message::is_identifier(std::string_view arg) {
+  return Identifier::is_identifier(arg);
+}
 
-  for (size_t i = 1; i < arg.size(); i++) {
-    if (!isalpha(arg[i]) && !isdigit(arg[i]) && arg[i] != '_') 
-      return false;
-  }
+// is_text_value: Checks if a value can be sent in a text DATA message (values received over the binary protocol may not).
+// Parameters:
+//   value - The value to check
+// Returns:
+//   bool - True if the value fits in a text message, false otherwise
+bool Message::is_text_value(std::string_view value) {
+  // "DATA ", the value and the newline must fit in one line
+  return value_check(value) && value.find('\n') == std::string_view::npos
+    && value.length() + 6 <= MAX_ENCODED_LEN;
+}
+
+// MessageView constructor
+MessageView::MessageView()
+  : m_message_type(MessageType::NONE)
+  , m_binary(false)
+{
+}
+
+// MessageView destructor
+MessageView::~MessageView()
+{
+}
 
-  return true;
-}
\ No newline at end of file
+// clear: Resets the view to an uninitialized message without releasing its argument storage.
+// Parameters:
+//   None
+// Returns:
+//   void
+void MessageView::clear()
+{
+  m_message_type = MessageType::NONE;
+  m_args.clear();
+  m_binary = false;
+}
+
+// is_valid: Checks if the message is properly formed according to its type and argument requirements.
+// Parameters:
+//   None
+// Returns:
+//   bool - True if the message is valid, false otherwise
+bool MessageView::is_valid() const
+{
+  return args_check(m_message_type, m_args, m_binary);
+}
@@ -7,6 +7,7 @@
 // Headers
 #include <vector>
 #include <string>
+#include <string_view>
 
 // Enumeration for message types
 enum class MessageType {
@@ -27,7 +28,19 @@ enum class MessageType {
   DIV,
   BEGIN,
   COMMIT,
+  SNAPSHOT,
   BYE,
+  MGET,
+  MSET,
+  INCRBY,
+  INCR,
+  DECR,
+  CAS,
+  SCAN,
+  KEYS,
+  DEL,
+  SETEX,
+  EXPIRE,
 
   // Responses
   OK,
@@ -143,8 +156,8 @@ public:
   // Parameters:
   //   i - The index of the argument to retrieve
   // Returns:
-  //   std::string - The argument at the specified index
-  std::string get_arg( unsigned i ) const { return m_args.at( i ); }
+  //   const std::string& - The argument at the specified index
+  const std::string &get_arg( unsigned i ) const { return m_args.at( i ); }
 
   // single_id_check: Validates if a single identifier in the message is correctly formatted.
   // Parameters:
@@ -158,14 +171,14 @@ public:
   //   word - The character to check
   // Returns:
   //   bool - True if the character is alphabetic, false otherwise
-  bool is_alpha(char word) const;
+  static bool is_alpha(char word);
 
   // is_valid_body: Validates the body of a string to ensure it contains only valid identifier characters.
   // Parameters:
   //   word - The string to validate
   // Returns:
   //   bool - True if the string body is valid, false otherwise
-  bool is_valid_body(std::string word) const;
+  static bool is_valid_body(std::string_view word);
 
   // val_check: Validates the value in the message to ensure it meets specific formatting or content criteria.
   // Parameters:
@@ -188,7 +201,135 @@ public:
   //   bool - True if both identifiers are valid, false otherwise
   bool double_id_check() const;
 
-  bool is_identifier(const std::string &arg) const;
+  // is_identifier: Checks if a string is an identifier (a letter followed by letters, digits and underscores).
+  // Parameters:
+  //   arg - The string to check
+  // Returns:
+  //   bool - True if the string is an identifier, false otherwise
+  static bool is_identifier(std::string_view arg);
+
+  // is_text_value: Checks if a value can be sent in a text DATA message (values received over the binary protocol may not).
+  // Parameters:
+  //   value - The value to check
+  // Returns:
+  //   bool - True if the value fits in a text message, false otherwise
+  static bool is_text_value(std::string_view value);
+};
+
+// A decoded message whose arguments refer to the buffer it was decoded
+// from, so that decoding a request doesn't allocate.  The buffer must
+// outlive the view.  A MessageView can be reused for successive
+// requests, keeping its argument storage.
+class MessageView {
+private:
+  // Member variables
+  // Message type
+  MessageType m_message_type;
+  // Vector to store the arguments
+  std::vector<std::string_view> m_args;
+  // Set if the message was decoded from a binary frame, whose values
+  // may hold any bytes
+  bool m_binary;
+
+public:
+  // Constructor
+  MessageView();
+
+  // Destructor
+  ~MessageView();
+
+  // Member functions
+
+  // clear: Resets the view to an uninitialized message without releasing its argument storage.
+  // Parameters:
+  //   None
+  // Returns:
+  //   void
+  void clear();
+
+  // Get message type
+  // Parameters:
+  //   void
+  // Returns:
+  //   MessageType - message type
+  MessageType get_message_type() const { return m_message_type; }
+
+  // set_message_type: Sets the message type of the message.
+  // Parameters:
+  //   message_type - MessageType to set for the message
+  // Returns:
+  //   void
+  void set_message_type( MessageType message_type ) { m_message_type = message_type; }
+
+  // set_binary: Marks the message as decoded from a binary frame (cleared by clear()).
+  // Parameters:
+  //   binary - True for a binary frame
+  // Returns:
+  //   void
+  void set_binary( bool binary ) { m_binary = binary; }
+
+  // is_binary: Checks if the message was decoded from a binary frame.
+  // Parameters:
+  //   None
+  // Returns:
+  //   bool - True for a binary frame
+  bool is_binary() const { return m_binary; }
+
+  // get_username: Retrieves the username from the message arguments.
+  // Parameters:
+  //   None
+  // Returns:
+  //   std::string_view - The username
+  std::string_view get_username() const { return m_args[0]; }
+
+  // get_table: Retrieves the table name from the message arguments.
+  // Parameters:
+  //   None
+  // Returns:
+  //   std::string_view - The table name
+  std::string_view get_table() const { return m_args[0]; }
+
+  // get_key: Retrieves the key from the message arguments.
+  // Parameters:
+  //   None
+  // Returns:
+  //   std::string_view - The key
+  std::string_view get_key() const { return m_args[1]; }
+
+  // get_value: Retrieves the value from the message arguments.
+  // Parameters:
+  //   None
+  // Returns:
+  //   std::string_view - The value
+  std::string_view get_value() const { return m_args[0]; }
+
+  // push_arg: Adds an argument to the message's argument list.
+  // Parameters:
+  //   arg - The argument to add
+  // Returns:
+  //   void
+  void push_arg( std::string_view arg ) { m_args.push_back( arg ); }
+
+  // get_num_args: Retrieves the number of arguments in the message.
+  // Parameters:
+  //   None
+  // Returns:
+  //   unsigned - The number of arguments
+  unsigned get_num_args() const { return m_args.size(); }
+
+  // get_arg: Retrieves an argument from the message at the specified index.
+  // Parameters:
+  //   i - The index of the argument to retrieve
+  // Returns:
+  //   std::string_view - The argument at the specified index
+  std::string_view get_arg( unsigned i ) const { return m_args.at( i ); }
+
+  // is_valid: Checks if the message is properly formed according to its type and argument requirements.
+  // Parameters:
+  //   None
+  // Returns:
+  //   bool - True if the message is valid, false otherwise
+  bool is_valid() const;
 };
 
 
@@ -5,12 +5,11 @@
 #include <sstream>
 #include <cassert>
 #include <iostream>
-#include <regex>
-#include <map>
+#include <algorithm>
 #include <string>
+#include <cstdint>
 #include "exceptions.h"
 #include "message_serialization.h"
-#include <unordered_map>
 
 // Namespaces
 using std::string;
@@ -18,7 +17,71 @@ using std::vector;
 using std::stringstream;
 using std::cout;
 using std::endl;
-using std::unordered_map; 
+
+namespace {
+
+// Message types by binary opcode (types added later get new opcodes at
+// the end, so existing binary clients keep working)
+const MessageType OPCODES[] = {
+  MessageType::NONE,
+  MessageType::LOGIN,
+  MessageType::CREATE,
+  MessageType::PUSH,
+  MessageType::POP,
+  MessageType::TOP,
+  MessageType::SET,
+  MessageType::GET,
+  MessageType::ADD,
+  MessageType::SUB,
+  MessageType::MUL,
+  MessageType::DIV,
+  MessageType::BEGIN,
+  MessageType::COMMIT,
+  MessageType::SNAPSHOT,
+  MessageType::BYE,
+  MessageType::OK,
+  MessageType::FAILED,
+  MessageType::ERROR,
+  MessageType::DATA,
+  MessageType::MGET,
+  MessageType::MSET,
+  MessageType::INCRBY,
+  MessageType::INCR,
+  MessageType::DECR,
+  MessageType::CAS,
+  MessageType::SCAN,
+  MessageType::KEYS,
+  MessageType::DEL,
+  MessageType::SETEX,
+  MessageType::EXPIRE,
+};
+
+const size_t NUM_OPCODES = sizeof( OPCODES ) / sizeof( OPCODES[0] );
+
+// Append a big-endian u32
+void put_u32( std::string &out, uint32_t v ) {
+  char bytes[4] = { char( v >> 24 ), char( v >> 16 ), char( v >> 8 ), char( v ) };
+  out.append( bytes, sizeof( bytes ) );
+}
+
+// A message's name followed by every one of its arguments, separated
+// by spaces
+vector<string> with_args( const char *name, const Message &msg ) {
+  vector<string> strings = { name };
+  for ( unsigned i = 0; i < msg.get_num_args(); i++ ) {
+    strings.push_back( " " );
+    strings.push_back( msg.get_arg( i ) );
+  }
+  return strings;
+}
+
+// Read a big-endian u32
+uint32_t get_u32( const char *p ) {
+  const unsigned char *b = reinterpret_cast<const unsigned char*>( p );
+  return ( uint32_t( b[0] ) << 24 ) | ( uint32_t( b[1] ) << 16 ) | ( uint32_t( b[2] ) << 8 ) | b[3];
+}
+
+}
 
 // Encodes a Message object into a string suitable for transmission.
 // Parameters:
@@ -55,136 +118,169 @@ void MessageSerialization::encode( const Message &msg, std::string &encoded_msg)
 // Returns:
 //   void
 void MessageSerialization::decode( const std::string &encoded_msg_, Message &msg) {
-  // Message object to store decoded message
-  Message new_message;
+  // Tokenize the message in place
+  MessageView view;
+  decode(std::string_view(encoded_msg_), view);
+
+  // Copy the arguments into the message object
+  msg = Message(view.get_message_type());
+  for (unsigned i = 0; i < view.get_num_args(); i++) {
+    msg.push_arg(string(view.get_arg(i)));
+  }
+}
 
+// Decodes a string into a MessageView without copying: the view's
+// arguments are slices of encoded_msg.
+// Parameters:
+//   encoded_msg - encoded message (must outlive msg)
+//   msg - message view to store decoded message
+// Returns:
+//   void
+void MessageSerialization::decode(std::string_view encoded_msg, MessageView &msg) {
   // Check if encoded message is too long
-  if (encoded_msg_.length() > 1024) {
+  if (encoded_msg.length() > Message::MAX_ENCODED_LEN) {
     throw InvalidMessage("encoded message length too long");
   }
 
   // Check if encoded message is not terminated by newline character
-  if (encoded_msg_[encoded_msg_.length() - 1] != '\n') {
+  if (encoded_msg.empty() || encoded_msg.back() != '\n') {
     throw InvalidMessage("encoded message not terminated by new line character");
   }
+  encoded_msg.remove_suffix(1);
 
-  // Split encoded message by space
-  vector<string> args = split(encoded_msg_, ' ');
+  msg.clear();
 
-  // Check if encoded message is empty
-  if (args.size() == 1 && args[0][args[0].size() - 1] == '\n') { 
-    args[0].pop_back();
+  // Find the command token
+  size_t begin = encoded_msg.find_first_not_of(' ');
+  if (begin == std::string_view::npos) {
+    throw InvalidMessage("Invalid string for MessageType");
   }
+  size_t end = std::min(encoded_msg.find(' ', begin), encoded_msg.length());
 
-  // Convert the first element of the vector to MessageType
-  MessageType m_type = stringToMessageType(args[0]);
-  
   // Set message type
-  new_message.set_message_type(m_type);
-
-  // Iterate through vector to add arguments to message object
-  for (size_t i = 1; i < args.size(); i++) {
-    // Remove newline character if it is the last argument
-    if (i == args.size() - 1 && args[i].back() == '\n') {
-      args[i].pop_back();
-    } 
-
-    // Add argument to message object
-    new_message.push_arg(args[i]);
+  MessageType m_type = token_to_message_type(encoded_msg.substr(begin, end - begin));
+  msg.set_message_type(m_type);
+
+  if (m_type == MessageType::FAILED || m_type == MessageType::ERROR) {
+    // The rest of the line is quoted text: strip the spaces and quotes
+    // around it
+    size_t text_begin = encoded_msg.find_first_not_of(' ', end);
+    if (text_begin != std::string_view::npos) {
+      size_t text_end = encoded_msg.find_last_not_of(' ') + 1;
+      if (encoded_msg[text_begin] == '"') {
+        text_begin++;
+      }
+      if (text_end > text_begin && encoded_msg[text_end - 1] == '"') {
+        text_end--;
+      }
+      msg.push_arg(encoded_msg.substr(text_begin, text_end - text_begin));
+    }
+  } else {
+    // Each remaining space-separated token is an argument
+    while ((begin = encoded_msg.find_first_not_of(' ', end)) != std::string_view::npos) {
+      end = std::min(encoded_msg.find(' ', begin), encoded_msg.length());
+      msg.push_arg(encoded_msg.substr(begin, end - begin));
+    }
   }
 
   // Check if message object is valid
-  if (!new_message.is_valid()) {
+  if (!msg.is_valid()) {
     throw InvalidMessage("Message object isn't valid");
   }
-
-  // Store message object in parameter
-  msg = new_message;
 }
 
-// Splits a string by a delimiter into a vector of strings.
+// Encodes a Message object as a binary frame, appending it to a string.
 // Parameters:
-//   s - string to split
-//   delim - character used as a delimiter
+//   msg - message object to encode
+//   frame - string to append the frame to
 // Returns:
-//   vector of strings resulting from the split
-vector<string> MessageSerialization::split(const string &s, char delim) {
-  // Vector to store split strings
-  vector<string> total;
-
-  // Stringstream to split string
-  stringstream ss (s);
-
-  // Iterate through stringstream to split string
-  string str;
-  while (getline(ss, str, delim)) {
-    total.push_back(str);
+//   void
+void MessageSerialization::encode_binary(const Message &msg, std::string &frame) {
+  size_t opcode = std::find(OPCODES, OPCODES + NUM_OPCODES, msg.get_message_type()) - OPCODES;
+  if (opcode == NUM_OPCODES || msg.get_num_args() > 255) {
+    throw InvalidMessage("message can't be encoded");
   }
 
-  // Return vector of split strings
-  vector<string> res;
-
-  // Iterate through vector to remove empty strings
-  for (const string& item : total) {
-    // If string is not empty, add to vector
-    if (item != "") {
-      res.push_back(item);
-    }
+  // Fill in the header once the body's length is known
+  size_t start = frame.size();
+  frame.append(FRAME_HEADER_LEN, '\0');
+  for (unsigned i = 0; i < msg.get_num_args(); i++) {
+    const string &arg = msg.get_arg(i);
+    put_u32(frame, arg.length());
+    frame += arg;
   }
 
-  // If last element is newline, remove it
-  if (res[res.size() - 1] == "\n") {
-    res.pop_back();
+  size_t len = frame.size() - start;
+  if (len > MAX_FRAME_LEN) {
+    frame.resize(start);
+    throw InvalidMessage("encoded message length too long");
   }
+  string header;
+  put_u32(header, len - FRAME_HEADER_LEN);
+  header += char(opcode);
+  header += char(msg.get_num_args());
+  frame.replace(start, FRAME_HEADER_LEN, header.append(2, '\0'));
+}
 
-  // If first element is FAILED or ERROR, process quotes
-  if (res[0] == "FAILED" || res[0] == "ERROR") {
-    return split_quote(res);
+// Gets the length of the binary frame at the start of a buffer.
+// Parameters:
+//   data - bytes received so far (starting at a frame)
+// Returns:
+//   size_t - length of the frame, header included (it may exceed
+//   MAX_FRAME_LEN, or the bytes received), or 0 if even the header
+//   hasn't been received yet
+size_t MessageSerialization::binary_frame_len(std::string_view data) {
+  if (data.length() < FRAME_HEADER_LEN) {
+    return 0;
   }
-
-  // Return vector of split strings
-  return res;
+  return FRAME_HEADER_LEN + size_t(get_u32(data.data()));
 }
 
-// Processes a vector of strings to handle quoted text properly.
+// Decodes a binary frame into a MessageView without copying: the
+// view's arguments are slices of frame.
 // Parameters:
-//   res - vector of strings initially split by 'split'
+//   frame - exactly one frame (must outlive msg)
+//   msg - message view to store decoded message
 // Returns:
-//   vector of strings after processing quotes
-vector<string> MessageSerialization::split_quote(vector<string> old) {
-  // Vector to store processed strings
-  vector<string> res;
-
-  // Store first element of vector
-  res.push_back(old[0]);
-
-  // Stringstream to store quoted text
-  std::ostringstream oss;
-
-  // Iterate through vector to process quoted text
-  for (size_t i = 1; i < old.size(); ++i) {
-    for (const char &c : old[i]) {
-      // If character is a quote, add to stringstream
-      if (c != '\"') {
-        oss << c;
-      }
-    }
-    // Add space after each word
-    oss << " ";
+//   void
+void MessageSerialization::decode_binary(std::string_view frame, MessageView &msg) {
+  // Check the header
+  if (frame.length() > MAX_FRAME_LEN) {
+    throw InvalidMessage("encoded message length too long");
+  }
+  if (frame.length() < FRAME_HEADER_LEN || binary_frame_len(frame) != frame.length()) {
+    throw InvalidMessage("incomplete binary frame");
+  }
+  unsigned char opcode = frame[4];
+  unsigned num_args = static_cast<unsigned char>(frame[5]);
+  if (opcode >= NUM_OPCODES || frame[6] != 0 || frame[7] != 0) {
+    throw InvalidMessage("Invalid binary frame header");
   }
-  // Store stringstream as string
-  string quote = oss.str();
 
-  // Remove extra space at end
-  quote.pop_back(); 
+  msg.clear();
+  msg.set_message_type(OPCODES[opcode]);
+  msg.set_binary(true);
 
-  // Add processed string to vector
-  res.push_back(quote);
-  
-  // Return processed vector
-  return res;
+  // Slice out each length-prefixed argument
+  std::string_view body = frame.substr(FRAME_HEADER_LEN);
+  for (unsigned i = 0; i < num_args; i++) {
+    if (body.length() < 4 || body.length() - 4 < get_u32(body.data())) {
+      throw InvalidMessage("binary frame argument overruns the frame");
+    }
+    size_t len = get_u32(body.data());
+    msg.push_arg(body.substr(4, len));
+    body.remove_prefix(4 + len);
+  }
+  if (!body.empty()) {
+    throw InvalidMessage("binary frame has trailing bytes");
+  }
+
+  // Check if message object is valid
+  if (!msg.is_valid()) {
+    throw InvalidMessage("Message object isn't valid");
+  }
 }
-  
+
 // Converts a MessageType and its associated data into a vector of strings.
 // Parameters:
 //   type - message type to convert
@@ -197,23 +293,39 @@ vector<string> MessageSerialization::type_to_strings(const MessageType type, con
     // Return vector of strings based on MessageType  
     case MessageType::NONE: return {"NONE"};
     case MessageType::LOGIN: return {"LOGIN ", msg.get_username()};
-    case MessageType::CREATE: return {"CREATE ", msg.get_table()};
+    case MessageType::CREATE:
+      if (msg.get_num_args() > 1) {
+        return {"CREATE ", msg.get_table(), " ", msg.get_arg(1)};
+      }
+      return {"CREATE ", msg.get_table()};
     case MessageType::PUSH: return {"PUSH ", msg.get_value()};
     case MessageType::POP: return {"POP"};
     case MessageType::TOP: return {"TOP"};
     case MessageType::SET: return {"SET ", msg.get_table(), " ", msg.get_key()};
     case MessageType::GET: return {"GET ", msg.get_table(), " ", msg.get_key()};
+    case MessageType::INCRBY: return {"INCRBY ", msg.get_table(), " ", msg.get_key(), " ", msg.get_arg(2)};
+    case MessageType::INCR: return {"INCR ", msg.get_table(), " ", msg.get_key()};
+    case MessageType::DECR: return {"DECR ", msg.get_table(), " ", msg.get_key()};
+    case MessageType::CAS: return {"CAS ", msg.get_table(), " ", msg.get_key()};
+    case MessageType::SETEX: return {"SETEX ", msg.get_table(), " ", msg.get_key(), " ", msg.get_arg(2)};
+    case MessageType::EXPIRE: return {"EXPIRE ", msg.get_table(), " ", msg.get_key(), " ", msg.get_arg(2)};
     case MessageType::ADD: return {"ADD"};
     case MessageType::SUB: return {"SUB"};
     case MessageType::MUL: return {"MUL"};
     case MessageType::DIV: return {"DIV"};
     case MessageType::BEGIN: return {"BEGIN"};
     case MessageType::COMMIT: return {"COMMIT"};
+    case MessageType::SNAPSHOT: return {"SNAPSHOT"};
     case MessageType::BYE: return {"BYE"};
     case MessageType::OK: return {"OK"};
     case MessageType::FAILED: return {"FAILED ", msg.get_quoted_text()};
     case MessageType::ERROR: return {"ERROR ", msg.get_quoted_text()};
-    case MessageType::DATA: return {"DATA ", msg.get_value()};
+    case MessageType::MGET: return with_args("MGET", msg);
+    case MessageType::MSET: return with_args("MSET", msg);
+    case MessageType::SCAN: return with_args("SCAN", msg);
+    case MessageType::KEYS: return with_args("KEYS", msg);
+    case MessageType::DEL: return with_args("DEL", msg);
+    case MessageType::DATA: return with_args("DATA", msg);
     default: return {"Unknown MessageType"};
   }
 }
@@ -224,36 +336,61 @@ vector<string> MessageSerialization::type_to_strings(const MessageType type, con
 // Returns:
 //   MessageType corresponding to the string
 MessageType MessageSerialization::stringToMessageType(const string& typeString) {
-  // Map of string to MessageType
-  static const unordered_map<string, MessageType> stringToTypeMap = {
-      {"NONE", MessageType::NONE},
-      {"LOGIN", MessageType::LOGIN},
-      {"CREATE", MessageType::CREATE},
-      {"PUSH", MessageType::PUSH},
-      {"POP", MessageType::POP},
-      {"TOP", MessageType::TOP},
-      {"SET", MessageType::SET},
-      {"GET", MessageType::GET},
-      {"ADD", MessageType::ADD},
-      {"SUB", MessageType::SUB},
-      {"MUL", MessageType::MUL},
-      {"DIV", MessageType::DIV},
-      {"BEGIN", MessageType::BEGIN},
-      {"COMMIT", MessageType::COMMIT},
-      {"BYE", MessageType::BYE},
-      {"OK", MessageType::OK},
-      {"FAILED", MessageType::FAILED},
-      {"ERROR", MessageType::ERROR},
-      {"DATA", MessageType::DATA}
-  };
-
-  // Iterate through map to find MessageType
-  auto it = stringToTypeMap.find(typeString);
-
-  // Return MessageType if found
-  if (it != stringToTypeMap.end()) {
-      return it->second;
-  } else {
-      throw InvalidMessage("Invalid string for MessageType");
+  return token_to_message_type(typeString);
+}
+
+// Converts a command token to a MessageType enum without allocating.
+// Parameters:
+//   token - token naming the message type
+// Returns:
+//   MessageType corresponding to the token
+MessageType MessageSerialization::token_to_message_type(std::string_view token) {
+  // Dispatch on length, then compare against the few names of that length
+  switch (token.length()) {
+    case 2:
+      if (token == "OK") return MessageType::OK;
+      break;
+    case 3:
+      if (token == "GET") return MessageType::GET;
+      if (token == "SET") return MessageType::SET;
+      if (token == "TOP") return MessageType::TOP;
+      if (token == "ADD") return MessageType::ADD;
+      if (token == "POP") return MessageType::POP;
+      if (token == "SUB") return MessageType::SUB;
+      if (token == "MUL") return MessageType::MUL;
+      if (token == "DIV") return MessageType::DIV;
+      if (token == "BYE") return MessageType::BYE;
+      if (token == "CAS") return MessageType::CAS;
+      if (token == "DEL") return MessageType::DEL;
+      break;
+    case 4:
+      if (token == "PUSH") return MessageType::PUSH;
+      if (token == "DATA") return MessageType::DATA;
+      if (token == "NONE") return MessageType::NONE;
+      if (token == "MGET") return MessageType::MGET;
+      if (token == "MSET") return MessageType::MSET;
+      if (token == "INCR") return MessageType::INCR;
+      if (token == "DECR") return MessageType::DECR;
+      if (token == "SCAN") return MessageType::SCAN;
+      if (token == "KEYS") return MessageType::KEYS;
+      break;
+    case 5:
+      if (token == "LOGIN") return MessageType::LOGIN;
+      if (token == "BEGIN") return MessageType::BEGIN;
+      if (token == "ERROR") return MessageType::ERROR;
+      if (token == "SETEX") return MessageType::SETEX;
+      break;
+    case 6:
+      if (token == "COMMIT") return MessageType::COMMIT;
+      if (token == "INCRBY") return MessageType::INCRBY;
+      if (token == "CREATE") return MessageType::CREATE;
+      if (token == "FAILED") return MessageType::FAILED;
+      if (token == "EXPIRE") return MessageType::EXPIRE;
+      break;
+    case 8:
+      if (token == "SNAPSHOT") return MessageType::SNAPSHOT;
+      break;
   }
-}
\ No newline at end of file
+
+  throw InvalidMessage("Invalid string for MessageType");
+}
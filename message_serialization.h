@@ -5,10 +5,31 @@
 #define MESSAGE_SERIALIZATION_H
 
 // Headers
+#include <cstddef>
 #include "message.h"
 
 namespace MessageSerialization {
 
+  // The binary protocol.  A client selects it by sending BINARY_MAGIC
+  // as the first byte of the connection (no text request starts with
+  // it); every message in both directions is then a frame:
+  //
+  //   header: body length (u32), opcode (u8), argument count (u8),
+  //           reserved (u16, zero)
+  //   body:   per argument: length (u32), bytes
+  //
+  // Integers are big-endian.  Arguments are not tokenized, so values
+  // may hold any bytes (spaces included) and be up to MAX_FRAME_LEN.
+
+  // First byte of a binary connection
+  const unsigned char BINARY_MAGIC = 0xB7;
+
+  // Size of a frame's header
+  const size_t FRAME_HEADER_LEN = 8;
+
+  // Largest frame accepted (header included)
+  const size_t MAX_FRAME_LEN = 64 << 20;
+
   // Encodes a Message object into a string suitable for transmission.
   // Parameters:
   //   msg - message object to encode
@@ -25,20 +46,40 @@ namespace MessageSerialization {
   //   void
   void decode(const std::string &encoded_msg, Message &msg);
 
-  // Splits a string by a delimiter into a vector of strings.
+  // Decodes a string into a MessageView without copying: the view's
+  // arguments are slices of encoded_msg.
   // Parameters:
-  //   s - string to split
-  //   delim - character used as a delimiter
+  //   encoded_msg - encoded message (must outlive msg)
+  //   msg - message view to store decoded message
   // Returns:
-  //   vector of strings resulting from the split
-  std::vector<std::string> split(const std::string &s, char delim);
+  //   void
+  void decode(std::string_view encoded_msg, MessageView &msg);
 
-  // Processes a vector of strings to handle quoted text properly.
+  // Encodes a Message object as a binary frame, appending it to a string.
   // Parameters:
-  //   res - vector of strings initially split by 'split'
+  //   msg - message object to encode
+  //   frame - string to append the frame to
   // Returns:
-  //   vector of strings after processing quotes
-  std::vector<std::string> split_quote(std::vector<std::string> res);
+  //   void
+  void encode_binary(const Message &msg, std::string &frame);
+
+  // Gets the length of the binary frame at the start of a buffer.
+  // Parameters:
+  //   data - bytes received so far (starting at a frame)
+  // Returns:
+  //   size_t - length of the frame, header included (it may exceed
+  //   MAX_FRAME_LEN, or the bytes received), or 0 if even the header
+  //   hasn't been received yet
+  size_t binary_frame_len(std::string_view data);
+
+  // Decodes a binary frame into a MessageView without copying: the
+  // view's arguments are slices of frame.
+  // Parameters:
+  //   frame - exactly one frame (must outlive msg)
+  //   msg - message view to store decoded message
+  // Returns:
+  //   void
+  void decode_binary(std::string_view frame, MessageView &msg);
 
   // Converts a MessageType and its associated data into a vector of strings.
   // Parameters:
@@ -54,6 +95,13 @@ namespace MessageSerialization {
   // Returns:
   //   MessageType corresponding to the string
   MessageType stringToMessageType(const std::string& typeString);
+
+  // Converts a command token to a MessageType enum without allocating.
+  // Parameters:
+  //   token - token naming the message type
+  // Returns:
+  //   MessageType corresponding to the token
+  MessageType token_to_message_type(std::string_view token);
 };
 
 // End Guards
@@ -4,6 +4,8 @@
 # and record its pid as SERVER_PID.
 # Use -n <num fds> option to set a limit on the maximum number
 # of file descriptors the server can have open.
+# Extra server options (e.g., SERVER_OPTS="-m occ") are taken from
+# the SERVER_OPTS environment variable.
 start_server() {
   max_fds='0'
   if [[ $# -ge 2 ]] && [[ "$1" = '-n' ]]; then
@@ -17,9 +19,9 @@ start_server() {
 
   >&2 echo "Starting server..."
   if [[ "${max_fds}" -gt 0 ]]; then
-    (ulimit -n "${max_fds}" && exec ./server ${port}) 2> server_err.log &
+    (ulimit -n "${max_fds}" && exec ./server ${SERVER_OPTS} ${port}) 2> server_err.log &
   else
-    ./server ${port} 2> server_err.log &
+    ./server ${SERVER_OPTS} ${port} 2> server_err.log &
   fi
   SERVER_PID=$!
   >&3 echo "pid ${SERVER_PID}"
@@ -0,0 +1,125 @@
+// mvcc.cpp
+
+// Headers
+#include <sched.h>
+#include "mvcc.h"
+
+// Constructor
+CommitClock::CommitClock()
+  : m_last( 0 )
+  , m_visible( 0 )
+{
+}
+
+// Destructor
+CommitClock::~CommitClock()
+{
+}
+
+// Make a commit visible to new snapshots, once every earlier commit
+// is visible too
+// Parameters:
+//   ts - commit timestamp
+// Returns:
+//   void
+void CommitClock::publish( uint64_t ts )
+{
+  // Earlier commits already hold all of their latches, so they finish
+  // installing without waiting for us; this wait is short
+  while ( m_visible.load() != ts - 1 ) {
+    sched_yield();
+  }
+  m_visible.store( ts );
+}
+
+// Constructor
+SnapshotRegistry::SnapshotRegistry()
+  : m_slots( nullptr )
+{
+}
+
+// Destructor
+SnapshotRegistry::~SnapshotRegistry()
+{
+  Slot *slot = m_slots.load();
+  while ( slot != nullptr ) {
+    Slot *next = slot->next;
+    delete slot;
+    slot = next;
+  }
+}
+
+// Take ownership of a slot
+// Parameters:
+//   void
+// Returns:
+//   Slot* - slot owned by the caller until release_slot()
+SnapshotRegistry::Slot *SnapshotRegistry::acquire_slot()
+{
+  // reuse a free slot if there is one
+  for ( Slot *slot = m_slots.load(); slot != nullptr; slot = slot->next ) {
+    bool expected = false;
+    if ( !slot->in_use.load() && slot->in_use.compare_exchange_strong( expected, true ) ) {
+      return slot;
+    }
+  }
+
+  // otherwise add a new one at the head of the list
+  Slot *slot = new Slot;
+  slot->ts.store( IDLE );
+  slot->in_use.store( true );
+  slot->next = m_slots.load();
+  while ( !m_slots.compare_exchange_weak( slot->next, slot ) ) {
+  }
+  return slot;
+}
+
+// Give a slot back
+// Parameters:
+//   slot - slot to release
+// Returns:
+//   void
+void SnapshotRegistry::release_slot( Slot *slot )
+{
+  slot->ts.store( IDLE );
+  slot->in_use.store( false );
+}
+
+// Begin a snapshot at the currently visible timestamp
+// Parameters:
+//   slot - caller's slot
+//   clock - commit clock
+// Returns:
+//   uint64_t - snapshot timestamp
+uint64_t SnapshotRegistry::begin( Slot *slot, const CommitClock &clock )
+{
+  // The timestamp is only safe to read at once it is in the slot and
+  // still the visible one: oldest() reads the clock before the slots, so if it
+  // missed our slot, it also saw a visible timestamp no newer than ours.
+  uint64_t ts = clock.visible();
+  while ( true ) {
+    slot->ts.store( ts );
+    uint64_t now = clock.visible();
+    if ( now == ts ) {
+      return ts;
+    }
+    ts = now;
+  }
+}
+
+// Find the oldest timestamp any current or future snapshot may read at
+// Parameters:
+//   clock - commit clock
+// Returns:
+//   uint64_t - oldest readable timestamp
+uint64_t SnapshotRegistry::oldest( const CommitClock &clock ) const
+{
+  uint64_t oldest = clock.visible();
+  for ( Slot *slot = m_slots.load(); slot != nullptr; slot = slot->next ) {
+    uint64_t ts = slot->ts.load();
+    if ( ts < oldest ) {
+      oldest = ts;
+    }
+  }
+  return oldest;
+}
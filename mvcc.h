@@ -0,0 +1,201 @@
+// mvcc.h
+
+// Guards
+#ifndef MVCC_H
+#define MVCC_H
+
+// Headers
+#include <atomic>
+#include <cstdint>
+
+// Hands out commit timestamps and tracks which of them readers may see.
+//
+// A writer takes a timestamp with begin_commit() while it holds the
+// latches of every shard it writes, installs its versions under that
+// timestamp, releases the latches and then calls publish().  Timestamps
+// become visible strictly in order, so a snapshot taken at visible()
+// includes every commit up to it and nothing after it.
+class CommitClock {
+private:
+  // Last timestamp handed out
+  std::atomic<uint64_t> m_last;
+
+  // Every commit with a timestamp up to this one has been published
+  std::atomic<uint64_t> m_visible;
+
+  // Copy constructor
+  CommitClock( const CommitClock & );
+
+  // Assignment operator
+  CommitClock &operator=( const CommitClock & );
+
+public:
+  // Constructor
+  CommitClock();
+
+  // Destructor
+  ~CommitClock();
+
+  // Take the timestamp for a new commit
+  // Parameters:
+  //   void
+  // Returns:
+  //   uint64_t - commit timestamp (larger than any handed out before)
+  uint64_t begin_commit() { return ++m_last; }
+
+  // Make a commit visible to new snapshots, once every earlier commit
+  // is visible too.  Must be called exactly once for each timestamp
+  // returned by begin_commit(), after its latches are released.
+  // Parameters:
+  //   ts - commit timestamp
+  // Returns:
+  //   void
+  void publish( uint64_t ts );
+
+  // Newest timestamp a snapshot may read at
+  // Parameters:
+  //   void
+  // Returns:
+  //   uint64_t - visible timestamp
+  uint64_t visible() const { return m_visible.load(); }
+};
+
+// Finishes a commit however the code installing it ends.  Takes a
+// timestamp when it is constructed; when it is destroyed (or finish()
+// is called) it calls release to drop the commit's latches and then
+// publishes the timestamp, so an exception thrown between the two
+// can't leave every later commit waiting for this one.
+template<typename Release>
+class CommitGuard {
+private:
+  // Clock the timestamp came from
+  CommitClock &m_clock;
+
+  // Releases the commit's latches (must not throw)
+  Release m_release;
+
+  // Commit timestamp
+  uint64_t m_ts;
+
+  // Whether the commit has been finished
+  bool m_done;
+
+  // Copy constructor
+  CommitGuard( const CommitGuard & );
+
+  // Assignment operator
+  CommitGuard &operator=( const CommitGuard & );
+
+public:
+  // Constructor (takes the timestamp)
+  // Parameters:
+  //   clock - commit clock
+  //   release - called to release the latches before publishing
+  CommitGuard( CommitClock &clock, Release release )
+    : m_clock( clock ), m_release( release ), m_ts( clock.begin_commit() ), m_done( false )
+  { }
+
+  // Destructor (finishes the commit if finish() wasn't called)
+  ~CommitGuard() { finish(); }
+
+  // Commit timestamp
+  // Parameters:
+  //   void
+  // Returns:
+  //   uint64_t - timestamp taken by the constructor
+  uint64_t get_ts() const { return m_ts; }
+
+  // Release the latches and publish the timestamp (only the first
+  // call does anything)
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void finish()
+  {
+    if ( !m_done ) {
+      m_done = true;
+      m_release();
+      m_clock.publish( m_ts );
+    }
+  }
+};
+
+// Registry of the snapshots readers currently hold, so the garbage
+// collector knows which old versions may still be read.
+//
+// Each reader (a client connection) owns a slot for its lifetime and
+// stores its snapshot timestamp there while it reads; beginning and
+// ending a snapshot never take a lock.
+class SnapshotRegistry {
+public:
+  // One reader's snapshot
+  struct Slot {
+    // Timestamp of the reader's snapshot, or IDLE
+    std::atomic<uint64_t> ts;
+    // Whether a reader owns this slot
+    std::atomic<bool> in_use;
+    // Next slot in the registry
+    Slot *next;
+  };
+
+  // Slot value meaning "not reading"
+  static const uint64_t IDLE = UINT64_MAX;
+
+private:
+  // All slots ever created (slots are reused, never freed until the
+  // registry is destroyed)
+  std::atomic<Slot*> m_slots;
+
+  // Copy constructor
+  SnapshotRegistry( const SnapshotRegistry & );
+
+  // Assignment operator
+  SnapshotRegistry &operator=( const SnapshotRegistry & );
+
+public:
+  // Constructor
+  SnapshotRegistry();
+
+  // Destructor
+  ~SnapshotRegistry();
+
+  // Take ownership of a slot
+  // Parameters:
+  //   void
+  // Returns:
+  //   Slot* - slot owned by the caller until release_slot()
+  Slot *acquire_slot();
+
+  // Give a slot back (its snapshot must have ended)
+  // Parameters:
+  //   slot - slot to release
+  // Returns:
+  //   void
+  void release_slot( Slot *slot );
+
+  // Begin a snapshot at the currently visible timestamp
+  // Parameters:
+  //   slot - caller's slot
+  //   clock - commit clock
+  // Returns:
+  //   uint64_t - snapshot timestamp
+  uint64_t begin( Slot *slot, const CommitClock &clock );
+
+  // End the snapshot held in a slot
+  // Parameters:
+  //   slot - caller's slot
+  // Returns:
+  //   void
+  void end( Slot *slot ) { slot->ts.store( IDLE ); }
+
+  // Find the oldest timestamp any current or future snapshot may read at
+  // Parameters:
+  //   clock - commit clock
+  // Returns:
+  //   uint64_t - oldest readable timestamp
+  uint64_t oldest( const CommitClock &clock ) const;
+};
+
+// End of guards
+#endif // MVCC_H
@@ -0,0 +1,109 @@
+// ordered_index.cpp
+
+// Headers
+#include "ordered_index.h"
+
+// Constructor
+OrderedIndex::OrderedIndex()
+{
+}
+
+// Destructor
+OrderedIndex::~OrderedIndex()
+{
+}
+
+// Look up the value of a key
+// Parameters:
+//   key - key to look up
+//   value - set to the key's value if it is present
+//   version - set to the version the key was last written with
+// Returns:
+//   bool - true if the key is present, false otherwise
+bool OrderedIndex::get( std::string_view key, std::string &value, uint64_t &version ) const
+{
+  auto it = m_map.find( key );
+  if ( it == m_map.end() ) {
+    return false;
+  }
+  value = it->second.value;
+  version = it->second.version;
+  return true;
+}
+
+// Look up the version a key was last written with
+// Parameters:
+//   key - key to look up
+//   version - set to the key's version if it is present
+// Returns:
+//   bool - true if the key is present, false otherwise
+bool OrderedIndex::get_version( std::string_view key, uint64_t &version ) const
+{
+  auto it = m_map.find( key );
+  if ( it == m_map.end() ) {
+    return false;
+  }
+  version = it->second.version;
+  return true;
+}
+
+// Check whether a key is present
+// Parameters:
+//   key - key to check
+// Returns:
+//   bool - true if the key is present, false otherwise
+bool OrderedIndex::contains( std::string_view key ) const
+{
+  return m_map.find( key ) != m_map.end();
+}
+
+// Insert a key or overwrite its value
+// Parameters:
+//   key - key to set
+//   value - new value (moved into the map)
+//   version - version to record for the key
+// Returns:
+//   void
+void OrderedIndex::put( std::string_view key, std::string value, uint64_t version )
+{
+  // one tree walk: lower_bound doubles as the insertion hint
+  auto it = m_map.lower_bound( key );
+  if ( it != m_map.end() && it->first == key ) {
+    it->second.value = std::move( value );
+    it->second.version = version;
+  } else {
+    m_map.emplace_hint( it, key, Record{ std::move( value ), version } );
+  }
+}
+
+// Remove a key
+// Parameters:
+//   key - key to remove
+// Returns:
+//   bool - true if the key was present, false otherwise
+bool OrderedIndex::erase( std::string_view key )
+{
+  auto it = m_map.find( key );
+  if ( it == m_map.end() ) {
+    return false;
+  }
+  m_map.erase( it );
+  return true;
+}
+
+// Visit keys in key order from a given key on, with their values and
+// versions, until the visitor says stop
+// Parameters:
+//   start - smallest key to visit
+//   visit - called with each key, its value and its version, until it
+//           returns false
+// Returns:
+//   void
+void OrderedIndex::scan_from( std::string_view start, const std::function<bool( std::string_view, std::string_view, uint64_t )> &visit ) const
+{
+  for ( auto it = m_map.lower_bound( start ); it != m_map.end(); ++it ) {
+    if ( !visit( it->first, it->second.value, it->second.version ) ) {
+      return;
+    }
+  }
+}
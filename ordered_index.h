@@ -0,0 +1,47 @@
+// ordered_index.h
+
+// Guards
+#ifndef ORDERED_INDEX_H
+#define ORDERED_INDEX_H
+
+// Headers
+#include <map>
+#include <string>
+#include <string_view>
+#include "storage_engine.h"
+
+// Storage engine keeping keys in a balanced tree, for tables that
+// need their keys in sorted order.
+class OrderedIndex : public StorageEngine {
+private:
+  // Value and version stored for one key
+  struct Record {
+    std::string value;
+    uint64_t version;
+  };
+
+  // Map of key-record pairs (std::less<> allows lookups by string_view)
+  std::map<std::string, Record, std::less<>> m_map;
+
+public:
+  // Constructor
+  OrderedIndex();
+
+  // Destructor
+  ~OrderedIndex() override;
+
+  using StorageEngine::get;
+  using StorageEngine::put;
+
+  bool get( std::string_view key, std::string &value, uint64_t &version ) const override;
+  bool get_version( std::string_view key, uint64_t &version ) const override;
+  bool contains( std::string_view key ) const override;
+  void put( std::string_view key, std::string value, uint64_t version ) override;
+  bool erase( std::string_view key ) override;
+  size_t size() const override { return m_map.size(); }
+  bool is_ordered() const override { return true; }
+  void scan_from( std::string_view start, const std::function<bool( std::string_view, std::string_view, uint64_t )> &visit ) const override;
+};
+
+// End of guards
+#endif // ORDERED_INDEX_H
@@ -0,0 +1,61 @@
+// read_set.cpp
+
+// Headers
+#include "read_set.h"
+#include "table.h"
+
+// Constructor
+ReadSet::ReadSet()
+{
+}
+
+// Destructor
+ReadSet::~ReadSet()
+{
+}
+
+// Record the version of a key that was read
+// Parameters:
+//   table - table read from
+//   key - key read
+//   version - version observed (0 if the key didn't exist)
+// Returns:
+//   void
+void ReadSet::record( Table *table, std::string_view key, uint64_t version )
+{
+  auto &reads = m_reads[table];
+  if ( reads.find( key ) == reads.end() ) {
+    reads.emplace( key, version );
+  }
+}
+
+// Add the (table, shard) pair of every key read to a list
+// Parameters:
+//   shards - list to append to
+// Returns:
+//   void
+void ReadSet::collect_shards( std::vector<std::pair<Table*, unsigned>> &shards ) const
+{
+  for ( auto &t : m_reads ) {
+    for ( auto &kv : t.second ) {
+      shards.emplace_back( t.first, Table::shard_of( kv.first ) );
+    }
+  }
+}
+
+// Check that no key read has been written since
+// Parameters:
+//   void
+// Returns:
+//   bool - true if every recorded version is still current
+bool ReadSet::validate() const
+{
+  for ( auto &t : m_reads ) {
+    for ( auto &kv : t.second ) {
+      if ( t.first->get_version( kv.first ) != kv.second ) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,75 @@
+// read_set.h
+
+// Guards
+#ifndef READ_SET_H
+#define READ_SET_H
+
+// Headers
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Forward declarations
+class Table;
+
+// Versions of the keys an optimistic transaction has read.  At COMMIT
+// the transaction is valid only if none of these keys has been written
+// since it was read.
+class ReadSet {
+private:
+  // Version observed for each key read, by table then key
+  // (std::less<> allows lookups by string_view)
+  std::map<Table*, std::map<std::string, uint64_t, std::less<>>> m_reads;
+
+  // Copy constructor
+  ReadSet( const ReadSet & );
+
+  // Assignment operator
+  ReadSet &operator=( const ReadSet & );
+
+public:
+  // Constructor
+  ReadSet();
+
+  // Destructor
+  ~ReadSet();
+
+  // Record the version of a key that was read.  Only the first read of
+  // a key is kept: if the key changed between two reads, validation
+  // fails anyway.
+  // Parameters:
+  //   table - table read from
+  //   key - key read
+  //   version - version observed (0 if the key didn't exist)
+  // Returns:
+  //   void
+  void record( Table *table, std::string_view key, uint64_t version );
+
+  // Add the (table, shard) pair of every key read to a list
+  // Parameters:
+  //   shards - list to append to
+  // Returns:
+  //   void
+  void collect_shards( std::vector<std::pair<Table*, unsigned>> &shards ) const;
+
+  // Check that no key read has been written since.  The caller must
+  // hold the lock of each key's shard.
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if every recorded version is still current
+  bool validate() const;
+
+  // Forget every recorded read
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void clear() { m_reads.clear(); }
+};
+
+// End of guards
+#endif // READ_SET_H
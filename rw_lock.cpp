@@ -0,0 +1,143 @@
+// rw_lock.cpp
+
+// Headers
+#include <cassert>
+#include "rw_lock.h"
+#include "guard.h"
+
+// Constructor
+RWLock::RWLock()
+  : m_state( 0 )
+  , m_waiters( 0 )
+  , m_writers( 0 )
+{
+  pthread_mutex_init( &m_mutex, nullptr );
+  pthread_cond_init( &m_cond, nullptr );
+}
+
+// Destructor
+RWLock::~RWLock()
+{
+  pthread_cond_destroy( &m_cond );
+  pthread_mutex_destroy( &m_mutex );
+}
+
+// Wake parked threads after the lock was released
+// Parameters:
+//   void
+// Returns:
+//   void
+void RWLock::wake_waiters()
+{
+  // A waiter registers in m_waiters before its final attempt to
+  // acquire, and the release happened before this load, so either we
+  // see the waiter here or its attempt sees the released state.
+  if ( m_waiters.load() > 0 ) {
+    Guard g( m_mutex );
+    pthread_cond_broadcast( &m_cond );
+  }
+}
+
+// Acquire exclusively, waiting if necessary
+// Parameters:
+//   void
+// Returns:
+//   void
+void RWLock::lock()
+{
+  if ( trylock() ) {
+    return;
+  }
+
+  // new readers hold off until the writer is through
+  m_writers++;
+  m_waiters++;
+  {
+    Guard g( m_mutex );
+    while ( !trylock() ) {
+      pthread_cond_wait( &m_cond, &m_mutex );
+    }
+  }
+  m_waiters--;
+  m_writers--;
+}
+
+// Acquire exclusively if nobody holds the lock
+// Parameters:
+//   void
+// Returns:
+//   bool - true if the lock was acquired, false otherwise
+bool RWLock::trylock()
+{
+  int expected = 0;
+  return m_state.compare_exchange_strong( expected, -1 );
+}
+
+// Release an exclusive hold
+// Parameters:
+//   void
+// Returns:
+//   void
+void RWLock::unlock()
+{
+  assert( m_state.load() == -1 );
+  m_state.store( 0 );
+  wake_waiters();
+}
+
+// Acquire shared, waiting if necessary
+// Parameters:
+//   void
+// Returns:
+//   void
+void RWLock::lock_shared()
+{
+  if ( trylock_shared() ) {
+    return;
+  }
+
+  m_waiters++;
+  {
+    Guard g( m_mutex );
+    while ( !trylock_shared() ) {
+      pthread_cond_wait( &m_cond, &m_mutex );
+    }
+  }
+  m_waiters--;
+}
+
+// Acquire shared if the lock is not held exclusively (nor awaited by
+// a caller of lock())
+// Parameters:
+//   void
+// Returns:
+//   bool - true if the lock was acquired, false otherwise
+bool RWLock::trylock_shared()
+{
+  if ( m_writers.load() > 0 ) {
+    return false;
+  }
+
+  int state = m_state.load( std::memory_order_relaxed );
+  while ( state >= 0 ) {
+    if ( m_state.compare_exchange_weak( state, state + 1 ) ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Release a shared hold
+// Parameters:
+//   void
+// Returns:
+//   void
+void RWLock::unlock_shared()
+{
+  assert( m_state.load() > 0 );
+
+  // only the last reader out can make the lock available to a writer
+  if ( m_state.fetch_sub( 1 ) == 1 ) {
+    wake_waiters();
+  }
+}
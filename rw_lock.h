@@ -0,0 +1,102 @@
+// rw_lock.h
+
+// Guards
+#ifndef RW_LOCK_H
+#define RW_LOCK_H
+
+// Headers
+#include <atomic>
+#include <pthread.h>
+
+// Reader/writer lock that is not tied to the thread that acquired it
+// (a transaction may lock on one worker thread and unlock on another).
+//
+// Uncontended acquire and release are a single atomic operation on
+// m_state, so concurrent readers never take a mutex.  The mutex and
+// condition variable are only used to park callers of the blocking
+// lock()/lock_shared() while the lock is unavailable.  While a caller
+// of lock() waits, new shared holders wait too, so a steady stream of
+// readers can't starve it.
+class RWLock {
+private:
+  // -1 if held exclusively, otherwise the number of shared holders
+  std::atomic<int> m_state;
+
+  // Number of threads parked in lock() or lock_shared()
+  std::atomic<int> m_waiters;
+
+  // Number of threads waiting in lock()
+  std::atomic<int> m_writers;
+
+  // Protects parking and wakeup of waiters
+  pthread_mutex_t m_mutex;
+
+  // Signaled whenever the lock becomes available
+  pthread_cond_t m_cond;
+
+  // Copy constructor
+  RWLock( const RWLock & );
+
+  // Assignment operator
+  RWLock &operator=( const RWLock & );
+
+  // Wake parked threads after the lock was released
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void wake_waiters();
+
+public:
+  // Constructor
+  RWLock();
+
+  // Destructor
+  ~RWLock();
+
+  // Acquire exclusively, waiting if necessary
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void lock();
+
+  // Acquire exclusively if nobody holds the lock
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if the lock was acquired, false otherwise
+  bool trylock();
+
+  // Release an exclusive hold
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void unlock();
+
+  // Acquire shared, waiting if necessary
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void lock_shared();
+
+  // Acquire shared if the lock is not held exclusively (nor awaited by
+  // a caller of lock())
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if the lock was acquired, false otherwise
+  bool trylock_shared();
+
+  // Release a shared hold
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void unlock_shared();
+};
+
+// End of guards
+#endif // RW_LOCK_H
@@ -1,32 +1,163 @@
 // Headers
 #include <iostream>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "csapp.h"
 #include "server.h"
 #include "exceptions.h"
 #include "guard.h"
 #include "table.h"
-#include <regex>
+#include "identifier.h"
+#include "snapshot_file.h"
+
+// This function checks whether a shard can take the server's own
+// writes (expiry and eviction), which skip a shard until it can
+// Parameters:
+//  table - table to write
+//  shard - shard index
+// Returns:
+//  bool - false if the shard's engine is behind, or has failed (it
+//  reported that when it did)
+static bool has_room(Table *table, unsigned shard) {
+    try {
+        return table->has_room(shard);
+    } catch (const StorageException&) {
+        return false;
+    }
+}
 
 // Constructor
-Server::Server() : listenfd(-1) {
-    // Initialize the mutex
-    pthread_mutex_init(&mutex, NULL);
+Server::Server(unsigned workers, ConcurrencyMode mode)
+    : listenfd(-1), epollfd(-1), wakefd(-1), num_workers(workers), concurrency_mode(mode),
+      eviction_requested(false), snapshot_interval(0), snapshot_requested(false) {
+    // Default to one worker per online CPU
+    if (num_workers == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = ncpus > 0 ? ncpus : 1;
+    }
+
+    // Initialize the work queue synchronization
+    pthread_mutex_init(&queue_mutex, NULL);
+    pthread_cond_init(&queue_cond, NULL);
+    pthread_mutex_init(&create_mutex, NULL);
+    pthread_mutex_init(&snapshot_mutex, NULL);
+    pthread_cond_init(&snapshot_cond, NULL);
+    pthread_mutex_init(&eviction_mutex, NULL);
+    pthread_cond_init(&eviction_cond, NULL);
+
+    // Transactions waiting for locks are retried when woken, not polled
+    lock_manager.set_wakeup([this](LockManager::TxnId txn) { wake_lock_waiter(txn); });
 }
 
 // Destructor
 Server::~Server() {
-    // Delete all the tables
-    for (auto& pair : tables) {
-        delete pair.second;
-    }
-
     // Close the listening socket
     if (listenfd != -1) {
         Close(listenfd);
     }
 
-    // Destroy the mutex
-    pthread_mutex_destroy(&mutex);
+    // Close the event loop descriptors
+    if (epollfd != -1) {
+        Close(epollfd);
+    }
+    if (wakefd != -1) {
+        Close(wakefd);
+    }
+
+    // Stop logging (the log writer flushes what is still buffered)
+    wal.reset();
+
+    // Destroy the work queue synchronization
+    pthread_cond_destroy(&queue_cond);
+    pthread_mutex_destroy(&queue_mutex);
+    pthread_mutex_destroy(&create_mutex);
+    pthread_cond_destroy(&eviction_cond);
+    pthread_mutex_destroy(&eviction_mutex);
+    pthread_cond_destroy(&snapshot_cond);
+    pthread_mutex_destroy(&snapshot_mutex);
+}
+
+// Applies the records of a log being replayed at startup: each table
+// is recreated and each committed write installed with a new commit
+// timestamp, in log order
+class Server::LogReplayer : public WriteAheadLog::Replayer {
+private:
+    Server *server;
+
+public:
+    LogReplayer(Server *server) : server(server) { }
+
+    void create_table(std::string_view name, StorageEngineKind engine, const MemoryBudget &budget) override {
+        Table *table = new Table(std::string(name), engine, budget);
+        if (!server->tables.add(table, server->commit_clock)) {
+            delete table;
+        }
+    }
+
+    void commit(const std::vector<WriteAheadLog::Write> &writes) override {
+        // An engine that fell behind is waited for before the commit
+        // starts (the error of one that failed ends the replay)
+        for (const WriteAheadLog::Write &w : writes) {
+            if (Table *table = server->tables.find(w.table)) {
+                table->wait_for_room(Table::shard_of(w.key));
+            }
+        }
+
+        // No other thread runs yet, so nothing needs to be locked
+        CommitGuard commit(server->commit_clock, []() { });
+        for (const WriteAheadLog::Write &w : writes) {
+            Table *table = server->tables.find(w.table);
+            if (table && w.erased) {
+                table->erase(w.key, commit.get_ts());
+            } else if (table) {
+                table->set(w.key, std::string(w.value), commit.get_ts(), w.deadline);
+            }
+        }
+    }
+};
+
+// This function loads the tables saved by the last snapshot, if any,
+// and enables snapshots
+// Parameters:
+//  path - image file written by snapshots
+//  interval - delay between periodic snapshots (seconds; 0 for
+//  snapshots only on request)
+// Returns:
+//  void (throws LogException if the image can't be read)
+void Server::open_snapshot(const std::string &path, unsigned interval) {
+    // Each table is served from its section of the mapped image until
+    // its keys are written, so nothing is read from disk here
+    std::shared_ptr<SnapshotFile> image = SnapshotFile::open(path);
+    for (size_t i = 0; image && i < image->num_tables(); i++) {
+        const SnapshotFile::Section &section = image->get_table(i);
+        Table *table = new Table(section.get_name(), section.get_engine_kind(), section.get_budget());
+        table->set_base(image, &section);
+        if (!tables.add(table, commit_clock)) {
+            delete table;
+        }
+    }
+
+    snapshot_path = path;
+    snapshot_interval = interval;
+}
+
+// This function replays a write-ahead log, recreating the tables and
+// committed writes it holds, then logs every later change to it
+// Parameters:
+//  path - log file (created if it doesn't exist)
+//  policy - when the log is flushed
+//  interval_ms - flush interval for WriteAheadLog::SyncPolicy::INTERVAL
+// Returns:
+//  void (throws LogException if the log can't be read or opened)
+void Server::open_log(const std::string &path, WriteAheadLog::SyncPolicy policy, unsigned interval_ms) {
+    std::unique_ptr<WriteAheadLog> log(new WriteAheadLog(policy, interval_ms));
+    log->set_on_durable([this](WriteAheadLog::Lsn lsn) { wake_durable_waiters(lsn); });
+    LogReplayer replayer(this);
+    log->open(path, replayer);
+    wal = std::move(log);
 }
 
 // This function listens for incoming connections
@@ -45,60 +176,662 @@ void Server::listen(const std::string &port) {
     }
 }
 
-// This function starts the server loop
+// This function starts the worker pool and runs the event loop, which
+// accepts connections and dispatches readable clients to the workers
 // Parameters:
 //  none
 // Returns:
 //  void
 void Server::server_loop() {
-    // Listen for incoming connections and create a new client connection
+    // Create the epoll instance and the wakeup eventfd
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollfd < 0 || wakefd < 0) {
+        throw CommException("Failed to create event loop");
+    }
+
+    // The listening socket must not block once its backlog is drained
+    int flags = fcntl(listenfd, F_GETFL, 0);
+    fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
+
+    // Watch the listening socket and the wakeup eventfd; their events
+    // are told apart from client events by the address in data.ptr
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listenfd;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &wakefd;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &ev);
+
+    // Start the worker pool
+    for (unsigned i = 0; i < num_workers; i++) {
+        pthread_t thr_id;
+        if (pthread_create(&thr_id, nullptr, client_worker, this) != 0) {
+            throw CommException("Could not create worker thread");
+        }
+        workers.push_back(thr_id);
+    }
+
+    // Start the garbage collector
+    if (pthread_create(&gc_thread, nullptr, gc_worker, this) != 0) {
+        throw CommException("Could not create garbage collector thread");
+    }
+
+    // Start the expiry thread
+    if (pthread_create(&expiry_thread, nullptr, expiry_worker, this) != 0) {
+        throw CommException("Could not create expiry thread");
+    }
+
+    // Start the eviction thread
+    if (pthread_create(&eviction_thread, nullptr, eviction_worker, this) != 0) {
+        throw CommException("Could not create eviction thread");
+    }
+
+    // Start the snapshot thread
+    if (!snapshot_path.empty() && pthread_create(&snapshot_thread, nullptr, snapshot_worker, this) != 0) {
+        throw CommException("Could not create snapshot thread");
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+
+    // Dispatch events until the server is killed
     while (true) {
-        // Accept a new connection
-        socklen_t clientlen = sizeof(struct sockaddr_storage);
+        // Collect the blocked requests to retry after this wait, which
+        // lasts no longer than it takes a parked lock waiter to time out
+        std::vector<ClientConnection*> retry;
+        int timeout;
+        pthread_mutex_lock(&queue_mutex);
+        retry.swap(deferred);
+        timeout = retry.empty() ? -1 : RETRY_DELAY_MS;
+        auto now = std::chrono::steady_clock::now();
+        for (const auto& waiter : lock_waiters) {
+            auto due = waiter.second.since + lock_manager.get_timeout();
+            int ms = due <= now ? 0 : std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1;
+            if (timeout < 0 || ms < timeout) {
+                timeout = ms;
+            }
+        }
+        pthread_mutex_unlock(&queue_mutex);
 
-        // Create a new client connection
-        struct sockaddr_storage clientaddr;
+        // Wait for events (briefly, if there are requests to retry)
+        int n = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            log_error("epoll_wait failed");
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listenfd) {
+                // New connections
+                accept_clients();
+            } else if (events[i].data.ptr == &wakefd) {
+                // Reset the wakeup counter
+                uint64_t count;
+                while (read(wakefd, &count, sizeof(count)) > 0) { }
+            } else {
+                // Client input (or hangup)
+                dispatch(static_cast<ClientConnection*>(events[i].data.ptr));
+            }
+        }
+
+        // Lock waiters nobody woke in time retry, to find they timed out
+        pthread_mutex_lock(&queue_mutex);
+        now = std::chrono::steady_clock::now();
+        for (auto it = lock_waiters.begin(); it != lock_waiters.end(); ) {
+            if (now - it->second.since >= lock_manager.get_timeout()) {
+                retry.push_back(it->second.client);
+                it = lock_waiters.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        pthread_mutex_unlock(&queue_mutex);
+
+        // Retry the blocked requests
+        for (ClientConnection *client : retry) {
+            dispatch(client);
+        }
+    }
+}
+
+// This function is the body of each worker thread: it services
+// client connections handed to it by the event loop
+// Parameters:
+//  arg - pointer to the server object
+// Returns:
+//  void
+void* Server::client_worker(void* arg) {
+    // Cast the argument to a Server pointer
+    Server *server = static_cast<Server*>(arg);
+
+    while (true) {
+        // Wait for a connection that has work to do
+        pthread_mutex_lock(&server->queue_mutex);
+        while (server->ready.empty()) {
+            pthread_cond_wait(&server->queue_cond, &server->queue_mutex);
+        }
+        ClientConnection *client = server->ready.front();
+        server->ready.pop_front();
+        pthread_mutex_unlock(&server->queue_mutex);
+
+        // Chat with the client
+        server->service(client);
+    }
+
+    // Return nullptr
+    return nullptr;
+}
+
+// This function is the body of the garbage collector thread: it
+// periodically frees old versions that no snapshot can read
+// Parameters:
+//  arg - pointer to the server object
+// Returns:
+//  void
+void* Server::gc_worker(void* arg) {
+    // Cast the argument to a Server pointer
+    Server *server = static_cast<Server*>(arg);
+
+    while (true) {
+        usleep(GC_INTERVAL_MS * 1000);
+        server->collect_garbage();
+    }
+
+    // Return nullptr
+    return nullptr;
+}
+
+// This function is the body of the expiry thread: it periodically
+// erases the keys whose deadlines have passed
+// Parameters:
+//  arg - pointer to the server object
+// Returns:
+//  void
+void* Server::expiry_worker(void* arg) {
+    // Cast the argument to a Server pointer
+    Server *server = static_cast<Server*>(arg);
+
+    while (true) {
+        usleep(EXPIRY_INTERVAL_MS * 1000);
+        server->expire_keys();
+    }
+
+    // Return nullptr
+    return nullptr;
+}
+
+// This function is the body of the eviction thread: it evicts keys
+// from the tables over their memory budgets
+// Parameters:
+//  arg - pointer to the server object
+// Returns:
+//  void
+void* Server::eviction_worker(void* arg) {
+    // Cast the argument to a Server pointer
+    Server *server = static_cast<Server*>(arg);
+
+    while (true) {
+        // Wait for a request, or for the interval to elapse
+        pthread_mutex_lock(&server->eviction_mutex);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += EVICTION_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!server->eviction_requested.load()) {
+            if (pthread_cond_timedwait(&server->eviction_cond, &server->eviction_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        server->eviction_requested.store(false);
+        pthread_mutex_unlock(&server->eviction_mutex);
+
+        // Keep going while writers outpace a pass (a pass erases a
+        // bounded batch from each shard, so locks are held briefly)
+        while (server->evict_keys() != 0) { }
+    }
+
+    // Return nullptr
+    return nullptr;
+}
+
+// This function asks the eviction thread for a pass
+// Parameters:
+//  none
+// Returns:
+//  void
+void Server::request_eviction() {
+    // Once requested, later writers needn't take the mutex until the
+    // pass starts
+    if (eviction_requested.load(std::memory_order_relaxed)) {
+        return;
+    }
+    Guard g(eviction_mutex);
+    eviction_requested.store(true);
+    pthread_cond_signal(&eviction_cond);
+}
 
+// This function is the body of the snapshot thread: it writes a
+// snapshot when one is requested or the snapshot interval elapses
+// Parameters:
+//  arg - pointer to the server object
+// Returns:
+//  void
+void* Server::snapshot_worker(void* arg) {
+    // Cast the argument to a Server pointer
+    Server *server = static_cast<Server*>(arg);
+
+    while (true) {
+        // Wait for a request, or for the interval to elapse
+        pthread_mutex_lock(&server->snapshot_mutex);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += server->snapshot_interval;
+        while (!server->snapshot_requested) {
+            if (server->snapshot_interval == 0) {
+                pthread_cond_wait(&server->snapshot_cond, &server->snapshot_mutex);
+            } else if (pthread_cond_timedwait(&server->snapshot_cond, &server->snapshot_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        server->snapshot_requested = false;
+        pthread_mutex_unlock(&server->snapshot_mutex);
+
+        try {
+            server->take_snapshot();
+        } catch (const LogException& ex) {
+            server->log_error(ex.what());
+        }
+    }
+
+    // Return nullptr
+    return nullptr;
+}
+
+// This function asks the snapshot thread to write a snapshot
+// Parameters:
+//  none
+// Returns:
+//  bool - false if snapshots are disabled
+bool Server::request_snapshot() {
+    if (snapshot_path.empty()) {
+        return false;
+    }
+
+    Guard g(snapshot_mutex);
+    snapshot_requested = true;
+    pthread_cond_signal(&snapshot_cond);
+    return true;
+}
+
+// This function saves every table, as of one point in time, to the
+// image file, then drops the log records the image makes redundant
+// Parameters:
+//  none
+// Returns:
+//  size_t - number of keys saved (throws LogException on failure)
+size_t Server::take_snapshot() {
+    // Start a new log file; the image will cover everything in the old
+    // one.  Creates are held off so that a table's CREATE record and
+    // its appearance in the directory are on the same side of the cut.
+    if (wal) {
+        Guard g(create_mutex);
+        wal->rotate();
+    }
+
+    // Every commit logged before the cut has already taken its
+    // timestamp; publishing a later one waits until they are all
+    // visible, so the snapshot below includes them
+    CommitGuard cut(commit_clock, []() { });
+    cut.finish();
+
+    // Read every table as of one snapshot (commits made meanwhile are
+    // in the new log file, and replaying them over the image is harmless)
+    SnapshotRegistry::Slot *slot = snapshots.acquire_slot();
+    uint64_t ts = snapshots.begin(slot, commit_clock);
+    std::vector<Table*> all;
+    tables.list(all);
+
+    size_t keys;
+    try {
+        keys = SnapshotFile::write(snapshot_path, all, ts);
+    } catch (const LogException&) {
+        snapshots.end(slot);
+        snapshots.release_slot(slot);
+        throw;
+    }
+    snapshots.end(slot);
+    snapshots.release_slot(slot);
+
+    // The records of the old log file are now redundant
+    if (wal) {
+        wal->remove_rotated();
+    }
+    return keys;
+}
+
+// This function frees, in every table, the old versions that no
+// current or future snapshot can read
+// Parameters:
+//  none
+// Returns:
+//  void
+void Server::collect_garbage() {
+    // Versions older than every snapshot's timestamp are unreachable;
+    // the latest commit bounds the snapshots of readers that may still
+    // see keys evicted by the last pass
+    uint64_t latest = commit_clock.visible();
+    uint64_t oldest = snapshots.oldest(commit_clock);
+
+    // Tables are never deleted while the server runs
+    std::vector<Table*> all;
+    tables.list(all);
+    for (Table *table : all) {
+        table->collect_garbage(oldest, latest);
+    }
+
+    // Table maps replaced by CREATE
+    tables.collect_garbage(oldest);
+}
+
+// This function erases, in every table, the keys whose deadlines have
+// passed
+// Parameters:
+//  none
+// Returns:
+//  size_t - number of keys erased
+size_t Server::expire_keys() {
+    uint64_t now = TimerWheel::now_ms();
+    size_t expired = 0;
+
+    // Tables are never deleted while the server runs
+    std::vector<Table*> all;
+    tables.list(all);
+    for (Table *table : all) {
+        for (unsigned i = 0; i < Table::NUM_SHARDS; i++) {
+            // A shard held by a transaction, or whose engine is
+            // behind, is tried again next time (its wheel keeps the
+            // keys until then)
+            if (!has_room(table, i) || !table->trylock(i)) {
+                continue;
+            }
+            std::vector<std::string> keys;
+            table->take_expired(i, now, keys);
+            if (keys.empty()) {
+                table->unlock(i);
+                continue;
+            }
+
+            // The erases commit together, and are logged while the
+            // shard is still locked.  A key that can't be erased (its
+            // base block is corrupt, say) is logged and skipped rather
+            // than ending the thread; it still reads as expired, and is
+            // tried again later.
+            CommitGuard commit(commit_clock, [table, i]() { table->unlock(i); });
+            WriteAheadLog::Record record(WriteAheadLog::Record::COMMIT);
+            size_t erased = 0;
+            for (const std::string &key : keys) {
+                try {
+                    table->erase_expired(key, commit.get_ts());
+                } catch (const std::exception &ex) {
+                    log_error("Failed to expire " + table->get_name() + "/" + key + ": " + ex.what());
+                    table->retry_expired(key, now + EXPIRY_RETRY_MS);
+                    continue;
+                }
+                record.add_erase(table->get_name(), key);
+                erased++;
+            }
+            try {
+                if (wal && erased != 0) {
+                    wal->append(record);
+                }
+            } catch (const std::exception &ex) {
+                log_error(ex.what());
+            }
+            expired += erased;
+        }
+    }
+    return expired;
+}
+
+// This function evicts the coldest keys from every table over its
+// memory budget
+// Parameters:
+//  none
+// Returns:
+//  size_t - number of keys evicted
+size_t Server::evict_keys() {
+    size_t evicted = 0;
+
+    // Tables are never deleted while the server runs
+    std::vector<Table*> all;
+    tables.list(all);
+    for (Table *table : all) {
+        if (table->get_budget().policy == EvictionPolicy::NOEVICTION || !table->is_full()) {
+            continue;
+        }
+        for (unsigned i = 0; i < Table::NUM_SHARDS; i++) {
+            // A shard held by a transaction, or whose engine is
+            // behind, is tried again next time
+            if (!table->is_full(i) || !has_room(table, i) || !table->trylock(i)) {
+                continue;
+            }
+
+            // The erases commit together, and are logged while the
+            // shard is still locked.  A key that can't be erased ends
+            // the batch (logged) rather than the thread; the keys
+            // erased before it are still logged.
+            CommitGuard commit(commit_clock, [table, i]() { table->unlock(i); });
+            std::vector<std::string> keys;
+            try {
+                table->evict(i, commit.get_ts(), keys);
+            } catch (const std::exception &ex) {
+                log_error("Failed to evict from " + table->get_name() + ": " + ex.what());
+            }
+            WriteAheadLog::Record record(WriteAheadLog::Record::COMMIT);
+            for (const std::string &key : keys) {
+                record.add_erase(table->get_name(), key);
+            }
+            try {
+                if (wal && !keys.empty()) {
+                    wal->append(record);
+                }
+            } catch (const std::exception &ex) {
+                log_error(ex.what());
+            }
+            evicted += keys.size();
+        }
+    }
+    return evicted;
+}
+
+// This function accepts every pending connection on the listening socket
+// Parameters:
+//  none
+// Returns:
+//  void
+void Server::accept_clients() {
+    while (true) {
         // Accept a new connection
-        int connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        int connfd = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
         // Check if the connection was accepted successfully
         if (connfd < 0) {
-            log_error("Failed to accept connection");
-            continue;
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("Failed to accept connection");
+            }
+            return;
         }
 
         // Create a new client connection
         ClientConnection* client = new ClientConnection(this, connfd);
 
-        // Create a new thread for the client
-        pthread_t thr_id;
+        // Watch the client; EPOLLONESHOT guarantees that only one worker
+        // at a time handles a given connection
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = client;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            log_error("Could not watch client connection");
+            delete client;
+        }
+    }
+}
+
+// This function hands a client connection to the worker pool
+// Parameters:
+//  client - client connection with work to do
+// Returns:
+//  void
+void Server::dispatch(ClientConnection *client) {
+    pthread_mutex_lock(&queue_mutex);
+    ready.push_back(client);
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
 
-        // Check if the thread was created successfully
-        if (pthread_create(&thr_id, nullptr, client_worker, client) != 0) {
-            log_error("Could not create client thread");
+// This function services a client connection on a worker thread,
+// then re-arms, defers or destroys it
+// Parameters:
+//  client - client connection to service
+// Returns:
+//  void
+void Server::service(ClientConnection *client) {
+    switch (client->chat_with_client()) {
+        case ClientConnection::ChatStatus::KEEP: {
+            // Wait for more input, or for room to send queued output (new
+            // requests aren't read until earlier replies have been sent)
+            struct epoll_event ev;
+            ev.events = (client->has_pending_output() ? EPOLLOUT : EPOLLIN) | EPOLLET | EPOLLONESHOT;
+            ev.data.ptr = client;
+            if (epoll_ctl(epollfd, EPOLL_CTL_MOD, client->get_fd(), &ev) < 0) {
+                log_error("Could not re-arm client connection");
+                delete client;
+            }
+            break;
+        }
+        case ClientConnection::ChatStatus::BLOCKED: {
+            // Retry the blocked request after the next event loop wait
+            pthread_mutex_lock(&queue_mutex);
+            bool first = deferred.empty();
+            deferred.push_back(client);
+            pthread_mutex_unlock(&queue_mutex);
+
+            // The event loop may be waiting with no timeout
+            if (first) {
+                wake_event_loop();
+            }
+            break;
+        }
+        case ClientConnection::ChatStatus::WAIT_LOCK: {
+            park_lock_waiter(client);
+            break;
+        }
+        case ClientConnection::ChatStatus::WAIT_DURABLE: {
+            park_durable_waiter(client);
+            break;
+        }
+        case ClientConnection::ChatStatus::CLOSE: {
+            // Closing the socket also removes it from the epoll set
             delete client;
+            break;
         }
     }
 }
 
-// This function creates a new client connection
+// This function parks a connection whose transaction is queued for a
+// lock, until the lock manager wakes the transaction
 // Parameters:
-//  arg - pointer to the server object
+//  client - client connection to park
 // Returns:
 //  void
-void* Server::client_worker(void* arg) {
-    // Detach the thread
-    pthread_detach(pthread_self());
+void Server::park_lock_waiter(ClientConnection *client) {
+    LockManager::TxnId txn = client->get_txn();
+    pthread_mutex_lock(&queue_mutex);
+    lock_waiters[txn] = LockWaiter{client, std::chrono::steady_clock::now()};
+    pthread_mutex_unlock(&queue_mutex);
 
-    // Cast the argument to a ClientConnection pointer
-    std::unique_ptr<ClientConnection> client(static_cast<ClientConnection*>(arg));
+    // The lock may have been let go before the connection was parked,
+    // when the wakeup found nobody to hand back
+    if (lock_manager.is_next(txn)) {
+        wake_lock_waiter(txn);
+    }
 
-    // Chat with the client
-    client->chat_with_client();
+    // The event loop must not wait past the new waiter's timeout
+    wake_event_loop();
+}
 
-    // Return nullptr
-    return nullptr;
+// This function hands the connection of a transaction woken by the lock
+// manager back to the worker pool, if it is parked
+// Parameters:
+//  txn - woken transaction
+// Returns:
+//  void
+void Server::wake_lock_waiter(LockManager::TxnId txn) {
+    // Called with the lock manager's mutex held, so it only queues the
+    // connection
+    pthread_mutex_lock(&queue_mutex);
+    auto it = lock_waiters.find(txn);
+    if (it != lock_waiters.end()) {
+        ready.push_back(it->second.client);
+        lock_waiters.erase(it);
+        pthread_cond_signal(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+// This function parks a connection whose replies wait for a log record
+// to be durable, until the log's writer has flushed it
+// Parameters:
+//  client - client connection to park
+// Returns:
+//  void
+void Server::park_durable_waiter(ClientConnection *client) {
+    WriteAheadLog::Lsn lsn = client->get_wait_lsn();
+    pthread_mutex_lock(&queue_mutex);
+    durable_waiters.emplace(lsn, client);
+    pthread_mutex_unlock(&queue_mutex);
+
+    // The record may have been flushed before the connection was
+    // parked, when the writer found nobody to hand back
+    if (wal->is_durable(lsn)) {
+        wake_durable_waiters(lsn);
+    }
+}
+
+// This function hands the connections waiting for log records up to one
+// just made durable back to the worker pool
+// Parameters:
+//  lsn - last durable log record
+// Returns:
+//  void
+void Server::wake_durable_waiters(WriteAheadLog::Lsn lsn) {
+    pthread_mutex_lock(&queue_mutex);
+    auto end = durable_waiters.upper_bound(lsn);
+    if (end != durable_waiters.begin()) {
+        for (auto it = durable_waiters.begin(); it != end; ++it) {
+            ready.push_back(it->second);
+        }
+        durable_waiters.erase(durable_waiters.begin(), end);
+        pthread_cond_broadcast(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+// This function wakes up the event loop
+// Parameters:
+//  none
+// Returns:
+//  void
+void Server::wake_event_loop() {
+    uint64_t one = 1;
+    ssize_t n = write(wakefd, &one, sizeof(one));
+    (void) n;
 }
 
 // This function logs an error message
@@ -114,33 +847,31 @@ void Server::log_error(const std::string &what) {
 // This function creates a new table
 // Parameters:
 //  name - table name
+//  engine - kind of storage engine for the table
+//  budget - memory budget of the table
 // Returns:
-//  void
-void Server::create_table(const std::string &name) {
+//  WriteAheadLog::Lsn - sequence number of the CREATE record (0 if
+//  logging is disabled)
+WriteAheadLog::Lsn Server::create_table(const std::string &name, StorageEngineKind engine, const MemoryBudget &budget) {
     // Check if the table name is valid
-    if (!std::regex_match(name, std::regex("^[A-Za-z0-9_]+$"))) {
+    if (!Identifier::is_identifier(name)) {
         throw InvalidMessage("Invalid table name");
     }
 
-    // Lock the mutex
-    if (tables.find(name) == tables.end()) {
-        // Create a new table if it does not exist
-        tables[name] = new Table(name);
-    } else {
-        // Throw an exception if the table already exists
+    // The directory can't change while creates are serialized, so the
+    // current map can be read without a snapshot
+    Guard g(create_mutex);
+    if (tables.find(name)) {
         throw InvalidMessage("table already exists");
     }
-}
 
-// This function finds a table
-// Parameters:
-//  name - table name
-// Returns:
-//  Table* - pointer to the table
-Table* Server::find_table(const std::string &name) {
-    // Find the table, if it exists in the map, otherwise return nullptr
-    Table* table = tables.count(name) ? tables[name] : nullptr;
-    
-    // Return the table
-    return table;
-}
\ No newline at end of file
+    // Log the table before anyone can write to it
+    WriteAheadLog::Lsn lsn = 0;
+    if (wal) {
+        WriteAheadLog::Record record = WriteAheadLog::Record::create_table(name, engine, budget);
+        lsn = wal->append(record);
+    }
+
+    tables.add(new Table(name, engine, budget), commit_clock);
+    return lsn;
+}
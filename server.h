@@ -3,26 +3,112 @@
 #define SERVER_H
 
 // Headers
+#include <atomic>
+#include <chrono>
 #include <map>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <pthread.h>
 #include <memory>
 #include <stack>
 #include <vector>
+#include <deque>
 #include "table.h"
 #include "client_connection.h"
+#include "mvcc.h"
+#include "lock_manager.h"
+#include "table_directory.h"
+#include "write_ahead_log.h"
+
+// How transactions are isolated from each other
+enum class ConcurrencyMode {
+    // Two-phase locking: a transaction locks the shard of every key it
+    // touches until it commits, and fails if a shard is already locked
+    LOCKING,
+    // Optimistic: a transaction locks nothing while it runs, and at
+    // COMMIT fails only if a key it read was written in the meantime
+    OPTIMISTIC,
+};
 
 class Server {
 private:
-    // Mutex to protect the stack
-    pthread_mutex_t mutex;
     // Variable to keep track of the client connections
     int listenfd;
+    // epoll instance watching the listening socket and all clients
+    int epollfd;
+    // eventfd used to wake up the event loop
+    int wakefd;
     // Variable to keep track of the transaction status
     bool inTransaction = false;
-    // Variable to keep track of the client connections
-    std::unordered_map<std::string, Table*> tables; 
+    // Number of worker threads in the pool
+    unsigned num_workers;
+    // How transactions are isolated from each other
+    ConcurrencyMode concurrency_mode;
+    // Worker threads
+    std::vector<pthread_t> workers;
+    // Mutex protecting the ready and deferred queues
+    pthread_mutex_t queue_mutex;
+    // Condition variable signaled when a connection becomes ready
+    pthread_cond_t queue_cond;
+    // Connections with input waiting to be handled by a worker
+    std::deque<ClientConnection*> ready;
+    // Connections whose current request is blocked and must be retried
+    std::vector<ClientConnection*> deferred;
+    // A connection whose transaction is queued for a lock
+    struct LockWaiter {
+        ClientConnection *client;
+        // When it was parked (it is retried once its wait could have
+        // timed out, even if nobody wakes it)
+        std::chrono::steady_clock::time_point since;
+    };
+    // Connections parked until the lock manager wakes their
+    // transactions, by transaction (protected by queue_mutex)
+    std::unordered_map<LockManager::TxnId, LockWaiter> lock_waiters;
+    // Connections parked until the log record their replies wait for is
+    // durable, by record (protected by queue_mutex)
+    std::multimap<WriteAheadLog::Lsn, ClientConnection*> durable_waiters;
+    // Tables by name (lock-free lookups)
+    TableDirectory tables;
+    // Hands out commit timestamps and tracks which are visible
+    CommitClock commit_clock;
+    // Snapshots currently held by readers
+    SnapshotRegistry snapshots;
+    // Thread freeing versions no snapshot can read any more
+    pthread_t gc_thread;
+    // Thread erasing keys whose deadlines have passed
+    pthread_t expiry_thread;
+    // Thread evicting keys from tables over their memory budgets
+    pthread_t eviction_thread;
+    // Mutex protecting eviction_requested
+    pthread_mutex_t eviction_mutex;
+    // Condition variable signaled when an eviction pass is requested
+    pthread_cond_t eviction_cond;
+    // Set when a write found a table over its memory budget (read
+    // without the mutex first, so writers seldom take it)
+    std::atomic<bool> eviction_requested;
+    // Shard locks of two-phase locking transactions
+    LockManager lock_manager;
+    // Log of committed changes (null unless logging is enabled)
+    std::unique_ptr<WriteAheadLog> wal;
+    // Mutex serializing table creation (so a CREATE is logged once)
+    pthread_mutex_t create_mutex;
+
+    // Image file written by snapshots (empty if snapshots are disabled)
+    std::string snapshot_path;
+    // Delay between periodic snapshots (seconds; 0 for none)
+    unsigned snapshot_interval;
+    // Thread writing snapshots
+    pthread_t snapshot_thread;
+    // Mutex protecting snapshot_requested
+    pthread_mutex_t snapshot_mutex;
+    // Condition variable signaled when a snapshot is requested
+    pthread_cond_t snapshot_cond;
+    // Set when a snapshot was requested by a client
+    bool snapshot_requested;
+
+    // Applies the records of a log being replayed at startup
+    class LogReplayer;
     
     // Prohibit copying and assignment
     // Copy Constructor
@@ -30,13 +116,116 @@ private:
     // Assignment Operator
     Server& operator=(const Server&);
 
+    // This function accepts every pending connection on the listening socket
+    // Parameters:
+    //  none
+    // Returns:
+    //  void
+    void accept_clients();
+
+    // This function hands a client connection to the worker pool
+    // Parameters:
+    //  client - client connection with work to do
+    // Returns:
+    //  void
+    void dispatch(ClientConnection *client);
+
+    // This function services a client connection on a worker thread,
+    // then re-arms, defers or destroys it
+    // Parameters:
+    //  client - client connection to service
+    // Returns:
+    //  void
+    void service(ClientConnection *client);
+
+    // This function parks a connection whose transaction is queued for
+    // a lock, until the lock manager wakes the transaction
+    // Parameters:
+    //  client - client connection to park
+    // Returns:
+    //  void
+    void park_lock_waiter(ClientConnection *client);
+
+    // This function hands the connection of a transaction woken by the
+    // lock manager back to the worker pool, if it is parked
+    // Parameters:
+    //  txn - woken transaction
+    // Returns:
+    //  void
+    void wake_lock_waiter(LockManager::TxnId txn);
+
+    // This function parks a connection whose replies wait for a log
+    // record to be durable, until the log's writer has flushed it
+    // Parameters:
+    //  client - client connection to park
+    // Returns:
+    //  void
+    void park_durable_waiter(ClientConnection *client);
+
+    // This function hands the connections waiting for log records up to
+    // one just made durable back to the worker pool
+    // Parameters:
+    //  lsn - last durable log record
+    // Returns:
+    //  void
+    void wake_durable_waiters(WriteAheadLog::Lsn lsn);
+
+    // This function wakes up the event loop
+    // Parameters:
+    //  none
+    // Returns:
+    //  void
+    void wake_event_loop();
+
 public:
+    // Event loop tuning
+    // Maximum number of events handled per epoll_wait call
+    static const int MAX_EVENTS = 64;
+    // Delay before a blocked request is retried (milliseconds)
+    static const int RETRY_DELAY_MS = 1;
+    // Delay between garbage collection passes (milliseconds)
+    static const int GC_INTERVAL_MS = 100;
+    // Delay between expiry passes (milliseconds; one tick of the
+    // tables' timer wheels)
+    static const int EXPIRY_INTERVAL_MS = TimerWheel::TICK_MS;
+    // Delay before a key that couldn't be expired is tried again
+    // (milliseconds)
+    static const int EXPIRY_RETRY_MS = 60000;
+    // Delay between eviction passes, unless one is requested sooner
+    // (milliseconds)
+    static const int EVICTION_INTERVAL_MS = 100;
+
     // Constructor
-    Server();
+    // Parameters:
+    //  workers - number of worker threads (0 means one per online CPU)
+    //  mode - how transactions are isolated from each other
+    Server(unsigned workers = 0, ConcurrencyMode mode = ConcurrencyMode::LOCKING);
 
     // Destructor
     ~Server();
 
+    // This function replays a write-ahead log, recreating the tables
+    // and committed writes it holds, then logs every later change to it
+    // (call before server_loop)
+    // Parameters:
+    //  path - log file (created if it doesn't exist)
+    //  policy - when the log is flushed
+    //  interval_ms - flush interval for WriteAheadLog::SyncPolicy::INTERVAL
+    // Returns:
+    //  void (throws LogException if the log can't be read or opened)
+    void open_log(const std::string &path, WriteAheadLog::SyncPolicy policy, unsigned interval_ms = 0);
+
+    // This function maps the image saved by the last snapshot, if any,
+    // as the read-only base layer of its tables, and enables snapshots
+    // (call before open_log and server_loop)
+    // Parameters:
+    //  path - image file written by snapshots
+    //  interval - delay between periodic snapshots (seconds; 0 for
+    //  snapshots only on request)
+    // Returns:
+    //  void (throws LogException if the image can't be read)
+    void open_snapshot(const std::string &path, unsigned interval = 0);
+
     // This function listens for incoming connections
     // Parameters:
     //  port - port number
@@ -44,20 +233,142 @@ public:
     //  void
     void listen(const std::string &port);
 
-    // This function starts the server loop
+    // This function starts the worker pool and runs the event loop, which
+    // accepts connections and dispatches readable clients to the workers
     // Parameters:
     //  none
     // Returns:
     //  void
     void server_loop();
 
-    // This function creates a new client connection
+    // This function is the body of each worker thread: it services
+    // client connections handed to it by the event loop
     // Parameters:
     //  arg - pointer to the server object
     // Returns:
     //  void
     static void* client_worker(void* arg);
 
+    // This function is the body of the garbage collector thread: it
+    // periodically frees old versions that no snapshot can read
+    // Parameters:
+    //  arg - pointer to the server object
+    // Returns:
+    //  void
+    static void* gc_worker(void* arg);
+
+    // This function is the body of the expiry thread: it periodically
+    // erases the keys whose deadlines have passed
+    // Parameters:
+    //  arg - pointer to the server object
+    // Returns:
+    //  void
+    static void* expiry_worker(void* arg);
+
+    // This function is the body of the eviction thread: it evicts keys
+    // from the tables over their memory budgets, periodically and
+    // whenever a write finds one
+    // Parameters:
+    //  arg - pointer to the server object
+    // Returns:
+    //  void
+    static void* eviction_worker(void* arg);
+
+    // This function asks the eviction thread for a pass (called by
+    // writers that find a table over its memory budget)
+    // Parameters:
+    //  none
+    // Returns:
+    //  void
+    void request_eviction();
+
+    // This function is the body of the snapshot thread: it writes a
+    // snapshot when one is requested or the snapshot interval elapses
+    // Parameters:
+    //  arg - pointer to the server object
+    // Returns:
+    //  void
+    static void* snapshot_worker(void* arg);
+
+    // This function asks the snapshot thread to write a snapshot
+    // Parameters:
+    //  none
+    // Returns:
+    //  bool - false if snapshots are disabled
+    bool request_snapshot();
+
+    // This function saves every table, as of one point in time, to the
+    // image file, then drops the log records the image makes redundant.
+    // It reads MVCC snapshots, so clients are never blocked.
+    // Parameters:
+    //  none
+    // Returns:
+    //  size_t - number of keys saved (throws LogException on failure)
+    size_t take_snapshot();
+
+    // This function frees, in every table, the old versions that no
+    // current or future snapshot can read
+    // Parameters:
+    //  none
+    // Returns:
+    //  void
+    void collect_garbage();
+
+    // This function erases, in every table, the keys whose deadlines
+    // have passed (they already read as missing; this frees them).
+    // Each shard's keys are erased by one commit, logged like a DEL.
+    // Parameters:
+    //  none
+    // Returns:
+    //  size_t - number of keys erased
+    size_t expire_keys();
+
+    // This function evicts, from every table over its memory budget
+    // (unless its policy is NOEVICTION), the coldest keys of the shards
+    // over their shares (see Table::evict()).  Each shard's keys are
+    // erased by one commit, logged like a DEL.
+    // Parameters:
+    //  none
+    // Returns:
+    //  size_t - number of keys evicted
+    size_t evict_keys();
+
+    // This function returns how transactions are isolated from each other
+    // Parameters:
+    //  none
+    // Returns:
+    //  ConcurrencyMode - the server's concurrency control mode
+    ConcurrencyMode get_concurrency_mode() const { return concurrency_mode; }
+
+    // This function returns the clock that orders commits
+    // Parameters:
+    //  none
+    // Returns:
+    //  CommitClock& - the server's commit clock
+    CommitClock& get_commit_clock() { return commit_clock; }
+
+    // This function returns the registry of readers' snapshots
+    // Parameters:
+    //  none
+    // Returns:
+    //  SnapshotRegistry& - the server's snapshot registry
+    SnapshotRegistry& get_snapshots() { return snapshots; }
+
+    // This function returns the lock manager of two-phase locking
+    // transactions
+    // Parameters:
+    //  none
+    // Returns:
+    //  LockManager& - the server's lock manager
+    LockManager& get_lock_manager() { return lock_manager; }
+
+    // This function returns the write-ahead log
+    // Parameters:
+    //  none
+    // Returns:
+    //  WriteAheadLog* - the log, or nullptr if logging is disabled
+    WriteAheadLog* get_log() { return wal.get(); }
+
     // This function logs an error message
     // Parameters:
     //  what - error message
@@ -68,16 +379,30 @@ public:
     // This function creates a new table
     // Parameters:
     //  name - table name
+    //  engine - kind of storage engine for the table
+    //  budget - memory budget of the table
     // Returns:
-    //  void
-    void create_table(const std::string &name);
+    //  WriteAheadLog::Lsn - sequence number of the CREATE record (0 if
+    //  logging is disabled)
+    WriteAheadLog::Lsn create_table(const std::string &name, StorageEngineKind engine = StorageEngineKind::HASH,
+                                    const MemoryBudget &budget = MemoryBudget());
 
-    // This function finds a table
+    // This function finds a table, without taking any lock.  The caller
+    // must hold a snapshot in the registry returned by get_snapshots()
+    // (see TableDirectory).
     // Parameters:
     //  name - table name
     // Returns:
     //  Table* - pointer to the table
-    Table* find_table(const std::string &name);
+    Table* find_table(std::string_view name) { return tables.find(name); }
+
+    // This function returns the table directory's epoch, which changes
+    // whenever a table is created (so cached lookups can be revalidated)
+    // Parameters:
+    //  none
+    // Returns:
+    //  uint64_t - current epoch
+    uint64_t get_table_epoch() const { return tables.epoch(); }
 };
 
 #endif // SERVER_H
\ No newline at end of file
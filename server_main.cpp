@@ -1,18 +1,110 @@
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
 #include "server.h"
+#include "lsm_engine.h"
+#include "exceptions.h"
 
 int main(int argc, char **argv)
 {
-  if ( argc != 2 ) {
-    std::cerr << "Usage: ./server <port>\n";
+  // Number of worker threads (0 means one per CPU)
+  unsigned workers = 0;
+  // Transaction concurrency control
+  ConcurrencyMode mode = ConcurrencyMode::LOCKING;
+  // Write-ahead log file (none by default) and when it is flushed
+  const char *log_path = nullptr;
+  WriteAheadLog::SyncPolicy sync_policy = WriteAheadLog::SyncPolicy::ALWAYS;
+  unsigned sync_interval_ms = 0;
+  // Snapshot image file (none by default) and seconds between snapshots
+  const char *snapshot_path = nullptr;
+  unsigned snapshot_interval = 0;
+  // Directory LSM tables keep their run files under
+  const char *run_dir = nullptr;
+
+  int opt;
+  bool bad_args = false;
+  while ( (opt = getopt( argc, argv, "w:m:l:f:s:i:d:" )) != -1 ) {
+    switch ( opt ) {
+    case 'w':
+      workers = std::atoi( optarg );
+      break;
+    case 'm':
+      if ( std::strcmp( optarg, "2pl" ) == 0 ) {
+        mode = ConcurrencyMode::LOCKING;
+      } else if ( std::strcmp( optarg, "occ" ) == 0 ) {
+        mode = ConcurrencyMode::OPTIMISTIC;
+      } else {
+        bad_args = true;
+      }
+      break;
+    case 'l':
+      log_path = optarg;
+      break;
+    case 'f':
+      if ( !WriteAheadLog::parse_policy( optarg, sync_policy, sync_interval_ms ) ) {
+        bad_args = true;
+      }
+      break;
+    case 's':
+      snapshot_path = optarg;
+      break;
+    case 'i':
+      snapshot_interval = std::atoi( optarg );
+      break;
+    case 'd':
+      run_dir = optarg;
+      break;
+    default:
+      bad_args = true;
+      break;
+    }
+  }
+
+  if ( bad_args || argc - optind != 1 ) {
+    std::cerr << "Usage: ./server [-w <workers>] [-m 2pl|occ] [-l <log file>] [-f always|never|<ms>]\n"
+                 "                [-s <snapshot file>] [-i <seconds>] [-d <directory>] <port>\n";
+    std::cerr << "Options:\n";
+    std::cerr << "  -w <workers>   number of worker threads (default: one per CPU)\n";
+    std::cerr << "  -m 2pl|occ     transaction concurrency control: two-phase locking\n";
+    std::cerr << "                 (default) or optimistic\n";
+    std::cerr << "  -l <log file>  write-ahead log: replayed at startup, then every\n";
+    std::cerr << "                 committed change is appended to it\n";
+    std::cerr << "  -f always|never|<ms>\n";
+    std::cerr << "                 when the log is flushed to disk: before each commit\n";
+    std::cerr << "                 is acknowledged (default), never, or every <ms>\n";
+    std::cerr << "                 milliseconds\n";
+    std::cerr << "  -s <snapshot file>\n";
+    std::cerr << "                 image of every table: loaded at startup, and written\n";
+    std::cerr << "                 by the SNAPSHOT command (and every -i seconds)\n";
+    std::cerr << "  -i <seconds>   delay between periodic snapshots (default: none)\n";
+    std::cerr << "  -d <directory> where tables created with the lsm engine keep\n";
+    std::cerr << "                 their data on disk (default: /tmp)\n";
     return 1;
   }
 
-  Server server;
+  if ( run_dir ) {
+    LsmEngine::set_directory( run_dir );
+  }
+
+  Server server( workers, mode );
 
   try {
-    server.listen( argv[1] );
+    // The image is loaded first: the log holds the changes made after it
+    if ( snapshot_path ) {
+      server.open_snapshot( snapshot_path, snapshot_interval );
+    }
+    if ( log_path ) {
+      server.open_log( log_path, sync_policy, sync_interval_ms );
+    }
+    server.listen( argv[optind] );
     server.server_loop();
+  } catch ( LogException &ex ) {
+    server.log_error( ex.what() );
+    return 1;
+  } catch ( StorageException &ex ) {
+    server.log_error( ex.what() );
+    return 1;
   } catch ( std::runtime_error &ex ) {
     server.log_error( "Fatal error starting server" );
     return 1;
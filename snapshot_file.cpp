@@ -0,0 +1,487 @@
+// snapshot_file.cpp
+
+// Headers
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot_file.h"
+#include "table.h"
+#include "write_ahead_log.h"
+#include "checksum.h"
+#include "exceptions.h"
+
+namespace {
+
+// First bytes of every image file
+const char MAGIC[8] = { 'P', 'K', 'V', 'S', 'N', 'A', 'P', '3' };
+
+// Size of the header: magic, table count, index CRC-32, index size
+const size_t HEADER_SIZE = 24;
+
+// Size of an index entry, not counting the table name and budget
+const size_t INDEX_ENTRY_SIZE = 25;
+
+// Size of a memory budget in an index entry: policy, most bytes
+const size_t BUDGET_SIZE = 9;
+
+// Read an integer from a possibly unaligned position
+// Parameters:
+//   p - first byte of the integer
+// Returns:
+//   T - the integer
+template<typename T>
+T load( const char *p )
+{
+  T v;
+  memcpy( &v, p, sizeof( v ) );
+  return v;
+}
+
+// Appends sections to an image file through a buffer, keeping the
+// checksum of each block of the current section
+class ImageWriter {
+private:
+  int m_fd;
+  std::string m_buf;
+  uint64_t m_pos;
+  uint32_t m_crc;
+  std::string m_block_crcs;
+  bool m_ok;
+
+  void add_block_crc()
+  {
+    m_block_crcs.append( reinterpret_cast<const char*>( &m_crc ), sizeof( m_crc ) );
+    m_crc = 0;
+  }
+
+public:
+  ImageWriter( int fd ) : m_fd( fd ), m_pos( 0 ), m_crc( 0 ), m_ok( true ) { }
+
+  // Append to the current section
+  void put( std::string_view data )
+  {
+    const size_t block = SnapshotFile::Section::BLOCK_BYTES;
+    for ( std::string_view rest = data; !rest.empty(); ) {
+      size_t n = std::min<size_t>( rest.size(), block - m_pos % block );
+      m_crc = crc32( rest.substr( 0, n ), m_crc );
+      m_pos += n;
+      rest.remove_prefix( n );
+      if ( m_pos % block == 0 ) {
+        add_block_crc();
+      }
+    }
+    put_raw( data );
+  }
+
+  template<typename T>
+  void put_int( T v )
+  {
+    put( std::string_view( reinterpret_cast<const char*>( &v ), sizeof( v ) ) );
+  }
+
+  // Append outside any section
+  void put_raw( std::string_view data )
+  {
+    m_buf.append( data );
+    if ( m_buf.size() >= SnapshotFile::WRITE_BUFFER_BYTES ) {
+      flush();
+    }
+  }
+
+  // End the current section: checksums of its blocks
+  std::string take_block_crcs()
+  {
+    if ( m_pos % SnapshotFile::Section::BLOCK_BYTES != 0 ) {
+      add_block_crc();
+    }
+    m_pos = 0;
+    std::string crcs;
+    crcs.swap( m_block_crcs );
+    return crcs;
+  }
+
+  // Write out the buffer; false if any write so far failed
+  bool flush()
+  {
+    size_t done = 0;
+    while ( m_ok && done < m_buf.size() ) {
+      ssize_t n = ::write( m_fd, m_buf.data() + done, m_buf.size() - done );
+      if ( n < 0 && errno != EINTR ) {
+        m_ok = false;
+      } else if ( n > 0 ) {
+        done += n;
+      }
+    }
+    m_buf.clear();
+    return m_ok;
+  }
+};
+
+}
+
+// Constructor
+// Parameters:
+//   name - table name
+//   engine - table's storage engine
+//   budget - table's memory budget
+//   data - section bytes
+//   block_crcs - CRC-32 of each block of the section
+//   crc - expected CRC-32 of the block checksums
+SnapshotFile::Section::Section( std::string_view name, StorageEngineKind engine, const MemoryBudget &budget, std::string_view data, std::string_view block_crcs, uint32_t crc )
+  : m_name( name )
+  , m_engine( engine )
+  , m_budget( budget )
+  , m_data( data )
+  , m_block_crcs( block_crcs )
+  , m_crc( crc )
+  , m_count( 0 )
+  , m_offsets( 0 )
+  , m_state( UNCHECKED )
+  , m_blocks( new std::atomic<uint8_t>[block_crcs.size() / sizeof( uint32_t )]() )
+{
+  // the entry offsets and key count must at least fit
+  if ( data.size() < sizeof( m_count ) ) {
+    m_state = CORRUPT;
+    return;
+  }
+  m_count = load<uint64_t>( data.data() + data.size() - sizeof( m_count ) );
+  if ( m_count > ( data.size() - sizeof( m_count ) ) / sizeof( uint64_t ) ) {
+    m_count = 0;
+    m_state = CORRUPT;
+    return;
+  }
+  m_offsets = data.size() - sizeof( m_count ) - m_count * sizeof( uint64_t );
+}
+
+// Verify the block checksums and the key count, the first time the
+// section is used
+// Parameters:
+//   void
+// Returns:
+//   void (throws LogException if the section is corrupt)
+void SnapshotFile::Section::check() const
+{
+  int state = m_state.load( std::memory_order_acquire );
+  if ( state == UNCHECKED ) {
+    // threads racing to check the section all reach the same verdict
+    // (the checksums are a thousandth of the section, so this is quick)
+    state = crc32( m_block_crcs ) == m_crc ? INTACT : CORRUPT;
+    m_state.store( state, std::memory_order_release );
+  }
+  if ( state == CORRUPT ) {
+    throw LogException( "Snapshot of table " + m_name + " is corrupt" );
+  }
+  check( m_data.size() - sizeof( m_count ), sizeof( m_count ) );
+}
+
+// Verify the blocks a range of the section lies in, the first time each
+// is read
+// Parameters:
+//   pos - first byte of the range
+//   len - length of the range
+// Returns:
+//   void (throws LogException if the range is corrupt)
+void SnapshotFile::Section::check( uint64_t pos, uint64_t len ) const
+{
+  if ( pos > m_data.size() || len > m_data.size() - pos ) {
+    throw LogException( "Snapshot of table " + m_name + " is corrupt" );
+  }
+  for ( uint64_t b = pos / BLOCK_BYTES; b * BLOCK_BYTES < pos + len; b++ ) {
+    int state = m_blocks[b].load( std::memory_order_acquire );
+    if ( state == UNCHECKED ) {
+      uint32_t crc = load<uint32_t>( m_block_crcs.data() + b * sizeof( uint32_t ) );
+      state = crc32( m_data.substr( b * BLOCK_BYTES, BLOCK_BYTES ) ) == crc ? INTACT : CORRUPT;
+      m_blocks[b].store( state, std::memory_order_release );
+    }
+    if ( state == CORRUPT ) {
+      throw LogException( "Snapshot of table " + m_name + " is corrupt" );
+    }
+  }
+}
+
+// Get an entry, checking the blocks it lies in
+// Parameters:
+//   i - entry index (less than size())
+//   key - set to the entry's key
+//   value - set to the entry's value
+//   deadline - set to the value's deadline (0 if none)
+// Returns:
+//   void (throws LogException if the section is corrupt)
+void SnapshotFile::Section::entry( uint64_t i, std::string_view &key, std::string_view &value, uint64_t &deadline ) const
+{
+  // each length is checked before it is used to find what follows
+  check( m_offsets + i * sizeof( uint64_t ), sizeof( uint64_t ) );
+  uint64_t pos = load<uint64_t>( m_data.data() + m_offsets + i * sizeof( uint64_t ) );
+  check( pos, sizeof( uint32_t ) );
+  uint32_t len = load<uint32_t>( m_data.data() + pos );
+  bool has_deadline = ( len & HAS_DEADLINE ) != 0;
+  len &= ~HAS_DEADLINE;
+  check( pos + sizeof( len ), len + sizeof( len ) );
+  key = m_data.substr( pos + sizeof( len ), len );
+  pos += sizeof( len ) + len;
+  len = load<uint32_t>( m_data.data() + pos );
+  check( pos + sizeof( len ), len + ( has_deadline ? sizeof( uint64_t ) : 0 ) );
+  value = m_data.substr( pos + sizeof( len ), len );
+  pos += sizeof( len ) + len;
+  deadline = has_deadline ? load<uint64_t>( m_data.data() + pos ) : 0;
+}
+
+// Find a key (binary search)
+// Parameters:
+//   key - key to find
+//   value - set to the key's value (a view into the mapped file)
+//   deadline - set to the value's deadline (0 if none)
+// Returns:
+//   bool - true if the key is in the section
+bool SnapshotFile::Section::find( std::string_view key, std::string_view &value, uint64_t &deadline ) const
+{
+  size_t i = lower_bound( key );
+  if ( i == m_count ) {
+    return false;
+  }
+  std::string_view k;
+  entry( i, k, value, deadline );
+  return k == key;
+}
+
+// Find the first key not less than a given key (binary search)
+// Parameters:
+//   key - key to look for
+// Returns:
+//   size_t - index of the entry, in key order (size() if every key is
+//   less)
+size_t SnapshotFile::Section::lower_bound( std::string_view key ) const
+{
+  check();
+
+  uint64_t lo = 0, hi = m_count;
+  while ( lo < hi ) {
+    uint64_t mid = lo + ( hi - lo ) / 2;
+    std::string_view k, value;
+    uint64_t deadline;
+    entry( mid, k, value, deadline );
+    if ( k < key ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Get the i-th entry, in key order
+// Parameters:
+//   i - entry index (less than size())
+//   key - set to the entry's key
+//   value - set to the entry's value
+//   deadline - set to the value's deadline (0 if none)
+// Returns:
+//   void
+void SnapshotFile::Section::get( size_t i, std::string_view &key, std::string_view &value, uint64_t &deadline ) const
+{
+  check();
+  entry( i, key, value, deadline );
+}
+
+// Constructor
+SnapshotFile::SnapshotFile()
+  : m_map( nullptr )
+  , m_length( 0 )
+{
+}
+
+// Destructor
+SnapshotFile::~SnapshotFile()
+{
+  if ( m_map != nullptr ) {
+    munmap( m_map, m_length );
+  }
+}
+
+// Write an image of some tables as of a snapshot timestamp
+// Parameters:
+//   path - image file
+//   tables - tables to save
+//   ts - snapshot timestamp
+// Returns:
+//   size_t - number of keys saved
+size_t SnapshotFile::write( const std::string &path, const std::vector<Table*> &tables, uint64_t ts )
+{
+  std::string tmp = path + ".tmp";
+  int fd = ::open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+  if ( fd < 0 ) {
+    throw LogException( "Could not create snapshot file " + tmp );
+  }
+
+  // Sections follow the header and index, which are written last
+  size_t index_size = 0;
+  for ( Table *table : tables ) {
+    index_size += INDEX_ENTRY_SIZE + table->get_name().size();
+    if ( table->get_budget().is_limited() ) {
+      index_size += BUDGET_SIZE;
+    }
+  }
+  uint64_t offset = HEADER_SIZE + index_size;
+  bool ok = lseek( fd, offset, SEEK_SET ) >= 0;
+
+  ImageWriter out( fd );
+  std::string index;
+  size_t keys = 0;
+  for ( Table *table : tables ) {
+    // Values are written as they are visited (a table's values needn't
+    // fit in memory); only the keys are kept, to sort the offsets
+    std::vector<std::pair<std::string, uint64_t>> entries;
+    uint64_t pos = 0;
+    table->scan_snapshot( ts, [&]( std::string_view key, std::string_view value, uint64_t deadline ) {
+      entries.emplace_back( key, pos );
+      out.put_int<uint32_t>( deadline != 0 ? key.size() | Section::HAS_DEADLINE : key.size() );
+      out.put( key );
+      out.put_int<uint32_t>( value.size() );
+      out.put( value );
+      pos += 2 * sizeof( uint32_t ) + key.size() + value.size();
+      if ( deadline != 0 ) {
+        out.put_int<uint64_t>( deadline );
+        pos += sizeof( uint64_t );
+      }
+    } );
+    std::sort( entries.begin(), entries.end() );
+
+    for ( auto &e : entries ) {
+      out.put_int<uint64_t>( e.second );
+    }
+    out.put_int<uint64_t>( entries.size() );
+    pos += sizeof( uint64_t ) * ( entries.size() + 1 );
+
+    std::string block_crcs = out.take_block_crcs();
+    out.put_raw( block_crcs );
+    uint32_t crc = crc32( block_crcs );
+    const MemoryBudget &budget = table->get_budget();
+    uint8_t engine = static_cast<uint8_t>( table->get_engine_kind() );
+    if ( budget.is_limited() ) {
+      engine |= Section::HAS_BUDGET;
+    }
+    uint32_t name_len = table->get_name().size();
+    index.append( reinterpret_cast<const char*>( &offset ), sizeof( offset ) );
+    index.append( reinterpret_cast<const char*>( &pos ), sizeof( pos ) );
+    index.append( reinterpret_cast<const char*>( &crc ), sizeof( crc ) );
+    index.append( reinterpret_cast<const char*>( &engine ), sizeof( engine ) );
+    index.append( reinterpret_cast<const char*>( &name_len ), sizeof( name_len ) );
+    index.append( table->get_name() );
+    if ( budget.is_limited() ) {
+      uint8_t policy = static_cast<uint8_t>( budget.policy );
+      index.append( reinterpret_cast<const char*>( &policy ), sizeof( policy ) );
+      index.append( reinterpret_cast<const char*>( &budget.max_bytes ), sizeof( budget.max_bytes ) );
+    }
+
+    offset += pos + block_crcs.size();
+    keys += entries.size();
+  }
+  ok = out.flush() && ok;
+
+  std::string header( MAGIC, sizeof( MAGIC ) );
+  uint32_t count = tables.size();
+  uint32_t index_crc = crc32( index );
+  uint64_t size = index.size();
+  header.append( reinterpret_cast<const char*>( &count ), sizeof( count ) );
+  header.append( reinterpret_cast<const char*>( &index_crc ), sizeof( index_crc ) );
+  header.append( reinterpret_cast<const char*>( &size ), sizeof( size ) );
+  header += index;
+  ok = ok && pwrite( fd, header.data(), header.size(), 0 ) == static_cast<ssize_t>( header.size() );
+
+  // The image replaces the old one only once all of it is on disk
+  ok = ok && fsync( fd ) == 0;
+  ok = close( fd ) == 0 && ok;
+  if ( !ok || rename( tmp.c_str(), path.c_str() ) != 0 || !WriteAheadLog::sync_parent_directory( path ) ) {
+    unlink( tmp.c_str() );
+    throw LogException( "Could not write snapshot file " + path );
+  }
+
+  return keys;
+}
+
+// Map an image into memory
+// Parameters:
+//   path - image file
+// Returns:
+//   std::shared_ptr<SnapshotFile> - the image (null if there is none)
+std::shared_ptr<SnapshotFile> SnapshotFile::open( const std::string &path )
+{
+  int fd = ::open( path.c_str(), O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 ) {
+    if ( errno == ENOENT ) {
+      return nullptr;
+    }
+    throw LogException( "Could not open snapshot file " + path );
+  }
+
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 || static_cast<size_t>( st.st_size ) < HEADER_SIZE ) {
+    close( fd );
+    throw LogException( "Snapshot file " + path + " is corrupt" );
+  }
+
+  std::shared_ptr<SnapshotFile> image( new SnapshotFile );
+  image->m_length = st.st_size;
+  void *map = mmap( nullptr, image->m_length, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED ) {
+    throw LogException( "Could not map snapshot file " + path );
+  }
+  image->m_map = map;
+
+  // Lookups are binary searches, so read-ahead would be wasted
+  madvise( map, image->m_length, MADV_RANDOM );
+
+  // Check the header and index
+  std::string_view file( static_cast<const char*>( map ), image->m_length );
+  uint32_t count = load<uint32_t>( file.data() + 8 );
+  uint32_t index_crc = load<uint32_t>( file.data() + 12 );
+  uint64_t index_size = load<uint64_t>( file.data() + 16 );
+  if ( file.compare( 0, sizeof( MAGIC ), MAGIC, sizeof( MAGIC ) ) != 0 ||
+       index_size > file.size() - HEADER_SIZE ||
+       crc32( file.substr( HEADER_SIZE, index_size ) ) != index_crc ) {
+    throw LogException( "Snapshot file " + path + " is corrupt" );
+  }
+
+  std::string_view index = file.substr( HEADER_SIZE, index_size );
+  for ( uint32_t i = 0; i < count; i++ ) {
+    if ( index.size() < INDEX_ENTRY_SIZE ) {
+      throw LogException( "Snapshot file " + path + " is corrupt" );
+    }
+    uint64_t offset = load<uint64_t>( index.data() );
+    uint64_t size = load<uint64_t>( index.data() + 8 );
+    uint32_t crc = load<uint32_t>( index.data() + 16 );
+    uint8_t engine = static_cast<uint8_t>( index[20] );
+    uint32_t name_len = load<uint32_t>( index.data() + 21 );
+    index.remove_prefix( INDEX_ENTRY_SIZE );
+    bool has_budget = ( engine & Section::HAS_BUDGET ) != 0;
+    engine &= ~Section::HAS_BUDGET;
+    if ( name_len > index.size() || offset > file.size() || size > file.size() - offset ||
+         Section::block_crcs_size( size ) > file.size() - offset - size ||
+         engine > static_cast<uint8_t>( StorageEngineKind::LSM ) ) {
+      throw LogException( "Snapshot file " + path + " is corrupt" );
+    }
+    std::string_view name = index.substr( 0, name_len );
+    index.remove_prefix( name_len );
+
+    MemoryBudget budget;
+    if ( has_budget ) {
+      if ( index.size() < BUDGET_SIZE || static_cast<uint8_t>( index[0] ) > static_cast<uint8_t>( EvictionPolicy::LFU ) ) {
+        throw LogException( "Snapshot file " + path + " is corrupt" );
+      }
+      budget.policy = static_cast<EvictionPolicy>( index[0] );
+      budget.max_bytes = load<uint64_t>( index.data() + 1 );
+      index.remove_prefix( BUDGET_SIZE );
+    }
+
+    image->m_sections.emplace_back( new Section( name, static_cast<StorageEngineKind>( engine ), budget, file.substr( offset, size ),
+                                                 file.substr( offset + size, Section::block_crcs_size( size ) ), crc ) );
+  }
+
+  return image;
+}
@@ -0,0 +1,271 @@
+// snapshot_file.h
+
+// Guards
+#ifndef SNAPSHOT_FILE_H
+#define SNAPSHOT_FILE_H
+
+// Headers
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "storage_engine.h"
+#include "memory_budget.h"
+
+// Forward declarations
+class Table;
+
+// A point-in-time image of every table, saved to disk.
+//
+// The image is read from MVCC snapshots (see VersionStore), so writing
+// it takes no locks and never holds up clients.  A new image is written
+// to a temporary file and renamed over the old one once it is on disk,
+// so there is always one complete image.
+//
+// The file is laid out to be used in place: at startup it is mapped
+// into memory, and each table's section becomes the read-only base
+// layer of the table (see Table::set_base()), so nothing is read until
+// a key is looked up.  Layout (integers in host byte order):
+//
+//   header:  magic (8 bytes), table count (u32), CRC-32 of the
+//            index (u32), index size (u64)
+//   index:   per table: section offset (u64), section size (u64),
+//            CRC-32 of the section's block checksums (u32), engine
+//            kind (u8, top bit set if the table has a memory budget),
+//            name length (u32), name, then the budget if any: eviction
+//            policy (u8), most bytes (u64)
+//   section: the entries, in no particular order: key length (u32,
+//            top bit set if the value has a deadline), key, value
+//            length (u32), value, then the deadline if any (u64); then
+//            the offset of each entry from the start of the section,
+//            sorted by key (u64 each), then the key count (u64); then
+//            (not counted in the section size) the CRC-32 of each
+//            BLOCK_BYTES of the section, the last block maybe short
+//            (u32 each)
+//
+// The header and index are checked when the file is opened.  A
+// section's blocks are checked as they are first read, so a lookup in
+// a large image only pays for the blocks it touches.
+class SnapshotFile {
+public:
+  // One table's keys and values, sorted by key
+  class Section {
+  private:
+    // Table name
+    std::string m_name;
+
+    // Table's storage engine
+    StorageEngineKind m_engine;
+
+    // Table's memory budget
+    MemoryBudget m_budget;
+
+    // Section bytes (in the mapped file)
+    std::string_view m_data;
+
+    // CRC-32 of each block of the section (in the mapped file)
+    std::string_view m_block_crcs;
+
+    // Expected CRC-32 of the block checksums
+    uint32_t m_crc;
+
+    // Number of keys
+    uint64_t m_count;
+
+    // Position of the sorted entry offsets in the section
+    uint64_t m_offsets;
+
+    // UNCHECKED until a checksum is verified, then INTACT or CORRUPT:
+    // of the block checksums and key count, and of each block
+    enum State { UNCHECKED, INTACT, CORRUPT };
+    mutable std::atomic<int> m_state;
+    std::unique_ptr<std::atomic<uint8_t>[]> m_blocks;
+
+    // Verify the block checksums and the key count, the first time the
+    // section is used
+    // Parameters:
+    //   void
+    // Returns:
+    //   void (throws LogException if the section is corrupt)
+    void check() const;
+
+    // Verify the blocks a range of the section lies in, the first time
+    // each is read
+    // Parameters:
+    //   pos - first byte of the range
+    //   len - length of the range
+    // Returns:
+    //   void (throws LogException if the range is corrupt)
+    void check( uint64_t pos, uint64_t len ) const;
+
+    // Get an entry, checking the blocks it lies in
+    // Parameters:
+    //   i - entry index (less than size())
+    //   key - set to the entry's key
+    //   value - set to the entry's value
+    //   deadline - set to the value's deadline (0 if none)
+    // Returns:
+    //   void
+    void entry( uint64_t i, std::string_view &key, std::string_view &value, uint64_t &deadline ) const;
+
+  public:
+    // Flag in an entry's key length telling that a deadline follows
+    static const uint32_t HAS_DEADLINE = 1u << 31;
+
+    // Flag in an index entry's engine kind telling that a memory budget
+    // follows the name
+    static const uint8_t HAS_BUDGET = 1u << 7;
+
+    // Size of the blocks whose checksums are verified separately
+    static const size_t BLOCK_BYTES = 4096;
+
+    // Get the size of the checksums of a section's blocks
+    // Parameters:
+    //   size - section size
+    // Returns:
+    //   size_t - bytes taken by the checksums
+    static size_t block_crcs_size( uint64_t size ) { return ( size + BLOCK_BYTES - 1 ) / BLOCK_BYTES * sizeof( uint32_t ); }
+
+    // Constructor
+    // Parameters:
+    //   name - table name
+    //   engine - table's storage engine
+    //   budget - table's memory budget
+    //   data - section bytes
+    //   block_crcs - CRC-32 of each block of the section
+    //   crc - expected CRC-32 of the block checksums
+    Section( std::string_view name, StorageEngineKind engine, const MemoryBudget &budget, std::string_view data, std::string_view block_crcs, uint32_t crc );
+
+    // Get the table name
+    // Parameters:
+    //   void
+    // Returns:
+    //   const std::string& - table name
+    const std::string &get_name() const { return m_name; }
+
+    // Get the table's storage engine
+    // Parameters:
+    //   void
+    // Returns:
+    //   StorageEngineKind - kind of engine
+    StorageEngineKind get_engine_kind() const { return m_engine; }
+
+    // Get the table's memory budget
+    // Parameters:
+    //   void
+    // Returns:
+    //   const MemoryBudget& - the budget
+    const MemoryBudget &get_budget() const { return m_budget; }
+
+    // Get the number of keys
+    // Parameters:
+    //   void
+    // Returns:
+    //   size_t - number of keys
+    size_t size() const { return m_count; }
+
+    // Find a key (binary search)
+    // Parameters:
+    //   key - key to find
+    //   value - set to the key's value (a view into the mapped file)
+    //   deadline - set to the value's deadline (0 if none)
+    // Returns:
+    //   bool - true if the key is in the section
+    //   (throws LogException if the section is corrupt)
+    bool find( std::string_view key, std::string_view &value, uint64_t &deadline ) const;
+
+    // Find a key, ignoring its deadline
+    // Parameters:
+    //   key - key to find
+    //   value - set to the key's value
+    // Returns:
+    //   bool - true if the key is in the section
+    bool find( std::string_view key, std::string_view &value ) const
+    {
+      uint64_t deadline;
+      return find( key, value, deadline );
+    }
+
+    // Find the first key not less than a given key (binary search)
+    // Parameters:
+    //   key - key to look for
+    // Returns:
+    //   size_t - index of the entry, in key order (size() if every key
+    //   is less)
+    //   (throws LogException if the section is corrupt)
+    size_t lower_bound( std::string_view key ) const;
+
+    // Get the i-th entry, in key order
+    // Parameters:
+    //   i - entry index (less than size())
+    //   key - set to the entry's key
+    //   value - set to the entry's value
+    //   deadline - set to the value's deadline (0 if none)
+    // Returns:
+    //   void (throws LogException if the section is corrupt)
+    void get( size_t i, std::string_view &key, std::string_view &value, uint64_t &deadline ) const;
+  };
+
+private:
+  // Mapped file
+  void *m_map;
+  size_t m_length;
+
+  // Sections, one per table
+  std::vector<std::unique_ptr<Section>> m_sections;
+
+  // Constructor
+  SnapshotFile();
+
+  // Copy constructor
+  SnapshotFile( const SnapshotFile & );
+
+  // Assignment operator
+  SnapshotFile &operator=( const SnapshotFile & );
+
+public:
+  // Size of the buffer sections are written through
+  static const size_t WRITE_BUFFER_BYTES = 1 << 20;
+
+  // Destructor (unmaps the file)
+  ~SnapshotFile();
+
+  // Write an image of some tables as of a snapshot timestamp (the
+  // snapshot must be registered while the tables are read)
+  // Parameters:
+  //   path - image file
+  //   tables - tables to save
+  //   ts - snapshot timestamp
+  // Returns:
+  //   size_t - number of keys saved
+  //   (throws LogException if the image can't be written)
+  static size_t write( const std::string &path, const std::vector<Table*> &tables, uint64_t ts );
+
+  // Map an image into memory
+  // Parameters:
+  //   path - image file
+  // Returns:
+  //   std::shared_ptr<SnapshotFile> - the image (null if there is none)
+  //   (throws LogException if it can't be mapped or its index is corrupt)
+  static std::shared_ptr<SnapshotFile> open( const std::string &path );
+
+  // Get the number of tables
+  // Parameters:
+  //   void
+  // Returns:
+  //   size_t - number of tables
+  size_t num_tables() const { return m_sections.size(); }
+
+  // Get a table's section
+  // Parameters:
+  //   i - table index (less than num_tables())
+  // Returns:
+  //   const Section& - the section
+  const Section &get_table( size_t i ) const { return *m_sections[i]; }
+};
+
+// End of guards
+#endif // SNAPSHOT_FILE_H
@@ -0,0 +1,495 @@
+// sorted_run.cpp
+
+// Headers
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sorted_run.h"
+#include "checksum.h"
+#include "exceptions.h"
+
+namespace {
+
+// Last bytes of every run file
+const char MAGIC[8] = { 'P', 'K', 'V', 'R', 'U', 'N', '0', '1' };
+
+// Size of the footer
+const size_t FOOTER_SIZE = 44;
+
+// Bloom filter probes per key (ln 2 * bits per key)
+const unsigned FILTER_HASHES = 7;
+
+// Read an integer from a possibly unaligned position
+// Parameters:
+//   p - first byte of the integer
+// Returns:
+//   T - the integer
+template<typename T>
+T load( const char *p )
+{
+  T v;
+  memcpy( &v, p, sizeof( v ) );
+  return v;
+}
+
+// Append an integer to a buffer
+// Parameters:
+//   buf - buffer to append to
+//   v - integer to append
+// Returns:
+//   void
+template<typename T>
+void append_int( std::string &buf, T v )
+{
+  buf.append( reinterpret_cast<const char*>( &v ), sizeof( v ) );
+}
+
+// Append a length-prefixed string to a buffer
+// Parameters:
+//   buf - buffer to append to
+//   s - string to append
+// Returns:
+//   void
+void append_string( std::string &buf, std::string_view s )
+{
+  append_int<uint32_t>( buf, s.size() );
+  buf.append( s );
+}
+
+// Take a length-prefixed string off the front of some bytes
+// Parameters:
+//   data - bytes to read (advanced past the string)
+//   s - set to the string
+// Returns:
+//   bool - false if the bytes are too short
+bool take_string( std::string_view &data, std::string_view &s )
+{
+  if ( data.size() < sizeof( uint32_t ) ) {
+    return false;
+  }
+  uint32_t len = load<uint32_t>( data.data() );
+  if ( len > data.size() - sizeof( len ) ) {
+    return false;
+  }
+  s = data.substr( sizeof( len ), len );
+  data.remove_prefix( sizeof( len ) + len );
+  return true;
+}
+
+// Decode the entry at a position in a block
+// Parameters:
+//   block - block bytes
+//   pos - position of the entry (advanced past it)
+//   entry - set to the entry
+// Returns:
+//   bool - false if the block is malformed
+bool decode_entry( std::string_view block, size_t &pos, SortedRun::Entry &entry )
+{
+  std::string_view rest = block.substr( pos );
+  size_t before = rest.size();
+  if ( !take_string( rest, entry.key ) || !take_string( rest, entry.value ) ||
+       rest.size() < sizeof( uint64_t ) + 1 ) {
+    return false;
+  }
+  entry.version = load<uint64_t>( rest.data() );
+  entry.deleted = rest[sizeof( uint64_t )] != 0;
+  pos += before - rest.size() + sizeof( uint64_t ) + 1;
+  return true;
+}
+
+// Bit a filter probe tests
+// Parameters:
+//   hash - hash of the key
+//   i - probe number
+//   bits - number of bits in the filter
+// Returns:
+//   uint64_t - bit index
+uint64_t probe_bit( uint64_t hash, unsigned i, uint64_t bits )
+{
+  // double hashing: the two halves of one hash make every probe
+  uint64_t h1 = hash & 0xFFFFFFFFu, h2 = ( hash >> 32 ) | 1;
+  return ( h1 + i * h2 ) % bits;
+}
+
+// Build a Bloom filter
+// Parameters:
+//   hashes - hash of every key
+// Returns:
+//   std::string - filter bits
+std::string build_filter( const std::vector<uint64_t> &hashes )
+{
+  uint64_t bits = hashes.size() * SortedRun::FILTER_BITS_PER_KEY;
+  if ( bits < 64 ) {
+    bits = 64;
+  }
+  std::string filter( ( bits + 7 ) / 8, '\0' );
+  bits = filter.size() * 8;
+  for ( uint64_t hash : hashes ) {
+    for ( unsigned i = 0; i < FILTER_HASHES; i++ ) {
+      uint64_t bit = probe_bit( hash, i, bits );
+      filter[bit / 8] |= static_cast<char>( 1 << ( bit % 8 ) );
+    }
+  }
+  return filter;
+}
+
+}
+
+// Constructor
+// Parameters:
+//   dir - directory to create the file in
+SortedRun::Writer::Writer( const std::string &dir )
+  : m_path( dir + "/pkv-run-XXXXXX" )
+  , m_offset( 0 )
+{
+  m_fd = mkostemp( &m_path[0], O_CLOEXEC );
+  if ( m_fd < 0 ) {
+    throw StorageException( "Could not create a run file in " + dir );
+  }
+  unlink( m_path.c_str() );
+}
+
+// Destructor
+SortedRun::Writer::~Writer()
+{
+  if ( m_fd >= 0 ) {
+    close( m_fd );
+  }
+}
+
+// Write bytes at the end of the file
+// Parameters:
+//   data - bytes to write
+// Returns:
+//   void
+void SortedRun::Writer::write( std::string_view data )
+{
+  while ( !data.empty() ) {
+    ssize_t n = ::write( m_fd, data.data(), data.size() );
+    if ( n < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      throw StorageException( "Could not write run file " + m_path + ": " + strerror( errno ) );
+    }
+    data.remove_prefix( n );
+  }
+}
+
+// Write the current block and add it to the index
+// Parameters:
+//   void
+// Returns:
+//   void
+void SortedRun::Writer::finish_block()
+{
+  write( m_block );
+  append_int<uint64_t>( m_index, m_offset );
+  append_int<uint32_t>( m_index, m_block.size() );
+  append_int<uint32_t>( m_index, crc32( m_block ) );
+  append_string( m_index, m_last_key );
+  m_offset += m_block.size();
+  m_block.clear();
+}
+
+// Append an entry
+// Parameters:
+//   entry - entry to append (key greater than the last one)
+// Returns:
+//   void
+void SortedRun::Writer::add( const Entry &entry )
+{
+  // the index starts with the run's smallest key
+  if ( m_hashes.empty() ) {
+    append_string( m_index, entry.key );
+  }
+
+  append_string( m_block, entry.key );
+  append_string( m_block, entry.value );
+  append_int<uint64_t>( m_block, entry.version );
+  m_block.push_back( entry.deleted ? 1 : 0 );
+  m_last_key.assign( entry.key );
+  m_hashes.push_back( hash_key( entry.key ) );
+
+  if ( m_block.size() >= BLOCK_BYTES ) {
+    finish_block();
+  }
+}
+
+// Write the index, filter and footer, and open the run
+// Parameters:
+//   void
+// Returns:
+//   std::shared_ptr<SortedRun> - the new run
+std::shared_ptr<SortedRun> SortedRun::Writer::finish()
+{
+  if ( !m_block.empty() ) {
+    finish_block();
+  }
+
+  std::string filter = build_filter( m_hashes );
+  std::string footer;
+  append_int<uint64_t>( footer, m_offset );
+  append_int<uint64_t>( footer, m_index.size() );
+  append_int<uint64_t>( footer, filter.size() );
+  append_int<uint64_t>( footer, m_hashes.size() );
+  append_int<uint32_t>( footer, crc32( filter, crc32( m_index ) ) );
+  footer.append( MAGIC, sizeof( MAGIC ) );
+  write( m_index );
+  write( filter );
+  write( footer );
+
+  // No fsync: runs don't outlive the process
+  int fd = m_fd;
+  m_fd = -1;
+  return open( fd, m_path );
+}
+
+// Constructor (positioned at the first entry)
+// Parameters:
+//   run - run to read
+SortedRun::Iterator::Iterator( const SortedRun &run )
+  : m_run( &run )
+  , m_block( 0 )
+  , m_pos( 0 )
+  , m_valid( true )
+{
+  m_run->read_block( 0, m_data );
+  next();
+}
+
+// Constructor (positioned at the first entry not less than start)
+// Parameters:
+//   run - run to read
+//   start - key to start from
+SortedRun::Iterator::Iterator( const SortedRun &run, std::string_view start )
+  : m_run( &run )
+  , m_block( run.find_block( start ) )
+  , m_pos( 0 )
+  , m_valid( m_block < run.m_index.size() )
+{
+  if ( !m_valid ) {
+    return;
+  }
+  // the block's last key is not less than start, so this stops in it
+  m_run->read_block( m_block, m_data );
+  do {
+    next();
+  } while ( m_entry.key < start );
+}
+
+// Move to the next entry
+// Parameters:
+//   void
+// Returns:
+//   void
+void SortedRun::Iterator::next()
+{
+  if ( m_pos == m_data.size() ) {
+    if ( ++m_block == m_run->m_index.size() ) {
+      m_valid = false;
+      return;
+    }
+    m_run->read_block( m_block, m_data );
+    m_pos = 0;
+  }
+  if ( !decode_entry( m_data, m_pos, m_entry ) ) {
+    throw StorageException( "Run file " + m_run->m_path + " is corrupt" );
+  }
+}
+
+// Constructor
+SortedRun::SortedRun()
+  : m_fd( -1 )
+  , m_file_size( 0 )
+  , m_count( 0 )
+{
+}
+
+// Destructor
+SortedRun::~SortedRun()
+{
+  if ( m_fd >= 0 ) {
+    close( m_fd );
+  }
+}
+
+// Hash a key for the Bloom filter
+// Parameters:
+//   key - key to hash
+// Returns:
+//   uint64_t - hash of the key
+uint64_t SortedRun::hash_key( std::string_view key )
+{
+  // runs never outlive the process, so the hash needn't be stable
+  // across builds
+  return std::hash<std::string_view>()( key ) * 0x9E3779B97F4A7C15ULL;
+}
+
+// Open a run written by a Writer
+// Parameters:
+//   fd - run file
+//   path - name of the file, for messages
+// Returns:
+//   std::shared_ptr<SortedRun> - the run
+std::shared_ptr<SortedRun> SortedRun::open( int fd, const std::string &path )
+{
+  std::shared_ptr<SortedRun> run( new SortedRun );
+  run->m_path = path;
+  run->m_fd = fd;
+
+  off_t size = lseek( run->m_fd, 0, SEEK_END );
+  if ( size < static_cast<off_t>( FOOTER_SIZE ) ) {
+    throw StorageException( "Run file " + path + " is corrupt" );
+  }
+  run->m_file_size = size;
+
+  char footer[FOOTER_SIZE];
+  if ( pread( run->m_fd, footer, FOOTER_SIZE, size - FOOTER_SIZE ) != static_cast<ssize_t>( FOOTER_SIZE ) ) {
+    throw StorageException( "Could not read run file " + path );
+  }
+  uint64_t index_offset = load<uint64_t>( footer );
+  uint64_t index_size = load<uint64_t>( footer + 8 );
+  uint64_t filter_size = load<uint64_t>( footer + 16 );
+  run->m_count = load<uint64_t>( footer + 24 );
+  uint32_t crc = load<uint32_t>( footer + 32 );
+  if ( memcmp( footer + 36, MAGIC, sizeof( MAGIC ) ) != 0 ||
+       index_offset + index_size + filter_size + FOOTER_SIZE != run->m_file_size ) {
+    throw StorageException( "Run file " + path + " is corrupt" );
+  }
+
+  // The index and filter stay in memory
+  std::string meta( index_size + filter_size, '\0' );
+  if ( pread( run->m_fd, &meta[0], meta.size(), index_offset ) != static_cast<ssize_t>( meta.size() ) ) {
+    throw StorageException( "Could not read run file " + path );
+  }
+  if ( crc32( meta ) != crc ) {
+    throw StorageException( "Run file " + path + " is corrupt" );
+  }
+  run->m_filter = meta.substr( index_size );
+
+  std::string_view index( meta.data(), index_size ), first;
+  if ( !take_string( index, first ) ) {
+    throw StorageException( "Run file " + path + " is corrupt" );
+  }
+  run->m_first_key.assign( first );
+  while ( !index.empty() ) {
+    BlockHandle block;
+    std::string_view last;
+    if ( index.size() < 16 ) {
+      throw StorageException( "Run file " + path + " is corrupt" );
+    }
+    block.offset = load<uint64_t>( index.data() );
+    block.size = load<uint32_t>( index.data() + 8 );
+    block.crc = load<uint32_t>( index.data() + 12 );
+    index.remove_prefix( 16 );
+    if ( !take_string( index, last ) || block.offset + block.size > index_offset ) {
+      throw StorageException( "Run file " + path + " is corrupt" );
+    }
+    block.last_key.assign( last );
+    run->m_index.push_back( std::move( block ) );
+  }
+  if ( run->m_index.empty() || run->m_filter.empty() ) {
+    throw StorageException( "Run file " + path + " is corrupt" );
+  }
+
+  return run;
+}
+
+// Read and check a block
+// Parameters:
+//   i - block index
+//   data - set to the block's bytes
+// Returns:
+//   void
+void SortedRun::read_block( size_t i, std::string &data ) const
+{
+  const BlockHandle &block = m_index[i];
+  data.resize( block.size );
+  ssize_t n;
+  do {
+    n = pread( m_fd, &data[0], block.size, block.offset );
+  } while ( n < 0 && errno == EINTR );
+  if ( n != static_cast<ssize_t>( block.size ) ) {
+    throw StorageException( "Could not read run file " + m_path );
+  }
+  if ( crc32( data ) != block.crc ) {
+    throw StorageException( "Run file " + m_path + " is corrupt" );
+  }
+}
+
+// Check whether the filter may contain a key
+// Parameters:
+//   hash - hash of the key
+// Returns:
+//   bool - false if the key is certainly not in the run
+bool SortedRun::may_contain( uint64_t hash ) const
+{
+  uint64_t bits = m_filter.size() * 8;
+  for ( unsigned i = 0; i < FILTER_HASHES; i++ ) {
+    uint64_t bit = probe_bit( hash, i, bits );
+    if ( ( m_filter[bit / 8] & ( 1 << ( bit % 8 ) ) ) == 0 ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Find the first block whose last key is not less than a key
+// Parameters:
+//   key - key to look for
+// Returns:
+//   size_t - block index (the number of blocks if every key is less)
+size_t SortedRun::find_block( std::string_view key ) const
+{
+  size_t lo = 0, hi = m_index.size();
+  while ( lo < hi ) {
+    size_t mid = lo + ( hi - lo ) / 2;
+    if ( std::string_view( m_index[mid].last_key ) < key ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Find a key's entry
+// Parameters:
+//   key - key to find
+//   hash - hash of the key
+//   value - set to the entry's value
+//   version - set to the entry's version
+//   deleted - set if the entry is a tombstone
+// Returns:
+//   bool - true if the run has an entry for the key
+bool SortedRun::find( std::string_view key, uint64_t hash, std::string &value, uint64_t &version, bool &deleted ) const
+{
+  if ( key < std::string_view( m_first_key ) || key > std::string_view( largest() ) || !may_contain( hash ) ) {
+    return false;
+  }
+
+  std::string data;
+  read_block( find_block( key ), data );
+  size_t pos = 0;
+  Entry entry;
+  while ( pos < data.size() ) {
+    if ( !decode_entry( data, pos, entry ) ) {
+      throw StorageException( "Run file " + m_path + " is corrupt" );
+    }
+    int cmp = entry.key.compare( key );
+    if ( cmp == 0 ) {
+      value.assign( entry.value );
+      version = entry.version;
+      deleted = entry.deleted;
+      return true;
+    }
+    if ( cmp > 0 ) {
+      break;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,304 @@
+// sorted_run.h
+
+// Guards
+#ifndef SORTED_RUN_H
+#define SORTED_RUN_H
+
+// Headers
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// An immutable file of entries sorted by key: the unit an LsmEngine
+// keeps its data on disk in.
+//
+// Entries are grouped into blocks of about BLOCK_BYTES.  The block
+// index (the last key of every block) and a Bloom filter of the keys
+// are kept in memory while the run is open, so a lookup of a key the
+// run doesn't have usually reads nothing, and any other lookup reads
+// one block.  Layout (integers in host byte order):
+//
+//   blocks: per entry: key length (u32), key, value length (u32),
+//           value, version (u64), deleted flag (u8)
+//   index:  first key length (u32), first key, then per block: offset
+//           (u64), size (u32), CRC-32 of the block (u32), last key
+//           length (u32), last key
+//   filter: Bloom filter bits
+//   footer: index offset (u64), index size (u64), filter size (u64),
+//           entry count (u64), CRC-32 of the index and filter (u32),
+//           magic (8 bytes)
+//
+// Runs are scratch files: the engine's data is made durable by the
+// write-ahead log and snapshots, so a run's file is unlinked as soon as
+// it is created, and disappears when the run is closed (or the process
+// exits, however it exits).
+class SortedRun {
+public:
+  // Size blocks are filled up to
+  static const size_t BLOCK_BYTES = 4096;
+
+  // Bloom filter bits per key (about 1% false positives)
+  static const unsigned FILTER_BITS_PER_KEY = 10;
+
+  // An entry, as views into a block or memtable
+  struct Entry {
+    std::string_view key;
+    std::string_view value;
+    uint64_t version;
+    // Set for a tombstone: the key was erased
+    bool deleted;
+  };
+
+  // Writes a new run, one entry at a time in key order
+  class Writer {
+  private:
+    // File being written (already unlinked), and its name for messages
+    std::string m_path;
+    int m_fd;
+
+    // Block being filled
+    std::string m_block;
+
+    // Index built so far, and the last key added
+    std::string m_index;
+    std::string m_last_key;
+
+    // Hashes of every key added, for the filter
+    std::vector<uint64_t> m_hashes;
+
+    // Bytes of blocks written
+    uint64_t m_offset;
+
+    // Copy constructor
+    Writer( const Writer & );
+
+    // Assignment operator
+    Writer &operator=( const Writer & );
+
+    // Write the current block and add it to the index
+    // Parameters:
+    //   void
+    // Returns:
+    //   void (throws StorageException if it can't be written)
+    void finish_block();
+
+    // Write bytes at the end of the file
+    // Parameters:
+    //   data - bytes to write
+    // Returns:
+    //   void (throws StorageException if they can't be written)
+    void write( std::string_view data );
+
+  public:
+    // Constructor
+    // Parameters:
+    //   dir - directory to create the file in
+    // (throws StorageException if it can't be created)
+    Writer( const std::string &dir );
+
+    // Destructor (closes the file if the run wasn't finished)
+    ~Writer();
+
+    // Append an entry
+    // Parameters:
+    //   entry - entry to append (key greater than the last one)
+    // Returns:
+    //   void (throws StorageException if it can't be written)
+    void add( const Entry &entry );
+
+    // Get the number of entries added
+    // Parameters:
+    //   void
+    // Returns:
+    //   size_t - number of entries
+    size_t size() const { return m_hashes.size(); }
+
+    // Get the approximate size of the file so far
+    // Parameters:
+    //   void
+    // Returns:
+    //   uint64_t - bytes
+    uint64_t bytes() const { return m_offset + m_block.size(); }
+
+    // Write the index, filter and footer, and open the run (at least
+    // one entry must have been added)
+    // Parameters:
+    //   void
+    // Returns:
+    //   std::shared_ptr<SortedRun> - the new run
+    //   (throws StorageException if it can't be written)
+    std::shared_ptr<SortedRun> finish();
+  };
+
+  // Reads a run's entries in key order, one block at a time
+  class Iterator {
+  private:
+    const SortedRun *m_run;
+    size_t m_block;
+    std::string m_data;
+    size_t m_pos;
+    Entry m_entry;
+    bool m_valid;
+
+  public:
+    // Constructor (positioned at the first entry)
+    // Parameters:
+    //   run - run to read (must outlive the iterator)
+    // (throws StorageException if a block can't be read)
+    Iterator( const SortedRun &run );
+
+    // Constructor (positioned at the first entry whose key is not less
+    // than a given key)
+    // Parameters:
+    //   run - run to read (must outlive the iterator)
+    //   start - key to start from
+    // (throws StorageException if a block can't be read)
+    Iterator( const SortedRun &run, std::string_view start );
+
+    // Check whether the iterator is at an entry
+    // Parameters:
+    //   void
+    // Returns:
+    //   bool - false once every entry has been read
+    bool valid() const { return m_valid; }
+
+    // Get the current entry
+    // Parameters:
+    //   void
+    // Returns:
+    //   const Entry& - the entry (valid until next())
+    const Entry &entry() const { return m_entry; }
+
+    // Move to the next entry
+    // Parameters:
+    //   void
+    // Returns:
+    //   void (throws StorageException if a block can't be read)
+    void next();
+  };
+
+private:
+  // Where a block is and what its last key is
+  struct BlockHandle {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t crc;
+    std::string last_key;
+  };
+
+  // File (already unlinked), and its name for messages
+  std::string m_path;
+  int m_fd;
+
+  // Size of the file
+  uint64_t m_file_size;
+
+  // Number of entries
+  uint64_t m_count;
+
+  // Smallest key
+  std::string m_first_key;
+
+  // Block index, in key order
+  std::vector<BlockHandle> m_index;
+
+  // Bloom filter bits
+  std::string m_filter;
+
+  // Constructor
+  SortedRun();
+
+  // Copy constructor
+  SortedRun( const SortedRun & );
+
+  // Assignment operator
+  SortedRun &operator=( const SortedRun & );
+
+  // Open a run written by a Writer
+  // Parameters:
+  //   fd - run file (owned by the run from now on)
+  //   path - name of the file, for messages
+  // Returns:
+  //   std::shared_ptr<SortedRun> - the run
+  //   (throws StorageException if it can't be read or is corrupt)
+  static std::shared_ptr<SortedRun> open( int fd, const std::string &path );
+
+  // Find the first block whose last key is not less than a key
+  // Parameters:
+  //   key - key to look for
+  // Returns:
+  //   size_t - block index (the number of blocks if every key is less)
+  size_t find_block( std::string_view key ) const;
+
+  // Read and check a block
+  // Parameters:
+  //   i - block index
+  //   data - set to the block's bytes
+  // Returns:
+  //   void (throws StorageException if it can't be read or is corrupt)
+  void read_block( size_t i, std::string &data ) const;
+
+  // Check whether the filter may contain a key
+  // Parameters:
+  //   hash - hash of the key (see hash_key())
+  // Returns:
+  //   bool - false if the key is certainly not in the run
+  bool may_contain( uint64_t hash ) const;
+
+public:
+  // Destructor (closes the file, which deletes it)
+  ~SortedRun();
+
+  // Hash a key for the Bloom filter
+  // Parameters:
+  //   key - key to hash
+  // Returns:
+  //   uint64_t - hash of the key
+  static uint64_t hash_key( std::string_view key );
+
+  // Find a key's entry (may be called by any number of threads at once)
+  // Parameters:
+  //   key - key to find
+  //   hash - hash of the key (see hash_key())
+  //   value - set to the entry's value
+  //   version - set to the entry's version
+  //   deleted - set if the entry is a tombstone
+  // Returns:
+  //   bool - true if the run has an entry for the key
+  //   (throws StorageException if a block can't be read)
+  bool find( std::string_view key, uint64_t hash, std::string &value, uint64_t &version, bool &deleted ) const;
+
+  // Get the smallest key
+  // Parameters:
+  //   void
+  // Returns:
+  //   const std::string& - smallest key
+  const std::string &smallest() const { return m_first_key; }
+
+  // Get the largest key
+  // Parameters:
+  //   void
+  // Returns:
+  //   const std::string& - largest key
+  const std::string &largest() const { return m_index.back().last_key; }
+
+  // Get the number of entries
+  // Parameters:
+  //   void
+  // Returns:
+  //   uint64_t - number of entries (tombstones included)
+  uint64_t size() const { return m_count; }
+
+  // Get the size of the file
+  // Parameters:
+  //   void
+  // Returns:
+  //   uint64_t - bytes
+  uint64_t file_size() const { return m_file_size; }
+};
+
+// End of guards
+#endif // SORTED_RUN_H
@@ -0,0 +1,51 @@
+// storage_engine.cpp
+
+// Headers
+#include <cassert>
+#include "storage_engine.h"
+#include "hash_index.h"
+#include "ordered_index.h"
+#include "lsm_engine.h"
+
+// Create an empty engine of the given kind
+// Parameters:
+//   kind - kind of engine to create
+// Returns:
+//   StorageEngine* - new engine (owned by the caller)
+StorageEngine *StorageEngine::create( StorageEngineKind kind )
+{
+  switch ( kind ) {
+  case StorageEngineKind::HASH:
+    return new HashIndex();
+  case StorageEngineKind::ORDERED:
+    return new OrderedIndex();
+  case StorageEngineKind::LSM:
+    return new LsmEngine();
+  }
+
+  assert( false );
+  return nullptr;
+}
+
+// Look up an engine kind by the name used in CREATE requests
+// Parameters:
+//   name - engine name ("hash", "ordered" or "lsm")
+//   kind - set to the named kind if the name is known
+// Returns:
+//   bool - true if the name is known, false otherwise
+bool StorageEngine::parse_kind( std::string_view name, StorageEngineKind &kind )
+{
+  if ( name == "hash" ) {
+    kind = StorageEngineKind::HASH;
+    return true;
+  }
+  if ( name == "ordered" ) {
+    kind = StorageEngineKind::ORDERED;
+    return true;
+  }
+  if ( name == "lsm" ) {
+    kind = StorageEngineKind::LSM;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,186 @@
+// storage_engine.h
+
+// Guards
+#ifndef STORAGE_ENGINE_H
+#define STORAGE_ENGINE_H
+
+// Headers
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Kinds of storage engine a table can be created with
+enum class StorageEngineKind {
+  // Open-addressing hash index (default, fastest point lookups)
+  HASH,
+  // Ordered tree index (keys kept in sorted order)
+  ORDERED,
+  // Log-structured merge tree (most of the data kept on disk)
+  LSM,
+};
+
+// Committed key/value storage underneath a Table.  Engines are not
+// thread safe unless is_concurrent() says so: the owning Table
+// serializes access to them.
+class StorageEngine {
+private:
+  // Copy constructor
+  StorageEngine( const StorageEngine & );
+
+  // Assignment operator
+  StorageEngine &operator=( const StorageEngine & );
+
+public:
+  // Constructor
+  StorageEngine() { }
+
+  // Destructor
+  virtual ~StorageEngine() { }
+
+  // Look up the value of a key
+  // Parameters:
+  //   key - key to look up
+  //   value - set to the key's value if it is present
+  //   version - set to the version the key was last written with
+  // Returns:
+  //   bool - true if the key is present, false otherwise
+  virtual bool get( std::string_view key, std::string &value, uint64_t &version ) const = 0;
+
+  // Look up the value of a key
+  // Parameters:
+  //   key - key to look up
+  //   value - set to the key's value if it is present
+  // Returns:
+  //   bool - true if the key is present, false otherwise
+  bool get( std::string_view key, std::string &value ) const
+  {
+    uint64_t version;
+    return get( key, value, version );
+  }
+
+  // Look up the version a key was last written with
+  // Parameters:
+  //   key - key to look up
+  //   version - set to the key's version if it is present
+  // Returns:
+  //   bool - true if the key is present, false otherwise
+  virtual bool get_version( std::string_view key, uint64_t &version ) const = 0;
+
+  // Check whether a key is present
+  // Parameters:
+  //   key - key to check
+  // Returns:
+  //   bool - true if the key is present, false otherwise
+  virtual bool contains( std::string_view key ) const = 0;
+
+  // Insert a key or overwrite its value
+  // Parameters:
+  //   key - key to set
+  //   value - new value (moved into the engine)
+  //   version - version to record for the key
+  // Returns:
+  //   void
+  virtual void put( std::string_view key, std::string value, uint64_t version ) = 0;
+
+  // Insert a key or overwrite its value, with version 0
+  // Parameters:
+  //   key - key to set
+  //   value - new value (moved into the engine)
+  // Returns:
+  //   void
+  void put( std::string_view key, std::string value )
+  {
+    put( key, std::move( value ), 0 );
+  }
+
+  // Remove a key
+  // Parameters:
+  //   key - key to remove
+  // Returns:
+  //   bool - true if the key was present, false otherwise
+  virtual bool erase( std::string_view key ) = 0;
+
+  // Number of keys stored
+  // Parameters:
+  //   void
+  // Returns:
+  //   size_t - number of keys
+  virtual size_t size() const = 0;
+
+  // Check whether the engine may be read while it is being written.
+  // A Table reads such an engine without a latch, and can scan it.
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if reads and writes may overlap
+  virtual bool is_concurrent() const { return false; }
+
+  // Check whether the engine can take writes now.  An engine that
+  // writes to disk in the background falls behind under a heavy load;
+  // writers check this before they commit (holding no latch), and come
+  // back later if it says no.
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if writes won't outrun the engine
+  //   (throws StorageException if the engine has failed)
+  virtual bool has_room() const { return true; }
+
+  // Wait until the engine can take writes (for threads that hold
+  // nothing anyone else waits for, such as log replay)
+  // Parameters:
+  //   void
+  // Returns:
+  //   void (throws StorageException if the engine has failed)
+  virtual void wait_for_room() const { }
+
+  // Visit every key in key order, with its value and version (only
+  // engines that are concurrent can be scanned)
+  // Parameters:
+  //   visit - called with each key, its value and its version (the
+  //           views are only valid during the call)
+  // Returns:
+  //   void
+  virtual void scan( const std::function<void( std::string_view, std::string_view, uint64_t )> &visit ) const { }
+
+  // Check whether the engine keeps its keys in order, so a range of
+  // keys can be read without reading the others (see scan_from())
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if the engine can be scanned from a key
+  virtual bool is_ordered() const { return false; }
+
+  // Visit keys in key order, from the first not less than a given key,
+  // until the visitor says stop (only engines that are ordered; one
+  // that isn't concurrent must be latched against writers meanwhile)
+  // Parameters:
+  //   start - smallest key to visit
+  //   visit - called with each key, its value and its version (the
+  //           views are only valid during the call), until it returns
+  //           false
+  // Returns:
+  //   void
+  virtual void scan_from( std::string_view start, const std::function<bool( std::string_view, std::string_view, uint64_t )> &visit ) const { }
+
+  // Create an empty engine of the given kind
+  // Parameters:
+  //   kind - kind of engine to create
+  // Returns:
+  //   StorageEngine* - new engine (owned by the caller)
+  static StorageEngine *create( StorageEngineKind kind );
+
+  // Look up an engine kind by the name used in CREATE requests
+  // Parameters:
+  //   name - engine name ("hash", "ordered" or "lsm")
+  //   kind - set to the named kind if the name is known
+  // Returns:
+  //   bool - true if the name is known, false otherwise
+  static bool parse_kind( std::string_view name, StorageEngineKind &kind );
+};
+
+// End of guards
+#endif // STORAGE_ENGINE_H
@@ -1,28 +1,119 @@
 // table.cpp
 
 // Headers
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <cstdint>
+#include <functional>
 #include "table.h"
 #include "exceptions.h"
 //#include "guard.h"
 
 // Namespaces
-using std::mutex;
 using std::vector;
-using std::map;
+
+namespace {
+
+// An LFU access word holds the minute its counter was last decayed (16
+// bits), then a use counter (8 bits) that grows logarithmically: once
+// above LFU_INITIAL, by one with probability 1 / ((counter -
+// LFU_INITIAL) * LFU_LOG_FACTOR + 1).  The counter drops by one for
+// every LFU_DECAY_MINUTES the key goes unused.
+const uint32_t LFU_INITIAL = 5;
+const uint32_t LFU_LOG_FACTOR = 10;
+const uint32_t LFU_DECAY_MINUTES = 1;
+
+// Get a pseudo-random number (xorshift, one generator per thread)
+// Parameters:
+//   void
+// Returns:
+//   uint64_t - the number
+uint64_t next_random()
+{
+  static thread_local uint64_t state = 0x9E3779B97F4A7C15ULL ^ reinterpret_cast<uintptr_t>( &state );
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+// Get the LRU clock, which an LRU access word is set to on each use
+// Parameters:
+//   void
+// Returns:
+//   uint32_t - current time (seconds)
+uint32_t lru_clock()
+{
+  return static_cast<uint32_t>( TimerWheel::now_ms() / 1000 );
+}
+
+// Get the current minute, as LFU access words hold it
+// Parameters:
+//   void
+// Returns:
+//   uint32_t - current time (minutes, modulo 2^16)
+uint32_t lfu_minutes()
+{
+  return static_cast<uint32_t>( TimerWheel::now_ms() / 60000 ) & 0xFFFF;
+}
+
+// Get the use counter of an LFU access word, decayed to a minute
+// Parameters:
+//   access - the access word
+//   minutes - current minute (see lfu_minutes())
+// Returns:
+//   uint32_t - the counter
+uint32_t lfu_counter( uint32_t access, uint32_t minutes )
+{
+  uint32_t counter = access & 0xFF;
+  uint32_t decay = ( ( minutes - ( access >> 8 ) ) & 0xFFFF ) / LFU_DECAY_MINUTES;
+  return decay < counter ? counter - decay : 0;
+}
+
+}
 
 // Constructor
-Table::Table( const std::string &name )
+Table::Table( const std::string &name, StorageEngineKind engine, const MemoryBudget &budget )
   : m_name( name )
+  , m_engine_kind( engine )
+  , m_budget( budget )
+  , m_base( nullptr )
 {
-    pthread_mutex_init(&m_mutex, nullptr);
+  for ( Shard &shard : m_shards ) {
+    shard.engine.reset( StorageEngine::create( engine ) );
+    shard.bytes.store( 0, std::memory_order_relaxed );
+  }
 }
 
 // Destructor
 Table::~Table()
 {
-    // destroy the mutex
-    pthread_mutex_destroy(&m_mutex);
+}
+
+// Set the table's read-only base layer
+// Parameters:
+//   image - image the base layer is in (kept mapped by the table)
+//   section - the table's section of the image
+// Returns:
+//   void
+void Table::set_base( std::shared_ptr<const SnapshotFile> image, const SnapshotFile::Section *section )
+{
+  m_image = std::move( image );
+  m_base = section;
+}
+
+// Find the shard a key belongs to
+// Parameters:
+//   key - key to look up
+// Returns:
+//   unsigned - shard index (less than NUM_SHARDS)
+unsigned Table::shard_of( std::string_view key )
+{
+  // Fibonacci hashing takes the shard from the top bits of the hash,
+  // leaving the low bits (used by the hash index) uncorrelated
+  uint64_t hash = std::hash<std::string_view>()( key );
+  return static_cast<unsigned>( ( hash * 0x9E3779B97F4A7C15ULL ) >> ( 64 - SHARD_BITS ) );
 }
 
 // Lock functions
@@ -32,9 +123,10 @@ Table::~Table()
 //   void
 void Table::lock()
 {
-  // lock
-//   m_mutex.lock();
-  pthread_mutex_lock(&m_mutex);
+  // always in index order, so two whole-table lockers can't deadlock
+  for ( unsigned i = 0; i < NUM_SHARDS; i++ ) {
+    lock( i );
+  }
 }
 
 // Unlock functions
@@ -44,9 +136,9 @@ void Table::lock()
 //   void
 void Table::unlock()
 {
-  // unlock
-//   m_mutex.unlock();
-    pthread_mutex_unlock(&m_mutex); 
+  for ( unsigned i = 0; i < NUM_SHARDS; i++ ) {
+    unlock( i );
+  }
 }
 
 // Trylock functions
@@ -56,23 +148,381 @@ void Table::unlock()
 //   bool - true if lock can be acquired, false otherwise
 bool Table::trylock()
 {
-  // return if lock can be done
-  int lock = pthread_mutex_trylock(&m_mutex);
-  return lock == 0;
-  
+  for ( unsigned i = 0; i < NUM_SHARDS; i++ ) {
+    if ( !trylock( i ) ) {
+      // back out the shards already taken
+      while ( i > 0 ) {
+        unlock( --i );
+      }
+      return false;
+    }
+  }
+  return true;
 }
 
 // Set function
 // Parameters:
 //   key - key to set
-//   value - value to set
+//   value - value to set (moved into the table)
+//   ts - commit timestamp of the write
+//   deadline - when the value expires (0 for never)
 // Returns:
 //   void
-void Table::set( const std::string &key, const std::string &value )
+void Table::set( std::string_view key, std::string value, uint64_t ts, uint64_t deadline )
 {
-  // initially set the key, value in the temporary table
-  proposed_changes[key] = value;
-   
+  Shard &shard = m_shards[shard_of(key)];
+  restore_evicted(shard, key);
+  if (m_budget.is_limited()) {
+    // the new value's bytes replace the old one's
+    size_t bytes = shard.bytes.load(std::memory_order_relaxed) + entry_bytes(key, value.size());
+    shard.bytes.store(bytes - value_bytes(shard, key), std::memory_order_relaxed);
+  }
+  shard.versions.install(key, value, ts, deadline);
+  if (shard.engine->is_concurrent()) {
+    shard.engine->put(key, std::move(value), ts);
+  } else {
+    shard.latch.lock();
+    shard.engine->put(key, std::move(value), ts);
+    shard.latch.unlock();
+  }
+  if (deadline != 0) {
+    shard.timers.add(key, deadline);
+  }
+  touch(shard, key);
+}
+
+// Erase function
+// Parameters:
+//   key - key to erase
+//   ts - commit timestamp of the erase
+// Returns:
+//   bool - true if the key existed (nothing is written otherwise)
+bool Table::erase( std::string_view key, uint64_t ts )
+{
+  bool in_base;
+  if (!check_erase(key, in_base)) {
+    return false;
+  }
+  erase_checked(key, ts, in_base);
+  return true;
+}
+
+// Check whether a key can be erased
+// Parameters:
+//   key - key to check
+//   in_base - set to whether the key is in the base layer
+// Returns:
+//   bool - true if the key exists
+bool Table::check_erase( std::string_view key, bool &in_base )
+{
+  std::string_view base;
+  uint64_t deadline;
+  in_base = get_base(key, base, deadline);
+  return has_key(key);
+}
+
+// Erase a key check_erase() found
+// Parameters:
+//   key - key to erase
+//   ts - commit timestamp of the erase
+//   in_base - whether the key is in the base layer
+// Returns:
+//   void
+void Table::erase_checked( std::string_view key, uint64_t ts, bool in_base )
+{
+  remove(m_shards[shard_of(key)], key, ts, in_base);
+}
+
+// Erase a key that has a value
+// Parameters:
+//   shard - the key's shard
+//   key - key to erase
+//   ts - commit timestamp of the erase
+//   in_base - whether the key is in the base layer
+// Returns:
+//   void
+void Table::remove( Shard &shard, std::string_view key, uint64_t ts, bool in_base )
+{
+  // The tombstone hides the key from snapshots from ts on, while older
+  // ones still read its last value; a key with a base value keeps its
+  // tombstone for good, so the base value stays hidden
+  restore_evicted(shard, key);
+  if (m_budget.is_limited()) {
+    shard.bytes.store(shard.bytes.load(std::memory_order_relaxed) - value_bytes(shard, key), std::memory_order_relaxed);
+  }
+  shard.versions.erase(key, ts, in_base);
+
+  // An ordered engine drops the key, so range scans find its older
+  // values through erased instead (recorded first: scans read the
+  // engine before erased)
+  if (shard.engine->is_ordered()) {
+    shard.latch.lock();
+    shard.erased.insert_or_assign(std::string(key), ts);
+    shard.latch.unlock();
+  }
+  if (shard.engine->is_concurrent()) {
+    shard.engine->erase(key);
+  } else {
+    shard.latch.lock();
+    shard.engine->erase(key);
+    shard.latch.unlock();
+  }
+}
+
+// Take the keys of a shard whose deadlines have passed
+// Parameters:
+//   shard - shard index
+//   now - current time
+//   keys - the expired keys are appended
+// Returns:
+//   void
+void Table::take_expired( unsigned shard, uint64_t now, std::vector<std::string> &keys )
+{
+  std::vector<std::string> due;
+  m_shards[shard].timers.advance(now, due);
+
+  // A key may be due more than once, or have been written since (with
+  // a later deadline, which is in the wheel too, or none)
+  std::sort(due.begin(), due.end());
+  due.erase(std::unique(due.begin(), due.end()), due.end());
+  for (std::string &key : due) {
+    if (TimerWheel::is_expired(m_shards[shard].versions.deadline_of(key), now)) {
+      keys.push_back(std::move(key));
+    }
+  }
+}
+
+// Erase a key taken by take_expired()
+// Parameters:
+//   key - key to erase
+//   ts - commit timestamp of the erase
+// Returns:
+//   void
+void Table::erase_expired( std::string_view key, uint64_t ts )
+{
+  std::string_view base;
+  uint64_t deadline;
+  bool in_base = get_base(key, base, deadline);
+  remove(m_shards[shard_of(key)], key, ts, in_base);
+}
+
+// Hand a key taken by take_expired() back to its shard's timer wheel
+// Parameters:
+//   key - key that couldn't be erased
+//   when - when to take it again
+// Returns:
+//   void
+void Table::retry_expired( std::string_view key, uint64_t when )
+{
+  m_shards[shard_of(key)].timers.add(key, when);
+}
+
+// Erase the coldest keys of a shard until it is below its share of
+// the memory budget
+// Parameters:
+//   shard - shard index
+//   ts - commit timestamp of the erases
+//   keys - the keys erased are appended
+// Returns:
+//   void
+void Table::evict( unsigned shard, uint64_t ts, std::vector<std::string> &keys )
+{
+  // Each key erased is the coldest of a few sampled at random, which
+  // comes close to the coldest of all without keeping keys in order
+  Shard &s = m_shards[shard];
+  std::vector<std::pair<std::string, uint32_t>> sampled;
+  for (size_t n = 0; n < EVICTION_BATCH && is_full(shard); n++) {
+    sampled.clear();
+    s.versions.sample(next_random(), EVICTION_SAMPLES, sampled);
+    if (sampled.empty()) {
+      break;
+    }
+    auto coldest = std::max_element(sampled.begin(), sampled.end(),
+                                    [this](const std::pair<std::string, uint32_t> &a, const std::pair<std::string, uint32_t> &b) {
+                                      return coldness(a.second) < coldness(b.second);
+                                    });
+    std::string_view base;
+    uint64_t deadline;
+    bool in_base = get_base(coldest->first, base, deadline);
+    remove(s, coldest->first, ts, in_base);
+    keys.push_back(std::move(coldest->first));
+  }
+}
+
+// Get the bytes a key and its latest value in the storage engine take
+// Parameters:
+//   shard - the key's shard
+//   key - key to check
+// Returns:
+//   size_t - bytes taken
+size_t Table::value_bytes( const Shard &shard, std::string_view key ) const
+{
+  // with its evicted versions restored, the key's newest version is its
+  // value in the engine
+  size_t size;
+  return shard.versions.value_size(key, size) ? entry_bytes(key, size) : 0;
+}
+
+// Record a use of a key, for the eviction policy
+// Parameters:
+//   shard - the key's shard
+//   key - key used
+// Returns:
+//   void
+void Table::touch( const Shard &shard, std::string_view key ) const
+{
+  if (!m_budget.is_limited() || m_budget.policy == EvictionPolicy::NOEVICTION) {
+    return;
+  }
+
+  // keys only in the base layer take no memory, so have no word
+  std::atomic<uint32_t> *access = shard.versions.access_of(key);
+  if (access == nullptr) {
+    return;
+  }
+
+  // A hot key's word changes rarely (an LRU clock ticks once a second,
+  // and an LFU counter grows ever more slowly), so readers seldom write
+  // to a shared cache line.  Racing updates may lose one another.
+  uint32_t old = access->load(std::memory_order_relaxed);
+  uint32_t now;
+  if (m_budget.policy == EvictionPolicy::LRU) {
+    now = lru_clock();
+  } else {
+    uint32_t minutes = lfu_minutes();
+    uint32_t counter = old == 0 ? LFU_INITIAL : lfu_counter(old, minutes);
+    if (counter < 0xFF) {
+      uint32_t base = counter > LFU_INITIAL ? counter - LFU_INITIAL : 0;
+      if (next_random() % (base * LFU_LOG_FACTOR + 1) == 0) {
+        counter++;
+      }
+    }
+    now = minutes << 8 | counter;
+  }
+  if (now != old) {
+    access->store(now, std::memory_order_relaxed);
+  }
+}
+
+// Get how cold a key is, for the eviction policy
+// Parameters:
+//   access - the key's access word
+// Returns:
+//   uint32_t - the larger, the better a key is to evict
+uint32_t Table::coldness( uint32_t access ) const
+{
+  if (m_budget.policy == EvictionPolicy::LRU) {
+    // seconds since the key was last used
+    return lru_clock() - access;
+  }
+  return 0xFF - lfu_counter(access, lfu_minutes());
+}
+
+// Get the bytes the table's keys and values take
+// Parameters:
+//   void
+// Returns:
+//   size_t - bytes taken
+size_t Table::get_memory() const
+{
+  size_t bytes = 0;
+  for (const Shard &shard : m_shards) {
+    bytes += shard.bytes.load(std::memory_order_relaxed);
+  }
+  return bytes;
+}
+
+// Put the latest value of a key whose versions were evicted back into
+// the version store, before it is written
+// Parameters:
+//   shard - the key's shard (locked exclusively)
+//   key - key about to be written
+// Returns:
+//   void
+void Table::restore_evicted( Shard &shard, std::string_view key )
+{
+  if (!shard.versions.contains(key, UINT64_MAX)) {
+    // The key's versions were evicted: its latest value goes back in
+    // first, for snapshots older than the write
+    std::string old_value;
+    uint64_t old_version;
+    if (shard.engine->get(key, old_value, old_version)) {
+      shard.versions.install(key, old_value, old_version);
+    }
+  }
+}
+
+// Add to the integer value of a key
+// Parameters:
+//   key - key to change
+//   delta - amount to add
+//   ts - commit timestamp of the write
+// Returns:
+//   int64_t - the key's new value
+int64_t Table::increment( std::string_view key, int64_t delta, uint64_t ts )
+{
+  // read, add and write under the one lock the caller holds
+  std::string value;
+  uint64_t version;
+  int64_t result = delta;
+  uint64_t deadline = 0;
+  if (get(key, value, version)) {
+    result = add_integer(value, delta);
+    deadline = get_deadline(key);
+  }
+  set(key, std::to_string(result), ts, deadline);
+  return result;
+}
+
+// Set a key only if its value is the expected one
+// Parameters:
+//   key - key to change
+//   expected - value the key must have
+//   value - new value
+//   ts - commit timestamp of the write
+// Returns:
+//   bool - true if the key was set
+bool Table::compare_and_set( std::string_view key, std::string_view expected, std::string value, uint64_t ts )
+{
+  // compare and write under the one lock the caller holds
+  std::string current;
+  uint64_t version;
+  if (!get(key, current, version) || current != expected) {
+    return false;
+  }
+  set(key, std::move(value), ts, get_deadline(key));
+  return true;
+}
+
+// Add to a value holding a decimal integer
+// Parameters:
+//   value - the value
+//   delta - amount to add
+// Returns:
+//   int64_t - the sum
+int64_t Table::add_integer( std::string_view value, int64_t delta )
+{
+  int64_t n;
+  if (!parse_integer(value, n)) {
+    throw OperationException("value is not an integer");
+  }
+  if (__builtin_add_overflow(n, delta, &n)) {
+    throw OperationException("integer overflow");
+  }
+  return n;
+}
+
+// Parse a decimal integer
+// Parameters:
+//   text - text to parse
+//   value - set to the integer
+// Returns:
+//   bool - false if text isn't an integer or is out of range
+bool Table::parse_integer( std::string_view text, int64_t &value )
+{
+  const char *end = text.data() + text.size();
+  std::from_chars_result parsed = std::from_chars(text.data(), end, value);
+  return parsed.ec == std::errc() && parsed.ptr == end;
 }
 
 // Get function
@@ -80,20 +530,89 @@ void Table::set( const std::string &key, const std::string &value )
 //   key - key to get
 // Returns:
 //   std::string - value of the key
-std::string Table::get( const std::string &key )
+std::string Table::get( std::string_view key )
 {
-  // key can be gotten from either the temporary map or the actual table
-  if (m_map.count(key) == 0 && proposed_changes.count(key) == 0) {
-    throw std::invalid_argument("key not in table");
+  // one probe of the storage engine
+  std::string value;
+  const Shard &shard = m_shards[shard_of(key)];
+  if (shard.engine->get(key, value)) {
+    if (has_expired(shard, key)) {
+      throw std::invalid_argument("key not in table");
+    }
+    touch(shard, key);
+  } else {
+    // keys never written are served from the base layer
+    std::string_view base;
+    if (!get_latest_base(shard, key, base)) {
+      throw std::invalid_argument("key not in table");
+    }
+    value.assign(base);
   }
 
   // return the value of the key
-  if (proposed_changes.count(key) == 1) {
-    return proposed_changes[key];
+  return value;
+}
+
+// Get function, also reporting the key's version
+// Parameters:
+//   key - key to get
+//   value - set to the value of the key if it exists
+//   version - set to the key's version (see get_version())
+// Returns:
+//   bool - true if key exists, false otherwise
+bool Table::get( std::string_view key, std::string &value, uint64_t &version )
+{
+  const Shard &shard = m_shards[shard_of(key)];
+  if (shard.engine->get(key, value, version)) {
+    // an expired key keeps the version of its value until it is erased
+    if (has_expired(shard, key)) {
+      return false;
+    }
+    touch(shard, key);
+  } else {
+    version = 0;
+    std::string_view base;
+    if (!get_latest_base(shard, key, base)) {
+      version = shard.versions.erased_at(key);
+      return false;
+    }
+    value.assign(base);
   }
+  return true;
+}
 
-  // return the value of the key
-  return m_map[key];
+// Get the version of a key
+// Parameters:
+//   key - key to check
+// Returns:
+//   uint64_t - version of the key, or 0 if it doesn't exist
+uint64_t Table::get_version( std::string_view key )
+{
+  uint64_t version;
+  const Shard &shard = m_shards[shard_of(key)];
+  if (!shard.engine->get_version(key, version)) {
+    // an erased key's version is that of its erase, as a snapshot
+    // reads it
+    return shard.versions.erased_at(key);
+  }
+  return version;
+}
+
+// Get the deadline of a key's latest value
+// Parameters:
+//   key - key to check
+// Returns:
+//   uint64_t - the deadline, or 0 if the value has none or there is no
+//   value
+uint64_t Table::get_deadline( std::string_view key )
+{
+  const Shard &shard = m_shards[shard_of(key)];
+  if (shard.engine->contains(key)) {
+    return shard.versions.deadline_of(key);
+  }
+  std::string_view base;
+  uint64_t deadline;
+  return get_base(key, base, deadline) && shard.versions.erased_at(key) == 0 ? deadline : 0;
 }
 
 // Has key function
@@ -101,46 +620,354 @@ std::string Table::get( const std::string &key )
 //   key - key to check
 // Returns:
 //   bool - true if key exists, false otherwise
-bool Table::has_key( const std::string &key )
+bool Table::has_key( std::string_view key )
 {
-  // key exists in either the temporary map or the actual table
-  return (m_map.count(key) == 1) || (proposed_changes.count(key) == 1);
+  std::string_view base;
+  const Shard &shard = m_shards[shard_of(key)];
+  if (shard.engine->contains(key)) {
+    return !has_expired(shard, key);
+  }
+  return get_latest_base(shard, key, base);
 }
 
-// Commit changes
+// Snapshot get function
 // Parameters:
-//   void
+//   key - key to get
+//   ts - snapshot timestamp
+//   value - set to the value of the key as of the snapshot
+//   version - set to the commit timestamp of that value, or of the
+//             erase that removed the key (0 if neither)
+//   deadline - set to the value's deadline (0 if none)
 // Returns:
-//   void
-void Table::commit_changes()
+//   bool - true if key existed at the snapshot, false otherwise
+bool Table::get_snapshot( std::string_view key, uint64_t ts, std::string &value, uint64_t &version, uint64_t &deadline ) const
 {
-  // add data from temporary map to actual table
-  for (const auto& pair : proposed_changes) {
-    m_map[pair.first] = pair.second;
+  // A value whose deadline has passed is gone, whatever the snapshot
+  // (the erase that follows it just frees it)
+  const Shard &shard = m_shards[shard_of(key)];
+  if (read_written(shard, key, ts, value, version, deadline)) {
+    if (deadline != 0 && deadline <= TimerWheel::now_ms()) {
+      return false;
+    }
+    touch(shard, key);
+    return true;
   }
 
-  // clear the temporary map
-  proposed_changes.clear();
+  // The key hadn't been written yet: its value at ts is its base value
+  // (if any).  An erase hides the base value too.
+  std::string_view base;
+  if (version != 0 || !get_base(key, base, deadline)) {
+    return false;
+  }
+  if (deadline != 0 && deadline <= TimerWheel::now_ms()) {
+    return false;
+  }
+  value.assign(base);
+  return true;
 }
 
-// Rollback changes
+// Read a key's newest value written at or before a snapshot, ignoring
+// the base layer
 // Parameters:
+//   shard - the key's shard
+//   key - key to read
+//   ts - snapshot timestamp
+//   value - set to the value of the key as of the snapshot
+//   version - set to the commit timestamp of that value, or of the
+//             erase that removed the key (0 if neither)
+//   deadline - set to the value's deadline (0 if none)
+// Returns:
+//   bool - true if the key had a value written at the snapshot
+bool Table::read_written( const Shard &shard, std::string_view key, uint64_t ts, std::string &value, uint64_t &version, uint64_t &deadline ) const
+{
+  while (true) {
+    bool present;
+    if (shard.versions.read(key, ts, value, version, deadline, present)) {
+      return true;
+    }
+    if (present) {
+      // every version is newer than the snapshot
+      return false;
+    }
+
+    // The key was evicted (or never written): the engine has its latest
+    // value (evicted values have no deadline), which is the one at ts
+    // unless it was written since
+    deadline = 0;
+    if (!read_engine(shard, key, value, version)) {
+      version = 0;
+      return false;
+    }
+    if (version <= ts) {
+      return true;
+    }
+
+    // The write put the evicted versions back before reaching the
+    // engine, so the next lookup finds them
+  }
+}
+
+// Look up the latest value of a key in the engine without holding the
+// shard's lock
+// Parameters:
+//   shard - the key's shard
+//   key - key to look up
+//   value - set to the key's value
+//   version - set to the commit timestamp of the value
+// Returns:
+//   bool - true if the engine has the key
+bool Table::read_engine( const Shard &shard, std::string_view key, std::string &value, uint64_t &version ) const
+{
+  if ( shard.engine->is_concurrent() ) {
+    return shard.engine->get( key, value, version );
+  }
+  shard.latch.lock_shared();
+  bool found = shard.engine->get( key, value, version );
+  shard.latch.unlock_shared();
+  return found;
+}
+
+// Visit every key that had a value at a snapshot
+// Parameters:
+//   ts - snapshot timestamp
+//   visit - called with each key, its value at ts and its deadline
+// Returns:
 //   void
+void Table::scan_snapshot( uint64_t ts, const std::function<void( std::string_view, std::string_view, uint64_t )> &visit ) const
+{
+  uint64_t now = TimerWheel::now_ms();
+  auto visit_live = [&]( std::string_view key, std::string_view value, uint64_t deadline ) {
+    if ( !TimerWheel::is_expired( deadline, now ) ) {
+      visit( key, value, deadline );
+    }
+  };
+
+  for ( const Shard &shard : m_shards ) {
+    if ( !shard.engine->is_concurrent() ) {
+      // the engine can't be scanned while it may be written, so evicted
+      // keys are looked up in it one at a time
+      std::string value;
+      uint64_t version, deadline;
+      shard.versions.scan( ts, visit_live, [&]( std::string_view key ) {
+        if ( read_written( shard, key, ts, value, version, deadline ) ) {
+          visit_live( key, value, deadline );
+        }
+      } );
+      continue;
+    }
+
+    // Keys still in memory, then the engine's keys that aren't: an
+    // evicted key's value at ts is the engine's, unless the key has
+    // been written since (which puts its versions back)
+    std::vector<std::string_view> in_memory;
+    shard.versions.scan( ts, [&]( std::string_view key, std::string_view value, uint64_t deadline ) {
+      in_memory.push_back( key );
+      visit_live( key, value, deadline );
+    } );
+    std::sort( in_memory.begin(), in_memory.end() );
+
+    std::string value;
+    uint64_t version, deadline;
+    bool present;
+    shard.engine->scan( [&]( std::string_view key, std::string_view engine_value, uint64_t engine_version ) {
+      if ( std::binary_search( in_memory.begin(), in_memory.end(), key ) ) {
+        return;
+      }
+      if ( engine_version <= ts ) {
+        visit( key, engine_value, 0 );
+      } else if ( shard.versions.read( key, ts, value, version, deadline, present ) ) {
+        visit_live( key, value, deadline );
+      }
+    } );
+  }
+
+  // Base values not yet shadowed by a write (or erase) at ts
+  if ( m_base != nullptr ) {
+    std::string value;
+    uint64_t version, deadline;
+    for ( size_t i = 0; i < m_base->size(); i++ ) {
+      std::string_view key, base;
+      uint64_t base_deadline;
+      m_base->get( i, key, base, base_deadline );
+      if ( !read_written( m_shards[shard_of( key )], key, ts, value, version, deadline ) && version == 0 ) {
+        visit_live( key, base, base_deadline );
+      }
+    }
+  }
+}
+
+// Visit every key that had a value at a snapshot, without deadlines
+// Parameters:
+//   ts - snapshot timestamp
+//   visit - called with each key and its value at ts
 // Returns:
 //   void
-void Table::rollback_changes()
+void Table::scan_snapshot( uint64_t ts, const std::function<void( std::string_view, std::string_view )> &visit ) const
 {
-  // clear the temporary map
-  proposed_changes.clear();
+  scan_snapshot( ts, [&]( std::string_view key, std::string_view value, uint64_t ) {
+    visit( key, value );
+  } );
 }
 
-// Get mutex
+// Get the first keys of a range in key order, as of a snapshot
 // Parameters:
+//   ts - snapshot timestamp
+//   start - smallest key of the range
+//   end - key just past the range (empty for no upper bound)
+//   limit - most keys to get
+//   entries - set to the keys and their values at ts
+// Returns:
 //   void
+void Table::scan_range( uint64_t ts, std::string_view start, std::string_view end, size_t limit, std::vector<std::pair<std::string, std::string>> &entries ) const
+{
+  entries.clear();
+  if ( limit == 0 ) {
+    return;
+  }
+  auto key_less = []( const std::pair<std::string, std::string> &a, const std::pair<std::string, std::string> &b ) {
+    return a.first < b.first;
+  };
+
+  // A hash engine can't be read from a key on, so the whole snapshot is
+  // scanned, keeping a max-heap of the smallest keys in the range seen
+  // so far (only keys that may be returned are copied)
+  if ( !m_shards[0].engine->is_ordered() ) {
+    scan_snapshot( ts, [&]( std::string_view key, std::string_view value ) {
+      if ( key < start || ( !end.empty() && key >= end ) ) {
+        return;
+      }
+      if ( entries.size() == limit ) {
+        if ( key >= entries.front().first ) {
+          return;
+        }
+        std::pop_heap( entries.begin(), entries.end(), key_less );
+        entries.pop_back();
+      }
+      entries.emplace_back( key, value );
+      std::push_heap( entries.begin(), entries.end(), key_less );
+    } );
+    std::sort_heap( entries.begin(), entries.end(), key_less );
+    return;
+  }
+
+  // Once limit keys are found, keys past the last of them needn't be
+  // read, so each shard reads fewer than the one before
+  auto key_equal = []( const std::pair<std::string, std::string> &a, const std::pair<std::string, std::string> &b ) {
+    return a.first == b.first;
+  };
+  std::string last;
+  bool full = false;
+  auto keep_first = [&]() {
+    // (a key erased and written again since ts is found twice)
+    std::sort( entries.begin(), entries.end(), key_less );
+    entries.erase( std::unique( entries.begin(), entries.end(), key_equal ), entries.end() );
+    if ( entries.size() >= limit ) {
+      entries.resize( limit );
+      last = entries.back().first;
+      full = true;
+    }
+  };
+  auto in_range = [&]( std::string_view key ) {
+    return ( end.empty() || key < end ) && ( !full || key <= std::string_view( last ) );
+  };
+
+  // The first keys of each shard from the start of the range on: the
+  // engine's, then those erased since that ts may still read
+  uint64_t now = TimerWheel::now_ms();
+  std::string value;
+  uint64_t version, deadline;
+  bool present;
+  for ( const Shard &shard : m_shards ) {
+    size_t taken = 0;
+    auto take = [&]( std::string_view key, std::string_view key_value, uint64_t key_deadline ) {
+      if ( !TimerWheel::is_expired( key_deadline, now ) ) {
+        entries.emplace_back( key, key_value );
+        taken++;
+      }
+    };
+
+    bool latched = !shard.engine->is_concurrent();
+    if ( latched ) {
+      shard.latch.lock_shared();
+    }
+    shard.engine->scan_from( start, [&]( std::string_view key, std::string_view engine_value, uint64_t engine_version ) {
+      if ( !in_range( key ) ) {
+        return false;
+      }
+      // as in read_written(): an evicted key's value at ts is the
+      // engine's, unless the key has been written since (which puts
+      // its versions back)
+      if ( shard.versions.read( key, ts, value, version, deadline, present ) ) {
+        take( key, value, deadline );
+      } else if ( !present && engine_version <= ts ) {
+        take( key, engine_value, 0 );
+      }
+      return taken < limit;
+    } );
+    if ( latched ) {
+      shard.latch.unlock_shared();
+    }
+
+    taken = 0;
+    shard.latch.lock_shared();
+    for ( auto it = shard.erased.lower_bound( start ); it != shard.erased.end() && in_range( it->first ) && taken < limit; ++it ) {
+      if ( it->second > ts && shard.versions.read( it->first, ts, value, version, deadline, present ) ) {
+        take( it->first, value, deadline );
+      }
+    }
+    shard.latch.unlock_shared();
+    keep_first();
+  }
+
+  // Base values not yet shadowed by a write (or erase) at ts
+  if ( m_base != nullptr ) {
+    size_t taken = 0;
+    for ( size_t i = m_base->lower_bound( start ); i < m_base->size() && taken < limit; i++ ) {
+      std::string_view key, base;
+      uint64_t base_deadline;
+      m_base->get( i, key, base, base_deadline );
+      if ( !in_range( key ) ) {
+        break;
+      }
+      if ( !read_written( m_shards[shard_of( key )], key, ts, value, version, deadline ) && version == 0 &&
+           !TimerWheel::is_expired( base_deadline, now ) ) {
+        entries.emplace_back( key, base );
+        taken++;
+      }
+    }
+  }
+
+  keep_first();
+}
+
+// Free the old versions of keys that no snapshot can read any more
+// Parameters:
+//   oldest - oldest timestamp any current or future snapshot reads at
+//   latest - latest visible commit timestamp
 // Returns:
-//   pthread_mutex_t* - pointer to the mutex
-pthread_mutex_t* Table::get_mutex()
+//   size_t - number of versions freed
+size_t Table::collect_garbage( uint64_t oldest, uint64_t latest )
 {
-  // return the mutex
-  return &m_mutex;
-}
\ No newline at end of file
+  size_t freed = 0;
+  for ( unsigned i = 0; i < NUM_SHARDS; i++ ) {
+    // the shared lock keeps writers out while versions are unlinked,
+    // but never waits for one
+    if ( !trylock_shared( i ) ) {
+      continue;
+    }
+    // keys are evicted once every snapshot sees their latest value
+    Shard &shard = m_shards[i];
+    freed += shard.versions.prune( oldest, latest, true );
+
+    // an erase every snapshot sees hides the key from range scans too
+    if ( !shard.erased.empty() ) {
+      shard.latch.lock();
+      for ( auto it = shard.erased.begin(); it != shard.erased.end(); ) {
+        it = it->second <= oldest ? shard.erased.erase( it ) : std::next( it );
+      }
+      shard.latch.unlock();
+    }
+    unlock_shared( i );
+  }
+  return freed;
+}
@@ -5,26 +5,209 @@
 #define TABLE_H
 
 // Includes
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <memory>
 #include <string>
-#include <pthread.h>
-#include <mutex>
+#include <string_view>
+#include <utility>
 #include <vector>
+#include "storage_engine.h"
+#include "rw_lock.h"
+#include "version_store.h"
+#include "snapshot_file.h"
+#include "timer_wheel.h"
+#include "memory_budget.h"
 
 class Table {
+public:
+  // Number of shards each table is partitioned into
+  static const unsigned SHARD_BITS = 4;
+  static const unsigned NUM_SHARDS = 1u << SHARD_BITS;
+
+  // Bytes a key is reckoned to take besides its key and value (its
+  // engine entry, version and directory node, and the allocator's
+  // overhead), for the memory budget
+  static const size_t ENTRY_OVERHEAD = 256;
+
+  // Keys sampled for each one evicted
+  static const size_t EVICTION_SAMPLES = 5;
+
+  // Most keys evict() erases from a shard at once
+  static const size_t EVICTION_BATCH = 256;
+
 private:
+  // One partition of the table's keys.  Each shard has its own lock,
+  // so requests touching keys in different shards don't contend.
+  struct alignas(64) Shard {
+    // Reader/writer lock protecting the shard.  It is not tied to a
+    // thread because a transaction may lock a shard on one worker
+    // thread and unlock it on another.
+    RWLock lock;
+
+    // Latest committed key-value pairs (a key's version is the commit
+    // timestamp of its latest value)
+    std::unique_ptr<StorageEngine> engine;
+
+    // Keeps lock-free snapshot readers out of an engine that isn't
+    // concurrent (see StorageEngine::is_concurrent()), and out of
+    // erased, while a writer changes them; writers already hold the
+    // lock, so readers that hold the lock need not take this too
+    mutable RWLock latch;
+
+    // Keys an ordered engine dropped since the oldest snapshot, with
+    // the commit timestamp of their latest erase: range scans find the
+    // values older snapshots still read through them (see scan_range())
+    std::map<std::string, uint64_t, std::less<>> erased;
+
+    // Every committed value still visible to some snapshot, for
+    // lock-free snapshot reads.  Keys whose latest value every snapshot
+    // sees are evicted, and read from the engine.
+    VersionStore versions;
+
+    // Keys whose latest value has a deadline, by deadline (a key whose
+    // deadline changed may also be there with its old one)
+    TimerWheel timers;
+
+    // Bytes taken by the keys and values in the engine (only counted
+    // if the table has a memory budget; written under the exclusive
+    // lock, read without it)
+    std::atomic<size_t> bytes;
+  };
+
   // Member variables
   // Name of the table
   std::string m_name;
 
-  // Mutex for thread safety
-  pthread_mutex_t m_mutex;
+  // Kind of storage engine holding the committed data
+  StorageEngineKind m_engine_kind;
+
+  // Memory budget
+  MemoryBudget m_budget;
+
+  // Shards, indexed by shard_of(key)
+  Shard m_shards[NUM_SHARDS];
+
+  // Read-only base layer: the table's keys as saved by the snapshot it
+  // was loaded from (null if none).  A key written since shadows its
+  // base value; every other key is served from the mapped image.
+  std::shared_ptr<const SnapshotFile> m_image;
+  const SnapshotFile::Section *m_base;
+
+  // Look up a key in the base layer
+  // Parameters:
+  //   key - key to look up
+  //   value - set to the key's base value
+  //   deadline - set to the base value's deadline (0 if none)
+  // Returns:
+  //   bool - true if the key is in the base layer
+  bool get_base( std::string_view key, std::string_view &value, uint64_t &deadline ) const
+  {
+    return m_base != nullptr && m_base->find( key, value, deadline );
+  }
+
+  // Look up a key's latest base value (the shard's lock must be held):
+  // a key erased since has none, nor has one whose deadline has passed
+  // Parameters:
+  //   shard - the key's shard
+  //   key - key to look up
+  //   value - set to the key's base value
+  // Returns:
+  //   bool - true if the key is in the base layer, wasn't erased and
+  //   hasn't expired
+  bool get_latest_base( const Shard &shard, std::string_view key, std::string_view &value ) const
+  {
+    uint64_t deadline;
+    return get_base( key, value, deadline ) && shard.versions.erased_at( key ) == 0 &&
+           !TimerWheel::is_expired( deadline, TimerWheel::now_ms() );
+  }
+
+  // Check whether the latest value of a key in the storage engine has
+  // expired (the shard's lock must be held)
+  // Parameters:
+  //   shard - the key's shard
+  //   key - key to check (in the shard's engine)
+  // Returns:
+  //   bool - true if the value's deadline has passed
+  bool has_expired( const Shard &shard, std::string_view key ) const
+  {
+    // every key with a deadline is in the wheel until it is erased
+    return !shard.timers.empty() && TimerWheel::is_expired( shard.versions.deadline_of( key ), TimerWheel::now_ms() );
+  }
+
+  // Erase a key that has a value (the shard's exclusive lock must be
+  // held)
+  // Parameters:
+  //   shard - the key's shard
+  //   key - key to erase
+  //   ts - commit timestamp of the erase
+  //   in_base - whether the key is in the base layer (see get_base())
+  // Returns:
+  //   void
+  void remove( Shard &shard, std::string_view key, uint64_t ts, bool in_base );
+
+  // Get the bytes a key and its latest value in the storage engine take
+  // (the shard's exclusive lock must be held, and the key's evicted
+  // versions restored)
+  // Parameters:
+  //   shard - the key's shard
+  //   key - key to check
+  // Returns:
+  //   size_t - bytes taken (0 if the key has no value in the engine)
+  size_t value_bytes( const Shard &shard, std::string_view key ) const;
+
+  // Record a use of a key, for the eviction policy (no lock needed, but
+  // the key's versions must be readable: see VersionStore::access_of())
+  // Parameters:
+  //   shard - the key's shard
+  //   key - key used
+  // Returns:
+  //   void
+  void touch( const Shard &shard, std::string_view key ) const;
+
+  // Get how cold a key is, for the eviction policy
+  // Parameters:
+  //   access - the key's access word (see touch())
+  // Returns:
+  //   uint32_t - the larger, the better a key is to evict
+  uint32_t coldness( uint32_t access ) const;
+
+  // Put the latest value of a key whose versions were evicted back into
+  // the version store, before it is written
+  // Parameters:
+  //   shard - the key's shard (locked exclusively)
+  //   key - key about to be written
+  // Returns:
+  //   void
+  void restore_evicted( Shard &shard, std::string_view key );
+
+  // Read a key's newest value written at or before a snapshot, ignoring
+  // the base layer
+  // Parameters:
+  //   shard - the key's shard
+  //   key - key to read
+  //   ts - snapshot timestamp
+  //   value - set to the value of the key as of the snapshot
+  //   version - set to the commit timestamp of that value, or of the
+  //             erase that removed the key (0 if neither)
+  //   deadline - set to the value's deadline (0 if none)
+  // Returns:
+  //   bool - true if the key had a value written at the snapshot
+  //   (expired or not)
+  bool read_written( const Shard &shard, std::string_view key, uint64_t ts, std::string &value, uint64_t &version, uint64_t &deadline ) const;
 
-  // Map of key-value pairs
-  std::map<std::string, std::string> m_map;
-  
-  // Map of proposed changes
-  std::map<std::string, std::string> proposed_changes;
+  // Look up the latest value of a key in the engine without holding the
+  // shard's lock
+  // Parameters:
+  //   shard - the key's shard
+  //   key - key to look up
+  //   value - set to the key's value
+  //   version - set to the commit timestamp of the value
+  // Returns:
+  //   bool - true if the engine has the key
+  bool read_engine( const Shard &shard, std::string_view key, std::string &value, uint64_t &version ) const;
 
   // Copy constructor
   Table( const Table & );
@@ -34,7 +217,11 @@ private:
 
 public:
   // Constructor
-  Table( const std::string &name );
+  // Parameters:
+  //   name - name of the table
+  //   engine - kind of storage engine holding the committed data
+  //   budget - memory budget (none by default)
+  Table( const std::string &name, StorageEngineKind engine = StorageEngineKind::HASH, const MemoryBudget &budget = MemoryBudget() );
 
   // Destructor
   ~Table();
@@ -43,75 +230,410 @@ public:
   // Parameters:
   //   void
   // Returns:
-  //   std::string - name of the table
-  std::string get_name() const { return m_name; }
+  //   const std::string& - name of the table
+  const std::string &get_name() const { return m_name; }
+
+  // Set the table's read-only base layer (before the table is used)
+  // Parameters:
+  //   image - image the base layer is in (kept mapped by the table)
+  //   section - the table's section of the image
+  // Returns:
+  //   void
+  void set_base( std::shared_ptr<const SnapshotFile> image, const SnapshotFile::Section *section );
+
+  // Get the kind of storage engine
+  // Parameters:
+  //   void
+  // Returns:
+  //   StorageEngineKind - kind of engine holding the committed data
+  StorageEngineKind get_engine_kind() const { return m_engine_kind; }
+
+  // Get the memory budget
+  // Parameters:
+  //   void
+  // Returns:
+  //   const MemoryBudget& - the table's memory budget
+  const MemoryBudget &get_budget() const { return m_budget; }
+
+  // Get the bytes a key and its latest value are reckoned to take: the
+  // key is kept by the engine and the version store, and the value by
+  // the engine (the version store only holds it until it is evicted),
+  // besides ENTRY_OVERHEAD
+  // Parameters:
+  //   key - the key
+  //   size - size of the value
+  // Returns:
+  //   size_t - bytes taken
+  size_t entry_bytes( std::string_view key, size_t size ) const { return 2 * key.size() + size + ENTRY_OVERHEAD; }
+
+  // Get the bytes the table's keys and values take (needs no lock).
+  // Only keys and values in the storage engines are counted (see
+  // entry_bytes()); keys still only in the base
+  // layer are served from the mapped image, and don't count.  Nothing
+  // is counted unless the table has a memory budget.
+  // Parameters:
+  //   void
+  // Returns:
+  //   size_t - bytes taken
+  size_t get_memory() const;
+
+  // Check whether the memory budget is used up (needs no lock)
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if the table has a budget, and its keys and values
+  //   take at least that much
+  bool is_full() const { return m_budget.is_limited() && get_memory() >= m_budget.max_bytes; }
+
+  // Check whether a shard's share of the memory budget is used up (needs
+  // no lock)
+  // Parameters:
+  //   shard - shard index
+  // Returns:
+  //   bool - true if the table has a budget, and the shard's keys and
+  //   values take at least an even share of it
+  bool is_full( unsigned shard ) const
+  {
+    return m_budget.is_limited() && m_shards[shard].bytes.load( std::memory_order_relaxed ) >= m_budget.max_bytes / NUM_SHARDS;
+  }
+
+  // Check whether a shard's engine can take writes now (see
+  // StorageEngine::has_room(); needs no lock, and is checked before a
+  // commit rather than under its latch)
+  // Parameters:
+  //   shard - shard index
+  // Returns:
+  //   bool - true if the shard can be written
+  //   (throws StorageException if the engine has failed)
+  bool has_room( unsigned shard ) const { return m_shards[shard].engine->has_room(); }
+
+  // Wait until a shard's engine can take writes (holding no lock)
+  // Parameters:
+  //   shard - shard index
+  // Returns:
+  //   void (throws StorageException if the engine has failed)
+  void wait_for_room( unsigned shard ) const { m_shards[shard].engine->wait_for_room(); }
+
+  // Find the shard a key belongs to
+  // Parameters:
+  //   key - key to look up
+  // Returns:
+  //   unsigned - shard index (less than NUM_SHARDS)
+  static unsigned shard_of( std::string_view key );
+
+  // Lock functions (shard granularity)
+  // Parameters:
+  //   shard - shard index
+  // Returns:
+  //   void
+  void lock( unsigned shard ) { m_shards[shard].lock.lock(); }
+
+  // Unlock functions (shard granularity)
+  // Parameters:
+  //   shard - shard index
+  // Returns:
+  //   void
+  void unlock( unsigned shard ) { m_shards[shard].lock.unlock(); }
+
+  // Trylock functions (shard granularity)
+  // Parameters:
+  //   shard - shard index
+  // Returns:
+  //   bool - true if lock can be acquired, false otherwise
+  bool trylock( unsigned shard ) { return m_shards[shard].lock.trylock(); }
+
+  // Shared lock functions (any number of readers may hold a shard at
+  // once, but not while it is locked exclusively)
+  // Parameters:
+  //   shard - shard index
+  // Returns:
+  //   void
+  void lock_shared( unsigned shard ) { m_shards[shard].lock.lock_shared(); }
+
+  // Shared unlock functions
+  // Parameters:
+  //   shard - shard index
+  // Returns:
+  //   void
+  void unlock_shared( unsigned shard ) { m_shards[shard].lock.unlock_shared(); }
 
-  // Lock functions
+  // Shared trylock functions
+  // Parameters:
+  //   shard - shard index
+  // Returns:
+  //   bool - true if a shared lock can be acquired, false otherwise
+  bool trylock_shared( unsigned shard ) { return m_shards[shard].lock.trylock_shared(); }
+
+  // Lock functions (whole table: every shard, in index order)
   // Parameters:
   //   void
   // Returns:
   //   void
   void lock();
 
-  // Unlock functions
+  // Unlock functions (whole table)
   // Parameters:
   //   void
   // Returns:
   //   void
   void unlock();
 
-  // Trylock functions
+  // Trylock functions (whole table: all shards or none)
   // Parameters:
   //   void
   // Returns:
   //   bool - true if lock can be acquired, false otherwise
   bool trylock();
 
-  // Note: these functions should only be called while the
-  // table's lock is held!
+  // Note: these functions should only be called while the lock of
+  // the key's shard is held!  get() and has_key() only need the
+  // shared lock; set() needs the exclusive lock.  Uncommitted
+  // transactional writes never reach the table: they are buffered
+  // in the transaction's WriteSet until COMMIT.  Keys found only in
+  // the base layer have version 0, like keys that don't exist (neither
+  // can change without a write, which gives the key a new version).
+  // An erased key's version is the commit timestamp of the erase, for
+  // as long as its tombstone is kept.  A value may have a deadline
+  // (wall-clock milliseconds, see TimerWheel::now_ms()): once it has
+  // passed, the key reads as missing, and take_expired() hands it out
+  // to be erased.  Keys that are read or written are touched for the
+  // table's eviction policy (if it has one).
 
   // Set function
   // Parameters:
   //   key - key to set
-  //   value - value to set
+  //   value - value to set (moved into the table)
+  //   ts - commit timestamp of the write (see CommitClock)
+  //   deadline - when the value expires (0 for never)
+  // Returns:
+  //   void
+  void set( std::string_view key, std::string value, uint64_t ts, uint64_t deadline = 0 );
+
+  // Erase function (the exclusive lock is needed).  The key's value is
+  // removed from the storage engine right away; its tombstone (and the
+  // versions older snapshots still read) are freed by collect_garbage().
+  // Parameters:
+  //   key - key to erase
+  //   ts - commit timestamp of the erase (see CommitClock)
+  // Returns:
+  //   bool - true if the key existed, false if there was nothing to erase
+  bool erase( std::string_view key, uint64_t ts );
+
+  // Check whether a key can be erased, before the erase's commit
+  // starts: this reads the base layer, which may fail, while
+  // erase_checked() reads nothing that can (the exclusive lock is
+  // needed, and must be held until the erase)
+  // Parameters:
+  //   key - key to check
+  //   in_base - set to whether the key is in the base layer, for
+  //             erase_checked()
+  // Returns:
+  //   bool - true if the key exists (throws LogException if its base
+  //   block is corrupt)
+  bool check_erase( std::string_view key, bool &in_base );
+
+  // Erase a key check_erase() found (the exclusive lock is needed)
+  // Parameters:
+  //   key - key to erase
+  //   ts - commit timestamp of the erase (see CommitClock)
+  //   in_base - as set by check_erase()
+  // Returns:
+  //   void
+  void erase_checked( std::string_view key, uint64_t ts, bool in_base );
+
+  // Take the keys of a shard whose deadlines have passed (the shard's
+  // exclusive lock is needed)
+  // Parameters:
+  //   shard - shard index
+  //   now - current time (see TimerWheel::now_ms())
+  //   keys - the expired keys are appended (each once), to be erased
+  //          with erase_expired() while the lock is still held
+  // Returns:
+  //   void
+  void take_expired( unsigned shard, uint64_t now, std::vector<std::string> &keys );
+
+  // Erase a key taken by take_expired() (the exclusive lock is needed)
+  // Parameters:
+  //   key - key to erase
+  //   ts - commit timestamp of the erase (see CommitClock)
+  // Returns:
+  //   void
+  void erase_expired( std::string_view key, uint64_t ts );
+
+  // Hand a key taken by take_expired() back to its shard's timer wheel,
+  // to be taken again later; it still reads as expired meanwhile (the
+  // exclusive lock is needed)
+  // Parameters:
+  //   key - key that couldn't be erased
+  //   when - when to take it again (see TimerWheel::now_ms())
+  // Returns:
+  //   void
+  void retry_expired( std::string_view key, uint64_t when );
+
+  // Erase the coldest keys of a shard (as the eviction policy reckons
+  // them, from EVICTION_SAMPLES keys sampled for each one) until it is
+  // below its share of the memory budget, or EVICTION_BATCH keys have
+  // been erased (the shard's exclusive lock is needed)
+  // Parameters:
+  //   shard - shard index
+  //   ts - commit timestamp of the erases (see CommitClock)
+  //   keys - the keys erased are appended
   // Returns:
   //   void
-  void set( const std::string &key, const std::string &value );
+  void evict( unsigned shard, uint64_t ts, std::vector<std::string> &keys );
+
+  // Add to the integer value of a key (the exclusive lock is needed).
+  // A key that doesn't exist counts as 0.  The key keeps its deadline.
+  // Parameters:
+  //   key - key to change
+  //   delta - amount to add
+  //   ts - commit timestamp of the write (see CommitClock)
+  // Returns:
+  //   int64_t - the key's new value (throws OperationException, leaving
+  //   the key unchanged, if its value isn't an integer or the sum
+  //   overflows)
+  int64_t increment( std::string_view key, int64_t delta, uint64_t ts );
+
+  // Set a key only if its value is the expected one (the exclusive lock
+  // is needed).  The key keeps its deadline.
+  // Parameters:
+  //   key - key to change
+  //   expected - value the key must have
+  //   value - new value
+  //   ts - commit timestamp of the write (see CommitClock)
+  // Returns:
+  //   bool - true if the key was set, false if it didn't exist or had
+  //   another value
+  bool compare_and_set( std::string_view key, std::string_view expected, std::string value, uint64_t ts );
+
+  // Add to a value holding a decimal integer
+  // Parameters:
+  //   value - the value
+  //   delta - amount to add
+  // Returns:
+  //   int64_t - the sum (throws OperationException if the value isn't
+  //   an integer or the sum overflows)
+  static int64_t add_integer( std::string_view value, int64_t delta );
+
+  // Parse a decimal integer
+  // Parameters:
+  //   text - text to parse (an optional '-' and digits only)
+  //   value - set to the integer
+  // Returns:
+  //   bool - false if text isn't an integer or is out of range
+  static bool parse_integer( std::string_view text, int64_t &value );
 
   // Has key function
   // Parameters:
   //   key - key to check
   // Returns:
   //   bool - true if key exists, false otherwise
-  bool has_key( const std::string &key );
+  bool has_key( std::string_view key );
 
   // Get function
   // Parameters:
   //   key - key to get
   // Returns:
   //   std::string - value of the key
-  std::string get( const std::string &key );
+  std::string get( std::string_view key );
 
-  // Commit changes
+  // Get function, also reporting the key's version
   // Parameters:
-  //   void
+  //   key - key to get
+  //   value - set to the value of the key if it exists
+  //   version - set to the key's version (see get_version())
   // Returns:
-  //   void
-  void commit_changes();
+  //   bool - true if key exists, false otherwise
+  bool get( std::string_view key, std::string &value, uint64_t &version );
 
-  // Rollback changes
+  // Get the version of a key (changes every time the key is set)
   // Parameters:
+  //   key - key to check
+  // Returns:
+  //   uint64_t - version of the key, or 0 if it doesn't exist
+  uint64_t get_version( std::string_view key );
+
+  // Get the deadline of a key's latest value
+  // Parameters:
+  //   key - key to check
+  // Returns:
+  //   uint64_t - the deadline (even if it has passed), or 0 if the
+  //   value has none or there is no value
+  uint64_t get_deadline( std::string_view key );
+
+  // Snapshot get function (needs no lock, but the snapshot must be
+  // registered with the server's SnapshotRegistry while it is read)
+  // Parameters:
+  //   key - key to get
+  //   ts - snapshot timestamp
+  //   value - set to the value of the key as of the snapshot
+  //   version - set to the commit timestamp of that value, or of the
+  //             erase that removed the key (0 if neither)
+  // Returns:
+  //   bool - true if key existed at the snapshot (and hasn't expired),
+  //   false otherwise
+  bool get_snapshot( std::string_view key, uint64_t ts, std::string &value, uint64_t &version ) const
+  {
+    uint64_t deadline;
+    return get_snapshot( key, ts, value, version, deadline );
+  }
+
+  // Snapshot get function, also reporting the value's deadline
+  // Parameters:
+  //   key - key to get
+  //   ts - snapshot timestamp
+  //   value - set to the value of the key as of the snapshot
+  //   version - set to the commit timestamp of that value, or of the
+  //             erase that removed the key (0 if neither)
+  //   deadline - set to the value's deadline (0 if none)
+  // Returns:
+  //   bool - true if key existed at the snapshot (and hasn't expired),
+  //   false otherwise
+  bool get_snapshot( std::string_view key, uint64_t ts, std::string &value, uint64_t &version, uint64_t &deadline ) const;
+
+  // Visit every key that had a value at a snapshot (needs no lock,
+  // but the snapshot must be registered while it is read).  Values
+  // whose deadlines have passed are left out.
+  // Parameters:
+  //   ts - snapshot timestamp
+  //   visit - called with each key, its value at ts and the value's
+  //           deadline (the views are only valid during the call)
+  // Returns:
   //   void
+  void scan_snapshot( uint64_t ts, const std::function<void( std::string_view, std::string_view, uint64_t )> &visit ) const;
+
+  // Visit every key that had a value at a snapshot, without deadlines
+  // Parameters:
+  //   ts - snapshot timestamp
+  //   visit - called with each key and its value at ts
   // Returns:
   //   void
-  void rollback_changes();
+  void scan_snapshot( uint64_t ts, const std::function<void( std::string_view, std::string_view )> &visit ) const;
 
-  // Get mutex
+  // Get the first keys of a range in key order, as of a snapshot (needs
+  // no lock, but the snapshot must be registered while it is read).
+  // An ordered engine is read from the start of the range on, so the
+  // keys before it aren't read; a hash engine is scanned whole.
   // Parameters:
+  //   ts - snapshot timestamp
+  //   start - smallest key of the range
+  //   end - key just past the range (empty for no upper bound)
+  //   limit - most keys to get
+  //   entries - set to the keys and their values at ts
+  // Returns:
   //   void
+  void scan_range( uint64_t ts, std::string_view start, std::string_view end, size_t limit, std::vector<std::pair<std::string, std::string>> &entries ) const;
+
+  // Free the old versions of keys that no snapshot can read any more.
+  // Shards that are locked exclusively are skipped until next time.
+  // Must not be called by two threads at once.
+  // Parameters:
+  //   oldest - oldest timestamp any current or future snapshot reads at
+  //   latest - latest visible commit timestamp (see CommitClock), read
+  //            after the previous call returned
   // Returns:
-  //   pthread_mutex_t* - pointer to the mutex
-  pthread_mutex_t* get_mutex();
+  //   size_t - number of versions freed
+  size_t collect_garbage( uint64_t oldest, uint64_t latest );
 };
 
 // End of guards
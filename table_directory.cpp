@@ -0,0 +1,106 @@
+// table_directory.cpp
+
+// Headers
+#include "table_directory.h"
+#include "table.h"
+#include "mvcc.h"
+#include "guard.h"
+
+// Constructor
+TableDirectory::TableDirectory()
+  : m_map( new Map )
+  , m_epoch( 0 )
+{
+  pthread_mutex_init( &m_mutex, nullptr );
+}
+
+// Destructor
+TableDirectory::~TableDirectory()
+{
+  const Map *map = m_map.load();
+  for ( auto &entry : *map ) {
+    delete entry.second;
+  }
+  delete map;
+
+  for ( auto &retired : m_retired ) {
+    delete retired.first;
+  }
+
+  pthread_mutex_destroy( &m_mutex );
+}
+
+// Find a table
+// Parameters:
+//   name - table name
+// Returns:
+//   Table* - the table, or nullptr if there is no such table
+Table *TableDirectory::find( std::string_view name ) const
+{
+  const Map *map = m_map.load( std::memory_order_acquire );
+  auto it = map->find( name );
+  return it != map->end() ? it->second : nullptr;
+}
+
+// Add a table, unless one with the same name exists
+// Parameters:
+//   table - table to add (owned by the directory if added)
+//   clock - commit clock giving the change its timestamp
+// Returns:
+//   bool - true if the table was added, false if the name is taken
+bool TableDirectory::add( Table *table, CommitClock &clock )
+{
+  Guard g( m_mutex );
+
+  const Map *old = m_map.load( std::memory_order_relaxed );
+  if ( old->count( table->get_name() ) != 0 ) {
+    return false;
+  }
+
+  Map *map = new Map( *old );
+  map->emplace( table->get_name(), table );
+
+  // A snapshot that begins once the change is visible finds the new
+  // map, so the old one is unreachable when every snapshot is at
+  // least this new
+  CommitGuard commit( clock, []() { } );
+  m_map.store( map, std::memory_order_release );
+  m_epoch.fetch_add( 1, std::memory_order_release );
+  commit.finish();
+
+  m_retired.emplace_back( old, commit.get_ts() );
+  return true;
+}
+
+// List every table
+// Parameters:
+//   tables - list to append to
+// Returns:
+//   void
+void TableDirectory::list( std::vector<Table*> &tables ) const
+{
+  Guard g( m_mutex );
+  for ( auto &entry : *m_map.load( std::memory_order_relaxed ) ) {
+    tables.push_back( entry.second );
+  }
+}
+
+// Free the retired maps no snapshot can be reading any more
+// Parameters:
+//   oldest - oldest timestamp any current or future snapshot reads at
+// Returns:
+//   void
+void TableDirectory::collect_garbage( uint64_t oldest )
+{
+  Guard g( m_mutex );
+
+  size_t kept = 0;
+  for ( auto &retired : m_retired ) {
+    if ( retired.second <= oldest ) {
+      delete retired.first;
+    } else {
+      m_retired[kept++] = retired;
+    }
+  }
+  m_retired.resize( kept );
+}
@@ -0,0 +1,100 @@
+// table_directory.h
+
+// Guards
+#ifndef TABLE_DIRECTORY_H
+#define TABLE_DIRECTORY_H
+
+// Headers
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+
+// Forward declarations
+class Table;
+class CommitClock;
+
+// The server's tables, by name.
+//
+// Lookups are lock-free: the directory is an immutable map behind an
+// atomic pointer.  Creating a table copies the map, adds the table and
+// swaps the pointer (creates are serialized by a mutex).  A replaced
+// map may still be read by lookups that loaded the old pointer, so it
+// is retired with the commit timestamp of the swap and only freed once
+// every snapshot is at least that new (the same rule that frees old
+// versions of keys).  Lookups must therefore be made while the caller
+// holds a snapshot in the server's SnapshotRegistry.
+class TableDirectory {
+private:
+  // Tables by name (the keys view the tables' own names)
+  typedef std::unordered_map<std::string_view, Table*> Map;
+
+  // Current map
+  std::atomic<const Map*> m_map;
+
+  // Incremented whenever the set of tables changes
+  std::atomic<uint64_t> m_epoch;
+
+  // Maps replaced by a newer one, with the timestamp of the swap
+  std::vector<std::pair<const Map*, uint64_t>> m_retired;
+
+  // Serializes creates and the freeing of retired maps
+  mutable pthread_mutex_t m_mutex;
+
+  // Copy constructor
+  TableDirectory( const TableDirectory & );
+
+  // Assignment operator
+  TableDirectory &operator=( const TableDirectory & );
+
+public:
+  // Constructor
+  TableDirectory();
+
+  // Destructor (deletes every table)
+  ~TableDirectory();
+
+  // Find a table (the caller must hold a snapshot)
+  // Parameters:
+  //   name - table name
+  // Returns:
+  //   Table* - the table, or nullptr if there is no such table
+  Table *find( std::string_view name ) const;
+
+  // Add a table, unless one with the same name exists
+  // Parameters:
+  //   table - table to add (owned by the directory if added)
+  //   clock - commit clock giving the change its timestamp
+  // Returns:
+  //   bool - true if the table was added, false if the name is taken
+  bool add( Table *table, CommitClock &clock );
+
+  // Get the directory's epoch, which changes whenever a table is added.
+  // A cache of lookups made at one epoch is valid while it is current.
+  // Parameters:
+  //   void
+  // Returns:
+  //   uint64_t - current epoch
+  uint64_t epoch() const { return m_epoch.load( std::memory_order_acquire ); }
+
+  // List every table (tables are never removed, so the pointers stay
+  // valid for the lifetime of the directory)
+  // Parameters:
+  //   tables - list to append to
+  // Returns:
+  //   void
+  void list( std::vector<Table*> &tables ) const;
+
+  // Free the retired maps no snapshot can be reading any more
+  // Parameters:
+  //   oldest - oldest timestamp any current or future snapshot reads at
+  // Returns:
+  //   void
+  void collect_garbage( uint64_t oldest );
+};
+
+// End of guards
+#endif // TABLE_DIRECTORY_H
@@ -0,0 +1,111 @@
+// timer_wheel.cpp
+
+// Headers
+#include <ctime>
+#include <utility>
+#include "timer_wheel.h"
+
+// Constructor
+// Parameters:
+//   now - current time (milliseconds)
+TimerWheel::TimerWheel( uint64_t now )
+  : m_tick( now / TICK_MS )
+  , m_size( 0 )
+{
+}
+
+// Get the current wall-clock time
+// Parameters:
+//   void
+// Returns:
+//   uint64_t - milliseconds since the Unix epoch
+uint64_t TimerWheel::now_ms()
+{
+  // wall-clock time, so deadlines in the log and snapshots still hold
+  // after a restart
+  struct timespec t;
+  clock_gettime( CLOCK_REALTIME, &t );
+  return uint64_t( t.tv_sec ) * 1000 + t.tv_nsec / 1000000;
+}
+
+// Put a timer into the slot covering its deadline
+// Parameters:
+//   timer - timer to place
+// Returns:
+//   void
+void TimerWheel::place( Timer &&timer )
+{
+  // the first tick at which the deadline has passed (a timer already
+  // due is taken at the next one)
+  uint64_t tick = timer.deadline / TICK_MS + ( timer.deadline % TICK_MS != 0 );
+  if ( tick < m_tick ) {
+    tick = m_tick;
+  }
+
+  // a slot of level n spans SLOTS^n ticks; deadlines past the top
+  // level's range wait in its farthest slot
+  uint64_t delta = tick - m_tick;
+  unsigned level = 0;
+  while ( level + 1 < LEVELS && delta >> ( SLOT_BITS * ( level + 1 ) ) != 0 ) {
+    level++;
+  }
+  if ( delta >> ( SLOT_BITS * LEVELS ) != 0 ) {
+    tick = m_tick + ( uint64_t( 1 ) << ( SLOT_BITS * LEVELS ) ) - 1;
+  }
+  m_slots[level][( tick >> ( SLOT_BITS * level ) ) & ( SLOTS - 1 )].push_back( std::move( timer ) );
+}
+
+// Add a key
+// Parameters:
+//   key - key to add
+//   deadline - when the key is due
+// Returns:
+//   void
+void TimerWheel::add( std::string_view key, uint64_t deadline )
+{
+  place( Timer{ std::string( key ), deadline } );
+  m_size++;
+}
+
+// Move the wheel's time forward, taking out every key that is due
+// Parameters:
+//   now - current time
+//   due - keys whose deadlines are at or before now are appended
+// Returns:
+//   void
+void TimerWheel::advance( uint64_t now, std::vector<std::string> &due )
+{
+  uint64_t target = now / TICK_MS;
+  while ( m_tick <= target ) {
+    if ( m_size == 0 ) {
+      // nothing to move: skip straight to the end
+      m_tick = target + 1;
+      break;
+    }
+
+    // Entering a new span of a higher level's slot: its timers are
+    // spread over the levels below (the next level up only when this
+    // level wraps around too)
+    for ( unsigned level = 1; level < LEVELS && ( m_tick & ( ( uint64_t( 1 ) << ( SLOT_BITS * level ) ) - 1 ) ) == 0; level++ ) {
+      std::vector<Timer> spread;
+      spread.swap( m_slots[level][( m_tick >> ( SLOT_BITS * level ) ) & ( SLOTS - 1 )] );
+      for ( Timer &timer : spread ) {
+        place( std::move( timer ) );
+      }
+    }
+
+    // Take the current tick's timers; one whose deadline was beyond the
+    // wheel's range goes back in
+    std::vector<Timer> slot;
+    slot.swap( m_slots[0][m_tick & ( SLOTS - 1 )] );
+    m_tick++;
+    for ( Timer &timer : slot ) {
+      if ( timer.deadline <= now ) {
+        due.push_back( std::move( timer.key ) );
+        m_size--;
+      } else {
+        place( std::move( timer ) );
+      }
+    }
+  }
+}
@@ -0,0 +1,125 @@
+// timer_wheel.h
+
+// Guards
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+// Headers
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Keys waiting for their deadlines, in a hierarchical timing wheel.
+//
+// Time is cut into ticks of TICK_MS milliseconds.  Level 0 has a slot
+// for each of the next SLOTS ticks; each slot of a higher level spans
+// all the slots of the level below.  A key is added to the slot of the
+// lowest level whose range reaches its deadline, in O(1).  Whenever the
+// wheel's time enters the span of a higher-level slot, its keys are
+// spread over the level below, so a key moves at most LEVELS - 1 times
+// before its level-0 slot comes due.  Advancing the wheel costs O(1)
+// per tick plus the keys moved or taken, however many keys are waiting.
+// Deadlines beyond the top level's range wait in its farthest slot, and
+// are added again when it comes due.
+//
+// A key is never removed early: whoever takes it must check that its
+// deadline still holds.  The wheel isn't synchronized (each table
+// shard has one, guarded by the shard's lock).
+class TimerWheel {
+public:
+  // Length of a tick (milliseconds)
+  static const uint64_t TICK_MS = 100;
+
+  // Slots per level
+  static const unsigned SLOT_BITS = 6;
+  static const unsigned SLOTS = 1u << SLOT_BITS;
+
+  // Number of levels (together covering SLOTS^LEVELS ticks, about 19
+  // days)
+  static const unsigned LEVELS = 4;
+
+private:
+  // A key and its deadline
+  struct Timer {
+    std::string key;
+    uint64_t deadline;
+  };
+
+  // Timers by level, then slot
+  std::vector<Timer> m_slots[LEVELS][SLOTS];
+
+  // Next tick to take the level-0 slot of
+  uint64_t m_tick;
+
+  // Number of timers
+  size_t m_size;
+
+  // Copy constructor
+  TimerWheel( const TimerWheel & );
+
+  // Assignment operator
+  TimerWheel &operator=( const TimerWheel & );
+
+  // Put a timer into the slot covering its deadline
+  // Parameters:
+  //   timer - timer to place (moved into the wheel)
+  // Returns:
+  //   void
+  void place( Timer &&timer );
+
+public:
+  // Constructor
+  // Parameters:
+  //   now - current time (milliseconds, see now_ms())
+  TimerWheel( uint64_t now = now_ms() );
+
+  // Get the current wall-clock time
+  // Parameters:
+  //   void
+  // Returns:
+  //   uint64_t - milliseconds since the Unix epoch
+  static uint64_t now_ms();
+
+  // Check whether a deadline has passed
+  // Parameters:
+  //   deadline - deadline (milliseconds since the epoch, 0 for none)
+  //   now - current time
+  // Returns:
+  //   bool - true if there is a deadline and it isn't after now
+  static bool is_expired( uint64_t deadline, uint64_t now ) { return deadline != 0 && deadline <= now; }
+
+  // Add a key
+  // Parameters:
+  //   key - key to add
+  //   deadline - when the key is due (milliseconds since the epoch)
+  // Returns:
+  //   void
+  void add( std::string_view key, uint64_t deadline );
+
+  // Move the wheel's time forward, taking out every key that is due
+  // Parameters:
+  //   now - current time (earlier times are ignored)
+  //   due - keys whose deadlines are at or before now are appended
+  // Returns:
+  //   void
+  void advance( uint64_t now, std::vector<std::string> &due );
+
+  // Get the number of keys waiting
+  // Parameters:
+  //   void
+  // Returns:
+  //   size_t - number of keys (a key added twice counts twice)
+  size_t size() const { return m_size; }
+
+  // Check whether any key is waiting
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if no key is waiting
+  bool empty() const { return m_size == 0; }
+};
+
+// End of guards
+#endif // TIMER_WHEEL_H
@@ -5,6 +5,28 @@
 #include "table.h"
 #include "value_stack.h"
 #include "exceptions.h"
+#include "identifier.h"
+#include "storage_engine.h"
+#include "hash_index.h"
+#include "rw_lock.h"
+#include "write_set.h"
+#include "read_set.h"
+#include "mvcc.h"
+#include "version_store.h"
+#include "lock_manager.h"
+#include "table_directory.h"
+#include "write_ahead_log.h"
+#include "snapshot_file.h"
+#include "lsm_engine.h"
+#include "timer_wheel.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <thread>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "tctest.h"
 #include <iostream>
 
@@ -96,16 +118,42 @@ void test_message_get_table( TestObjs *objs );
 void test_message_get_value( TestObjs *objs );
 void test_message_get_key( TestObjs *objs );
 void test_message_is_valid( TestObjs *objs );
+void test_identifier( TestObjs *objs );
 void test_message_serialization_encode( TestObjs *objs );
 void test_message_serialization_encode_long( TestObjs *objs );
 void test_message_serialization_encode_too_long( TestObjs *objs );
 void test_message_serialization_decode( TestObjs *objs );
 void test_message_serialization_decode_invalid( TestObjs *objs );
+void test_message_serialization_decode_view( TestObjs *objs );
+void test_message_serialization_binary( TestObjs *objs );
+void test_message_serialization_multi_key( TestObjs *objs );
 void test_table_has_key( TestObjs *objs );
 void test_table_get( TestObjs *objs );
-void test_table_commit_changes( TestObjs *objs );
-void test_table_rollback_changes( TestObjs *objs );
-void test_table_commit_and_rollback( TestObjs *objs );
+void test_table_increment( TestObjs *objs );
+void test_table_compare_and_set( TestObjs *objs );
+void test_table_scan_range( TestObjs *objs );
+void test_table_erase( TestObjs *objs );
+void test_table_expiry( TestObjs *objs );
+void test_table_memory( TestObjs *objs );
+void test_write_set_commit( TestObjs *objs );
+void test_write_set_rollback( TestObjs *objs );
+void test_write_set_commit_and_rollback( TestObjs *objs );
+void test_write_set_erase( TestObjs *objs );
+void test_read_set_validate( TestObjs *objs );
+void test_storage_engines( TestObjs *objs );
+void test_hash_index_erase( TestObjs *objs );
+void test_rw_lock( TestObjs *objs );
+void test_table_shards( TestObjs *objs );
+void test_snapshots( TestObjs *objs );
+void test_version_store( TestObjs *objs );
+void test_version_store_erase( TestObjs *objs );
+void test_timer_wheel( TestObjs *objs );
+void test_lock_manager( TestObjs *objs );
+void test_table_directory( TestObjs *objs );
+void test_write_ahead_log( TestObjs *objs );
+void test_snapshot_file( TestObjs *objs );
+void test_lsm_engine( TestObjs *objs );
+void test_lsm_table( TestObjs *objs );
 void test_value_stack( TestObjs *objs );
 void test_value_stack_exceptions( TestObjs *objs );
 
@@ -124,16 +172,42 @@ int main(int argc, char **argv)
   TEST( test_message_get_value );
   TEST( test_message_get_key );
   TEST( test_message_is_valid );
+  TEST( test_identifier );
   TEST( test_message_serialization_encode );
   TEST( test_message_serialization_encode_long );
   TEST( test_message_serialization_encode_too_long );
   TEST( test_message_serialization_decode );
   TEST( test_message_serialization_decode_invalid );
+  TEST( test_message_serialization_decode_view );
+  TEST( test_message_serialization_binary );
+  TEST( test_message_serialization_multi_key );
   TEST( test_table_has_key );
   TEST( test_table_get );
-  TEST( test_table_commit_changes );
-  TEST( test_table_rollback_changes );
-  TEST( test_table_commit_and_rollback );
+  TEST( test_table_increment );
+  TEST( test_table_compare_and_set );
+  TEST( test_table_scan_range );
+  TEST( test_table_erase );
+  TEST( test_table_expiry );
+  TEST( test_table_memory );
+  TEST( test_write_set_commit );
+  TEST( test_write_set_rollback );
+  TEST( test_write_set_commit_and_rollback );
+  TEST( test_write_set_erase );
+  TEST( test_read_set_validate );
+  TEST( test_storage_engines );
+  TEST( test_hash_index_erase );
+  TEST( test_rw_lock );
+  TEST( test_table_shards );
+  TEST( test_snapshots );
+  TEST( test_version_store );
+  TEST( test_version_store_erase );
+  TEST( test_timer_wheel );
+  TEST( test_lock_manager );
+  TEST( test_table_directory );
+  TEST( test_write_ahead_log );
+  TEST( test_snapshot_file );
+  TEST( test_lsm_engine );
+  TEST( test_lsm_table );
   TEST( test_value_stack );
   TEST( test_value_stack_exceptions );
 
@@ -296,6 +370,38 @@ void test_message_is_valid( TestObjs *objs )
   ASSERT( !objs->invalid_login_req.is_valid() );
   ASSERT( !objs->invalid_create_req.is_valid() );
   ASSERT( !objs->invalid_data_resp.is_valid() );
+
+  // CREATE takes an optional storage engine name
+  ASSERT( Message( MessageType::CREATE, { "line_items", "ordered" } ).is_valid() );
+  ASSERT( !Message( MessageType::CREATE, { "line_items", "hash", "extra" } ).is_valid() );
+}
+
+void test_identifier( TestObjs * )
+{
+  ASSERT( Identifier::is_identifier( "a" ) );
+  ASSERT( Identifier::is_identifier( "fruit_2" ) );
+  ASSERT( Identifier::is_identifier( "Z9" ) );
+  ASSERT( !Identifier::is_identifier( "" ) );
+  ASSERT( !Identifier::is_identifier( "_fruit" ) );
+  ASSERT( !Identifier::is_identifier( "8foobar" ) );
+  ASSERT( !Identifier::is_identifier( "foo-bar" ) );
+  ASSERT( !Identifier::is_identifier( "foo bar" ) );
+
+  // long enough to take the 16-bytes-at-a-time path, with a bad
+  // character in each position of the first block and in the tail
+  std::string lng( 40, 'k' );
+  ASSERT( Identifier::is_identifier( lng ) );
+  for ( size_t i = 1; i < lng.size(); i++ ) {
+    for ( char bad : { '-', '/', ':', '@', '[', '`', '{', '\x80', '\xff' } ) {
+      std::string s = lng;
+      s[i] = bad;
+      ASSERT( !Identifier::is_identifier( s ) );
+    }
+  }
+
+  // punctuation is rejected anywhere in the body
+  ASSERT( !Message::is_valid_body( "ab.c" ) );
+  ASSERT( !Message( MessageType::GET, { "fruit", "app!es" } ).is_valid() );
 }
 
 void test_message_serialization_encode( TestObjs *objs )
@@ -399,19 +505,166 @@ void test_message_serialization_decode_invalid( TestObjs *objs )
   }
 }
 
+void test_message_serialization_decode_view( TestObjs *objs )
+{
+  MessageView view;
+
+  MessageSerialization::decode( objs->encoded_get_req, view );
+  ASSERT( MessageType::GET == view.get_message_type() );
+  ASSERT( 2 == view.get_num_args() );
+  ASSERT( "lineitems" == view.get_table() );
+  ASSERT( "foobar" == view.get_key() );
+
+  // Arguments are slices of the encoded message, not copies
+  ASSERT( view.get_table().data() == objs->encoded_get_req.data() + 4 );
+
+  // A view can be reused for the next message
+  MessageSerialization::decode( objs->encoded_create_req, view );
+  ASSERT( MessageType::CREATE == view.get_message_type() );
+  ASSERT( 1 == view.get_num_args() );
+  ASSERT( "invoices" == view.get_table() );
+
+  MessageSerialization::decode( objs->encoded_error_resp, view );
+  ASSERT( MessageType::ERROR == view.get_message_type() );
+  ASSERT( 1 == view.get_num_args() );
+  ASSERT( "Wow, something really got messed up" == view.get_arg( 0 ) );
+
+  MessageSerialization::decode( objs->encoded_bye_req, view );
+  ASSERT( MessageType::BYE == view.get_message_type() );
+  ASSERT( 0 == view.get_num_args() );
+
+  try {
+    MessageSerialization::decode( objs->encoded_push_req_no_nl, view );
+    FAIL( "No exception thrown decoding message lacking terminating newline" );
+  } catch ( InvalidMessage &ex ) {
+    // Good
+  }
+
+  try {
+    MessageSerialization::decode( std::string_view( "FETCH foo bar\n" ), view );
+    FAIL( "No exception thrown decoding unknown command" );
+  } catch ( InvalidMessage &ex ) {
+    // Good
+  }
+}
+
+void test_message_serialization_binary( TestObjs *objs )
+{
+  std::string frame;
+
+  // Header: body length, opcode, argument count, reserved
+  MessageSerialization::encode_binary( objs->get_req, frame );
+  ASSERT( std::string( "\0\0\0\x17\x07\x02\0\0\0\0\0\x08" "accounts\0\0\0\x07" "acct123", 31 ) == frame );
+  ASSERT( frame.size() == MessageSerialization::binary_frame_len( frame ) );
+  ASSERT( 0 == MessageSerialization::binary_frame_len( std::string_view( frame ).substr( 0, 7 ) ) );
+
+  MessageView view;
+  MessageSerialization::decode_binary( frame, view );
+  ASSERT( MessageType::GET == view.get_message_type() );
+  ASSERT( view.is_binary() );
+  ASSERT( "accounts" == view.get_table() );
+  ASSERT( "acct123" == view.get_key() );
+
+  // Arguments are slices of the frame, not copies
+  ASSERT( view.get_table().data() == frame.data() + 12 );
+
+  // Values may hold spaces and newlines, and be longer than a text line
+  std::string value = "hello, world\n" + std::string( 4 * Message::MAX_ENCODED_LEN, 'v' );
+  frame.clear();
+  MessageSerialization::encode_binary( Message( MessageType::PUSH, { value } ), frame );
+  MessageSerialization::decode_binary( frame, view );
+  ASSERT( MessageType::PUSH == view.get_message_type() );
+  ASSERT( value == view.get_value() );
+  ASSERT( !Message::is_text_value( value ) );
+  ASSERT( Message::is_text_value( "47374" ) );
+
+  // Decoding a text message clears the binary flag
+  MessageSerialization::decode( objs->encoded_get_req, view );
+  ASSERT( !view.is_binary() );
+
+  // Frames appended to one buffer are decoded one at a time
+  frame.clear();
+  MessageSerialization::encode_binary( objs->login_req, frame );
+  MessageSerialization::encode_binary( objs->ok_resp, frame );
+  size_t len = MessageSerialization::binary_frame_len( frame );
+  MessageSerialization::decode_binary( std::string_view( frame ).substr( 0, len ), view );
+  ASSERT( MessageType::LOGIN == view.get_message_type() );
+  ASSERT( "alice" == view.get_username() );
+  MessageSerialization::decode_binary( std::string_view( frame ).substr( len ), view );
+  ASSERT( MessageType::OK == view.get_message_type() );
+  ASSERT( 0 == view.get_num_args() );
+
+  // Truncated frames, arguments overrunning the frame, bad opcodes and
+  // invalid arguments are rejected
+  frame.clear();
+  MessageSerialization::encode_binary( objs->set_req, frame );
+  std::vector<std::string> bad = {
+    frame.substr( 0, frame.size() - 1 ),
+    frame.substr( 0, 5 ),
+    frame,
+    frame,
+    frame,
+  };
+  bad[2][5] = 3;
+  bad[3][4] = char( 200 );
+  bad[4][12] = '8';
+  for ( const std::string &b : bad ) {
+    try {
+      MessageSerialization::decode_binary( b, view );
+      FAIL( "No exception thrown decoding an invalid binary frame" );
+    } catch ( InvalidMessage &ex ) {
+      // Good
+    }
+  }
+}
+
+void test_message_serialization_multi_key( TestObjs * )
+{
+  std::string s;
+
+  MessageSerialization::encode( Message( MessageType::MGET, { "accounts", "a1", "a2", "a3" } ), s );
+  ASSERT( "MGET accounts a1 a2 a3\n" == s );
+  MessageSerialization::encode( Message( MessageType::DATA, { "10", "20", "30" } ), s );
+  ASSERT( "DATA 10 20 30\n" == s );
+
+  MessageView view;
+  MessageSerialization::decode( std::string_view( "MSET accounts a1 a2\n" ), view );
+  ASSERT( MessageType::MSET == view.get_message_type() );
+  ASSERT( 3 == view.get_num_args() );
+  ASSERT( "accounts" == view.get_table() );
+  ASSERT( "a2" == view.get_arg( 2 ) );
+
+  // Each value of a multi-value reply is an argument
+  MessageSerialization::decode( std::string_view( "DATA 10 20 30\n" ), view );
+  ASSERT( MessageType::DATA == view.get_message_type() );
+  ASSERT( 3 == view.get_num_args() );
+  ASSERT( "30" == view.get_arg( 2 ) );
+
+  // Binary opcodes of the new types follow the original ones
+  s.clear();
+  MessageSerialization::encode_binary( Message( MessageType::MGET, { "t", "k" } ), s );
+  ASSERT( 20 == s[4] );
+  MessageSerialization::decode_binary( s, view );
+  ASSERT( MessageType::MGET == view.get_message_type() );
+
+  // At least one key, and every key an identifier
+  ASSERT( !Message( MessageType::MGET, { "accounts" } ).is_valid() );
+  ASSERT( !Message( MessageType::MSET, { "accounts", "a1", "9lives" } ).is_valid() );
+}
+
 void test_table_has_key( TestObjs *objs )
 {
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    objs->invoices->set( "abc123", "1000" );
-    objs->invoices->set( "xyz456", "1318" );
+    objs->invoices->set( "abc123", "1000", 1 );
+    objs->invoices->set( "xyz456", "1318", 2 );
   }
 
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    // Changes should be visible even though we haven't committed them
+    // Writes made under the table lock are visible right away
     ASSERT( objs->invoices->has_key( "abc123" ) );
     ASSERT( objs->invoices->has_key( "xyz456" ) );
 
@@ -424,14 +677,14 @@ void test_table_get( TestObjs *objs )
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    objs->invoices->set( "abc123", "1000" );
-    objs->invoices->set( "xyz456", "1318" );
+    objs->invoices->set( "abc123", "1000", 1 );
+    objs->invoices->set( "xyz456", "1318", 2 );
   }
 
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    // Changes should be visible even though we haven't committed them
+    // Writes made under the table lock are visible right away
     ASSERT( "1000" == objs->invoices->get( "abc123" ) );
     ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
 
@@ -439,69 +692,400 @@ void test_table_get( TestObjs *objs )
   }
 }
 
-void test_table_commit_changes( TestObjs *objs )
+void test_table_increment( TestObjs *objs )
 {
-  {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
-
-    objs->invoices->set( "abc123", "1000" );
-    objs->invoices->set( "xyz456", "1318" );
+  TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+
+  // A missing key counts as 0
+  ASSERT( 5 == objs->invoices->increment( "count", 5, 1 ) );
+  ASSERT( 3 == objs->invoices->increment( "count", -2, 2 ) );
+  ASSERT( "3" == objs->invoices->get( "count" ) );
+  ASSERT( 2 == objs->invoices->get_version( "count" ) );
+
+  std::string value;
+  uint64_t version;
+  ASSERT( objs->invoices->get_snapshot( "count", 1, value, version ) );
+  ASSERT( "5" == value );
+
+  // Values that aren't integers, and overflows, leave the key unchanged
+  objs->invoices->set( "name", "alice", 3 );
+  objs->invoices->set( "big", std::to_string( INT64_MAX ), 4 );
+  try {
+    objs->invoices->increment( "name", 1, 5 );
+    FAIL( "No exception thrown incrementing a value that isn't an integer" );
+  } catch ( OperationException &ex ) {
+    // Good
   }
+  try {
+    objs->invoices->increment( "big", 1, 6 );
+    FAIL( "No exception thrown on overflow" );
+  } catch ( OperationException &ex ) {
+    // Good
+  }
+  ASSERT( "alice" == objs->invoices->get( "name" ) );
+  ASSERT( 4 == objs->invoices->get_version( "big" ) );
+  ASSERT( -1 == objs->invoices->increment( "big", INT64_MIN, 7 ) );
+
+  int64_t n;
+  ASSERT( Table::parse_integer( "-42", n ) && -42 == n );
+  ASSERT( !Table::parse_integer( "", n ) );
+  ASSERT( !Table::parse_integer( "12abc", n ) );
+  ASSERT( !Table::parse_integer( "+1", n ) );
+  ASSERT( !Table::parse_integer( "99999999999999999999", n ) );
+  ASSERT( -1 == Table::add_integer( "0", -1 ) );
+}
 
-  {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+void test_table_compare_and_set( TestObjs *objs )
+{
+  TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    // Changes should be visible even though we haven't committed them
-    ASSERT( "1000" == objs->invoices->get( "abc123" ) );
-    ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
+  // A missing key never matches
+  ASSERT( !objs->invoices->compare_and_set( "abc123", "1000", "1100", 1 ) );
+  ASSERT( !objs->invoices->has_key( "abc123" ) );
 
-    ASSERT( !objs->invoices->has_key( "nonexistent" ) );
+  objs->invoices->set( "abc123", "1000", 2 );
+  ASSERT( !objs->invoices->compare_and_set( "abc123", "999", "1100", 3 ) );
+  ASSERT( "1000" == objs->invoices->get( "abc123" ) );
+  ASSERT( 2 == objs->invoices->get_version( "abc123" ) );
+
+  ASSERT( objs->invoices->compare_and_set( "abc123", "1000", "1100", 4 ) );
+  ASSERT( "1100" == objs->invoices->get( "abc123" ) );
+  ASSERT( 4 == objs->invoices->get_version( "abc123" ) );
+}
+
+void test_table_scan_range( TestObjs * )
+{
+  for ( StorageEngineKind kind : { StorageEngineKind::HASH, StorageEngineKind::ORDERED, StorageEngineKind::LSM } ) {
+    Table table( "scanned", kind );
+    for ( int i = 0; i < 100; i++ ) {
+      std::string key = "k" + std::to_string( 1000 + i );
+      TableGuard g( &table );
+      table.set( key, std::to_string( i ), i + 1 );
+    }
+
+    // The first keys of the range, in key order
+    std::vector<std::pair<std::string, std::string>> entries;
+    table.scan_range( 100, "k1010", "k1020", 3, entries );
+    ASSERT( 3 == entries.size() );
+    ASSERT( "k1010" == entries[0].first && "10" == entries[0].second );
+    ASSERT( "k1012" == entries[2].first );
+
+    // The end of the range is excluded, and an empty end is unbounded
+    table.scan_range( 100, "k1010", "k1020", 50, entries );
+    ASSERT( 10 == entries.size() );
+    ASSERT( "k1019" == entries.back().first );
+    table.scan_range( 100, "k1095", "", 50, entries );
+    ASSERT( 5 == entries.size() );
+
+    // Only keys written at the snapshot are seen
+    table.scan_range( 50, "", "", 1000, entries );
+    ASSERT( 50 == entries.size() );
+    ASSERT( "k1049" == entries.back().first );
+
+    table.scan_range( 100, "z", "", 10, entries );
+    ASSERT( entries.empty() );
+
+    // Snapshots older than an erase still see the key, until every
+    // snapshot sees the erase
+    {
+      TableGuard g( &table );
+      table.erase( "k1011", 101 );
+      table.erase( "k1012", 101 );
+      table.set( "k1012", "again", 102 );
+    }
+    table.scan_range( 100, "k1010", "k1020", 3, entries );
+    ASSERT( 3 == entries.size() && "k1011" == entries[1].first && "12" == entries[2].second );
+    table.scan_range( 101, "k1010", "k1020", 3, entries );
+    ASSERT( 3 == entries.size() && "k1013" == entries[1].first && "k1014" == entries[2].first );
+    table.scan_range( 102, "k1010", "k1020", 2, entries );
+    ASSERT( 2 == entries.size() && "k1012" == entries[1].first && "again" == entries[1].second );
+    table.collect_garbage( 100, 102 );
+    table.scan_range( 100, "k1011", "k1012", 5, entries );
+    ASSERT( 1 == entries.size() && "11" == entries[0].second );
+    table.collect_garbage( 102, 102 );
+    table.scan_range( 102, "k1011", "k1013", 5, entries );
+    ASSERT( 1 == entries.size() && "again" == entries[0].second );
   }
+}
 
-  {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+void test_table_erase( TestObjs *objs )
+{
+  std::string value;
+  uint64_t version;
+
+  // erasing removes the key from the table, but not from snapshots
+  // older than the erase
+  objs->invoices->set( "abc123", "1000", 1 );
+  ASSERT( objs->invoices->erase( "abc123", 2 ) );
+  ASSERT( !objs->invoices->erase( "abc123", 3 ) );
+  ASSERT( !objs->invoices->erase( "nonexistent", 3 ) );
+  ASSERT( !objs->invoices->has_key( "abc123" ) );
+  ASSERT( 2 == objs->invoices->get_version( "abc123" ) );
+  ASSERT( objs->invoices->get_snapshot( "abc123", 1, value, version ) && "1000" == value );
+  ASSERT( !objs->invoices->get_snapshot( "abc123", 2, value, version ) && 2 == version );
+
+  // once every snapshot sees the erase, nothing of the key is left
+  objs->invoices->collect_garbage( 2, 2 );
+  objs->invoices->collect_garbage( 3, 3 );
+  ASSERT( !objs->invoices->get_snapshot( "abc123", 3, value, version ) && 0 == version );
+  ASSERT( 0 == objs->invoices->get_version( "abc123" ) );
+
+  // a key can be set again after it was erased
+  objs->invoices->set( "abc123", "1318", 4 );
+  ASSERT( "1318" == objs->invoices->get( "abc123" ) );
+
+  // an LSM table erases keys whose versions were evicted too
+  Table table( "big", StorageEngineKind::LSM );
+  table.set( "apples", "1", 1 );
+  table.collect_garbage( 1, 1 );
+  table.collect_garbage( 2, 2 );
+  ASSERT( table.erase( "apples", 3 ) );
+  ASSERT( table.get_snapshot( "apples", 2, value, version ) && "1" == value );
+  ASSERT( !table.get_snapshot( "apples", 3, value, version ) );
+  ASSERT( !table.has_key( "apples" ) );
+  table.collect_garbage( 3, 3 );
+  table.collect_garbage( 4, 4 );
+  ASSERT( !table.get_snapshot( "apples", 4, value, version ) && 0 == version );
+}
 
-    // Commit changes
-    objs->invoices->commit_changes();
+void test_table_expiry( TestObjs * )
+{
+  for ( StorageEngineKind engine : { StorageEngineKind::HASH, StorageEngineKind::LSM } ) {
+    Table table( "sessions", engine );
+    std::string value;
+    uint64_t version, deadline;
+    uint64_t now = TimerWheel::now_ms();
+    uint64_t later = now + 60000;
+
+    // a key whose deadline has passed reads as missing at once, before
+    // it is erased
+    table.set( "alice", "1", 1, now - 1 );
+    table.set( "bob", "2", 2, later );
+    table.set( "carol", "3", 3 );
+    ASSERT( !table.has_key( "alice" ) );
+    ASSERT( !table.get( "alice", value, version ) && 1 == version );
+    ASSERT( !table.get_snapshot( "alice", 3, value, version ) && 1 == version );
+    ASSERT( table.get_snapshot( "bob", 3, value, version, deadline ) && "2" == value && later == deadline );
+    ASSERT( "3" == table.get( "carol" ) );
+    ASSERT( later == table.get_deadline( "bob" ) && 0 == table.get_deadline( "carol" ) );
+
+    // increments and compare-and-set keep the deadline, an expired key
+    // counts as missing, and set drops the deadline
+    ASSERT( 12 == table.increment( "bob", 10, 4 ) );
+    ASSERT( table.compare_and_set( "bob", "12", "13", 5 ) );
+    ASSERT( later == table.get_deadline( "bob" ) );
+    ASSERT( 1 == table.increment( "alice", 1, 6 ) );
+    ASSERT( 0 == table.get_deadline( "alice" ) );
+    table.set( "dave", "4", 7, now - 1 );
+    table.set( "erin", "5", 8, now - 1 );
+    table.set( "erin", "6", 9 );
+
+    // values with deadlines stay in memory (with their deadlines) when
+    // the rest are evicted
+    table.collect_garbage( 9, 9 );
+    ASSERT( table.get_snapshot( "bob", 9, value, version, deadline ) && "13" == value && later == deadline );
+    std::map<std::string, std::string> seen;
+    table.scan_snapshot( 9, [&]( std::string_view k, std::string_view v ) {
+      seen.emplace( k, v );
+    } );
+    ASSERT( 4 == seen.size() && "1" == seen["alice"] && "13" == seen["bob"] && "6" == seen["erin"] );
+
+    // only keys whose latest values have expired are taken, once each
+    // (within a tick of their deadlines)
+    std::vector<std::string> keys;
+    for ( unsigned i = 0; i < Table::NUM_SHARDS; i++ ) {
+      table.take_expired( i, now + TimerWheel::TICK_MS, keys );
+    }
+    ASSERT( 1 == keys.size() && "dave" == keys[0] );
+
+    // a key handed back is taken again at the time given, and reads as
+    // missing until then
+    table.retry_expired( "dave", now + 1000 );
+    keys.clear();
+    for ( unsigned i = 0; i < Table::NUM_SHARDS; i++ ) {
+      table.take_expired( i, now + 2 * TimerWheel::TICK_MS, keys );
+    }
+    ASSERT( keys.empty() );
+    ASSERT( !table.has_key( "dave" ) );
+    for ( unsigned i = 0; i < Table::NUM_SHARDS; i++ ) {
+      table.take_expired( i, now + 1000 + TimerWheel::TICK_MS, keys );
+    }
+    ASSERT( 1 == keys.size() && "dave" == keys[0] );
+    table.erase_expired( "dave", 10 );
+    ASSERT( 10 == table.get_version( "dave" ) );
+    ASSERT( !table.has_key( "dave" ) );
+    keys.clear();
+    for ( unsigned i = 0; i < Table::NUM_SHARDS; i++ ) {
+      table.take_expired( i, now + TimerWheel::TICK_MS, keys );
+    }
+    ASSERT( keys.empty() );
+  }
 
-    // Changes should still be visible
-    ASSERT( "1000" == objs->invoices->get( "abc123" ) );
-    ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
+  // deadlines are saved in snapshot images, and hide base values too
+  char path[] = "/tmp/expiry_testXXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  close( fd );
+  uint64_t now = TimerWheel::now_ms();
+  {
+    Table table( "sessions" );
+    table.set( "alice", "1", 1, now + 60000 );
+    table.set( "bob", "2", 2, now + 50 );
+    table.set( "carol", "3", 3 );
+    std::vector<Table*> tables = { &table };
+    ASSERT( 3 == SnapshotFile::write( path, tables, 3 ) );
+  }
+  std::shared_ptr<SnapshotFile> image = SnapshotFile::open( path );
+  std::string_view value;
+  uint64_t deadline;
+  ASSERT( image->get_table( 0 ).find( "alice", value, deadline ) && "1" == value && now + 60000 == deadline );
+  ASSERT( image->get_table( 0 ).find( "carol", value, deadline ) && "3" == value && 0 == deadline );
+  Table table( "sessions" );
+  table.set_base( image, &image->get_table( 0 ) );
+  ASSERT( now + 60000 == table.get_deadline( "alice" ) );
+  while ( TimerWheel::now_ms() <= now + 50 ) {
+    usleep( 10000 );
+  }
+  ASSERT( table.has_key( "alice" ) && !table.has_key( "bob" ) && table.has_key( "carol" ) );
+  std::string v;
+  uint64_t version;
+  ASSERT( !table.get_snapshot( "bob", 3, v, version ) );
+  unlink( path );
+}
 
-    ASSERT( !objs->invoices->has_key( "nonexistent" ) );
+void test_table_memory( TestObjs * )
+{
+  // without a budget, nothing is counted
+  Table plain( "plain" );
+  plain.set( "a", "1", 1 );
+  ASSERT( 0 == plain.get_memory() && !plain.is_full() );
+
+  for ( StorageEngineKind engine : { StorageEngineKind::HASH, StorageEngineKind::LSM } ) {
+    for ( EvictionPolicy policy : { EvictionPolicy::LRU, EvictionPolicy::LFU } ) {
+      // room for 400 keys like "k0000" with one-byte values
+      Table table( "cache", engine, MemoryBudget( 400 * ( 10 + 1 + Table::ENTRY_OVERHEAD ), policy ) );
+      size_t key_bytes = table.entry_bytes( "k0000", 1 );
+      ASSERT( 11 + Table::ENTRY_OVERHEAD == key_bytes );
+      std::string value;
+      uint64_t version;
+
+      // each key counts once, with its latest value, even once its
+      // versions are evicted
+      table.set( "k0000", "1", 1 );
+      ASSERT( key_bytes == table.get_memory() );
+      table.set( "k0000", "123", 2 );
+      ASSERT( table.entry_bytes( "k0000", 3 ) == table.get_memory() );
+      table.collect_garbage( 2, 2 );
+      table.collect_garbage( 3, 3 );
+      table.set( "k0000", "1", 3 );
+      ASSERT( key_bytes == table.get_memory() );
+      ASSERT( table.erase( "k0000", 4 ) );
+      ASSERT( 0 == table.get_memory() );
+
+      // twice as many keys as fit, the first 20 of them used often
+      uint64_t ts = 10;
+      char key[8];
+      for ( int i = 0; i < 800; i++ ) {
+        snprintf( key, sizeof( key ), "k%04d", i );
+        table.set( key, "1", ts++ );
+      }
+      for ( int n = 0; n < 300; n++ ) {
+        for ( int i = 0; i < 20; i++ ) {
+          snprintf( key, sizeof( key ), "k%04d", i );
+          ASSERT( table.get_snapshot( key, ts, value, version ) );
+        }
+      }
+      ASSERT( 800 * key_bytes == table.get_memory() );
+      ASSERT( table.is_full() );
+
+      // eviction brings each shard within its share of the budget
+      std::vector<std::string> keys;
+      for ( unsigned i = 0; i < Table::NUM_SHARDS; i++ ) {
+        ASSERT( table.is_full( i ) );
+        table.evict( i, ts, keys );
+        ASSERT( !table.is_full( i ) );
+      }
+      ASSERT( !table.is_full() );
+      ASSERT( keys.size() * key_bytes == 800 * key_bytes - table.get_memory() );
+      for ( const std::string &k : keys ) {
+        ASSERT( !table.has_key( k ) && ts == table.get_version( k ) );
+      }
+
+      // the keys used often are kept (LRU keys were all used within a
+      // second or so, so can't be told apart)
+      if ( policy == EvictionPolicy::LFU ) {
+        for ( int i = 0; i < 20; i++ ) {
+          snprintf( key, sizeof( key ), "k%04d", i );
+          ASSERT( table.has_key( key ) );
+        }
+      }
+    }
   }
+
+  // policy names
+  EvictionPolicy policy;
+  ASSERT( MemoryBudget::parse_policy( "lfu", policy ) && EvictionPolicy::LFU == policy );
+  ASSERT( MemoryBudget::parse_policy( "noeviction", policy ) && EvictionPolicy::NOEVICTION == policy );
+  ASSERT( !MemoryBudget::parse_policy( "random", policy ) );
 }
 
-void test_table_rollback_changes( TestObjs *objs )
+void test_write_set_commit( TestObjs *objs )
 {
+  WriteSet ws;
+
+  ws.put( objs->invoices, "abc123", "1000" );
+  ws.put( objs->invoices, "xyz456", "1318" );
+
+  // Changes should be visible to the transaction even though we
+  // haven't committed them...
+  ASSERT( "1000" == *ws.find( objs->invoices, "abc123" ) );
+  ASSERT( "1318" == *ws.find( objs->invoices, "xyz456" ) );
+  ASSERT( nullptr == ws.find( objs->invoices, "nonexistent" ) );
+  ASSERT( nullptr == ws.find( objs->line_items, "abc123" ) );
+
+  // ...but not to anyone reading the table
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    objs->invoices->set( "abc123", "1000" );
-    objs->invoices->set( "xyz456", "1318" );
+    ASSERT( !objs->invoices->has_key( "abc123" ) );
+    ASSERT( !objs->invoices->has_key( "xyz456" ) );
   }
 
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    // Changes should be visible even though we haven't committed them
+    // Commit changes
+    ws.apply( 1 );
+    ASSERT( ws.empty() );
+
+    // Changes should now be in the table
     ASSERT( "1000" == objs->invoices->get( "abc123" ) );
     ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
 
     ASSERT( !objs->invoices->has_key( "nonexistent" ) );
   }
+}
 
-  {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+void test_write_set_rollback( TestObjs *objs )
+{
+  WriteSet ws;
 
-    // Rollback changes
-    objs->invoices->rollback_changes();
-  }
+  ws.put( objs->invoices, "abc123", "1000" );
+  ws.put( objs->invoices, "xyz456", "1318" );
+  ws.put( objs->invoices, "abc123", "1001" );
+
+  // Later writes to a key replace earlier ones
+  ASSERT( "1001" == *ws.find( objs->invoices, "abc123" ) );
+
+  // Rollback changes
+  ws.clear();
+  ASSERT( ws.empty() );
+  ASSERT( nullptr == ws.find( objs->invoices, "abc123" ) );
 
   {
     TableGuard g( objs->invoices ); // ensure table is locked and unlocked
 
-    // Table should be empty again!
+    // Table should still be empty
     ASSERT( !objs->invoices->has_key( "abc123" ) );
     ASSERT( !objs->invoices->has_key( "xyz456" ) );
     ASSERT( !objs->invoices->has_key( "nonexistent" ) );
@@ -511,63 +1095,1056 @@ void test_table_rollback_changes( TestObjs *objs )
 // Test that changes can be committed, then more modifications can be
 // done and then rolled back, and the originally committed data is still
 // there.
-void test_table_commit_and_rollback( TestObjs *objs )
+void test_write_set_commit_and_rollback( TestObjs *objs )
 {
-  // Add some data
+  WriteSet ws;
+
+  // Add some data (to two tables) and commit it
+  ws.put( objs->line_items, "apples", "100" );
+  ws.put( objs->line_items, "bananas", "150" );
+  ws.put( objs->invoices, "abc123", "1000" );
   {
-    TableGuard g( objs->line_items );
+    TableGuard g1( objs->line_items );
+    TableGuard g2( objs->invoices );
 
-    objs->line_items->set( "apples", "100" );
-    objs->line_items->set( "bananas", "150" );
+    ws.apply( 1 );
   }
 
-  // Commit changes
+  // Ensure that data is there
   {
     TableGuard g( objs->line_items );
 
-    objs->line_items->commit_changes();
+    ASSERT( "100" == objs->line_items->get( "apples" ) );
+    ASSERT( "150" == objs->line_items->get( "bananas" ) );
+    ASSERT( "1000" == objs->invoices->get( "abc123" ) );
   }
 
-  // Ensure that data is there
+  // Add more data, then roll it back
+  ws.put( objs->line_items, "oranges", "220" );
+  ws.put( objs->line_items, "apples", "0" );
+  ASSERT( "0" == *ws.find( objs->line_items, "apples" ) );
+  ws.clear();
+
+  // Original data should still be there (since it was committed),
+  // but pending changes shouldn't be there
   {
     TableGuard g( objs->line_items );
 
     ASSERT( "100" == objs->line_items->get( "apples" ) );
     ASSERT( "150" == objs->line_items->get( "bananas" ) );
+    ASSERT( !objs->line_items->has_key( "oranges" ) );
   }
+}
+
+void test_write_set_erase( TestObjs *objs )
+{
+  WriteSet ws;
 
-  // Add more data
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( objs->invoices );
+    objs->invoices->set( "abc123", "1000", 1 );
+  }
 
-    objs->line_items->set( "oranges", "220" );
+  // an erase is buffered as a key without a value, which a later
+  // write of the key replaces
+  ws.erase( objs->invoices, "abc123" );
+  ASSERT( nullptr != ws.find( objs->invoices, "abc123" ) && !*ws.find( objs->invoices, "abc123" ) );
+  ws.put( objs->invoices, "xyz456", "1318" );
+  ws.erase( objs->invoices, "xyz456" );
+  ASSERT( !*ws.find( objs->invoices, "xyz456" ) );
+  ws.put( objs->invoices, "xyz456", "1319" );
+  ASSERT( "1319" == *ws.find( objs->invoices, "xyz456" ) );
+
+  // rolling back leaves the key in the table
+  ws.clear();
+  {
+    TableGuard g( objs->invoices );
+    ASSERT( "1000" == objs->invoices->get( "abc123" ) );
   }
 
-  // Ensure that data is there
+  // committing erases it, once prepare() has found it (a key that
+  // doesn't exist is left alone)
+  ws.erase( objs->invoices, "abc123" );
+  ws.erase( objs->invoices, "nokey" );
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( objs->invoices );
+    ws.prepare();
+    ws.apply( 2 );
+    ASSERT( !objs->invoices->has_key( "abc123" ) );
+    ASSERT( !objs->invoices->has_key( "nokey" ) );
+    std::string value;
+    uint64_t version;
+    ASSERT( !objs->invoices->get( "nokey", value, version ) );
+    ASSERT( 0 == version );
+  }
+}
 
-    ASSERT( "100" == objs->line_items->get( "apples" ) );
-    ASSERT( "150" == objs->line_items->get( "bananas" ) );
-    ASSERT( "220" == objs->line_items->get( "oranges" ) );
+void test_read_set_validate( TestObjs *objs )
+{
+  ReadSet rs;
+  std::string value;
+  uint64_t version;
+
+  {
+    TableGuard g( objs->invoices );
+    objs->invoices->set( "abc123", "1000", 1 );
+
+    ASSERT( objs->invoices->get( "abc123", value, version ) );
+    ASSERT( version != 0 );
+    rs.record( objs->invoices, "abc123", version );
+
+    // a key that doesn't exist is read as version 0
+    ASSERT( !objs->invoices->get( "xyz456", value, version ) );
+    ASSERT( 0 == version );
+    rs.record( objs->invoices, "xyz456", version );
+
+    ASSERT( rs.validate() );
+
+    // only the first read of a key counts
+    rs.record( objs->invoices, "abc123", version + 1 );
+    ASSERT( rs.validate() );
+
+    // rewriting a key (even with the same value) invalidates the read
+    objs->invoices->set( "abc123", "1000", 2 );
+    ASSERT( !rs.validate() );
   }
 
-  // Rollback most recent change
+  // creating a key that was read as missing invalidates the read
+  rs.clear();
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( objs->invoices );
+    rs.record( objs->invoices, "xyz456", objs->invoices->get_version( "xyz456" ) );
+    ASSERT( rs.validate() );
+    objs->invoices->set( "xyz456", "1318", 3 );
+    ASSERT( !rs.validate() );
+  }
+
+  std::vector<std::pair<Table*, unsigned>> shards;
+  rs.collect_shards( shards );
+  ASSERT( 1 == shards.size() );
+  ASSERT( objs->invoices == shards[0].first && Table::shard_of( "xyz456" ) == shards[0].second );
+}
 
-    objs->line_items->rollback_changes();
+void test_storage_engines( TestObjs * )
+{
+  for ( StorageEngineKind kind : { StorageEngineKind::HASH, StorageEngineKind::ORDERED, StorageEngineKind::LSM } ) {
+    std::unique_ptr<StorageEngine> engine( StorageEngine::create( kind ) );
+    std::string value;
+
+    ASSERT( 0 == engine->size() );
+    ASSERT( !engine->get( "apples", value ) );
+
+    // enough keys to make the hash index grow several times
+    for ( int i = 0; i < 1000; i++ ) {
+      engine->put( "k" + std::to_string( i ), std::to_string( i ) );
+    }
+    ASSERT( 1000 == engine->size() );
+    for ( int i = 0; i < 1000; i++ ) {
+      ASSERT( engine->get( "k" + std::to_string( i ), value ) );
+      ASSERT( std::to_string( i ) == value );
+    }
+    ASSERT( !engine->contains( "k1000" ) );
+
+    // overwriting does not add a key
+    engine->put( "k7", "seven" );
+    ASSERT( 1000 == engine->size() );
+    ASSERT( engine->get( "k7", value ) );
+    ASSERT( "seven" == value );
+
+    ASSERT( engine->erase( "k7" ) );
+    ASSERT( !engine->erase( "k7" ) );
+    ASSERT( !engine->contains( "k7" ) );
+    ASSERT( 999 == engine->size() );
   }
 
-  // Original data should still be there (since it was committed),
-  // but pending change shouldn't be there
+  // engine names accepted by CREATE
+  StorageEngineKind kind;
+  ASSERT( StorageEngine::parse_kind( "ordered", kind ) && kind == StorageEngineKind::ORDERED );
+  ASSERT( StorageEngine::parse_kind( "hash", kind ) && kind == StorageEngineKind::HASH );
+  ASSERT( StorageEngine::parse_kind( "lsm", kind ) && kind == StorageEngineKind::LSM );
+  ASSERT( !StorageEngine::parse_kind( "btree", kind ) );
+
+  // a table behaves the same whatever engine it was created with
+  Table ordered( "ordered_items", StorageEngineKind::ORDERED );
+  ordered.set( "apples", "100", 1 );
+  ASSERT( "100" == ordered.get( "apples" ) );
+  ASSERT( !ordered.has_key( "pears" ) );
+}
+
+void test_hash_index_erase( TestObjs * )
+{
+  HashIndex index;
+  std::string value;
+
+  // erasing every other key must keep the rest reachable
+  // (backward-shift deletion moves entries of the same probe run)
+  for ( int i = 0; i < 5000; i++ ) {
+    index.put( "key" + std::to_string( i ), std::to_string( i ) );
+  }
+  size_t capacity = index.capacity();
+  ASSERT( index.size() * 8 <= capacity * 7 );
+
+  for ( int i = 0; i < 5000; i += 2 ) {
+    ASSERT( index.erase( "key" + std::to_string( i ) ) );
+  }
+  ASSERT( 2500 == index.size() );
+  for ( int i = 0; i < 5000; i++ ) {
+    ASSERT( ( i % 2 == 1 ) == index.get( "key" + std::to_string( i ), value ) );
+  }
+
+  // reinserting reuses the freed slots
+  for ( int i = 0; i < 5000; i += 2 ) {
+    index.put( "key" + std::to_string( i ), "again" );
+  }
+  ASSERT( 5000 == index.size() );
+  ASSERT( capacity == index.capacity() );
+  ASSERT( index.get( "key42", value ) && "again" == value );
+  ASSERT( index.get( "key43", value ) && "43" == value );
+
+  // a table that empties out shrinks, down to its smallest size
+  for ( int i = 100; i < 5000; i++ ) {
+    ASSERT( index.erase( "key" + std::to_string( i ) ) );
+  }
+  ASSERT( 100 == index.size() );
+  ASSERT( index.capacity() < capacity / 8 && index.size() * 4 >= index.capacity() );
+  for ( int i = 0; i < 5000; i++ ) {
+    ASSERT( ( i < 100 ) == index.contains( "key" + std::to_string( i ) ) );
+  }
+  for ( int i = 0; i < 100; i++ ) {
+    ASSERT( index.erase( "key" + std::to_string( i ) ) );
+  }
+  ASSERT( 0 == index.size() && 16 == index.capacity() );
+}
+
+void test_rw_lock( TestObjs *objs )
+{
+  RWLock lock;
+
+  // readers share, writers exclude everyone
+  ASSERT( lock.trylock_shared() );
+  ASSERT( lock.trylock_shared() );
+  ASSERT( !lock.trylock() );
+  lock.unlock_shared();
+  ASSERT( !lock.trylock() );
+  lock.unlock_shared();
+  ASSERT( lock.trylock() );
+  ASSERT( !lock.trylock_shared() );
+  ASSERT( !lock.trylock() );
+
+  // a reader parked behind the writer is woken by an unlock from a
+  // different thread than the one that locked
+  bool got_it = false;
+  std::thread reader( [&]() {
+    lock.lock_shared();
+    got_it = true;
+    lock.unlock_shared();
+  } );
+  std::thread( [&]() { lock.unlock(); } ).join();
+  reader.join();
+  ASSERT( got_it );
+  ASSERT( lock.trylock() );
+  lock.unlock();
+
+  // once a writer waits, new readers are turned away until it is done
+  ASSERT( lock.trylock_shared() );
+  std::thread writer( [&]() {
+    lock.lock();
+    lock.unlock();
+  } );
+  while ( lock.trylock_shared() ) {
+    lock.unlock_shared();
+    std::this_thread::yield();
+  }
+  lock.unlock_shared();
+  writer.join();
+  ASSERT( lock.trylock_shared() );
+  lock.unlock_shared();
+
+  // autocommit reads of a table take the shared lock of the key's shard
+  unsigned shard = Table::shard_of( "apples" );
+  ASSERT( objs->line_items->trylock_shared( shard ) );
+  ASSERT( objs->line_items->trylock_shared( shard ) );
+  ASSERT( !objs->line_items->trylock( shard ) );
+  objs->line_items->unlock_shared( shard );
+  objs->line_items->unlock_shared( shard );
+}
+
+void test_table_shards( TestObjs *objs )
+{
+  // find two keys that live in different shards
+  std::string a = "k0", b;
+  for ( int i = 1; b.empty(); i++ ) {
+    std::string k = "k" + std::to_string( i );
+    if ( Table::shard_of( k ) != Table::shard_of( a ) ) {
+      b = k;
+    }
+  }
+  unsigned sa = Table::shard_of( a ), sb = Table::shard_of( b );
+
+  // disjoint keys can be locked and changed independently
+  ASSERT( objs->line_items->trylock( sa ) );
+  ASSERT( objs->line_items->trylock( sb ) );
+  ASSERT( !objs->line_items->trylock( sa ) );
+  objs->line_items->set( a, "1", 1 );
+
+  // a whole-table trylock fails (and takes nothing) while any shard is held
+  ASSERT( !objs->line_items->trylock() );
+  objs->line_items->unlock( sa );
+  ASSERT( !objs->line_items->trylock() );
+  ASSERT( objs->line_items->trylock( sa ) );
+  objs->line_items->unlock( sa );
+  objs->line_items->unlock( sb );
+
   {
     TableGuard g( objs->line_items );
+    ASSERT( "1" == objs->line_items->get( a ) );
+    ASSERT( !objs->line_items->has_key( b ) );
+  }
+}
 
-    ASSERT( "100" == objs->line_items->get( "apples" ) );
-    ASSERT( "150" == objs->line_items->get( "bananas" ) );
-    ASSERT( !objs->line_items->has_key( "oranges" ) );
+void test_snapshots( TestObjs * )
+{
+  CommitClock clock;
+  SnapshotRegistry registry;
+
+  // commits become visible in timestamp order, even if published out of order
+  uint64_t t1 = clock.begin_commit();
+  uint64_t t2 = clock.begin_commit();
+  ASSERT( t1 < t2 );
+  ASSERT( 0 == clock.visible() );
+  std::thread late( [&]() { clock.publish( t2 ); } );
+  clock.publish( t1 );
+  late.join();
+  ASSERT( t2 == clock.visible() );
+
+  // with no readers, nothing older than the visible timestamp is needed
+  SnapshotRegistry::Slot *a = registry.acquire_slot();
+  SnapshotRegistry::Slot *b = registry.acquire_slot();
+  ASSERT( a != b );
+  ASSERT( t2 == registry.oldest( clock ) );
+
+  // a reader's snapshot holds back the oldest timestamp until it ends
+  ASSERT( t2 == registry.begin( a, clock ) );
+  uint64_t t3 = clock.begin_commit();
+  clock.publish( t3 );
+  ASSERT( t3 == registry.begin( b, clock ) );
+  ASSERT( t2 == registry.oldest( clock ) );
+  registry.end( a );
+  ASSERT( t3 == registry.oldest( clock ) );
+
+  // released slots are reused
+  registry.end( b );
+  registry.release_slot( a );
+  ASSERT( a == registry.acquire_slot() );
+}
+
+void test_version_store( TestObjs *objs )
+{
+  VersionStore store;
+  std::string value;
+  uint64_t version;
+
+  store.install( "apples", "100", 1 );
+  store.install( "apples", "150", 3 );
+  store.install( "bananas", "7", 2 );
+
+  // each snapshot sees the newest value committed at or before it
+  ASSERT( !store.read( "apples", 0, value, version ) && 0 == version );
+  ASSERT( store.read( "apples", 1, value, version ) && "100" == value && 1 == version );
+  ASSERT( store.read( "apples", 2, value, version ) && "100" == value && 1 == version );
+  ASSERT( store.read( "apples", 5, value, version ) && "150" == value && 3 == version );
+  ASSERT( !store.read( "bananas", 1, value, version ) );
+  ASSERT( !store.read( "cherries", 5, value, version ) );
+
+  // pruning keeps every version a snapshot at or after 2 can read...
+  ASSERT( 0 == store.prune( 2 ) );
+  ASSERT( 3 == store.version_count() );
+
+  // ...and frees the ones that only older snapshots could
+  ASSERT( 1 == store.prune( 3 ) );
+  ASSERT( 2 == store.version_count() );
+  ASSERT( store.read( "apples", 3, value, version ) && "150" == value );
+  ASSERT( store.read( "bananas", 3, value, version ) && "7" == value );
+
+  // the directory keeps finding every key as it grows
+  for ( uint64_t i = 0; i < 1000; i++ ) {
+    store.install( "key" + std::to_string( i ), std::to_string( i ), 10 + i );
+  }
+  store.prune( 2000 );
+  for ( uint64_t i = 0; i < 1000; i++ ) {
+    ASSERT( store.read( "key" + std::to_string( i ), 2000, value, version ) );
+    ASSERT( std::to_string( i ) == value && 10 + i == version );
+  }
+
+  // tables keep the latest value in the storage engine and every
+  // version a snapshot may read in the shard's version store; once
+  // every snapshot sees the latest value, the chain is evicted and
+  // snapshot reads go to the engine
+  objs->invoices->set( "abc123", "1000", 1 );
+  objs->invoices->set( "abc123", "1318", 2 );
+  ASSERT( "1318" == objs->invoices->get( "abc123" ) );
+  ASSERT( 2 == objs->invoices->get_version( "abc123" ) );
+  ASSERT( objs->invoices->get_snapshot( "abc123", 1, value, version ) && "1000" == value );
+  ASSERT( 0 == objs->invoices->collect_garbage( 2, 2 ) );
+  ASSERT( objs->invoices->get_snapshot( "abc123", 2, value, version ) && "1318" == value && 2 == version );
+  ASSERT( 0 == objs->invoices->collect_garbage( 2, 2 ) );
+  ASSERT( 2 == objs->invoices->collect_garbage( 3, 3 ) );
+  ASSERT( objs->invoices->get_snapshot( "abc123", 3, value, version ) && "1318" == value );
+  objs->invoices->set( "abc123", "1400", 3 );
+  ASSERT( objs->invoices->get_snapshot( "abc123", 2, value, version ) && "1318" == value );
+  ASSERT( objs->invoices->get_snapshot( "abc123", 3, value, version ) && "1400" == value );
+}
+
+void test_version_store_erase( TestObjs * )
+{
+  VersionStore store;
+  std::string value;
+  uint64_t version, deadline;
+  bool present;
+
+  store.install( "apples", "100", 1 );
+  store.install( "bananas", "7", 2 );
+  store.install( "cherries", "9", 2 );
+  store.erase( "apples", 3, false );
+  store.erase( "bananas", 4, true );
+
+  // snapshots before an erase still read the value, later ones read
+  // the tombstone
+  ASSERT( store.read( "apples", 2, value, version ) && "100" == value && 1 == version );
+  ASSERT( !store.read( "apples", 3, value, version, deadline, present ) && 3 == version && present );
+  ASSERT( store.contains( "apples", 2 ) && !store.contains( "apples", 3 ) );
+  ASSERT( 3 == store.erased_at( "apples" ) );
+  ASSERT( 0 == store.erased_at( "cherries" ) );
+  size_t seen = 0;
+  store.scan( 5, [&]( std::string_view key, std::string_view, uint64_t ) {
+    ASSERT( "cherries" == key );
+    seen++;
+  } );
+  ASSERT( 1 == seen );
+
+  // once every snapshot sees the erases, the values they hid are freed
+  // and the erased key is dropped (unless its tombstone must be kept)
+  ASSERT( 2 == store.prune( 5, 5 ) );
+  ASSERT( 2 == store.version_count() );
+  ASSERT( !store.read( "apples", 5, value, version, deadline, present ) && 0 == version && !present );
+  ASSERT( 4 == store.erased_at( "bananas" ) );
+  ASSERT( store.read( "cherries", 5, value, version ) && "9" == value );
+
+  // the dropped key is freed once no reader can still be looking at it
+  ASSERT( 0 == store.prune( 5, 5 ) );
+  ASSERT( 1 == store.prune( 6, 6 ) );
+
+  // and can be written again
+  store.install( "apples", "101", 7 );
+  ASSERT( store.read( "apples", 7, value, version ) && "101" == value );
+}
+
+void test_timer_wheel( TestObjs * )
+{
+  const uint64_t TICK = TimerWheel::TICK_MS;
+  const uint64_t RANGE = TICK << ( TimerWheel::SLOT_BITS * TimerWheel::LEVELS );
+  TimerWheel wheel( 0 );
+  std::vector<std::string> due;
+
+  // keys come due in deadline order (at the first tick after their
+  // deadlines), on every level of the wheel
+  wheel.add( "a", 50 );
+  wheel.add( "b", 10 * TICK );
+  wheel.add( "c", 640 * TICK + 1 );
+  wheel.add( "d", 300000 * TICK );
+  wheel.add( "e", 2 * RANGE );
+  wheel.add( "b", 10 * TICK );
+  ASSERT( 6 == wheel.size() );
+  wheel.advance( 99, due );
+  ASSERT( due.empty() );
+  wheel.advance( 100, due );
+  ASSERT( 1 == due.size() && "a" == due[0] );
+  due.clear();
+  wheel.advance( 10 * TICK, due );
+  ASSERT( 2 == due.size() && "b" == due[0] && "b" == due[1] );
+  due.clear();
+  wheel.advance( 640 * TICK, due );
+  ASSERT( due.empty() );
+  wheel.advance( 641 * TICK, due );
+  ASSERT( 1 == due.size() && "c" == due[0] );
+  due.clear();
+  wheel.advance( 300000 * TICK - 1, due );
+  ASSERT( due.empty() );
+  wheel.advance( 300000 * TICK, due );
+  ASSERT( 1 == due.size() && "d" == due[0] );
+  due.clear();
+
+  // a deadline beyond the wheel's range waits until it is in range
+  wheel.advance( RANGE + TICK, due );
+  ASSERT( due.empty() && 1 == wheel.size() );
+  wheel.advance( 2 * RANGE, due );
+  ASSERT( 1 == due.size() && "e" == due[0] && wheel.empty() );
+  due.clear();
+
+  // a key added when it is already due is taken at the next tick
+  wheel.add( "f", 5 );
+  wheel.advance( 2 * RANGE, due );
+  ASSERT( due.empty() );
+  wheel.advance( 2 * RANGE + TICK, due );
+  ASSERT( 1 == due.size() && "f" == due[0] );
+}
+
+void test_lock_manager( TestObjs *objs )
+{
+  typedef LockManager::Result Result;
+  LockManager locks( 50 );
+  Table *t = objs->invoices;
+  LockManager::TxnId a = locks.begin(), b = locks.begin(), c = locks.begin();
+  ASSERT( a != 0 && a != b && b != c );
+
+  // a busy shard makes later requesters wait, in arrival order
+  ASSERT( Result::GRANTED == locks.acquire( a, t, 0 ) );
+  ASSERT( Result::GRANTED == locks.acquire( a, t, 0 ) );
+  ASSERT( !t->trylock( 0 ) );
+  ASSERT( Result::WAIT == locks.acquire( b, t, 0 ) );
+  ASSERT( Result::WAIT == locks.acquire( c, t, 0 ) );
+  locks.release( a, t, 0 );
+  ASSERT( Result::WAIT == locks.acquire( c, t, 0 ) );
+  ASSERT( Result::GRANTED == locks.acquire( b, t, 0 ) );
+
+  // waiting for a transaction that waits for you is a deadlock
+  // (c waits for b on shard 0, so b must not wait for c on shard 1)
+  ASSERT( Result::GRANTED == locks.acquire( c, t, 1 ) );
+  ASSERT( Result::DEADLOCK == locks.acquire( b, t, 1 ) );
+
+  // the victim is no longer queued, so its next request starts afresh
+  ASSERT( Result::WAIT == locks.acquire( a, t, 1 ) );
+  locks.cancel( a );
+  locks.release( b, t, 0 );
+  ASSERT( Result::GRANTED == locks.acquire( c, t, 0 ) );
+
+  // nobody waits forever
+  ASSERT( Result::WAIT == locks.acquire( a, t, 0 ) );
+  std::this_thread::sleep_for( std::chrono::milliseconds( 60 ) );
+  ASSERT( Result::TIMEOUT == locks.acquire( a, t, 0 ) );
+
+  locks.release( c, t, 0 );
+  locks.release( c, t, 1 );
+  ASSERT( t->trylock() );
+  t->unlock();
+
+  // a waiter is woken when the lock may be granted to it, and
+  // autocommit writes keep off a shard while anyone is queued for it
+  std::vector<LockManager::TxnId> woken;
+  locks.set_wakeup( [&]( LockManager::TxnId txn ) { woken.push_back( txn ); } );
+  ASSERT( !locks.is_queued( t, 2 ) );
+  ASSERT( Result::GRANTED == locks.acquire( a, t, 2 ) );
+  ASSERT( Result::WAIT == locks.acquire( b, t, 2 ) );
+  ASSERT( Result::WAIT == locks.acquire( c, t, 2 ) );
+  ASSERT( locks.is_queued( t, 2 ) && !locks.is_next( b ) );
+  locks.release( a, t, 2 );
+  ASSERT( 1 == woken.size() && b == woken[0] );
+  ASSERT( locks.is_next( b ) && !locks.is_next( c ) );
+
+  // the first waiter giving up wakes the next one
+  locks.cancel( b );
+  ASSERT( 2 == woken.size() && c == woken[1] );
+
+  // a shard held by an autocommit write is only held briefly
+  ASSERT( t->trylock( 2 ) );
+  ASSERT( Result::BUSY == locks.acquire( c, t, 2 ) );
+  t->unlock( 2 );
+  ASSERT( Result::GRANTED == locks.acquire( c, t, 2 ) );
+  ASSERT( !locks.is_queued( t, 2 ) );
+  locks.release( c, t, 2 );
+  ASSERT( 2 == woken.size() );
+}
+
+void test_table_directory( TestObjs * )
+{
+  TableDirectory directory;
+  CommitClock clock;
+  SnapshotRegistry registry;
+  SnapshotRegistry::Slot *slot = registry.acquire_slot();
+
+  ASSERT( nullptr == directory.find( "invoices" ) );
+
+  // a reader holding an old snapshot keeps using whatever map it loaded
+  registry.begin( slot, clock );
+  Table *invoices = new Table( "invoices" );
+  ASSERT( directory.add( invoices, clock ) );
+  ASSERT( invoices == directory.find( "invoices" ) );
+  directory.collect_garbage( registry.oldest( clock ) );
+  registry.end( slot );
+
+  // names are unique (and a failed create leaves the epoch alone)
+  uint64_t epoch = directory.epoch();
+  Table *duplicate = new Table( "invoices" );
+  ASSERT( !directory.add( duplicate, clock ) );
+  delete duplicate;
+  ASSERT( epoch == directory.epoch() );
+
+  // every create is a commit, and later lookups see every table
+  for ( int i = 0; i < 100; i++ ) {
+    ASSERT( directory.add( new Table( "t" + std::to_string( i ) ), clock ) );
+  }
+  ASSERT( 101 == clock.visible() );
+  ASSERT( epoch + 100 == directory.epoch() );
+  directory.collect_garbage( registry.oldest( clock ) );
+  ASSERT( invoices == directory.find( "invoices" ) );
+  ASSERT( nullptr != directory.find( "t99" ) );
+  ASSERT( "t42" == directory.find( "t42" )->get_name() );
+
+  std::vector<Table*> tables;
+  directory.list( tables );
+  ASSERT( 101 == tables.size() );
+
+  registry.release_slot( slot );
+}
+
+// Replayer remembering the records of a log as text
+class RecordingReplayer : public WriteAheadLog::Replayer {
+public:
+  std::vector<std::string> records;
+
+  void create_table( std::string_view name, StorageEngineKind engine, const MemoryBudget &budget ) override
+  {
+    std::string record = "CREATE " + std::string( name ) + ( engine == StorageEngineKind::ORDERED ? " ordered" : "" );
+    if ( budget.is_limited() ) {
+      record += " max " + std::to_string( budget.max_bytes ) + ( budget.policy == EvictionPolicy::LFU ? " lfu" : budget.policy == EvictionPolicy::LRU ? " lru" : " noeviction" );
+    }
+    records.push_back( record );
+  }
+
+  void commit( const std::vector<WriteAheadLog::Write> &writes ) override
+  {
+    std::string record = "COMMIT";
+    for ( const WriteAheadLog::Write &w : writes ) {
+      record += " " + std::string( w.table ) + "." + std::string( w.key ) + ( w.erased ? " erased" : "=" + std::string( w.value ) );
+      if ( w.deadline != 0 ) {
+        record += " until " + std::to_string( w.deadline );
+      }
+    }
+    records.push_back( record );
+  }
+};
+
+void test_write_ahead_log( TestObjs * )
+{
+  char path[] = "/tmp/wal_testXXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  close( fd );
+
+  {
+    // a new log replays nothing
+    WriteAheadLog log( WriteAheadLog::SyncPolicy::ALWAYS );
+    std::atomic<WriteAheadLog::Lsn> told( 0 );
+    log.set_on_durable( [&]( WriteAheadLog::Lsn lsn ) { told.store( lsn ); } );
+    RecordingReplayer replayer;
+    ASSERT( 0 == log.open( path, replayer ) );
+    ASSERT( log.is_durable( 0 ) );
+
+    WriteAheadLog::Record create = WriteAheadLog::Record::create_table( "fruit", StorageEngineKind::ORDERED );
+    ASSERT( 1 == log.append( create ) );
+
+    WriteAheadLog::Record commit( WriteAheadLog::Record::COMMIT );
+    commit.add_write( "fruit", "apple", "3" );
+    commit.add_write( "fruit", "pear", "" );
+    ASSERT( 2 == log.append( commit ) );
+
+    // the writer thread flushes the records in the background, and
+    // says so once they are durable
+    while ( told.load() < 2 ) {
+      usleep( 1000 );
+    }
+    ASSERT( log.is_durable( 2 ) );
+  }
+
+  // sync policies
+  WriteAheadLog::SyncPolicy policy;
+  unsigned interval_ms = 0;
+  ASSERT( WriteAheadLog::parse_policy( "never", policy, interval_ms ) );
+  ASSERT( WriteAheadLog::SyncPolicy::NEVER == policy );
+  ASSERT( WriteAheadLog::parse_policy( "20", policy, interval_ms ) );
+  ASSERT( WriteAheadLog::SyncPolicy::INTERVAL == policy && 20 == interval_ms );
+  ASSERT( !WriteAheadLog::parse_policy( "0", policy, interval_ms ) );
+  ASSERT( !WriteAheadLog::parse_policy( "often", policy, interval_ms ) );
+
+  // a torn record at the end of the log (a crash in the middle of a
+  // write) is cut off
+  fd = ::open( path, O_WRONLY | O_APPEND );
+  ASSERT( fd >= 0 );
+  ASSERT( 6 == write( fd, "\x20\0\0\0ab", 6 ) );
+  close( fd );
+
+  {
+    WriteAheadLog log( WriteAheadLog::SyncPolicy::NEVER );
+    RecordingReplayer replayer;
+    ASSERT( 2 == log.open( path, replayer ) );
+    ASSERT( 2 == replayer.records.size() );
+    ASSERT( "CREATE fruit ordered" == replayer.records[0] );
+    ASSERT( "COMMIT fruit.apple=3 fruit.pear=" == replayer.records[1] );
+
+    // new records follow the last intact one
+    WriteAheadLog::Record commit( WriteAheadLog::Record::COMMIT );
+    commit.add_write( "fruit", "apple", "4", 1234 );
+    commit.add_erase( "fruit", "pear" );
+    log.append( commit );
+
+    // a table's memory budget is logged with it
+    WriteAheadLog::Record create = WriteAheadLog::Record::create_table( "veg", StorageEngineKind::HASH, MemoryBudget( 4096, EvictionPolicy::LFU ) );
+    log.append( create );
+  }
+
+  {
+    WriteAheadLog log( WriteAheadLog::SyncPolicy::NEVER );
+    RecordingReplayer replayer;
+    ASSERT( 4 == log.open( path, replayer ) );
+    ASSERT( "COMMIT fruit.apple=4 until 1234 fruit.pear erased" == replayer.records[2] );
+    ASSERT( "CREATE veg max 4096 lfu" == replayer.records[3] );
+
+    // after a rotation, records go to a new file
+    log.rotate();
+    WriteAheadLog::Record commit( WriteAheadLog::Record::COMMIT );
+    commit.add_write( "fruit", "apple", "5" );
+    log.append( commit );
   }
+
+  std::string rotated = std::string( path ) + WriteAheadLog::ROTATED_SUFFIX;
+  {
+    // both files are replayed, the rotated one first
+    WriteAheadLog log( WriteAheadLog::SyncPolicy::NEVER );
+    RecordingReplayer replayer;
+    ASSERT( 5 == log.open( path, replayer ) );
+    ASSERT( "COMMIT fruit.apple=4 until 1234 fruit.pear erased" == replayer.records[2] );
+    ASSERT( "COMMIT fruit.apple=5" == replayer.records[4] );
+
+    // once the rotated records are in a snapshot, they are dropped
+    log.remove_rotated();
+    ASSERT( 0 != access( rotated.c_str(), F_OK ) );
+  }
+
+  {
+    WriteAheadLog log( WriteAheadLog::SyncPolicy::NEVER );
+    RecordingReplayer replayer;
+    ASSERT( 1 == log.open( path, replayer ) );
+    ASSERT( "COMMIT fruit.apple=5" == replayer.records[0] );
+  }
+
+  unlink( path );
+}
+
+void test_snapshot_file( TestObjs * )
+{
+  char path[] = "/tmp/snapshot_testXXXXXX";
+  int fd = mkstemp( path );
+  ASSERT( fd >= 0 );
+  close( fd );
+  unlink( path );
+
+  // no image yet
+  ASSERT( nullptr == SnapshotFile::open( path ) );
+
+  {
+    Table fruit( "fruit", StorageEngineKind::ORDERED );
+    Table veg( "veg", StorageEngineKind::HASH, MemoryBudget( 1 << 20, EvictionPolicy::LRU ) );
+    fruit.set( "pear", "2", 1 );
+    fruit.set( "apple", "1", 2 );
+    fruit.set( "apple", "3", 3 );
+    veg.set( "kale", "4", 4 );
+
+    // the image holds each key's value as of the snapshot
+    std::vector<Table*> tables = { &fruit, &veg };
+    ASSERT( 2 == SnapshotFile::write( path, tables, 2 ) );
+  }
+
+  std::shared_ptr<SnapshotFile> image = SnapshotFile::open( path );
+  ASSERT( nullptr != image );
+  ASSERT( 2 == image->num_tables() );
+  const SnapshotFile::Section &fruit_image = image->get_table( 0 );
+  ASSERT( "fruit" == fruit_image.get_name() );
+  ASSERT( StorageEngineKind::ORDERED == fruit_image.get_engine_kind() );
+  ASSERT( 2 == fruit_image.size() );
+  std::string_view key, value;
+  uint64_t deadline;
+  fruit_image.get( 0, key, value, deadline );
+  ASSERT( "apple" == key && "1" == value && 0 == deadline );
+  ASSERT( fruit_image.find( "pear", value ) && "2" == value );
+  ASSERT( !fruit_image.find( "plum", value ) );
+  ASSERT( 0 == image->get_table( 1 ).size() );
+  ASSERT( !fruit_image.get_budget().is_limited() );
+  ASSERT( ( 1 << 20 ) == image->get_table( 1 ).get_budget().max_bytes );
+  ASSERT( EvictionPolicy::LRU == image->get_table( 1 ).get_budget().policy );
+
+  // a table loaded from the image serves its keys from the image until
+  // they are written
+  Table fruit( "fruit", StorageEngineKind::ORDERED );
+  fruit.set_base( image, &fruit_image );
+  ASSERT( fruit.has_key( "apple" ) );
+  ASSERT( "1" == fruit.get( "apple" ) );
+  ASSERT( 0 == fruit.get_version( "apple" ) );
+  fruit.set( "apple", "5", 10 );
+  fruit.set( "plum", "6", 11 );
+  ASSERT( "5" == fruit.get( "apple" ) );
+  ASSERT( "2" == fruit.get( "pear" ) );
+
+  // snapshots from before the write still see the base value
+  std::string v;
+  uint64_t version;
+  ASSERT( fruit.get_snapshot( "apple", 9, v, version ) && "1" == v && 0 == version );
+  ASSERT( fruit.get_snapshot( "apple", 10, v, version ) && "5" == v && 10 == version );
+  ASSERT( !fruit.get_snapshot( "plum", 10, v, version ) );
+
+  // scans merge both layers
+  std::map<std::string, std::string> seen;
+  fruit.scan_snapshot( 10, [&]( std::string_view k, std::string_view val ) {
+    seen.emplace( k, val );
+  } );
+  ASSERT( 2 == seen.size() && "5" == seen["apple"] && "2" == seen["pear"] );
+  std::vector<std::pair<std::string, std::string>> entries;
+  fruit.scan_range( 9, "", "", 10, entries );
+  ASSERT( 2 == entries.size() && "1" == entries[0].second && "pear" == entries[1].first );
+  fruit.scan_range( 10, "b", "", 10, entries );
+  ASSERT( 1 == entries.size() && "pear" == entries[0].first );
+
+  // an erase hides a base value for good
+  ASSERT( fruit.erase( "pear", 11 ) );
+  ASSERT( !fruit.has_key( "pear" ) );
+  fruit.scan_range( 11, "", "", 10, entries );
+  ASSERT( 2 == entries.size() && "apple" == entries[0].first && "plum" == entries[1].first );
+  ASSERT( fruit.get_snapshot( "pear", 10, v, version ) && "2" == v );
+  fruit.collect_garbage( 11, 11 );
+  fruit.collect_garbage( 12, 12 );
+  ASSERT( !fruit.get_snapshot( "pear", 12, v, version ) && 11 == version );
+  ASSERT( !fruit.has_key( "pear" ) );
+  fruit.set( "pear", "7", 13 );
+
+  // a new image (written while the old one is mapped) replaces it
+  std::vector<Table*> tables = { &fruit };
+  ASSERT( 3 == SnapshotFile::write( path, tables, 13 ) );
+  ASSERT( fruit.get_snapshot( "pear", 13, v, version ) && "7" == v );
+  std::shared_ptr<SnapshotFile> later = SnapshotFile::open( path );
+  ASSERT( 1 == later->num_tables() && 3 == later->get_table( 0 ).size() );
+  ASSERT( later->get_table( 0 ).find( "plum", value ) && "6" == value );
+
+  // a damaged section is detected when it is first used
+  fd = ::open( path, O_WRONLY );
+  ASSERT( fd >= 0 );
+  struct stat st;
+  ASSERT( 0 == fstat( fd, &st ) );
+  ASSERT( 1 == pwrite( fd, "X", 1, st.st_size - 1 ) );
+  close( fd );
+  std::shared_ptr<SnapshotFile> damaged = SnapshotFile::open( path );
+  try {
+    damaged->get_table( 0 ).find( "plum", value );
+    FAIL( "damaged section was used" );
+  } catch ( LogException &ex ) {
+    // good
+  }
+
+  // in a section of many blocks, only the entries in a damaged block
+  // are lost
+  {
+    Table big( "big", StorageEngineKind::ORDERED );
+    char key[8];
+    for ( int i = 0; i < 2000; i++ ) {
+      snprintf( key, sizeof( key ), "k%04d", i );
+      big.set( key, std::string( 100, 'a' + i % 26 ) + key, i + 1 );
+    }
+    std::vector<Table*> tables = { &big };
+    ASSERT( 2000 == SnapshotFile::write( path, tables, 2000 ) );
+  }
+  fd = ::open( path, O_RDWR );
+  ASSERT( fd >= 0 );
+  ASSERT( 0 == fstat( fd, &st ) );
+  std::string file( st.st_size, '\0' );
+  ASSERT( st.st_size == pread( fd, &file[0], file.size(), 0 ) );
+  size_t at = file.find( std::string( 3, 'a' + 1234 % 26 ) + "k1234" );
+  ASSERT( at != std::string::npos );
+  ASSERT( 1 == pwrite( fd, "X", 1, at - 1 ) );
+  close( fd );
+  std::shared_ptr<SnapshotFile> patched = SnapshotFile::open( path );
+  const SnapshotFile::Section &big = patched->get_table( 0 );
+  size_t lost = 0;
+  for ( size_t i = 0; i < big.size(); i++ ) {
+    std::string_view k, v;
+    uint64_t deadline;
+    try {
+      big.get( i, k, v, deadline );
+      ASSERT( "k1234" != k );
+    } catch ( LogException &ex ) {
+      lost++;
+    }
+  }
+  ASSERT( lost > 0 && lost < 100 );
+
+  // as is a damaged index, when the image is opened
+  ASSERT( 0 == truncate( path, 30 ) );
+  try {
+    SnapshotFile::open( path );
+    FAIL( "damaged snapshot was opened" );
+  } catch ( LogException &ex ) {
+    // good
+  }
+
+  unlink( path );
+}
+
+void test_lsm_engine( TestObjs * )
+{
+  LsmEngine engine;
+  std::string value;
+  uint64_t version;
+
+  // enough data for several flushes and a compaction into level 1
+  std::string padding( 100, 'x' );
+  const int keys = 40000;
+  for ( int i = 0; i < keys; i++ ) {
+    engine.put( "k" + std::to_string( i ), std::to_string( i ) + padding, i + 1 );
+  }
+  // overwrite and erase keys that are on disk by now
+  for ( int i = 0; i < keys; i += 10 ) {
+    engine.put( "k" + std::to_string( i ), "new", keys + i );
+  }
+  for ( int i = 5; i < keys; i += 10 ) {
+    ASSERT( engine.erase( "k" + std::to_string( i ) ) );
+  }
+  ASSERT( !engine.erase( "k5" ) );
+  ASSERT( !engine.erase( "nope" ) );
+  engine.wait_for_background_work();
+
+  std::vector<size_t> runs = engine.run_counts();
+  ASSERT( runs.size() >= 2 );
+  ASSERT( runs[0] < LsmEngine::L0_RUNS );
+  ASSERT( runs[1] > 0 );
+
+  for ( int i = 0; i < keys; i++ ) {
+    std::string key = "k" + std::to_string( i );
+    if ( i % 10 == 5 ) {
+      ASSERT( !engine.contains( key ) );
+    } else if ( i % 10 == 0 ) {
+      ASSERT( engine.get( key, value, version ) && "new" == value && uint64_t( keys + i ) == version );
+    } else {
+      ASSERT( engine.get( key, value, version ) && std::to_string( i ) + padding == value );
+      ASSERT( uint64_t( i + 1 ) == version );
+    }
+  }
+  ASSERT( !engine.contains( "k" + std::to_string( keys ) ) );
+
+  // scans see each key once, in order, without the erased ones
+  size_t seen = 0;
+  std::string last;
+  engine.scan( [&]( std::string_view key, std::string_view, uint64_t ) {
+    ASSERT( seen == 0 || last < key );
+    last.assign( key );
+    seen++;
+  } );
+  ASSERT( size_t( keys - keys / 10 ) == seen );
+  ASSERT( seen == engine.size() );
+
+  // a scan from a key reads the same keys from there on, and stops
+  // when told to
+  std::vector<std::string> expected, found;
+  engine.scan( [&]( std::string_view key, std::string_view, uint64_t ) {
+    if ( key >= "k2" && expected.size() < 500 ) {
+      expected.emplace_back( key );
+    }
+  } );
+  engine.scan_from( "k2", [&]( std::string_view key, std::string_view, uint64_t ) {
+    found.emplace_back( key );
+    return found.size() < 500;
+  } );
+  ASSERT( expected == found );
+
+  // readers never block on, or see a torn, write
+  std::atomic<bool> done( false ), torn( false );
+  std::thread reader( [&]() {
+    std::string v;
+    uint64_t ver;
+    while ( !done ) {
+      for ( int i = 1; i < keys; i += 97 ) {
+        if ( i % 10 == 0 || i % 10 == 5 ) {
+          continue;
+        }
+        if ( !engine.get( "k" + std::to_string( i ), v, ver ) || ( std::to_string( i ) + padding != v && "again" != v ) ) {
+          torn = true;
+        }
+      }
+    }
+  } );
+  for ( int i = 1; i < keys; i += 2 ) {
+    if ( i % 10 != 5 ) {
+      engine.put( "k" + std::to_string( i ), "again", 2 * keys + i );
+    }
+  }
+  done = true;
+  reader.join();
+  ASSERT( !torn );
+  ASSERT( engine.get( "k1", value ) && "again" == value );
+
+  // writers that wait for room go at the pace of the flushes
+  std::string big( 1000, 'b' );
+  for ( int i = 0; i < 5000; i++ ) {
+    engine.wait_for_room();
+    engine.put( "b" + std::to_string( i ), big, 3 * keys + i );
+  }
+  engine.wait_for_background_work();
+  ASSERT( engine.has_room() );
+  ASSERT( engine.get( "b4999", value ) && big == value );
+
+  // an engine whose flush fails turns writers away, and still reads
+  LsmEngine::set_directory( "/nonexistent" );
+  LsmEngine failed;
+  LsmEngine::set_directory( "/tmp" );
+  for ( int i = 0; i < 2000; i++ ) {
+    failed.put( "f" + std::to_string( i ), big, i + 1 );
+  }
+  failed.wait_for_background_work();
+  try {
+    failed.has_room();
+    FAIL( "a failed engine has room" );
+  } catch ( StorageException &ex ) {
+  }
+  try {
+    failed.wait_for_room();
+    FAIL( "a failed engine has room" );
+  } catch ( StorageException &ex ) {
+  }
+  ASSERT( failed.get( "f0", value ) && big == value );
+  ASSERT( failed.get( "f1999", value ) && big == value );
+}
+
+void test_lsm_table( TestObjs * )
+{
+  Table table( "big", StorageEngineKind::LSM );
+  ASSERT( StorageEngineKind::LSM == table.get_engine_kind() );
+  table.set( "apples", "1", 1 );
+  table.set( "pears", "2", 2 );
+  table.set( "apples", "3", 3 );
+
+  // every snapshot sees the latest values, so they leave memory (over
+  // two passes: readers may still see them during the first)
+  table.collect_garbage( 3, 3 );
+  table.collect_garbage( 4, 4 );
+  std::string value;
+  uint64_t version;
+  ASSERT( table.get_snapshot( "apples", 3, value, version ) && "3" == value && 3 == version );
+  ASSERT( table.get_snapshot( "pears", 5, value, version ) && "2" == value && 2 == version );
+  ASSERT( !table.get_snapshot( "plums", 5, value, version ) );
+  ASSERT( "3" == table.get( "apples" ) );
+
+  // writing an evicted key brings back the value older snapshots read
+  table.set( "apples", "4", 6 );
+  ASSERT( table.get_snapshot( "apples", 5, value, version ) && "3" == value && 3 == version );
+  ASSERT( table.get_snapshot( "apples", 6, value, version ) && "4" == value && 6 == version );
+
+  // scans merge the keys in memory with the evicted ones
+  std::map<std::string, std::string> seen;
+  table.scan_snapshot( 5, [&]( std::string_view k, std::string_view v ) {
+    ASSERT( seen.emplace( k, v ).second );
+  } );
+  ASSERT( 2 == seen.size() && "3" == seen["apples"] && "2" == seen["pears"] );
+  seen.clear();
+  table.scan_snapshot( 6, [&]( std::string_view k, std::string_view v ) {
+    ASSERT( seen.emplace( k, v ).second );
+  } );
+  ASSERT( 2 == seen.size() && "4" == seen["apples"] );
 }
 
 void test_value_stack( TestObjs *objs )
@@ -0,0 +1,582 @@
+// version_store.cpp
+
+// Headers
+#include <functional>
+#include "version_store.h"
+
+// Constructor
+VersionStore::VersionStore()
+  : m_dir( new_directory( MIN_CAPACITY ) )
+  , m_count( 0 )
+{
+}
+
+// Destructor
+VersionStore::~VersionStore()
+{
+  Directory *dir = m_dir.load();
+  for ( size_t i = 0; i < dir->capacity; i++ ) {
+    KeyNode *node = dir->slots[i].load();
+    if ( node == nullptr ) {
+      continue;
+    }
+    free_chain( node->head.load() );
+    delete node;
+  }
+  free_directory( dir );
+
+  for ( Directory *retired : m_retired ) {
+    free_directory( retired );
+  }
+
+  for ( Evicted &evicted : m_evicting ) {
+    free_evicted( evicted );
+  }
+  for ( Evicted &evicted : m_evicted ) {
+    free_evicted( evicted );
+  }
+}
+
+// Hash a key
+// Parameters:
+//   key - key to hash
+// Returns:
+//   uint32_t - hash of the key
+uint32_t VersionStore::hash_key( std::string_view key )
+{
+  return static_cast<uint32_t>( std::hash<std::string_view>()( key ) );
+}
+
+// Allocate an empty directory
+// Parameters:
+//   capacity - number of slots (a power of two)
+// Returns:
+//   Directory* - new directory
+VersionStore::Directory *VersionStore::new_directory( size_t capacity )
+{
+  Directory *dir = new Directory;
+  dir->capacity = capacity;
+  dir->slots = new std::atomic<KeyNode*>[capacity];
+  for ( size_t i = 0; i < capacity; i++ ) {
+    dir->slots[i].store( nullptr, std::memory_order_relaxed );
+  }
+  dir->retired_at = 0;
+  return dir;
+}
+
+// Free a directory (not the keys it points to)
+// Parameters:
+//   dir - directory to free
+// Returns:
+//   void
+void VersionStore::free_directory( Directory *dir )
+{
+  delete[] dir->slots;
+  delete dir;
+}
+
+// Find a key's node
+// Parameters:
+//   dir - directory to search
+//   key - key to find
+//   hash - hash of the key
+// Returns:
+//   KeyNode* - the key's node, or nullptr if the key was never written
+VersionStore::KeyNode *VersionStore::find_node( const Directory *dir, std::string_view key, uint32_t hash )
+{
+  size_t mask = dir->capacity - 1;
+  for ( size_t i = hash & mask; ; i = ( i + 1 ) & mask ) {
+    KeyNode *node = dir->slots[i].load( std::memory_order_acquire );
+    if ( node == nullptr ) {
+      return nullptr;
+    }
+    if ( node->hash == hash && node->key == key ) {
+      return node;
+    }
+  }
+}
+
+// Put a node into the first free slot of its probe sequence
+// Parameters:
+//   dir - directory to insert into
+//   node - node to insert
+// Returns:
+//   void
+void VersionStore::place_node( Directory *dir, KeyNode *node )
+{
+  size_t mask = dir->capacity - 1;
+  size_t i = node->hash & mask;
+  while ( dir->slots[i].load( std::memory_order_relaxed ) != nullptr ) {
+    i = ( i + 1 ) & mask;
+  }
+  dir->slots[i].store( node, std::memory_order_release );
+}
+
+// Free a chain of versions
+// Parameters:
+//   v - newest version of the chain
+// Returns:
+//   size_t - number of versions freed
+size_t VersionStore::free_chain( Version *v )
+{
+  size_t freed = 0;
+  while ( v != nullptr ) {
+    Version *older = v->older.load( std::memory_order_relaxed );
+    delete v;
+    v = older;
+    freed++;
+  }
+  return freed;
+}
+
+// Free memory cut off by prune()
+// Parameters:
+//   evicted - what was cut off
+// Returns:
+//   size_t - number of versions freed
+size_t VersionStore::free_evicted( const Evicted &evicted )
+{
+  size_t freed = free_chain( evicted.chain );
+  if ( evicted.node != nullptr ) {
+    freed += free_chain( evicted.node->head.load( std::memory_order_relaxed ) );
+    delete evicted.node;
+  }
+  if ( evicted.dir != nullptr ) {
+    free_directory( evicted.dir );
+  }
+  return freed;
+}
+
+// Check whether every snapshot sees a key erased, so it can be dropped
+// Parameters:
+//   node - the key's node
+//   oldest - oldest timestamp any current or future snapshot reads at
+// Returns:
+//   bool - true if the key's newest version is a tombstone no newer
+//   than oldest, which needn't be kept
+bool VersionStore::is_droppable( const KeyNode *node, uint64_t oldest )
+{
+  Version *v = node->head.load( std::memory_order_relaxed );
+  return v != nullptr && v->erased && v->ts <= oldest && !node->keep_erased;
+}
+
+// Read a key as of a snapshot
+// Parameters:
+//   key - key to read
+//   ts - snapshot timestamp
+//   value - set to the newest value committed at or before ts
+//   version - set to the commit timestamp of that value (0 if none)
+// Returns:
+//   bool - true if the key had a value at ts, false otherwise
+bool VersionStore::read( std::string_view key, uint64_t ts, std::string &value, uint64_t &version ) const
+{
+  uint64_t deadline;
+  bool present;
+  return read( key, ts, value, version, deadline, present );
+}
+
+// Read a key as of a snapshot, also reporting whether it has any versions
+// Parameters:
+//   key - key to read
+//   ts - snapshot timestamp
+//   value - set to the newest value committed at or before ts
+//   version - set to the commit timestamp of that value, or of the
+//             erase that removed the key (0 if neither)
+//   deadline - set to the deadline of that value (0 if none)
+//   present - set to false if the key has no versions
+// Returns:
+//   bool - true if the key had a value at ts, false otherwise
+bool VersionStore::read( std::string_view key, uint64_t ts, std::string &value, uint64_t &version, uint64_t &deadline, bool &present ) const
+{
+  version = 0;
+  deadline = 0;
+  present = false;
+
+  KeyNode *node = find_node( m_dir.load( std::memory_order_acquire ), key, hash_key( key ) );
+  if ( node == nullptr ) {
+    return false;
+  }
+
+  // skip versions committed after the snapshot
+  Version *v = node->head.load( std::memory_order_acquire );
+  present = v != nullptr;
+  while ( v != nullptr && v->ts > ts ) {
+    v = v->older.load( std::memory_order_acquire );
+  }
+  if ( v == nullptr ) {
+    return false;
+  }
+
+  version = v->ts;
+  if ( v->erased ) {
+    return false;
+  }
+  value = v->value;
+  deadline = v->deadline;
+  return true;
+}
+
+// Check whether a key had a value at a snapshot
+// Parameters:
+//   key - key to check
+//   ts - snapshot timestamp
+// Returns:
+//   bool - true if a value of the key was committed at or before ts
+bool VersionStore::contains( std::string_view key, uint64_t ts ) const
+{
+  KeyNode *node = find_node( m_dir.load( std::memory_order_acquire ), key, hash_key( key ) );
+  if ( node == nullptr ) {
+    return false;
+  }
+
+  Version *v = node->head.load( std::memory_order_acquire );
+  while ( v != nullptr && v->ts > ts ) {
+    v = v->older.load( std::memory_order_acquire );
+  }
+  return v != nullptr && !v->erased;
+}
+
+// Visit every key that had a value at a snapshot, with that value
+// Parameters:
+//   ts - snapshot timestamp
+//   visit - called with each key, its value at ts and its deadline
+// Returns:
+//   void
+void VersionStore::scan( uint64_t ts, const std::function<void( std::string_view, std::string_view, uint64_t )> &visit ) const
+{
+  scan( ts, visit, []( std::string_view ) { } );
+}
+
+// Visit every key that had a value at a snapshot, with that value, and
+// every key whose versions were evicted
+// Parameters:
+//   ts - snapshot timestamp
+//   visit - called with each key, its value at ts and its deadline
+//   evicted - called with each key that has no versions
+// Returns:
+//   void
+void VersionStore::scan( uint64_t ts, const std::function<void( std::string_view, std::string_view, uint64_t )> &visit, const std::function<void( std::string_view )> &evicted ) const
+{
+  // every key committed at or before ts was installed before the
+  // snapshot began, so it is in the directory loaded now
+  Directory *dir = m_dir.load( std::memory_order_acquire );
+  for ( size_t i = 0; i < dir->capacity; i++ ) {
+    KeyNode *node = dir->slots[i].load( std::memory_order_acquire );
+    if ( node == nullptr ) {
+      continue;
+    }
+
+    Version *v = node->head.load( std::memory_order_acquire );
+    if ( v == nullptr ) {
+      evicted( node->key );
+      continue;
+    }
+    while ( v != nullptr && v->ts > ts ) {
+      v = v->older.load( std::memory_order_acquire );
+    }
+    if ( v != nullptr && !v->erased ) {
+      visit( node->key, v->value, v->deadline );
+    }
+  }
+}
+
+// Find a key's node, adding the key if it is new
+// Parameters:
+//   key - key to find
+//   ts - commit timestamp of the write about to be installed
+// Returns:
+//   KeyNode* - the key's node
+VersionStore::KeyNode *VersionStore::find_or_add( std::string_view key, uint64_t ts )
+{
+  Directory *dir = m_dir.load( std::memory_order_relaxed );
+  uint32_t hash = hash_key( key );
+  KeyNode *node = find_node( dir, key, hash );
+
+  if ( node == nullptr ) {
+    // grow at half load, so probe runs stay short
+    if ( ( m_count + 1 ) * 2 > dir->capacity ) {
+      Directory *bigger = new_directory( dir->capacity * 2 );
+      for ( size_t i = 0; i < dir->capacity; i++ ) {
+        KeyNode *n = dir->slots[i].load( std::memory_order_relaxed );
+        if ( n != nullptr ) {
+          place_node( bigger, n );
+        }
+      }
+      m_dir.store( bigger, std::memory_order_release );
+
+      // readers that picked up the old directory have snapshots older
+      // than this commit, so it can be freed once those are gone
+      dir->retired_at = ts;
+      m_retired.push_back( dir );
+      dir = bigger;
+    }
+
+    node = new KeyNode;
+    node->key.assign( key );
+    node->hash = hash;
+    node->head.store( nullptr, std::memory_order_relaxed );
+    node->keep_erased = false;
+    node->access.store( 0, std::memory_order_relaxed );
+    place_node( dir, node );
+    m_count++;
+  }
+  return node;
+}
+
+// Add a new version of a key
+// Parameters:
+//   key - key written
+//   value - value written
+//   ts - commit timestamp (larger than the key's previous versions)
+//   deadline - when the value expires (0 for never)
+// Returns:
+//   void
+void VersionStore::install( std::string_view key, const std::string &value, uint64_t ts, uint64_t deadline )
+{
+  KeyNode *node = find_or_add( key, ts );
+  Version *v = new Version;
+  v->ts = ts;
+  v->value = value;
+  v->deadline = deadline;
+  v->erased = false;
+  v->older.store( node->head.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+  node->head.store( v, std::memory_order_release );
+}
+
+// Add a tombstone for a key
+// Parameters:
+//   key - key erased
+//   ts - commit timestamp (larger than the key's previous versions)
+//   keep - true if the key's tombstone must be kept for good
+// Returns:
+//   void
+void VersionStore::erase( std::string_view key, uint64_t ts, bool keep )
+{
+  KeyNode *node = find_or_add( key, ts );
+  if ( keep ) {
+    node->keep_erased = true;
+  }
+  Version *v = new Version;
+  v->ts = ts;
+  v->deadline = 0;
+  v->erased = true;
+  v->older.store( node->head.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+  node->head.store( v, std::memory_order_release );
+}
+
+// Get the timestamp of a key's erase, if its newest version is a tombstone
+// Parameters:
+//   key - key to check
+// Returns:
+//   uint64_t - commit timestamp of the erase, or 0 if the key's newest
+//   version isn't a tombstone
+uint64_t VersionStore::erased_at( std::string_view key ) const
+{
+  KeyNode *node = find_node( m_dir.load( std::memory_order_acquire ), key, hash_key( key ) );
+  if ( node == nullptr ) {
+    return 0;
+  }
+  Version *v = node->head.load( std::memory_order_acquire );
+  return v != nullptr && v->erased ? v->ts : 0;
+}
+
+// Get the deadline of a key's newest value
+// Parameters:
+//   key - key to check
+// Returns:
+//   uint64_t - the deadline, or 0 if the newest value has none
+uint64_t VersionStore::deadline_of( std::string_view key ) const
+{
+  KeyNode *node = find_node( m_dir.load( std::memory_order_acquire ), key, hash_key( key ) );
+  if ( node == nullptr ) {
+    return 0;
+  }
+  Version *v = node->head.load( std::memory_order_acquire );
+  return v != nullptr ? v->deadline : 0;
+}
+
+// Get the size of a key's newest value
+// Parameters:
+//   key - key to check
+//   size - set to the size of the value
+// Returns:
+//   bool - true if the key's newest version is a value
+bool VersionStore::value_size( std::string_view key, size_t &size ) const
+{
+  KeyNode *node = find_node( m_dir.load( std::memory_order_acquire ), key, hash_key( key ) );
+  if ( node == nullptr ) {
+    return false;
+  }
+  Version *v = node->head.load( std::memory_order_acquire );
+  if ( v == nullptr || v->erased ) {
+    return false;
+  }
+  size = v->value.size();
+  return true;
+}
+
+// Get the word a key's uses are recorded in
+// Parameters:
+//   key - key to look up
+// Returns:
+//   std::atomic<uint32_t>* - the key's word, or nullptr if the key has
+//   never been written
+std::atomic<uint32_t> *VersionStore::access_of( std::string_view key ) const
+{
+  KeyNode *node = find_node( m_dir.load( std::memory_order_acquire ), key, hash_key( key ) );
+  return node != nullptr ? &node->access : nullptr;
+}
+
+// Pick keys that have values, from consecutive slots of the directory
+// Parameters:
+//   start - random number choosing the first slot looked at
+//   count - most keys to pick
+//   keys - the keys picked are appended, each with its access word
+// Returns:
+//   void
+void VersionStore::sample( uint64_t start, size_t count, std::vector<std::pair<std::string, uint32_t>> &keys ) const
+{
+  // A key whose versions were evicted still has its value in the
+  // engine; one whose newest version is a tombstone has none
+  const Directory *dir = m_dir.load( std::memory_order_acquire );
+  size_t mask = dir->capacity - 1;
+  size_t picked = 0;
+  for ( size_t n = 0; n < dir->capacity && picked < count; n++ ) {
+    const KeyNode *node = dir->slots[( start + n ) & mask].load( std::memory_order_acquire );
+    if ( node == nullptr ) {
+      continue;
+    }
+    const Version *v = node->head.load( std::memory_order_acquire );
+    if ( v == nullptr || !v->erased ) {
+      keys.emplace_back( node->key, node->access.load( std::memory_order_relaxed ) );
+      picked++;
+    }
+  }
+}
+
+// Free everything no snapshot at or after a timestamp can read, and
+// optionally evict keys whose newest version every snapshot sees
+// Parameters:
+//   oldest - oldest timestamp any current or future snapshot reads at
+//   latest - latest visible commit timestamp, read after the previous
+//            call returned
+//   evict - true to evict keys
+// Returns:
+//   size_t - number of versions freed
+size_t VersionStore::prune( uint64_t oldest, uint64_t latest, bool evict )
+{
+  size_t freed = 0;
+
+  // A reader may still be looking at a chain evicted while it read, but
+  // its snapshot is no newer than the latest commit once the eviction
+  // was over
+  size_t kept = 0;
+  for ( Evicted &evicted : m_evicted ) {
+    if ( evicted.retired_at < oldest ) {
+      freed += free_evicted( evicted );
+    } else {
+      m_evicted[kept++] = evicted;
+    }
+  }
+  m_evicted.resize( kept );
+  for ( Evicted &evicted : m_evicting ) {
+    evicted.retired_at = latest;
+    m_evicted.push_back( evicted );
+  }
+  m_evicting.clear();
+
+  // A reader at snapshot ts >= oldest stops at the first version with
+  // a timestamp <= ts, which is at or before the first version with a
+  // timestamp <= oldest; everything older than that is unreachable.
+  Directory *dir = m_dir.load( std::memory_order_relaxed );
+  size_t droppable = 0;
+  for ( size_t i = 0; i < dir->capacity; i++ ) {
+    KeyNode *node = dir->slots[i].load( std::memory_order_relaxed );
+    if ( node == nullptr ) {
+      continue;
+    }
+
+    Version *v = node->head.load( std::memory_order_relaxed );
+    while ( v != nullptr && v->ts > oldest ) {
+      v = v->older.load( std::memory_order_relaxed );
+    }
+    if ( v == nullptr ) {
+      continue;
+    }
+
+    // Every snapshot sees the newest version, which the engine has too
+    // (a tombstone stays until its key is dropped, and a deadline,
+    // which the engine doesn't keep, until the value is replaced)
+    if ( evict && v == node->head.load( std::memory_order_relaxed ) && !v->erased && v->deadline == 0 ) {
+      node->head.store( nullptr, std::memory_order_release );
+      m_evicting.push_back( Evicted{ v, nullptr, nullptr, 0 } );
+      continue;
+    }
+
+    freed += free_chain( v->older.exchange( nullptr ) );
+    if ( is_droppable( node, oldest ) ) {
+      droppable++;
+    }
+  }
+
+  // Keys every snapshot sees erased are left out of a new directory
+  // (sized for the keys that remain), once there are enough of them to
+  // be worth copying the rest.  A reader that didn't find a key in the
+  // new directory reads it as never written, which is what every
+  // snapshot sees anyway.
+  if ( droppable > 0 && droppable * 4 >= m_count ) {
+    size_t capacity = MIN_CAPACITY;
+    while ( ( m_count - droppable + 1 ) * 2 > capacity ) {
+      capacity *= 2;
+    }
+    Directory *smaller = new_directory( capacity );
+    for ( size_t i = 0; i < dir->capacity; i++ ) {
+      KeyNode *node = dir->slots[i].load( std::memory_order_relaxed );
+      if ( node == nullptr ) {
+        continue;
+      }
+      if ( is_droppable( node, oldest ) ) {
+        m_evicting.push_back( Evicted{ nullptr, node, nullptr, 0 } );
+      } else {
+        place_node( smaller, node );
+      }
+    }
+    m_dir.store( smaller, std::memory_order_release );
+    m_evicting.push_back( Evicted{ nullptr, nullptr, dir, 0 } );
+    m_count -= droppable;
+  }
+
+  // Directories replaced before the oldest snapshot began
+  kept = 0;
+  for ( Directory *retired : m_retired ) {
+    if ( retired->retired_at <= oldest ) {
+      free_directory( retired );
+    } else {
+      m_retired[kept++] = retired;
+    }
+  }
+  m_retired.resize( kept );
+
+  return freed;
+}
+
+// Count the versions currently kept
+// Parameters:
+//   void
+// Returns:
+//   size_t - number of versions
+size_t VersionStore::version_count() const
+{
+  size_t count = 0;
+  Directory *dir = m_dir.load( std::memory_order_acquire );
+  for ( size_t i = 0; i < dir->capacity; i++ ) {
+    KeyNode *node = dir->slots[i].load( std::memory_order_acquire );
+    if ( node == nullptr ) {
+      continue;
+    }
+    for ( Version *v = node->head.load( std::memory_order_acquire ); v != nullptr; v = v->older.load( std::memory_order_acquire ) ) {
+      count++;
+    }
+  }
+  return count;
+}
@@ -0,0 +1,342 @@
+// version_store.h
+
+// Guards
+#ifndef VERSION_STORE_H
+#define VERSION_STORE_H
+
+// Headers
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Timestamped versions of the keys in one table shard, readable without
+// any lock.
+//
+// Each key has a chain of versions, newest first.  Writers (which hold
+// the shard's exclusive latch) push new versions onto the front of a
+// chain and add new keys to an insert-only open-addressing directory,
+// publishing every change with a single release store.  Readers find
+// the newest version no newer than their snapshot timestamp.
+//
+// Memory a reader might still be looking at is never freed while it
+// could be read: prune() is given the oldest timestamp any snapshot
+// may read at, and only frees versions (and replaced directories) that
+// no such snapshot can reach.
+//
+// prune() can also evict keys: a key whose newest version every
+// snapshot sees loses its whole chain, and readers find it in the
+// shard's storage engine instead (see Table::get_snapshot()).  Only the
+// key itself stays in memory.
+//
+// Erasing a key adds a tombstone version, which hides the key from
+// snapshots at or after the erase.  Once every snapshot sees the
+// tombstone, prune() drops the key altogether (unless the tombstone
+// must be kept to hide a value stored elsewhere, see erase()).
+//
+// A value may have a deadline, after which readers treat it as gone
+// (see Table); keys whose newest value has one are never evicted.
+class VersionStore {
+private:
+  // One version of a key
+  struct Version {
+    // Commit timestamp
+    uint64_t ts;
+    // Value written by the commit (empty for a tombstone)
+    std::string value;
+    // Wall-clock time the value expires at (milliseconds since the
+    // epoch, 0 if never)
+    uint64_t deadline;
+    // Set if the commit erased the key
+    bool erased;
+    // Next older version (cut by prune())
+    std::atomic<Version*> older;
+  };
+
+  // A key and its chain of versions
+  struct KeyNode {
+    std::string key;
+    uint32_t hash;
+    std::atomic<Version*> head;
+    // Set if the key's tombstones are never dropped
+    bool keep_erased;
+    // When or how often the key was used, kept by the table for its
+    // eviction policy (see access_of())
+    std::atomic<uint32_t> access;
+  };
+
+  // Open-addressing table of keys (capacity is a power of two)
+  struct Directory {
+    size_t capacity;
+    std::atomic<KeyNode*> *slots;
+    // Commit timestamp of the write that replaced this directory
+    uint64_t retired_at;
+  };
+
+  // Smallest directory allocated
+  static const size_t MIN_CAPACITY = 16;
+
+  // Current directory
+  std::atomic<Directory*> m_dir;
+
+  // Number of keys (only used by writers)
+  size_t m_count;
+
+  // Directories replaced by a bigger one, not yet freed
+  std::vector<Directory*> m_retired;
+
+  // Memory cut off by prune() that a reader may still be looking at
+  // (a chain cut off by eviction, a dropped key with its chain, or the
+  // directory it was dropped from), and the latest commit timestamp
+  // when it was cut off (readers that found it have snapshots no newer)
+  struct Evicted {
+    Version *chain;
+    KeyNode *node;
+    Directory *dir;
+    uint64_t retired_at;
+  };
+
+  // Memory cut off by the last prune(), not yet given a timestamp
+  std::vector<Evicted> m_evicting;
+
+  // Memory cut off earlier, not yet freed
+  std::vector<Evicted> m_evicted;
+
+  // Copy constructor
+  VersionStore( const VersionStore & );
+
+  // Assignment operator
+  VersionStore &operator=( const VersionStore & );
+
+  // Hash a key
+  // Parameters:
+  //   key - key to hash
+  // Returns:
+  //   uint32_t - hash of the key
+  static uint32_t hash_key( std::string_view key );
+
+  // Allocate an empty directory
+  // Parameters:
+  //   capacity - number of slots (a power of two)
+  // Returns:
+  //   Directory* - new directory
+  static Directory *new_directory( size_t capacity );
+
+  // Free a directory (not the keys it points to)
+  // Parameters:
+  //   dir - directory to free
+  // Returns:
+  //   void
+  static void free_directory( Directory *dir );
+
+  // Find a key's node
+  // Parameters:
+  //   dir - directory to search
+  //   key - key to find
+  //   hash - hash of the key
+  // Returns:
+  //   KeyNode* - the key's node, or nullptr if the key was never written
+  static KeyNode *find_node( const Directory *dir, std::string_view key, uint32_t hash );
+
+  // Put a node into the first free slot of its probe sequence
+  // Parameters:
+  //   dir - directory to insert into
+  //   node - node to insert
+  // Returns:
+  //   void
+  static void place_node( Directory *dir, KeyNode *node );
+
+  // Free a chain of versions
+  // Parameters:
+  //   v - newest version of the chain
+  // Returns:
+  //   size_t - number of versions freed
+  static size_t free_chain( Version *v );
+
+  // Free memory cut off by prune()
+  // Parameters:
+  //   evicted - what was cut off
+  // Returns:
+  //   size_t - number of versions freed
+  static size_t free_evicted( const Evicted &evicted );
+
+  // Find a key's node, adding the key if it is new (shard's exclusive
+  // latch must be held)
+  // Parameters:
+  //   key - key to find
+  //   ts - commit timestamp of the write about to be installed
+  // Returns:
+  //   KeyNode* - the key's node
+  KeyNode *find_or_add( std::string_view key, uint64_t ts );
+
+  // Check whether every snapshot sees a key erased, so it can be dropped
+  // Parameters:
+  //   node - the key's node
+  //   oldest - oldest timestamp any current or future snapshot reads at
+  // Returns:
+  //   bool - true if the key's newest version is a tombstone no newer
+  //   than oldest, which needn't be kept
+  static bool is_droppable( const KeyNode *node, uint64_t oldest );
+
+public:
+  // Constructor
+  VersionStore();
+
+  // Destructor
+  ~VersionStore();
+
+  // Read a key as of a snapshot (no lock needed)
+  // Parameters:
+  //   key - key to read
+  //   ts - snapshot timestamp
+  //   value - set to the newest value committed at or before ts
+  //   version - set to the commit timestamp of that value (0 if none)
+  // Returns:
+  //   bool - true if the key had a value at ts, false otherwise
+  bool read( std::string_view key, uint64_t ts, std::string &value, uint64_t &version ) const;
+
+  // Read a key as of a snapshot, also reporting whether it has any
+  // versions at all (no lock needed)
+  // Parameters:
+  //   key - key to read
+  //   ts - snapshot timestamp
+  //   value - set to the newest value committed at or before ts
+  //   version - set to the commit timestamp of that value, or of the
+  //             erase that removed the key (0 if neither)
+  //   deadline - set to the deadline of that value (0 if none)
+  //   present - set to false if the key has no versions (it was never
+  //             written, or it was evicted or dropped)
+  // Returns:
+  //   bool - true if the key had a value at ts, false otherwise
+  bool read( std::string_view key, uint64_t ts, std::string &value, uint64_t &version, uint64_t &deadline, bool &present ) const;
+
+  // Check whether a key had a value at a snapshot (no lock needed)
+  // Parameters:
+  //   key - key to check
+  //   ts - snapshot timestamp
+  // Returns:
+  //   bool - true if a value of the key was committed at or before ts
+  bool contains( std::string_view key, uint64_t ts ) const;
+
+  // Visit every key that had a value at a snapshot, with that value
+  // (no lock needed; keys are visited in no particular order)
+  // Parameters:
+  //   ts - snapshot timestamp
+  //   visit - called with each key, its value at ts and the value's
+  //           deadline (0 if none)
+  // Returns:
+  //   void
+  void scan( uint64_t ts, const std::function<void( std::string_view, std::string_view, uint64_t )> &visit ) const;
+
+  // Visit every key that had a value at a snapshot, with that value, and
+  // every key whose versions were evicted (no lock needed; keys are
+  // visited in no particular order)
+  // Parameters:
+  //   ts - snapshot timestamp
+  //   visit - called with each key, its value at ts and the value's
+  //           deadline (0 if none)
+  //   evicted - called with each key that has no versions
+  // Returns:
+  //   void
+  void scan( uint64_t ts, const std::function<void( std::string_view, std::string_view, uint64_t )> &visit, const std::function<void( std::string_view )> &evicted ) const;
+
+  // Add a new version of a key (shard's exclusive latch must be held)
+  // Parameters:
+  //   key - key written
+  //   value - value written
+  //   ts - commit timestamp (larger than the key's previous versions)
+  //   deadline - when the value expires (0 for never)
+  // Returns:
+  //   void
+  void install( std::string_view key, const std::string &value, uint64_t ts, uint64_t deadline = 0 );
+
+  // Add a tombstone for a key (shard's exclusive latch must be held)
+  // Parameters:
+  //   key - key erased
+  //   ts - commit timestamp (larger than the key's previous versions)
+  //   keep - true if the key has a value stored elsewhere (that
+  //          readers would find once the key is dropped), so its
+  //          tombstone must be kept for good
+  // Returns:
+  //   void
+  void erase( std::string_view key, uint64_t ts, bool keep );
+
+  // Get the timestamp of a key's erase, if its newest version is a
+  // tombstone (shard's latch must be held, so no newer version can
+  // be installed meanwhile)
+  // Parameters:
+  //   key - key to check
+  // Returns:
+  //   uint64_t - commit timestamp of the erase, or 0 if the key's
+  //   newest version isn't a tombstone (or it has no versions)
+  uint64_t erased_at( std::string_view key ) const;
+
+  // Get the deadline of a key's newest value (shard's latch must be
+  // held)
+  // Parameters:
+  //   key - key to check
+  // Returns:
+  //   uint64_t - the deadline, or 0 if the newest value has none (or
+  //   the key has no versions, or its newest is a tombstone)
+  uint64_t deadline_of( std::string_view key ) const;
+
+  // Get the size of a key's newest value (shard's latch must be held)
+  // Parameters:
+  //   key - key to check
+  //   size - set to the size of the value
+  // Returns:
+  //   bool - true if the key's newest version is a value, false if it
+  //   is a tombstone (or the key has no versions)
+  bool value_size( std::string_view key, size_t &size ) const;
+
+  // Get the word a key's uses are recorded in (no lock needed, but it
+  // may only be used while the key's versions could be read).  It
+  // starts out as 0 when the key is first written.
+  // Parameters:
+  //   key - key to look up
+  // Returns:
+  //   std::atomic<uint32_t>* - the key's word, or nullptr if the key has
+  //   never been written (or was dropped)
+  std::atomic<uint32_t> *access_of( std::string_view key ) const;
+
+  // Pick keys that have values, from consecutive slots of the directory
+  // (whose order has nothing to do with the keys' uses), for a sampled
+  // eviction policy (shard's latch must be held)
+  // Parameters:
+  //   start - random number choosing the first slot looked at
+  //   count - most keys to pick
+  //   keys - the keys picked are appended, each with its access word
+  // Returns:
+  //   void
+  void sample( uint64_t start, size_t count, std::vector<std::pair<std::string, uint32_t>> &keys ) const;
+
+  // Free everything no snapshot at or after a timestamp can read, and
+  // optionally evict keys whose newest version every snapshot sees
+  // (unless it has a deadline).
+  // Keys every snapshot sees erased are dropped from the directory once
+  // they make up a quarter of it (which replaces the directory).
+  // Installs must be excluded (e.g., by holding the shard's shared latch).
+  // Parameters:
+  //   oldest - oldest timestamp any current or future snapshot reads at
+  //   latest - latest visible commit timestamp, read after the previous
+  //            call returned
+  //   evict - true to evict keys (their latest values must be readable
+  //           from the storage engine)
+  // Returns:
+  //   size_t - number of versions freed
+  size_t prune( uint64_t oldest, uint64_t latest = 0, bool evict = false );
+
+  // Count the versions currently kept (for tests and statistics)
+  // Parameters:
+  //   void
+  // Returns:
+  //   size_t - number of versions
+  size_t version_count() const;
+};
+
+// End of guards
+#endif // VERSION_STORE_H
@@ -0,0 +1,671 @@
+// write_ahead_log.cpp
+
+// Headers
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include "write_ahead_log.h"
+#include "exceptions.h"
+#include "guard.h"
+#include "checksum.h"
+
+namespace {
+
+// Size of a record's frame header (payload length, then CRC-32)
+const size_t HEADER_SIZE = 8;
+
+// Length written in place of a value's to log an erase
+const uint32_t ERASED_LEN = UINT32_MAX;
+
+// Length written before a value's to log its deadline (a u64 follows,
+// then the value as usual)
+const uint32_t DEADLINE_LEN = UINT32_MAX - 1;
+
+// Reads the fields of a record's payload
+class PayloadReader {
+private:
+  std::string_view m_data;
+
+public:
+  PayloadReader( std::string_view data ) : m_data( data ) { }
+
+  bool done() const { return m_data.empty(); }
+
+  bool get_u8( uint8_t &v )
+  {
+    if ( m_data.size() < 1 ) {
+      return false;
+    }
+    v = static_cast<uint8_t>( m_data[0] );
+    m_data.remove_prefix( 1 );
+    return true;
+  }
+
+  bool get_u32( uint32_t &v )
+  {
+    if ( m_data.size() < sizeof( v ) ) {
+      return false;
+    }
+    memcpy( &v, m_data.data(), sizeof( v ) );
+    m_data.remove_prefix( sizeof( v ) );
+    return true;
+  }
+
+  bool get_u64( uint64_t &v )
+  {
+    if ( m_data.size() < sizeof( v ) ) {
+      return false;
+    }
+    memcpy( &v, m_data.data(), sizeof( v ) );
+    m_data.remove_prefix( sizeof( v ) );
+    return true;
+  }
+
+  bool get_string( std::string_view &s )
+  {
+    uint32_t len;
+    if ( !get_u32( len ) || m_data.size() < len ) {
+      return false;
+    }
+    s = m_data.substr( 0, len );
+    m_data.remove_prefix( len );
+    return true;
+  }
+
+  bool get_value( std::string_view &s, bool &erased, uint64_t &deadline )
+  {
+    uint32_t len;
+    if ( m_data.size() < sizeof( len ) ) {
+      return false;
+    }
+    memcpy( &len, m_data.data(), sizeof( len ) );
+    erased = len == ERASED_LEN;
+    deadline = 0;
+    if ( erased ) {
+      s = std::string_view();
+      m_data.remove_prefix( sizeof( len ) );
+      return true;
+    }
+    if ( len == DEADLINE_LEN ) {
+      if ( m_data.size() < sizeof( len ) + sizeof( deadline ) ) {
+        return false;
+      }
+      memcpy( &deadline, m_data.data() + sizeof( len ), sizeof( deadline ) );
+      m_data.remove_prefix( sizeof( len ) + sizeof( deadline ) );
+    }
+    return get_string( s );
+  }
+};
+
+// Decode a record's payload and hand it to a replayer
+// Parameters:
+//   payload - record payload (its checksum already verified)
+//   replayer - receives the record
+// Returns:
+//   bool - false if the payload is malformed
+bool replay_record( std::string_view payload, WriteAheadLog::Replayer &replayer )
+{
+  PayloadReader in( payload );
+  uint8_t type;
+  if ( !in.get_u8( type ) ) {
+    return false;
+  }
+
+  if ( type == WriteAheadLog::Record::CREATE ) {
+    uint8_t engine;
+    std::string_view name;
+    if ( !in.get_u8( engine ) || !in.get_string( name ) ) {
+      return false;
+    }
+    if ( engine > static_cast<uint8_t>( StorageEngineKind::LSM ) ) {
+      return false;
+    }
+
+    // Tables without a memory budget have nothing more
+    MemoryBudget budget;
+    if ( !in.done() ) {
+      uint8_t policy;
+      if ( !in.get_u8( policy ) || !in.get_u64( budget.max_bytes ) ||
+           policy > static_cast<uint8_t>( EvictionPolicy::LFU ) ) {
+        return false;
+      }
+      budget.policy = static_cast<EvictionPolicy>( policy );
+    }
+    if ( !in.done() ) {
+      return false;
+    }
+    replayer.create_table( name, static_cast<StorageEngineKind>( engine ), budget );
+    return true;
+  }
+
+  if ( type == WriteAheadLog::Record::COMMIT ) {
+    uint32_t count;
+    if ( !in.get_u32( count ) ) {
+      return false;
+    }
+    // every write takes at least 12 bytes, which bounds the reservation
+    std::vector<WriteAheadLog::Write> writes;
+    writes.reserve( std::min<size_t>( count, payload.size() / 12 ) );
+    for ( uint32_t i = 0; i < count; i++ ) {
+      WriteAheadLog::Write w;
+      if ( !in.get_string( w.table ) || !in.get_string( w.key ) || !in.get_value( w.value, w.erased, w.deadline ) ) {
+        return false;
+      }
+      writes.push_back( w );
+    }
+    if ( !in.done() ) {
+      return false;
+    }
+    replayer.commit( writes );
+    return true;
+  }
+
+  return false;
+}
+
+// Read a whole file
+// Parameters:
+//   fd - file, positioned at its start
+//   data - set to the file's contents
+// Returns:
+//   bool - false if the file couldn't be read
+bool read_file( int fd, std::string &data )
+{
+  char buf[65536];
+  ssize_t n;
+  while ( ( n = read( fd, buf, sizeof( buf ) ) ) != 0 ) {
+    if ( n < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      return false;
+    }
+    data.append( buf, n );
+  }
+  return true;
+}
+
+// Replay every intact record at the start of some data
+// Parameters:
+//   data - framed records
+//   replayer - receives the records
+//   end - set to the offset just past the last intact record
+// Returns:
+//   size_t - number of records replayed
+size_t replay_records( const std::string &data, WriteAheadLog::Replayer &replayer, size_t &end )
+{
+  size_t pos = 0, count = 0;
+  while ( data.size() - pos >= HEADER_SIZE ) {
+    uint32_t len, crc;
+    memcpy( &len, &data[pos], sizeof( len ) );
+    memcpy( &crc, &data[pos + 4], sizeof( crc ) );
+    if ( data.size() - pos - HEADER_SIZE < len ) {
+      break;
+    }
+    std::string_view payload( data.data() + pos + HEADER_SIZE, len );
+    if ( crc32( payload ) != crc || !replay_record( payload, replayer ) ) {
+      break;
+    }
+    pos += HEADER_SIZE + len;
+    count++;
+  }
+  end = pos;
+  return count;
+}
+
+// Report a failure to write the log and stop the server (committed
+// changes can no longer be made durable)
+// Parameters:
+//   what - operation that failed
+// Returns:
+//   never
+[[noreturn]] void fatal_log_error( const char *what )
+{
+  std::cerr << "Write-ahead log " << what << " failed: " << strerror( errno ) << std::endl;
+  exit( 1 );
+}
+
+// Write some bytes to the log, stopping the server if that fails
+// Parameters:
+//   fd - log file
+//   data - bytes to write
+//   len - number of bytes
+// Returns:
+//   void
+void write_log( int fd, const char *data, size_t len )
+{
+  size_t done = 0;
+  while ( done < len ) {
+    ssize_t n = write( fd, data + done, len - done );
+    if ( n < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      fatal_log_error( "write" );
+    }
+    done += n;
+  }
+}
+
+}
+
+// Suffix of the name of a log file moved aside by rotate()
+const char WriteAheadLog::ROTATED_SUFFIX[] = ".old";
+
+// Constructor
+// Parameters:
+//   type - kind of record
+WriteAheadLog::Record::Record( Type type )
+  : m_data( HEADER_SIZE, '\0' )
+  , m_writes( 0 )
+{
+  m_data.push_back( static_cast<char>( type ) );
+  if ( type == COMMIT ) {
+    // write count, filled in by seal()
+    m_data.append( sizeof( m_writes ), '\0' );
+  }
+}
+
+// Make a CREATE record
+// Parameters:
+//   name - table name
+//   engine - table's storage engine
+//   budget - table's memory budget
+// Returns:
+//   Record - the record
+WriteAheadLog::Record WriteAheadLog::Record::create_table( std::string_view name, StorageEngineKind engine, const MemoryBudget &budget )
+{
+  Record record( CREATE );
+  record.m_data.push_back( static_cast<char>( engine ) );
+  record.put_string( name );
+  if ( budget.is_limited() ) {
+    record.m_data.push_back( static_cast<char>( budget.policy ) );
+    record.m_data.append( reinterpret_cast<const char*>( &budget.max_bytes ), sizeof( budget.max_bytes ) );
+  }
+  return record;
+}
+
+// Append a length-prefixed string to the payload
+// Parameters:
+//   s - string to append
+// Returns:
+//   void
+void WriteAheadLog::Record::put_string( std::string_view s )
+{
+  uint32_t len = s.size();
+  m_data.append( reinterpret_cast<const char*>( &len ), sizeof( len ) );
+  m_data.append( s );
+}
+
+// Add a write to a COMMIT record
+// Parameters:
+//   table - table name
+//   key - key written
+//   value - value written
+//   deadline - when the value expires (0 for never)
+// Returns:
+//   void
+void WriteAheadLog::Record::add_write( std::string_view table, std::string_view key, std::string_view value, uint64_t deadline )
+{
+  put_string( table );
+  put_string( key );
+  if ( deadline != 0 ) {
+    m_data.append( reinterpret_cast<const char*>( &DEADLINE_LEN ), sizeof( DEADLINE_LEN ) );
+    m_data.append( reinterpret_cast<const char*>( &deadline ), sizeof( deadline ) );
+  }
+  put_string( value );
+  m_writes++;
+}
+
+// Add an erase to a COMMIT record
+// Parameters:
+//   table - table name
+//   key - key erased
+// Returns:
+//   void
+void WriteAheadLog::Record::add_erase( std::string_view table, std::string_view key )
+{
+  put_string( table );
+  put_string( key );
+  m_data.append( reinterpret_cast<const char*>( &ERASED_LEN ), sizeof( ERASED_LEN ) );
+  m_writes++;
+}
+
+// Fill in the frame header
+// Parameters:
+//   void
+// Returns:
+//   const std::string& - the framed record
+const std::string &WriteAheadLog::Record::seal()
+{
+  if ( static_cast<uint8_t>( m_data[HEADER_SIZE] ) == COMMIT ) {
+    memcpy( &m_data[HEADER_SIZE + 1], &m_writes, sizeof( m_writes ) );
+  }
+
+  std::string_view payload( m_data );
+  payload.remove_prefix( HEADER_SIZE );
+  uint32_t len = payload.size();
+  uint32_t crc = crc32( payload );
+  memcpy( &m_data[0], &len, sizeof( len ) );
+  memcpy( &m_data[4], &crc, sizeof( crc ) );
+  return m_data;
+}
+
+// Constructor
+// Parameters:
+//   policy - when the log is flushed
+//   interval_ms - flush interval for SyncPolicy::INTERVAL
+WriteAheadLog::WriteAheadLog( SyncPolicy policy, unsigned interval_ms )
+  : m_policy( policy )
+  , m_interval_ms( interval_ms )
+  , m_fd( -1 )
+  , m_next_fd( -1 )
+  , m_rotate_at( 0 )
+  , m_appended( 0 )
+  , m_durable( 0 )
+  , m_stopping( false )
+{
+  pthread_mutex_init( &m_mutex, nullptr );
+  pthread_cond_init( &m_cond, nullptr );
+}
+
+// Destructor
+WriteAheadLog::~WriteAheadLog()
+{
+  if ( m_fd != -1 ) {
+    {
+      Guard g( m_mutex );
+      m_stopping = true;
+      pthread_cond_signal( &m_cond );
+    }
+    pthread_join( m_writer, nullptr );
+    close( m_fd );
+  }
+  if ( m_next_fd != -1 ) {
+    close( m_next_fd );
+  }
+
+  pthread_cond_destroy( &m_cond );
+  pthread_mutex_destroy( &m_mutex );
+}
+
+// Replay a log file, then open it for appending and start the writer thread
+// Parameters:
+//   path - log file (created if it doesn't exist)
+//   replayer - receives the records in the file
+// Returns:
+//   size_t - number of records replayed
+size_t WriteAheadLog::open( const std::string &path, Replayer &replayer )
+{
+  // Records moved aside by the last rotation come first
+  size_t count = 0;
+  std::string rotated = path + ROTATED_SUFFIX;
+  if ( access( rotated.c_str(), F_OK ) == 0 ) {
+    bool complete;
+    count += replay( rotated, replayer, complete );
+  }
+
+  int fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+  if ( fd < 0 ) {
+    throw LogException( "Could not open log file " + path );
+  }
+
+  // Replay every intact record
+  std::string data;
+  if ( !read_file( fd, data ) ) {
+    close( fd );
+    throw LogException( "Could not read log file " + path );
+  }
+  size_t pos;
+  count += replay_records( data, replayer, pos );
+
+  // Cut off a torn tail, so new records follow the last intact one
+  if ( pos != data.size() && ftruncate( fd, pos ) != 0 ) {
+    close( fd );
+    throw LogException( "Could not truncate log file " + path );
+  }
+  if ( lseek( fd, pos, SEEK_SET ) < 0 ) {
+    close( fd );
+    throw LogException( "Could not seek in log file " + path );
+  }
+
+  m_path = path;
+  m_fd = fd;
+  if ( pthread_create( &m_writer, nullptr, writer_main, this ) != 0 ) {
+    close( fd );
+    m_fd = -1;
+    throw LogException( "Could not create log writer thread" );
+  }
+
+  return count;
+}
+
+// Replay a file of records without changing it
+// Parameters:
+//   path - file to read
+//   replayer - receives the records in the file
+//   complete - set to false if the file ends with a torn or corrupt
+//              record, true otherwise
+// Returns:
+//   size_t - number of records replayed
+size_t WriteAheadLog::replay( const std::string &path, Replayer &replayer, bool &complete )
+{
+  int fd = ::open( path.c_str(), O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 ) {
+    throw LogException( "Could not open " + path );
+  }
+  std::string data;
+  bool ok = read_file( fd, data );
+  close( fd );
+  if ( !ok ) {
+    throw LogException( "Could not read " + path );
+  }
+
+  size_t end;
+  size_t count = replay_records( data, replayer, end );
+  complete = end == data.size();
+  return count;
+}
+
+// Move the log file aside and continue in a new one
+// Parameters:
+//   void
+// Returns:
+//   void
+void WriteAheadLog::rotate()
+{
+  // The file moved aside last time is still needed
+  std::string rotated = m_path + ROTATED_SUFFIX;
+  if ( access( rotated.c_str(), F_OK ) == 0 ) {
+    return;
+  }
+
+  // The writer keeps writing to the renamed file until it switches
+  if ( rename( m_path.c_str(), rotated.c_str() ) != 0 ) {
+    throw LogException( "Could not rename log file " + m_path );
+  }
+  int fd = ::open( m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+  if ( fd < 0 || !sync_parent_directory( m_path ) ) {
+    if ( fd >= 0 ) {
+      close( fd );
+    }
+    rename( rotated.c_str(), m_path.c_str() );
+    throw LogException( "Could not create log file " + m_path );
+  }
+
+  Guard g( m_mutex );
+  m_next_fd = fd;
+  m_rotate_at = m_pending.size();
+  pthread_cond_signal( &m_cond );
+}
+
+// Delete the file rotate() moved aside
+// Parameters:
+//   void
+// Returns:
+//   void
+void WriteAheadLog::remove_rotated()
+{
+  std::string rotated = m_path + ROTATED_SUFFIX;
+  if ( unlink( rotated.c_str() ) == 0 ) {
+    sync_parent_directory( rotated );
+  }
+}
+
+// Make a change to a file's directory entry durable
+// Parameters:
+//   path - the file
+// Returns:
+//   bool - true if the directory was flushed
+bool WriteAheadLog::sync_parent_directory( const std::string &path )
+{
+  size_t slash = path.rfind( '/' );
+  std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr( 0, slash );
+  int fd = ::open( dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if ( fd < 0 ) {
+    return false;
+  }
+  bool ok = fsync( fd ) == 0;
+  close( fd );
+  return ok;
+}
+
+// Append a record
+// Parameters:
+//   record - record to append
+// Returns:
+//   Lsn - the record's sequence number
+WriteAheadLog::Lsn WriteAheadLog::append( Record &record )
+{
+  const std::string &framed = record.seal();
+
+  Guard g( m_mutex );
+  m_pending.append( framed );
+  Lsn lsn = ++m_appended;
+
+  // the interval writer wakes up on its own schedule
+  if ( m_policy != SyncPolicy::INTERVAL ) {
+    pthread_cond_signal( &m_cond );
+  }
+  return lsn;
+}
+
+// Body of the writer thread
+// Parameters:
+//   arg - pointer to the log
+// Returns:
+//   void* - nullptr
+void *WriteAheadLog::writer_main( void *arg )
+{
+  static_cast<WriteAheadLog*>( arg )->write_batches();
+  return nullptr;
+}
+
+// Write and flush batches until the log is closed
+// Parameters:
+//   void
+// Returns:
+//   void
+void WriteAheadLog::write_batches()
+{
+  std::string batch;
+
+  while ( true ) {
+    Lsn last;
+    bool stopping;
+    int next_fd;
+    size_t rotate_at;
+    {
+      Guard g( m_mutex );
+      if ( m_policy == SyncPolicy::INTERVAL ) {
+        // sleep for one interval (or until the log is closed)
+        struct timespec deadline;
+        clock_gettime( CLOCK_REALTIME, &deadline );
+        deadline.tv_sec += m_interval_ms / 1000;
+        deadline.tv_nsec += ( m_interval_ms % 1000 ) * 1000000L;
+        if ( deadline.tv_nsec >= 1000000000L ) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000L;
+        }
+        while ( !m_stopping && pthread_cond_timedwait( &m_cond, &m_mutex, &deadline ) != ETIMEDOUT ) {
+        }
+      } else {
+        while ( m_pending.empty() && m_next_fd == -1 && !m_stopping ) {
+          pthread_cond_wait( &m_cond, &m_mutex );
+        }
+      }
+
+      // take everything appended so far: while this batch is being
+      // written and flushed, new records collect for the next one
+      batch.swap( m_pending );
+      last = m_appended;
+      stopping = m_stopping;
+      next_fd = m_next_fd;
+      rotate_at = m_rotate_at;
+      m_next_fd = -1;
+    }
+
+    if ( next_fd != -1 ) {
+      // records appended before the rotation finish the old file, and
+      // are on disk before anything is written to the new one
+      write_log( m_fd, batch.data(), rotate_at );
+      if ( m_policy != SyncPolicy::NEVER && fdatasync( m_fd ) != 0 ) {
+        fatal_log_error( "fdatasync" );
+      }
+      close( m_fd );
+      m_fd = next_fd;
+      batch.erase( 0, rotate_at );
+    }
+
+    if ( !batch.empty() ) {
+      write_log( m_fd, batch.data(), batch.size() );
+      batch.clear();
+
+      if ( m_policy != SyncPolicy::NEVER && fdatasync( m_fd ) != 0 ) {
+        fatal_log_error( "fdatasync" );
+      }
+    }
+
+    m_durable.store( last, std::memory_order_release );
+    if ( m_policy == SyncPolicy::ALWAYS && m_on_durable ) {
+      m_on_durable( last );
+    }
+
+    if ( stopping ) {
+      return;
+    }
+  }
+}
+
+// Parse a sync policy name
+// Parameters:
+//   name - policy name
+//   policy - set to the policy named
+//   interval_ms - set to the interval, for SyncPolicy::INTERVAL
+// Returns:
+//   bool - true if the name is valid
+bool WriteAheadLog::parse_policy( const char *name, SyncPolicy &policy, unsigned &interval_ms )
+{
+  if ( strcmp( name, "always" ) == 0 ) {
+    policy = SyncPolicy::ALWAYS;
+    return true;
+  }
+  if ( strcmp( name, "never" ) == 0 ) {
+    policy = SyncPolicy::NEVER;
+    return true;
+  }
+
+  char *end;
+  long ms = strtol( name, &end, 10 );
+  if ( *name == '\0' || *end != '\0' || ms <= 0 || ms > 60000 ) {
+    return false;
+  }
+  policy = SyncPolicy::INTERVAL;
+  interval_ms = ms;
+  return true;
+}
@@ -0,0 +1,318 @@
+// write_ahead_log.h
+
+// Guards
+#ifndef WRITE_AHEAD_LOG_H
+#define WRITE_AHEAD_LOG_H
+
+// Headers
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <pthread.h>
+#include "storage_engine.h"
+#include "memory_budget.h"
+
+// Append-only log of every committed change, so tables survive a
+// restart.
+//
+// Committers append records to an in-memory buffer (while they still
+// hold the latches of the shards they wrote, so changes to a key are
+// logged in commit order).  A dedicated writer thread hands everything
+// appended since its last pass to a single write() and, depending on
+// the sync policy, fdatasync(): many commits share one flush (group
+// commit).  Under the ALWAYS policy a commit is only acknowledged once
+// is_durable() says its record has been flushed; the writer tells
+// whoever waits for that after each flush (see set_on_durable()).
+//
+// Each record is framed as a 32-bit payload length and a CRC-32 of the
+// payload, so replay stops cleanly at a torn or corrupt tail.
+//
+// A snapshot of the tables makes the records before it redundant:
+// rotate() moves the log aside (to <path>.old) and starts a new file,
+// and once a snapshot taken after the rotation is safely on disk,
+// remove_rotated() deletes the old one.  At startup the rotated file
+// (if it is still there) is replayed before the current one.
+class WriteAheadLog {
+public:
+  // When the log is flushed to stable storage
+  enum class SyncPolicy {
+    // After every batch, before its commits are acknowledged
+    ALWAYS,
+    // Every interval_ms milliseconds (a crash loses at most that much)
+    INTERVAL,
+    // Never (the operating system decides)
+    NEVER,
+  };
+
+  // Log sequence number: records are numbered from 1 in append order
+  typedef uint64_t Lsn;
+
+  // One record, built up before it is appended
+  class Record {
+  public:
+    enum Type : uint8_t {
+      // A table was created: engine kind, table name, then (if the
+      // table has a memory budget) eviction policy and most bytes
+      CREATE = 1,
+      // A transaction (or autocommit SET) committed: its writes and erases
+      COMMIT = 2,
+    };
+
+  private:
+    // Frame header (filled in by seal()) followed by the payload
+    std::string m_data;
+
+    // Number of writes in a COMMIT record
+    uint32_t m_writes;
+
+    // Append a length-prefixed string to the payload
+    void put_string( std::string_view s );
+
+  public:
+    // Constructor
+    // Parameters:
+    //   type - kind of record
+    Record( Type type );
+
+    // Make a CREATE record
+    // Parameters:
+    //   name - table name
+    //   engine - table's storage engine
+    //   budget - table's memory budget
+    // Returns:
+    //   Record - the record
+    static Record create_table( std::string_view name, StorageEngineKind engine, const MemoryBudget &budget = MemoryBudget() );
+
+    // Add a write to a COMMIT record
+    // Parameters:
+    //   table - table name
+    //   key - key written
+    //   value - value written
+    //   deadline - when the value expires (0 for never)
+    // Returns:
+    //   void
+    void add_write( std::string_view table, std::string_view key, std::string_view value, uint64_t deadline = 0 );
+
+    // Add an erase to a COMMIT record
+    // Parameters:
+    //   table - table name
+    //   key - key erased
+    // Returns:
+    //   void
+    void add_erase( std::string_view table, std::string_view key );
+
+    // Get the size of the record so far
+    // Parameters:
+    //   void
+    // Returns:
+    //   size_t - size in bytes, including the frame header
+    size_t size() const { return m_data.size(); }
+
+    // Fill in the frame header
+    // Parameters:
+    //   void
+    // Returns:
+    //   const std::string& - the framed record
+    const std::string &seal();
+  };
+
+  // A write read back from a COMMIT record (views into the log data)
+  struct Write {
+    std::string_view table;
+    std::string_view key;
+    std::string_view value;
+    // Set if the key was erased (value is empty)
+    bool erased;
+    // When the value expires (0 for never)
+    uint64_t deadline;
+  };
+
+  // Receives the records of a log being replayed
+  class Replayer {
+  public:
+    virtual ~Replayer() { }
+
+    // Replay a CREATE record
+    // Parameters:
+    //   name - table name
+    //   engine - table's storage engine
+    //   budget - table's memory budget
+    // Returns:
+    //   void
+    virtual void create_table( std::string_view name, StorageEngineKind engine, const MemoryBudget &budget ) = 0;
+
+    // Replay a COMMIT record
+    // Parameters:
+    //   writes - the transaction's writes
+    // Returns:
+    //   void
+    virtual void commit( const std::vector<Write> &writes ) = 0;
+  };
+
+private:
+  // How often the log is flushed
+  SyncPolicy m_policy;
+
+  // Flush interval for SyncPolicy::INTERVAL
+  unsigned m_interval_ms;
+
+  // Log file name
+  std::string m_path;
+
+  // Log file (-1 until open() is called)
+  int m_fd;
+
+  // New log file the writer should switch to (-1 if none), and the
+  // number of pending bytes that still belong in the old one
+  int m_next_fd;
+  size_t m_rotate_at;
+
+  // Writer thread
+  pthread_t m_writer;
+
+  // Protects m_pending, m_appended, m_next_fd, m_rotate_at and m_stopping
+  pthread_mutex_t m_mutex;
+
+  // Signaled when records are appended (or the log is closing)
+  pthread_cond_t m_cond;
+
+  // Framed records not yet handed to the writer
+  std::string m_pending;
+
+  // LSN of the last record appended
+  Lsn m_appended;
+
+  // LSN of the last record known to be durable (under the sync policy)
+  std::atomic<Lsn> m_durable;
+
+  // Set when the writer thread should finish and exit
+  bool m_stopping;
+
+  // Called by the writer thread when records become durable (under
+  // SyncPolicy::ALWAYS)
+  std::function<void( Lsn )> m_on_durable;
+
+  // Copy constructor
+  WriteAheadLog( const WriteAheadLog & );
+
+  // Assignment operator
+  WriteAheadLog &operator=( const WriteAheadLog & );
+
+  // Body of the writer thread
+  // Parameters:
+  //   arg - pointer to the log
+  // Returns:
+  //   void* - nullptr
+  static void *writer_main( void *arg );
+
+  // Write and flush batches until the log is closed
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void write_batches();
+
+public:
+  // Suffix of the name of a log file moved aside by rotate()
+  static const char ROTATED_SUFFIX[];
+
+  // Constructor
+  // Parameters:
+  //   policy - when the log is flushed
+  //   interval_ms - flush interval for SyncPolicy::INTERVAL
+  WriteAheadLog( SyncPolicy policy, unsigned interval_ms = 0 );
+
+  // Destructor (writes and flushes whatever is still buffered)
+  ~WriteAheadLog();
+
+  // Replay a log file (after the file rotate() moved it to, if that is
+  // still there), then open it for appending and start the writer
+  // thread.  A torn or corrupt record ends the replay, and it and
+  // everything after it are cut off the file.
+  // Parameters:
+  //   path - log file (created if it doesn't exist)
+  //   replayer - receives the records in the file
+  // Returns:
+  //   size_t - number of records replayed
+  //   (throws LogException if the file can't be read or opened)
+  size_t open( const std::string &path, Replayer &replayer );
+
+  // Replay a file of records without changing it
+  // Parameters:
+  //   path - file to read
+  //   replayer - receives the records in the file
+  //   complete - set to false if the file ends with a torn or corrupt
+  //              record, true otherwise
+  // Returns:
+  //   size_t - number of records replayed
+  //   (throws LogException if the file can't be read)
+  static size_t replay( const std::string &path, Replayer &replayer, bool &complete );
+
+  // Move the log file aside and continue in a new one: records
+  // appended from now on go to the new file.  Does nothing if an
+  // earlier rotated file hasn't been removed yet (it is still needed,
+  // so the current file simply keeps growing until the next snapshot).
+  // Parameters:
+  //   void
+  // Returns:
+  //   void (throws LogException if the new file can't be created)
+  void rotate();
+
+  // Delete the file rotate() moved aside (call once its records are
+  // covered by a snapshot that is safely on disk)
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void remove_rotated();
+
+  // Make a change to a file's directory entry (creating, renaming or
+  // removing it) durable
+  // Parameters:
+  //   path - the file
+  // Returns:
+  //   bool - true if the directory was flushed
+  static bool sync_parent_directory( const std::string &path );
+
+  // Set the function the writer thread calls, under SyncPolicy::ALWAYS,
+  // each time it has flushed a batch of records (call before open())
+  // Parameters:
+  //   on_durable - called with the LSN of the last durable record
+  // Returns:
+  //   void
+  void set_on_durable( const std::function<void( Lsn )> &on_durable ) { m_on_durable = on_durable; }
+
+  // Append a record
+  // Parameters:
+  //   record - record to append
+  // Returns:
+  //   Lsn - the record's sequence number
+  Lsn append( Record &record );
+
+  // Check whether a record may be acknowledged (under SyncPolicy::ALWAYS,
+  // once it has been flushed; otherwise right away)
+  // Parameters:
+  //   lsn - record's sequence number (0 for none)
+  // Returns:
+  //   bool - true if the record is durable
+  bool is_durable( Lsn lsn ) const
+  {
+    return m_policy != SyncPolicy::ALWAYS || m_durable.load( std::memory_order_acquire ) >= lsn;
+  }
+
+  // Parse a sync policy name ("always", "never", or a number of
+  // milliseconds for SyncPolicy::INTERVAL)
+  // Parameters:
+  //   name - policy name
+  //   policy - set to the policy named
+  //   interval_ms - set to the interval, for SyncPolicy::INTERVAL
+  // Returns:
+  //   bool - true if the name is valid
+  static bool parse_policy( const char *name, SyncPolicy &policy, unsigned &interval_ms );
+};
+
+// End of guards
+#endif // WRITE_AHEAD_LOG_H
@@ -0,0 +1,158 @@
+// write_set.cpp
+
+// Headers
+#include <utility>
+#include "write_set.h"
+#include "table.h"
+
+// Constructor
+WriteSet::WriteSet()
+{
+}
+
+// Destructor
+WriteSet::~WriteSet()
+{
+}
+
+// Buffer a write
+// Parameters:
+//   table - table written to
+//   key - key to set
+//   value - value to set
+//   deadline - when the value expires (0 for never)
+// Returns:
+//   void
+void WriteSet::put( Table *table, std::string_view key, std::string_view value, uint64_t deadline )
+{
+  auto &writes = m_writes[table];
+  auto it = writes.find( key );
+  if ( it != writes.end() ) {
+    it->second.value.emplace( value );
+    it->second.deadline = deadline;
+  } else {
+    writes.emplace( key, Write{ std::string( value ), deadline, false, false } );
+  }
+}
+
+// Buffer an erase
+// Parameters:
+//   table - table erased from
+//   key - key to erase
+// Returns:
+//   void
+void WriteSet::erase( Table *table, std::string_view key )
+{
+  auto &writes = m_writes[table];
+  auto it = writes.find( key );
+  if ( it != writes.end() ) {
+    it->second.value.reset();
+    it->second.deadline = 0;
+  } else {
+    writes.emplace( key, Write{ std::nullopt, 0, false, false } );
+  }
+}
+
+// Look up a buffered write
+// Parameters:
+//   table - table to look in
+//   key - key to look up
+// Returns:
+//   const std::optional<std::string>* - buffered value (empty if the
+//   key was erased), or nullptr if the key wasn't written
+const std::optional<std::string> *WriteSet::find( Table *table, std::string_view key ) const
+{
+  uint64_t deadline;
+  return find( table, key, deadline );
+}
+
+// Look up a buffered write, also reporting its deadline
+// Parameters:
+//   table - table to look in
+//   key - key to look up
+//   deadline - set to the buffered value's deadline (0 if none)
+// Returns:
+//   const std::optional<std::string>* - buffered value (empty if the
+//   key was erased), or nullptr if the key wasn't written
+const std::optional<std::string> *WriteSet::find( Table *table, std::string_view key, uint64_t &deadline ) const
+{
+  deadline = 0;
+  auto t = m_writes.find( table );
+  if ( t == m_writes.end() ) {
+    return nullptr;
+  }
+  auto it = t->second.find( key );
+  if ( it == t->second.end() ) {
+    return nullptr;
+  }
+  deadline = it->second.deadline;
+  return &it->second.value;
+}
+
+// Add the (table, shard) pair of every key written to a list
+// Parameters:
+//   shards - list to append to
+// Returns:
+//   void
+void WriteSet::collect_shards( std::vector<std::pair<Table*, unsigned>> &shards ) const
+{
+  for ( auto &t : m_writes ) {
+    for ( auto &kv : t.second ) {
+      shards.emplace_back( t.first, Table::shard_of( kv.first ) );
+    }
+  }
+}
+
+// Add every buffered write to a write-ahead log COMMIT record
+// Parameters:
+//   record - record to add to
+// Returns:
+//   void
+void WriteSet::log( WriteAheadLog::Record &record ) const
+{
+  for ( auto &t : m_writes ) {
+    for ( auto &kv : t.second ) {
+      if ( kv.second.value ) {
+        record.add_write( t.first->get_name(), kv.first, *kv.second.value, kv.second.deadline );
+      } else {
+        record.add_erase( t.first->get_name(), kv.first );
+      }
+    }
+  }
+}
+
+// Look up the key of every buffered tombstone in its table
+// Parameters:
+//   void
+// Returns:
+//   void
+void WriteSet::prepare()
+{
+  for ( auto &t : m_writes ) {
+    for ( auto &kv : t.second ) {
+      if ( !kv.second.value ) {
+        kv.second.found = t.first->check_erase( kv.first, kv.second.in_base );
+      }
+    }
+  }
+}
+
+// Write every buffered value (and erase every buffered tombstone's key
+// that prepare() found) into its table and empty the buffer
+// Parameters:
+//   ts - commit timestamp given to every write
+// Returns:
+//   void
+void WriteSet::apply( uint64_t ts )
+{
+  for ( auto &t : m_writes ) {
+    for ( auto &kv : t.second ) {
+      if ( kv.second.value ) {
+        t.first->set( kv.first, std::move( *kv.second.value ), ts, kv.second.deadline );
+      } else if ( kv.second.found ) {
+        t.first->erase_checked( kv.first, ts, kv.second.in_base );
+      }
+    }
+  }
+  m_writes.clear();
+}
@@ -0,0 +1,141 @@
+// write_set.h
+
+// Guards
+#ifndef WRITE_SET_H
+#define WRITE_SET_H
+
+// Headers
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "write_ahead_log.h"
+
+// Forward declarations
+class Table;
+
+// Writes made by one transaction, buffered privately until COMMIT.
+// Nothing is written to a table before the transaction commits, so
+// other connections never see uncommitted values and rolling back is
+// just discarding the buffer.  An erase is buffered as a tombstone (a
+// key without a value), which later writes of the key replace.
+class WriteSet {
+private:
+  // A buffered value (none for a key that was erased) and its deadline
+  // (0 for none); an erase also notes what prepare() found of the key
+  struct Write {
+    std::optional<std::string> value;
+    uint64_t deadline;
+    bool found;
+    bool in_base;
+  };
+
+  // Buffered writes by table, then key (std::less<> allows lookups
+  // by string_view)
+  std::unordered_map<Table*, std::map<std::string, Write, std::less<>>> m_writes;
+
+  // Copy constructor
+  WriteSet( const WriteSet & );
+
+  // Assignment operator
+  WriteSet &operator=( const WriteSet & );
+
+public:
+  // Constructor
+  WriteSet();
+
+  // Destructor
+  ~WriteSet();
+
+  // Buffer a write
+  // Parameters:
+  //   table - table written to
+  //   key - key to set
+  //   value - value to set
+  //   deadline - when the value expires (0 for never)
+  // Returns:
+  //   void
+  void put( Table *table, std::string_view key, std::string_view value, uint64_t deadline = 0 );
+
+  // Buffer an erase
+  // Parameters:
+  //   table - table erased from
+  //   key - key to erase
+  // Returns:
+  //   void
+  void erase( Table *table, std::string_view key );
+
+  // Look up a buffered write (so a transaction reads its own writes)
+  // Parameters:
+  //   table - table to look in
+  //   key - key to look up
+  // Returns:
+  //   const std::optional<std::string>* - buffered value (empty if the
+  //   key was erased), or nullptr if the key wasn't written
+  const std::optional<std::string> *find( Table *table, std::string_view key ) const;
+
+  // Look up a buffered write, also reporting its deadline
+  // Parameters:
+  //   table - table to look in
+  //   key - key to look up
+  //   deadline - set to the buffered value's deadline (0 if none)
+  // Returns:
+  //   const std::optional<std::string>* - buffered value (empty if the
+  //   key was erased), or nullptr if the key wasn't written
+  const std::optional<std::string> *find( Table *table, std::string_view key, uint64_t &deadline ) const;
+
+  // Check whether anything was written
+  // Parameters:
+  //   void
+  // Returns:
+  //   bool - true if no writes are buffered
+  bool empty() const { return m_writes.empty(); }
+
+  // Add the (table, shard) pair of every key written to a list
+  // Parameters:
+  //   shards - list to append to
+  // Returns:
+  //   void
+  void collect_shards( std::vector<std::pair<Table*, unsigned>> &shards ) const;
+
+  // Add every buffered write to a write-ahead log COMMIT record
+  // Parameters:
+  //   record - record to add to
+  // Returns:
+  //   void
+  void log( WriteAheadLog::Record &record ) const;
+
+  // Look up the key of every buffered tombstone in its table, before
+  // the commit starts, so apply() reads nothing that can fail.
+  // The caller must hold the exclusive lock of each written key's shard
+  // until apply().
+  // Parameters:
+  //   void
+  // Returns:
+  //   void (throws LogException if a key's base block is corrupt)
+  void prepare();
+
+  // Write every buffered value (and erase every buffered tombstone's
+  // key that prepare() found) into its table and empty the buffer.
+  // The caller must hold the exclusive lock of each written key's shard.
+  // Parameters:
+  //   ts - commit timestamp given to every write
+  // Returns:
+  //   void
+  void apply( uint64_t ts );
+
+  // Discard every buffered write
+  // Parameters:
+  //   void
+  // Returns:
+  //   void
+  void clear() { m_writes.clear(); }
+};
+
+// End of guards
+#endif // WRITE_SET_H